@@ -1,5 +1,6 @@
 #!/usr/bin/python3
 
+import os
 import glob
 import time
 import numpy as np
@@ -23,16 +24,23 @@ if __name__ == '__main__':
     print(joblibs)
     print()
 
-    print('[*] Reading the contents of \'CIC-IDS-2017.csv\' into a numpy array...')
-    dataset = np.genfromtxt('CIC-IDS-2017.csv', delimiter=',')
-    filtered_dataset = dataset[~np.isnan(dataset).any(axis=1)]
-    filtered_dataset = filtered_dataset[np.isfinite(filtered_dataset).all(axis=1)]
-    print('\t[*] dataset numpy array shape: {}.'.format(str(dataset.shape)))
-    print('\t[*] filtered_dataset numpy array shape: {}.'.format(str(filtered_dataset.shape)))
+    if os.path.exists('CIC-IDS-2017.X.npy') and os.path.exists('CIC-IDS-2017.y.npy'):
+        # Output of 'ml_dataset' (tools/ml_dataset.cc): already concatenated and filtered.
+        print('[*] Mapping \'CIC-IDS-2017.X.npy\' and \'CIC-IDS-2017.y.npy\'...')
+        dataset_features = np.load('CIC-IDS-2017.X.npy', mmap_mode='r')
+        dataset_labels = np.load('CIC-IDS-2017.y.npy', mmap_mode='r')
+    else:
+        print('[*] Reading the contents of \'CIC-IDS-2017.csv\' into a numpy array...')
+        dataset = np.genfromtxt('CIC-IDS-2017.csv', delimiter=',')
+        filtered_dataset = dataset[~np.isnan(dataset).any(axis=1)]
+        filtered_dataset = filtered_dataset[np.isfinite(filtered_dataset).all(axis=1)]
+        print('\t[*] dataset numpy array shape: {}.'.format(str(dataset.shape)))
+        print('\t[*] filtered_dataset numpy array shape: {}.'.format(str(filtered_dataset.shape)))
+
+        print('[*] Splitting the dataset into \'features\' and \'labels\'...')
+        dataset_features = filtered_dataset[:,:78]
+        dataset_labels = filtered_dataset[:,78]
 
-    print('[*] Splitting the dataset into \'features\' and \'labels\'...')
-    dataset_features = filtered_dataset[:,:78]
-    dataset_labels = filtered_dataset[:,78]
     print('\t[*] dataset_features numpy array shape: {}.'.format(str(dataset_features.shape)))
     print('\t[*] dataset_labels numpy array shape: {}.'.format(str(dataset_labels.shape)))
 
@@ -0,0 +1,193 @@
+#!/usr/bin/python3
+
+# This script converts the joblibs used by ml_classifiers.py into the
+# native model format (.mlm) read by the inspector (see ml_models.h).
+# It has to run with the same scikit-learn version the joblibs were dumped with.
+# Next to each model, it also writes the model's sklearn outputs for the feature vectors
+# of tmp/timeouted_connections.txt (clf_<key>.reference.npy), which ml_bench checks
+# the native engines against.
+
+import os
+import sys
+import struct
+import numpy as np
+
+from joblib import load
+
+MODEL_MAGIC = b'MLCM'
+MODEL_VERSION = 1
+
+MODEL_TREES = 1
+MODEL_ADABOOST_SAMME_R = 2
+MODEL_LINEAR = 3
+MODEL_GAUSSIAN_NB = 4
+MODEL_BERNOULLI_NB = 5
+MODEL_MLP = 7
+MODEL_ADABOOST_SAMME = 8
+
+ACTIVATIONS = {'identity':0, 'relu':1, 'tanh':2, 'logistic':3, 'softmax':4}
+
+clf_joblibs = {'svc':'clf_svc.joblib', 'ab':'clf_ab.joblib', 'dt':'clf_dt.joblib', 'rf':'clf_rf.joblib', 'bnb':'clf_bnb.joblib', 'gnb':'clf_gnb.joblib', 'mlp':'clf_mlp.joblib'}
+
+def scaler_parameters(scaler):
+    # Both scalers are affine maps: x' = x * scale + offset.
+    if hasattr(scaler, 'min_'):
+        # MinMaxScaler: x * scale_ + min_.
+        return np.asarray(scaler.scale_, dtype='<f8'), np.asarray(scaler.min_, dtype='<f8')
+
+    # StandardScaler: (x - mean_) / scale_.
+    scale = 1.0 / np.asarray(scaler.scale_, dtype='<f8')
+    return scale, -np.asarray(scaler.mean_, dtype='<f8') * scale
+
+def write_header(f, kind, num_features, num_classes, scaler):
+    f.write(MODEL_MAGIC)
+    f.write(struct.pack('<IIII', MODEL_VERSION, kind, num_features, num_classes))
+
+    if scaler is None:
+        f.write(struct.pack('<I', 0))
+    else:
+        scale, offset = scaler_parameters(scaler)
+        f.write(struct.pack('<I', 1))
+        f.write(scale.tobytes())
+        f.write(offset.tobytes())
+
+def tree_arrays(tree, num_classes, one_hot):
+    # Converts a sklearn Tree into TreeNode records (threshold, feature, left, right, value)
+    # and the class fractions of its leaves (or a one-hot vote of the majority class).
+    nodes = []
+    values = []
+
+    for i in range(tree.node_count):
+        if tree.children_left[i] == -1:
+            counts = np.asarray(tree.value[i][0], dtype='<f8')
+            fractions = counts / counts.sum() if counts.sum() > 0 else np.full(num_classes, 1.0 / num_classes)
+
+            if one_hot:
+                fractions = np.eye(num_classes)[np.argmax(counts)]
+
+            nodes.append((0.0, -1, -1, -1, len(values)))
+            values.extend(fractions)
+        else:
+            nodes.append((float(tree.threshold[i]), int(tree.feature[i]), int(tree.children_left[i]), int(tree.children_right[i]), -1))
+
+    return nodes, values
+
+def write_trees(f, estimators, weights, num_classes, one_hot=False):
+    roots, all_nodes, all_values = [], [], []
+
+    for estimator in estimators:
+        nodes, values = tree_arrays(estimator.tree_, num_classes, one_hot)
+        node_base, value_base = len(all_nodes), len(all_values)
+
+        roots.append(node_base)
+
+        for threshold, feature, left, right, value in nodes:
+            if feature >= 0:
+                all_nodes.append((threshold, feature, left + node_base, right + node_base, -1))
+            else:
+                all_nodes.append((threshold, feature, left, right, value + value_base))
+
+        all_values.extend(values)
+
+    f.write(struct.pack('<III', len(roots), len(all_nodes), len(all_values)))
+    f.write(np.asarray(roots, dtype='<i4').tobytes())
+    f.write(np.asarray(weights, dtype='<f8').tobytes())
+
+    for node in all_nodes:
+        f.write(struct.pack('<diiii', *node))
+
+    f.write(np.asarray(all_values, dtype='<f8').tobytes())
+
+def export(key, clf, scaler, output_path):
+    num_features = clf.n_features_in_ if hasattr(clf, 'n_features_in_') else clf.n_features_
+    num_classes = len(clf.classes_)
+
+    with open(output_path, 'wb') as f:
+        if key == 'dt':
+            write_header(f, MODEL_TREES, num_features, num_classes, scaler)
+            write_trees(f, [clf], [1.0], num_classes)
+        elif key == 'rf':
+            write_header(f, MODEL_TREES, num_features, num_classes, scaler)
+            write_trees(f, clf.estimators_, [1.0] * len(clf.estimators_), num_classes)
+        elif key == 'ab':
+            weights = clf.estimator_weights_[:len(clf.estimators_)]
+
+            if getattr(clf, 'algorithm', 'SAMME') == 'SAMME.R':
+                write_header(f, MODEL_ADABOOST_SAMME_R, num_features, num_classes, scaler)
+                write_trees(f, clf.estimators_, weights, num_classes)
+            else:
+                # SAMME predicts with weighted hard votes: one-hot leaves averaged with the estimator weights
+                # (the engine turns them into sklearn's probabilities).
+                write_header(f, MODEL_ADABOOST_SAMME, num_features, num_classes, scaler)
+                write_trees(f, clf.estimators_, weights, num_classes, one_hot=True)
+        elif key == 'svc':
+            write_header(f, MODEL_LINEAR, num_features, num_classes, scaler)
+            f.write(np.asarray(clf.coef_, dtype='<f8').tobytes())
+            f.write(np.asarray(clf.intercept_, dtype='<f8').tobytes())
+        elif key == 'gnb':
+            variances = clf.var_ if hasattr(clf, 'var_') else clf.sigma_
+
+            write_header(f, MODEL_GAUSSIAN_NB, num_features, num_classes, scaler)
+            f.write(np.asarray(clf.class_prior_, dtype='<f8').tobytes())
+            f.write(np.asarray(clf.theta_, dtype='<f8').tobytes())
+            f.write(np.asarray(variances, dtype='<f8').tobytes())
+        elif key == 'bnb':
+            write_header(f, MODEL_BERNOULLI_NB, num_features, num_classes, scaler)
+            f.write(struct.pack('<Id', 0 if clf.binarize is None else 1, 0.0 if clf.binarize is None else clf.binarize))
+            f.write(np.asarray(clf.class_log_prior_, dtype='<f8').tobytes())
+            f.write(np.asarray(clf.feature_log_prob_, dtype='<f8').tobytes())
+        elif key == 'mlp':
+            # One (outputs, activation, weights, biases) entry per layer; coefs_ are (inputs, outputs), stored transposed.
+            write_header(f, MODEL_MLP, num_features, num_classes, scaler)
+            f.write(struct.pack('<I', len(clf.coefs_)))
+
+            for i, (coefs, intercepts) in enumerate(zip(clf.coefs_, clf.intercepts_)):
+                activation = clf.out_activation_ if i == len(clf.coefs_) - 1 else clf.activation
+
+                f.write(struct.pack('<II', coefs.shape[1], ACTIVATIONS[activation]))
+                f.write(np.ascontiguousarray(coefs.T, dtype='<f8').tobytes())
+                f.write(np.asarray(intercepts, dtype='<f8').tobytes())
+
+def write_reference(clf, scaler, rows, output_path):
+    # One row per feature vector: its (unscaled) features, sklearn's predicted class index
+    # and its class probabilities (NaN for models without predict_proba, e.g. LinearSVC).
+    scaled = scaler.transform(rows)
+    labels = np.searchsorted(clf.classes_, clf.predict(scaled))
+
+    if hasattr(clf, 'predict_proba'):
+        proba = clf.predict_proba(scaled)
+    else:
+        proba = np.full((len(rows), len(clf.classes_)), np.nan)
+
+    reference = np.hstack([rows, labels.reshape(-1, 1), proba])
+    np.save(output_path, np.ascontiguousarray(reference, dtype='<f8'))
+
+if __name__ == '__main__':
+    if len(sys.argv) > 4:
+        print('Usage: python3 /path/to/export_native_models.py [<joblibs_dir>] [<output_dir>] [<timeouted_connections.txt>]')
+        sys.exit(1)
+
+    joblibs_dir = sys.argv[1] if len(sys.argv) > 1 else '/home/lnutimura/Desktop/ml_classifiers/joblibs/'
+    output_dir = sys.argv[2] if len(sys.argv) > 2 else joblibs_dir
+    rows_path = sys.argv[3] if len(sys.argv) > 3 else os.path.join(os.path.dirname(os.path.abspath(__file__)), 'tmp', 'timeouted_connections.txt')
+
+    # The reference rows are optional: without them, only the models are exported.
+    rows = np.loadtxt(rows_path, ndmin=2) if os.path.exists(rows_path) else None
+
+    scaler = load(joblibs_dir + '/scaler.joblib')
+
+    for key, joblib_name in clf_joblibs.items():
+        # The MLP is optional: the notebooks don't train one.
+        if key == 'mlp' and not os.path.exists(joblibs_dir + '/' + joblib_name):
+            continue
+
+        output_path = '{}/clf_{}.mlm'.format(output_dir, key)
+
+        print('[*] Exporting \'{}\' to \'{}\'...'.format(joblib_name, output_path))
+        clf = load(joblibs_dir + '/' + joblib_name)
+        export(key, clf, scaler, output_path)
+
+        if rows is not None:
+            write_reference(clf, scaler, rows, '{}/clf_{}.reference.npy'.format(output_dir, key))
+
+    print('[*] Done!')
@@ -0,0 +1,62 @@
+/*
+    Drives the baseline Connection with ml_sensor's FlowPackets, filling in the
+    Snort Packet fields it reads. Included by the ml_sensor copy record.sh builds.
+*/
+#include <memory>
+class BaselineConnection {
+    public:
+        BaselineConnection() { }
+
+        BaselineConnection(const FlowPacket& packet, const std::string& id) : flow(new baseline::SnortFlow()) {
+            flow->client_ip.text = packet.client_ip;
+            flow->server_ip.text = packet.server_ip;
+            flow->client_port = packet.client_port;
+            flow->server_port = packet.server_port;
+
+            Feed feed(packet, flow.get());
+            connection = std::make_shared<baseline::Connection>(&feed.p, id);
+        }
+
+        void add_packet(const FlowPacket& packet) {
+            Feed feed(packet, flow.get());
+            connection->add_packet(&feed.p);
+        }
+
+        int64_t get_flowlastseen() { return connection->get_flowlastseen(); }
+        int64_t get_flowfirstseen() { return connection->get_flowfirstseen(); }
+        std::string get_flowid() { return connection->get_flowid(); }
+
+        void get_feature_vector(double* features) {
+            std::vector<double> vector = connection->get_feature_vector();
+            if (vector.size() != NUM_FEATURES) {
+                std::cerr << "[!] The baseline Connection returned " << vector.size() << " features." << std::endl;
+                abort();
+            }
+            std::copy(vector.begin(), vector.end(), features);
+        }
+
+    private:
+        struct Feed {
+            baseline::DAQ_PktHdr_t header;
+            baseline::tcp::TCPHdr tcph;
+            baseline::Packet p;
+
+            Feed(const FlowPacket& packet, baseline::SnortFlow* flow) {
+                header.ts.tv_sec = packet.timestamp / 1000000;
+                header.ts.tv_usec = packet.timestamp % 1000000;
+                header.pktlen = packet.pktlen;
+                tcph.th_flags = packet.tcp_flags;
+                tcph.window = packet.window;
+                p.pkth = &header;
+                p.dsize = packet.dsize;
+                p.ip_proto_next = packet.protocol;
+                p.flow = flow;
+                p.ptrs.tcph = packet.tcp ? &tcph : nullptr;
+                p.tcp = packet.tcp;
+                p.from_client = packet.from_client;
+            }
+        };
+
+        std::shared_ptr<baseline::SnortFlow> flow;
+        std::shared_ptr<baseline::Connection> connection;
+};
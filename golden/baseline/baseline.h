@@ -0,0 +1,80 @@
+/*
+    The root commit's Connection (a78fce7), on stand-ins for the Snort types it reads.
+    record.sh extracts the class into baseline_connection.h, next to the build.
+*/
+#include <map>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <iostream>
+#include <sys/time.h>
+#include <boost/accumulators/accumulators.hpp>
+#include <boost/accumulators/statistics/sum.hpp>
+#include <boost/accumulators/statistics/min.hpp>
+#include <boost/accumulators/statistics/max.hpp>
+#include <boost/accumulators/statistics/mean.hpp>
+#include <boost/accumulators/statistics/count.hpp>
+#include <boost/accumulators/statistics/variance.hpp>
+
+namespace baseline {
+
+using namespace boost::accumulators;
+
+typedef accumulator_set< int64_t, features<tag::count, tag::sum, tag::min, tag::max, tag::mean, tag::variance > > intAcc;
+typedef accumulator_set< double, features<tag::count, tag::sum, tag::min, tag::max, tag::mean, tag::variance > > doubleAcc;
+
+typedef char SfIpString[64];
+
+struct SfIp {
+    std::string text;
+
+    void ntop(SfIpString out) const { strcpy(out, text.c_str()); }
+};
+
+struct SnortFlow {
+    SfIp client_ip, server_ip;
+    uint16_t client_port, server_port;
+};
+
+struct DAQ_PktHdr_t {
+    struct timeval ts;
+    uint32_t pktlen;
+};
+
+namespace tcp {
+    struct TCPHdr {
+        uint8_t th_flags;
+        uint16_t window;
+
+        bool are_flags_set(uint8_t flags) const { return (th_flags & flags) == flags; }
+        uint16_t win() const { return window; }
+    };
+}
+
+enum { TH_FIN = 0x01, TH_SYN = 0x02, TH_RST = 0x04, TH_PUSH = 0x08, TH_ACK = 0x10, TH_URG = 0x20, TH_ECE = 0x40, TH_CWR = 0x80 };
+
+struct Ptrs {
+    const tcp::TCPHdr* tcph;
+};
+
+struct Packet {
+    const DAQ_PktHdr_t* pkth;
+    uint16_t dsize;
+    uint8_t ip_proto_next;
+    SnortFlow* flow;
+    Ptrs ptrs;
+    bool tcp;
+    bool from_client;
+
+    bool is_tcp() const { return tcp; }
+    bool is_from_client() const { return from_client; }
+};
+
+/* As in the root commit. */
+int64_t get_time_in_microseconds(time_t tvsec, suseconds_t tvusec) {
+    return tvsec * (int)1e6 + tvusec;
+}
+
+#include "baseline_connection.h"
+
+}
@@ -0,0 +1,28 @@
+#!/bin/sh
+# Records the golden output with the root commit's feature engine (a78fce7):
+# ml_sensor's capture replay and flow tracking, with its Connection swapped
+# for the original one. Run from the repository root.
+#
+#   sh golden/baseline/record.sh [output]
+set -e
+
+root=a78fce7
+output=${1:-golden/synthetic_svc.txt}
+build=$(mktemp -d)
+trap 'rm -rf "$build"' EXIT
+
+# The Connection class, as the root commit shipped it.
+git show $root:ml_classifiers.h | tr -d '\r' | sed -n '/^class Connection {/,/^};/p' > "$build/baseline_connection.h"
+
+# ml_sensor, tracking flows with BaselineConnection. baseline.h goes first so
+# the root commit's code resolves its names before ml_sensor's headers load.
+{
+    echo '#include "baseline.h"'
+    sed -e 's#"\.\./\(ml_[a-z_]*\.h\)"#"'"$PWD"'/\1"#' \
+        -e 's#^\(\#include ".*/ml_connection.h"\)$#\1\n\#include "adapter.h"#' \
+        -e '/^class FlowTable {/,/^};/s/\bConnection\b/BaselineConnection/g' \
+        tools/ml_sensor.cc
+} > "$build/ml_sensor.cc"
+
+g++ -std=c++11 -O2 -pthread -w -I"$build" -Igolden/baseline "$build/ml_sensor.cc" -o "$build/ml_sensor"
+"$build/ml_sensor" -r golden/synthetic.pcap -m golden/clf_svc.mlm --record "$output" | grep '^\[\*\]'
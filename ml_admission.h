@@ -0,0 +1,308 @@
+#ifndef ML_ADMISSION_H
+#define ML_ADMISSION_H
+
+/*
+    Admission filter for new flows.
+    Port scans and SYN floods are mostly single-packet flows, and giving each of them a full
+    Connection (map entry, flow id, accumulators, log lines) is what makes them expensive.
+    Instead, a new flow's first packet is held in a fixed-size probation table and the flow
+    only becomes a Connection once it proves to be more than a probe (a packet answering it).
+
+    Probes that never get that far are only counted, in bounded sketches: a count-min sketch
+    of probes per key (e.g. source address) picks the heavy keys, and each of those gets a
+    small HyperLogLog of the distinct peers it probed. A key reaching the threshold of distinct
+    peers within a window is reported once, as a single aggregated event, and summarized when
+    the window ends. Memory is fixed and the per-packet cost is a few hashed updates, however
+    many probes come in.
+*/
+
+#include <cmath>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+
+/* 64-bit finalizer (splitmix64), spreading a hash over every bit. */
+inline uint64_t mix64(uint64_t value) {
+    value += 0x9e3779b97f4a7c15ULL;
+    value = (value ^ (value >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    value = (value ^ (value >> 27)) * 0x94d049bb133111ebULL;
+    return value ^ (value >> 31);
+}
+
+/* Count-min sketch with conservative updates (only the smallest counters of a key grow). */
+class CountMinSketch {
+    public:
+        void configure(uint32_t width, uint32_t depth) {
+            this->width = width;
+            this->depth = depth;
+            counters.assign((size_t)width * depth, 0);
+        }
+
+        /* Counts one more occurrence of "key". Returns its estimated count. */
+        uint32_t add(uint64_t key) {
+            uint32_t* cells[max_depth];
+            uint32_t estimate = UINT32_MAX;
+
+            for (uint32_t row = 0; row < depth; row++) {
+                cells[row] = &counters[(size_t)row * width + mix64(key + row) % width];
+                estimate = std::min(estimate, *cells[row]);
+            }
+
+            if (estimate < UINT32_MAX) estimate++;
+
+            for (uint32_t row = 0; row < depth; row++) {
+                *cells[row] = std::max(*cells[row], estimate);
+            }
+            return estimate;
+        }
+
+        void clear() {
+            std::fill(counters.begin(), counters.end(), 0);
+        }
+
+        static const uint32_t max_depth = 8;
+
+    private:
+        uint32_t width = 0;
+        uint32_t depth = 0;
+        std::vector<uint32_t> counters;
+};
+
+/* HyperLogLog with 64 registers (about 13% standard error), enough to tell a scan from a retry. */
+class HyperLogLog {
+    public:
+        HyperLogLog() {
+            clear();
+        }
+
+        void add(uint64_t hash) {
+            hash = mix64(hash);
+
+            uint32_t index = (uint32_t)(hash & (num_registers - 1));
+            uint64_t rest = hash >> 6;
+            uint8_t rank = (uint8_t)(rest ? __builtin_ctzll(rest) + 1 : 59);
+
+            registers[index] = std::max(registers[index], rank);
+        }
+
+        double estimate() const {
+            double sum = 0;
+            uint32_t zeros = 0;
+
+            for (uint32_t i = 0; i < num_registers; i++) {
+                sum += std::ldexp(1.0, -registers[i]);
+                if (registers[i] == 0) zeros++;
+            }
+
+            double estimate = 0.709 * num_registers * num_registers / sum;
+
+            /* Small range correction (linear counting). */
+            if (estimate <= 2.5 * num_registers && zeros > 0) {
+                estimate = num_registers * std::log((double)num_registers / zeros);
+            }
+            return estimate;
+        }
+
+        void clear() {
+            memset(registers, 0, sizeof(registers));
+        }
+
+    private:
+        static const uint32_t num_registers = 64;
+        uint8_t registers[num_registers];
+};
+
+/* A key's activity: when it first reaches the threshold ("summary" false) and at the end of the window. */
+struct FanoutEvent {
+    std::string label;
+    uint64_t probes;
+    double peers;
+    bool summary;
+};
+
+/*
+    Distinct peers probed per key (fan-out of a source, or fan-in of a destination).
+    Keys are tracked once the count-min sketch has seen "admit" probes from them, in a 4-way
+    set-associative table that replaces the least active entry of a full set.
+*/
+class FanoutTracker {
+    public:
+        /* "entries" is rounded up to a multiple of 4. Times are in microseconds. */
+        void configure(size_t entries, uint32_t threshold, int64_t window) {
+            this->threshold = threshold;
+            this->window = window;
+
+            admit = std::max<uint32_t>(2, threshold / 8);
+            sketch.configure(4096, 4);
+            table.assign((entries + ways - 1) / ways * ways, Entry());
+            window_start = 0;
+        }
+
+        /*
+            Records a probe of "peer" by "key" at "now". label() names the key, and is only called
+            when the key starts being tracked. Events (and the summaries of a window that just
+            ended) are appended to "events".
+        */
+        template <typename Label>
+        void observe(uint64_t key, uint64_t peer, int64_t now, Label label, std::vector<FanoutEvent>& events) {
+            if (table.empty()) return;
+
+            if (window_start == 0) window_start = now;
+            if (now - window_start >= window) end_window(now, events);
+
+            uint32_t probes = sketch.add(key);
+            if (probes < admit) return;
+
+            Entry* set = &table[(mix64(key) % (table.size() / ways)) * ways];
+            Entry* entry = nullptr;
+
+            for (size_t i = 0; i < ways && !entry; i++) {
+                if (set[i].used && set[i].key == key) entry = &set[i];
+            }
+
+            if (!entry) {
+                entry = std::min_element(set, set + ways, [](const Entry& a, const Entry& b) {
+                    return (a.used ? a.probes + 1 : 0) < (b.used ? b.probes + 1 : 0);
+                });
+
+                /* A set full of busier keys keeps them. */
+                if (entry->used && entry->probes >= probes) return;
+
+                *entry = Entry();
+                entry->used = true;
+                entry->key = key;
+                entry->label = label();
+                entry->probes = probes - 1;
+            }
+
+            entry->probes++;
+            entry->peers.add(peer);
+
+            if (!entry->reported && entry->peers.estimate() >= threshold) {
+                entry->reported = true;
+                events.push_back({ entry->label, entry->probes, entry->peers.estimate(), false });
+            }
+        }
+
+        /* Summarizes the keys reported in the current window and starts a new one. */
+        void end_window(int64_t now, std::vector<FanoutEvent>& events) {
+            for (Entry& entry : table) {
+                if (entry.used && entry.reported) {
+                    events.push_back({ entry.label, entry.probes, entry.peers.estimate(), true });
+                }
+                entry = Entry();
+            }
+
+            sketch.clear();
+            window_start = now;
+        }
+
+    private:
+        struct Entry {
+            bool used = false;
+            bool reported = false;
+            uint64_t key = 0;
+            uint64_t probes = 0;
+            HyperLogLog peers;
+            std::string label;
+        };
+
+        static const size_t ways = 4;
+
+        uint32_t threshold = 64;
+        uint32_t admit = 8;
+        int64_t window = 60000000;
+        int64_t window_start = 0;
+
+        CountMinSketch sketch;
+        std::vector<Entry> table;
+};
+
+/*
+    Fixed-size table of the flows on probation, direct-mapped on the flow key's hash.
+    A new flow landing on an occupied slot evicts the flow held there: under a flood, the
+    table just turns over and its memory doesn't grow.
+*/
+template <typename T>
+class ProbationTable {
+    public:
+        /* "size" is rounded up to a power of two; flows are held for up to "timeout" microseconds. */
+        void configure(size_t size, int64_t timeout) {
+            size_t slots = 1;
+            while (slots < size) slots <<= 1;
+
+            this->timeout = timeout;
+            table.assign(slots, Slot());
+            held = 0;
+        }
+
+        /* Holds "value" for flow "key". Returns true (and the evicted flow's value) if another flow was in the way. */
+        bool hold(uint64_t key, int64_t now, const T& value, T& evicted) {
+            if (table.empty()) return false;
+
+            Slot& slot = table[mix64(key) & (table.size() - 1)];
+            bool eviction = slot.used && slot.key != key;
+
+            if (eviction) evicted = slot.value;
+            if (!slot.used) held++;
+
+            slot.used = true;
+            slot.key = key;
+            slot.since = now;
+            slot.value = value;
+            return eviction;
+        }
+
+        /* Flow "key"'s held value, left on probation (with its first hold time), or null if it isn't held. */
+        T* find(uint64_t key) {
+            if (table.empty()) return nullptr;
+
+            Slot& slot = table[mix64(key) & (table.size() - 1)];
+            return (slot.used && slot.key == key) ? &slot.value : nullptr;
+        }
+
+        /* Takes flow "key" off probation. Returns false if it isn't held. */
+        bool release(uint64_t key, T& value) {
+            if (table.empty()) return false;
+
+            Slot& slot = table[mix64(key) & (table.size() - 1)];
+            if (!slot.used || slot.key != key) return false;
+
+            value = slot.value;
+            slot.used = false;
+            held--;
+            return true;
+        }
+
+        /* Moves the flows held since before now - timeout to "expired". */
+        void expire(int64_t now, std::vector<T>& expired) {
+            for (Slot& slot : table) {
+                if (slot.used && now - slot.since > timeout) {
+                    expired.push_back(slot.value);
+                    slot.used = false;
+                    held--;
+                }
+            }
+        }
+
+        /* Flows currently on probation. */
+        size_t size() const {
+            return held;
+        }
+
+    private:
+        struct Slot {
+            bool used = false;
+            uint64_t key = 0;
+            int64_t since = 0;
+            T value;
+        };
+
+        int64_t timeout = 10000000;
+        size_t held = 0;
+        std::vector<Slot> table;
+};
+
+#endif
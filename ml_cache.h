@@ -0,0 +1,166 @@
+#ifndef ML_CACHE_H
+#define ML_CACHE_H
+
+/*
+    Bounded verdict cache.
+    Repetitive flows (DNS, NTP, health checks...) towards the same service end up with
+    nearly identical feature vectors, so their verdict is cached under a key made of the
+    server endpoint and a coarse signature of the flow's main features.
+
+    The table is split in shards, each one guarded by its own mutex and evicting with
+    the CLOCK algorithm. Entries also expire after a TTL (in flow time, so pcap replays
+    behave like live traffic).
+*/
+
+#include <mutex>
+#include <atomic>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+#include <unordered_map>
+
+class VerdictCache {
+    public:
+        /* Lookup/insert/eviction counters, read by the inspector's pegs. */
+        struct Stats {
+            std::atomic<uint64_t> lookups { 0 };
+            std::atomic<uint64_t> hits { 0 };
+            std::atomic<uint64_t> inserts { 0 };
+            std::atomic<uint64_t> evictions { 0 };
+        };
+
+        /* Sizes the cache for "capacity" entries living "ttl" microseconds. */
+        void configure(size_t capacity, int64_t ttl) {
+            this->ttl = ttl;
+
+            size_t per_shard = std::max<size_t>(1, capacity / num_shards);
+            for (Shard& shard : shards) {
+                std::lock_guard<std::mutex> lock(shard.mutex);
+
+                shard.entries.assign(per_shard, Entry());
+                shard.index.clear();
+                shard.index.reserve(per_shard);
+                shard.hand = 0;
+                shard.used = 0;
+            }
+        }
+
+        /* Returns true (and the cached verdict) if "key" is cached and hasn't expired at "now". */
+        bool lookup(uint64_t key, int64_t now, float& verdict) {
+            Shard& shard = shards[key % num_shards];
+            std::lock_guard<std::mutex> lock(shard.mutex);
+
+            stats.lookups++;
+
+            std::unordered_map<uint64_t, size_t>::iterator it = shard.index.find(key);
+            if (it == shard.index.end()) return false;
+
+            Entry& entry = shard.entries[it->second];
+            if (now > entry.expires) return false;
+
+            entry.referenced = true;
+            verdict = entry.verdict;
+            stats.hits++;
+            return true;
+        }
+
+        /* Caches (or refreshes) a verdict, evicting with CLOCK when the shard is full. */
+        void insert(uint64_t key, int64_t now, float verdict) {
+            Shard& shard = shards[key % num_shards];
+            std::lock_guard<std::mutex> lock(shard.mutex);
+
+            if (shard.entries.empty()) return;
+
+            std::unordered_map<uint64_t, size_t>::iterator it = shard.index.find(key);
+            size_t slot;
+
+            if (it != shard.index.end()) {
+                slot = it->second;
+            } else if (shard.used < shard.entries.size()) {
+                slot = shard.used++;
+                shard.index[key] = slot;
+            } else {
+                slot = evict(shard, now);
+                shard.index[key] = slot;
+            }
+
+            Entry& entry = shard.entries[slot];
+            entry.key = key;
+            entry.verdict = verdict;
+            entry.expires = now + ttl;
+            entry.referenced = false;
+
+            stats.inserts++;
+        }
+
+        Stats stats;
+
+    private:
+        struct Entry {
+            uint64_t key = 0;
+            int64_t expires = 0;
+            float verdict = 0;
+            bool referenced = false;
+        };
+
+        struct Shard {
+            std::mutex mutex;
+            std::vector<Entry> entries;
+            std::unordered_map<uint64_t, size_t> index;
+            size_t hand = 0;
+            size_t used = 0;
+        };
+
+        /* CLOCK: expired entries go first, otherwise the first entry not referenced since the hand's last pass. */
+        size_t evict(Shard& shard, int64_t now) {
+            while (true) {
+                Entry& entry = shard.entries[shard.hand];
+                size_t slot = shard.hand;
+
+                shard.hand = (shard.hand + 1) % shard.entries.size();
+
+                if (entry.referenced && now <= entry.expires) {
+                    entry.referenced = false;
+                    continue;
+                }
+
+                shard.index.erase(entry.key);
+                stats.evictions++;
+                return slot;
+            }
+        }
+
+        static const size_t num_shards = 16;
+
+        Shard shards[num_shards];
+        int64_t ttl = 0;
+};
+
+/*
+    Coarse signature of a value: half-octave buckets of its magnitude, so flows that differ
+    by a few bytes or microseconds still share a key.
+*/
+inline uint64_t quantize_feature(double value) {
+    double magnitude = (value < 0) ? -value : value;
+    uint64_t bucket = 0;
+
+    while (magnitude >= 1.0 && bucket < 126) {
+        magnitude /= 1.4142135623730951;
+        bucket++;
+    }
+    return (value < 0) ? (bucket | 0x80) : bucket;
+}
+
+/* FNV-1a, used to build the cache keys. */
+inline uint64_t fnv1a(uint64_t hash, const void* data, size_t size) {
+    const unsigned char* bytes = (const unsigned char*)data;
+
+    for (size_t i = 0; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+#endif
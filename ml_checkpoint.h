@@ -0,0 +1,208 @@
+#ifndef ML_CHECKPOINT_H
+#define ML_CHECKPOINT_H
+
+/*
+    Checkpoint (snapshot) of the connections map.
+    A checkpoint is a header followed by an array of fixed-size FlowRecords, in native
+    byte order, so it's restored by mapping the file and walking the array: no parsing.
+    Snapshots are written to "<path>.tmp" and renamed over <path>, so a crash while
+    saving never leaves a truncated checkpoint behind.
+*/
+
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "ml_stats.h"
+
+static const char CHECKPOINT_MAGIC[4] = { 'M', 'L', 'C', 'K' };
+static const uint32_t CHECKPOINT_VERSION = 1;
+
+/* Flag counters, in FIN, SYN, RST, PSH, ACK, URG, CWR, ECE order. */
+static const unsigned CHECKPOINT_FLAGS = 8;
+
+struct CheckpointHeader {
+    char magic[4];
+    uint32_t version;
+
+    /* sizeof(FlowRecord), so snapshots from a different layout are refused. */
+    uint32_t record_size;
+    uint32_t reserved;
+
+    uint64_t num_records;
+
+    /* Latest flow_last_seen among the saved flows (microseconds), the rebasing reference. */
+    int64_t saved_at;
+};
+
+/* Everything a Connection is made of. */
+struct FlowRecord {
+    char flow_id[128];
+    char client_ip[48];
+    char server_ip[48];
+
+    uint16_t client_port;
+    uint16_t server_port;
+    uint8_t protocol;
+
+    uint32_t forward_count;
+    uint32_t backward_count;
+
+    int64_t flow_first_seen;
+    int64_t flow_last_seen;
+    int64_t forward_last_seen;
+    int64_t backward_last_seen;
+    int64_t start_active_time;
+    int64_t end_active_time;
+
+    uint32_t flags[CHECKPOINT_FLAGS];
+
+    uint32_t forward_PSH;
+    uint32_t forward_URG;
+    uint32_t backward_PSH;
+    uint32_t backward_URG;
+
+    uint32_t forward_bytes;
+    uint32_t forward_hbytes;
+    uint32_t backward_bytes;
+    uint32_t backward_hbytes;
+
+    uint32_t act_data_pkt_forward;
+    uint32_t min_seg_size_forward;
+    uint32_t init_win_bytes_forward;
+    uint32_t init_win_bytes_backward;
+
+    RunningStats<int64_t> flow_iat;
+    RunningStats<int64_t> forward_iat;
+    RunningStats<int64_t> backward_iat;
+    RunningStats<int64_t> flow_idle;
+    RunningStats<int64_t> flow_active;
+    RunningStats<double> flow_length;
+    RunningStats<double> forward_pkt;
+    RunningStats<double> backward_pkt;
+
+    uint32_t sf_count;
+    int64_t sf_ac_helper;
+    int64_t sf_last_packet_timestamp;
+
+    int64_t f_bulk_duration;
+    uint32_t f_bulk_total_size;
+    uint32_t f_bulk_state_count;
+    uint32_t f_bulk_packet_count;
+    uint32_t f_bulk_size_helper;
+    int64_t f_bulk_start_helper;
+    uint32_t f_bulk_packet_count_helper;
+    int64_t f_bulk_last_timestamp;
+
+    int64_t b_bulk_duration;
+    uint32_t b_bulk_total_size;
+    uint32_t b_bulk_state_count;
+    uint32_t b_bulk_packet_count;
+    uint32_t b_bulk_size_helper;
+    int64_t b_bulk_start_helper;
+    uint32_t b_bulk_packet_count_helper;
+    int64_t b_bulk_last_timestamp;
+};
+
+/* Writes a checkpoint atomically (temporary file + rename). */
+inline bool write_checkpoint(const std::string& path, const std::vector<FlowRecord>& records, int64_t saved_at) {
+    std::string tmp_path = path + ".tmp";
+    FILE* file = fopen(tmp_path.c_str(), "wb");
+
+    if (!file) return false;
+
+    CheckpointHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic));
+    header.version = CHECKPOINT_VERSION;
+    header.record_size = sizeof(FlowRecord);
+    header.num_records = records.size();
+    header.saved_at = saved_at;
+
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+              (records.empty() || fwrite(records.data(), sizeof(FlowRecord), records.size(), file) == records.size());
+
+    ok = (fflush(file) == 0) && (fsync(fileno(file)) == 0) && ok;
+    ok = (fclose(file) == 0) && ok;
+
+    if (!ok || rename(tmp_path.c_str(), path.c_str()) != 0) {
+        unlink(tmp_path.c_str());
+        return false;
+    }
+    return true;
+}
+
+/* Read-only, memory-mapped checkpoint. */
+class CheckpointFile {
+    public:
+        bool open(const std::string& path, std::string& error) {
+            int fd = ::open(path.c_str(), O_RDONLY);
+
+            if (fd < 0) {
+                error = "couldn't open " + path;
+                return false;
+            }
+
+            struct stat st;
+            if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(CheckpointHeader)) {
+                ::close(fd);
+                error = path + " is too short";
+                return false;
+            }
+
+            void* addr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+            ::close(fd);
+
+            if (addr == MAP_FAILED) {
+                error = "couldn't map " + path;
+                return false;
+            }
+
+            map = (const char*)addr;
+            map_size = st.st_size;
+
+            const CheckpointHeader* header = this->header();
+
+            if (memcmp(header->magic, CHECKPOINT_MAGIC, sizeof(header->magic)) != 0 || header->version != CHECKPOINT_VERSION) {
+                error = path + " isn't a checkpoint (or has an unsupported version)";
+                return false;
+            }
+
+            if (header->record_size != sizeof(FlowRecord)) {
+                error = path + " was saved with a different flow layout";
+                return false;
+            }
+
+            if (sizeof(CheckpointHeader) + header->num_records * sizeof(FlowRecord) > map_size) {
+                error = path + " is truncated";
+                return false;
+            }
+
+            return true;
+        }
+
+        const CheckpointHeader* header() const {
+            return (const CheckpointHeader*)map;
+        }
+
+        const FlowRecord* records() const {
+            return (const FlowRecord*)(map + sizeof(CheckpointHeader));
+        }
+
+        ~CheckpointFile() {
+            if (map) munmap((void*)map, map_size);
+        }
+
+    private:
+        const char* map = nullptr;
+        size_t map_size = 0;
+};
+
+#endif
@@ -32,8 +32,103 @@ using namespace snort;
 static const char* s_name = "ml_classifiers";
 static const char* s_help = "machine learning classifiers";
 
+struct MLStats
+{
+    PegCount total_packets;
+    PegCount first_stage_flows;
+    PegCount first_stage_usecs;
+    PegCount second_stage_flows;
+    PegCount second_stage_usecs;
+    PegCount voted_flows;
+    PegCount vote_usecs;
+    PegCount scorer_flows;
+    PegCount scorer_usecs;
+    PegCount scorer_timeouts;
+    PegCount routed_flows;
+    PegCount routed_usecs;
+    PegCount cache_lookups;
+    PegCount cache_hits;
+    PegCount cache_inserts;
+    PegCount cache_evictions;
+    PegCount flows_created;
+    PegCount live_flows;
+    PegCount flows_expired;
+    PegCount normal_flows;
+    PegCount attack_flows;
+    PegCount held_flows;
+    PegCount promoted_flows;
+    PegCount probe_flows;
+    PegCount scan_events;
+    PegCount flood_events;
+    PegCount overload_level;
+    PegCount overload_escalations;
+    PegCount shed_packets;
+    PegCount shed_permille;
+    PegCount overload_flows;
+    PegCount queue_depth;
+    PegCount expiry_usecs;
+    PegCount materialize_usecs;
+    PegCount pool_batches;
+    PegCount pool_tasks;
+    PegCount pool_steals;
+    PegCount packet_nsecs_p50;
+    PegCount packet_nsecs_p99;
+    PegCount packet_nsecs_max;
+    PegCount verdict_usecs_p50;
+    PegCount verdict_usecs_p99;
+    PegCount verdict_usecs_max;
+};
+
+static const PegInfo ml_pegs[] =
+{
+    { CountType::SUM, "total_packets", "total packets" },
+    { CountType::MAX, "first_stage_flows", "flows scored by the single (or cascade's first stage) native model" },
+    { CountType::MAX, "first_stage_usecs", "time spent in the single (or cascade's first stage) native model" },
+    { CountType::MAX, "second_stage_flows", "uncertain flows scored by the cascade's second stage" },
+    { CountType::MAX, "second_stage_usecs", "time spent in the cascade's second stage" },
+    { CountType::MAX, "voted_flows", "flows scored by every available native model" },
+    { CountType::MAX, "vote_usecs", "time spent scoring voted flows" },
+    { CountType::MAX, "scorer_flows", "flows scored by the external scorer" },
+    { CountType::MAX, "scorer_usecs", "time spent waiting for the external scorer" },
+    { CountType::MAX, "scorer_timeouts", "flows the external scorer didn't score in time" },
+    { CountType::MAX, "routed_flows", "flows scored by their model route's model" },
+    { CountType::MAX, "routed_usecs", "time spent scoring routed flows" },
+    { CountType::MAX, "cache_lookups", "flows looked up in the verdict cache" },
+    { CountType::MAX, "cache_hits", "flows classified with a cached verdict" },
+    { CountType::MAX, "cache_inserts", "confident verdicts added to the verdict cache" },
+    { CountType::MAX, "cache_evictions", "verdicts evicted from the full verdict cache" },
+    { CountType::SUM, "flows_created", "connections created" },
+    { CountType::MAX, "live_flows", "connections currently tracked" },
+    { CountType::MAX, "flows_expired", "connections timeouted and sent to classification" },
+    { CountType::MAX, "normal_flows", "connections classified as Normal" },
+    { CountType::MAX, "attack_flows", "connections classified as Attack" },
+    { CountType::MAX, "held_flows", "new flows whose first packet was held by the admission filter" },
+    { CountType::MAX, "promoted_flows", "held flows promoted to connections by a second packet" },
+    { CountType::MAX, "probe_flows", "held flows that ended as single-packet probes" },
+    { CountType::MAX, "scan_events", "sources reported for probing too many destinations" },
+    { CountType::MAX, "flood_events", "destinations reported for being probed by too many sources" },
+    { CountType::MAX, "overload_level", "current overload level (0 none, 1 sampling, 2 reduced features, 3 cheap model)" },
+    { CountType::MAX, "overload_escalations", "times the overload controller moved to a higher level" },
+    { CountType::MAX, "shed_packets", "packets of flows left out by the overload controller's sampling" },
+    { CountType::MAX, "shed_permille", "share of the packets shed by the overload controller, in per mille" },
+    { CountType::MAX, "overload_flows", "flows scored by the overload model" },
+    { CountType::MAX, "queue_depth", "timeouted connections waiting for a verdict" },
+    { CountType::MAX, "expiry_usecs", "time spent looking for timeouted connections" },
+    { CountType::MAX, "materialize_usecs", "time spent building the feature vectors of timeouted connections" },
+    { CountType::MAX, "pool_batches", "batches of timeouted connections split over the background pool" },
+    { CountType::MAX, "pool_tasks", "tasks run by the background pool (scoring chunks, model loads)" },
+    { CountType::MAX, "pool_steals", "tasks a background pool worker stole from another" },
+    { CountType::MAX, "packet_nsecs_p50", "median packet processing time" },
+    { CountType::MAX, "packet_nsecs_p99", "99th percentile packet processing time" },
+    { CountType::MAX, "packet_nsecs_max", "maximum packet processing time" },
+    { CountType::MAX, "verdict_usecs_p50", "median time from connection timeout to verdict" },
+    { CountType::MAX, "verdict_usecs_p99", "99th percentile time from connection timeout to verdict" },
+    { CountType::MAX, "verdict_usecs_max", "maximum time from connection timeout to verdict" },
+    { CountType::END, nullptr, nullptr }
+};
+
 static THREAD_LOCAL ProfileStats ml_PerfStats;
-static THREAD_LOCAL SimpleStats ml_stats;
+static THREAD_LOCAL MLStats ml_stats;
 
 //-------------------------------------------------------------------------
 // class stuff
@@ -43,6 +138,7 @@ class MLClassifiers : public Inspector
 {
 public:
     MLClassifiers();
+    ~MLClassifiers() override;
 
     bool configure(SnortConfig*) override;
     void show(SnortConfig*) override;
@@ -54,10 +150,35 @@ MLClassifiers::MLClassifiers()
     LogMessage("[*] MLClassifiers::MLClassifiers()\n");
 }
 
+MLClassifiers::~MLClassifiers()
+{
+    /*
+        Shutdown (or a reload replacing this inspector): the live connections survive in the checkpoint.
+        On shutdown, the packet threads (and the background service) are already stopped.
+    */
+    save_checkpoint();
+}
+
 bool MLClassifiers::configure(SnortConfig*)
 {
-    std::thread verify_thread(verify_timeouts);
-    verify_thread.detach();
+    if (ml_cache) {
+        ml_verdict_cache.configure(ml_cache_size, ml_cache_ttl);
+    }
+
+    configure_admission();
+
+    ml_overload_controller.configure(ml_overload_latency, ml_overload_queue, ml_overload_sampling, ml_overload_interval);
+
+    /* Before loading the models: the routes' models are loaded too. */
+    build_routes();
+
+    load_native_models();
+    start_model_watcher();
+    open_scorer_ring();
+
+    /* The timeout scan, the periodic checkpoints and the model watcher run on the background service (see ml_tinit()). */
+    schedule_service();
+    restore_checkpoint();
     return true;
 }
 
@@ -75,45 +196,159 @@ void MLClassifiers::eval(Packet* p)
             - Se existe, timo, basta adicionar as informaes do novo pacote  respectiva conexo;
             - Se no existe,  preciso criar uma nova conexo, inicializar seus campos e adicionar  lista de conexes.
     */
+    Profile profile(ml_PerfStats);
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
     if ((p->is_tcp() || p->is_udp() || p->is_icmp()) && p->flow) {
-        std::vector<std::string> id_candidates = get_id_candidates(p);
+        std::vector<std::string> id_candidates;
+        {
+            Profile key_profile(ml_key_perf_stats);
+            id_candidates = get_id_candidates(p);
+        }
+        {
+            Profile lookup_profile(ml_lookup_perf_stats);
 
-        /* Attempts to find an existent connection with the flow_id equals to id_candidates[0]. */
-        connections_it = connections.find(id_candidates[0]);
+            /* Attempts to find an existent connection with the flow_id equals to id_candidates[0]. */
+            connections_it = connections.find(id_candidates[0]);
 
-        /* If it couldn't find an existent connection with the above flow_id, it
-           attempts again with the flow_id equals to id_candidates[1] .*/
-        if (connections_it == connections.end()) {
-            connections_it = connections.find(id_candidates[1]);
+            /* If it couldn't find an existent connection with the above flow_id, it
+               attempts again with the flow_id equals to id_candidates[1] .*/
+            if (connections_it == connections.end()) {
+                connections_it = connections.find(id_candidates[1]);
+            }
         }
 
+        FlowPacket packet = flow_packet(p);
+
         /* Finally, checks if any connection was found. */
         if (connections_it != connections.end()) {
             /* Found it! */
 
             /* Adds the packet's information to the connection. */
-            connections_it->second.add_packet(p);
+            Profile update_profile(ml_update_perf_stats);
+            connections_it->second.add_packet(packet);
+        } else if (ml_overload && !ml_overload_controller.sampled(flow_hash(id_candidates))) {
+            /* Under overload, the flows left out of the sample aren't tracked at all (see ml_overload.h). */
+            ml_overload_controller.shed();
         } else {
             /* Couldn't find it... */
+            Profile create_profile(ml_create_perf_stats);
+
+            SfIpString client_ip, server_ip;
+            p->flow->client_ip.ntop(client_ip);
+            p->flow->server_ip.ntop(server_ip);
+
+            packet.client_ip = client_ip;
+            packet.client_port = p->flow->client_port;
+            packet.server_ip = server_ip;
+            packet.server_port = p->flow->server_port;
+
+            /* With the admission filter, the flow's first packet waits on probation for a second one. */
+            FlowPacket first = packet;
+            std::string id = id_candidates[0];
 
-            /* Creates a new connection and inserts it in the connections list. */
-            Connection newConnection(p, id_candidates[0]);
-            connections.insert(std::pair<std::string, Connection>(id_candidates[0], newConnection));
+            if (!ml_admission || admit_flow(p, id_candidates, packet, first, id)) {
+                std::cout << "[+] " << id << std::endl;
+
+                /* Creates a new connection and inserts it in the connections list. */
+                Connection newConnection(first, id);
+                if (ml_admission) newConnection.add_packet(packet);
+
+                route_flow(newConnection, p->flow->client_ip, p->flow->server_ip, p->flow->server_port);
+
+                connections.insert(std::pair<std::string, Connection>(id, newConnection));
+
+                ++ml_stats.flows_created;
+                ml_classification_stats.live_flows++;
+            }
+        }
+
+        if (ml_packet_time) {
+            check_packet_time(p, packet.timestamp);
         }
     }
     ++ml_stats.total_packets;
+
+    if (!ml_packet_histogram) {
+        ml_packet_histogram = ml_packet_latency.create();
+    }
+
+    std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+    uint64_t packet_nsecs = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+
+    ml_packet_histogram->record(packet_nsecs);
+
+    if (ml_overload) {
+        track_overload(packet_nsecs, std::chrono::duration_cast<std::chrono::nanoseconds>(end.time_since_epoch()).count());
+    }
 }
 
 //-------------------------------------------------------------------------
 // module stuff
 //-------------------------------------------------------------------------
 
+static const Parameter ml_route_params[] =
+{
+    { "prefix", Parameter::PT_STRING, nullptr, "any", "IPv4 or IPv6 prefix of the flows' server (or else client) address, e.g. 10.1.0.0/16, or any" },
+    { "ports", Parameter::PT_STRING, nullptr, nullptr, "server ports and ranges, e.g. '22 3389 8000-8099' (default: every port)" },
+    { "key", Parameter::PT_SELECT, "ab | dt | rf | svc | bnb | gnb | xgb | lgbm | mlp", nullptr, "machine learning classifier scoring the route's flows" },
+    { "alert_thresholds", Parameter::PT_STRING, nullptr, nullptr, "the route's alert thresholds (default: the module's alert_thresholds)" },
+    { nullptr, Parameter::PT_MAX, nullptr, nullptr, nullptr }
+};
+
 static const Parameter ml_params[] =
 {
-    { "key", Parameter::PT_SELECT, "ab | dt | rf | svc | bnb | gnb", "ab", "machine learning classifier" },
+    { "key", Parameter::PT_SELECT, "ab | dt | rf | svc | bnb | gnb | xgb | lgbm | mlp", "ab", "machine learning classifier" },
+    { "model_dir", Parameter::PT_STRING, nullptr, "/home/lnutimura/Desktop/ml_classifiers/joblibs", "directory of the native models (clf_<key>.mlm)" },
+    { "model_watch", Parameter::PT_BOOL, nullptr, "true", "reload the native model when clf_<key>.mlm changes in model_dir" },
+    { "mode", Parameter::PT_ENUM, "single | cascade | vote", "single", "classify with the key model, a cascade of two models or a vote of every native model" },
+    { "cascade_first", Parameter::PT_SELECT, "gnb | bnb | svc | dt", "gnb", "cheap model scoring every flow in cascade mode" },
+    { "cascade_second", Parameter::PT_SELECT, "rf | ab | xgb | lgbm | mlp", "rf", "model scoring the uncertain flows in cascade mode" },
+    { "uncertainty_min", Parameter::PT_REAL, "0:1", "0.1", "lowest first stage attack probability sent to the second stage" },
+    { "uncertainty_max", Parameter::PT_REAL, "0:1", "0.9", "highest first stage attack probability sent to the second stage" },
+    { "cache", Parameter::PT_BOOL, nullptr, "false", "reuse confident verdicts for flows with the same server endpoint and feature signature" },
+    { "cache_size", Parameter::PT_INT, "16:max32", "65536", "maximum number of cached verdicts" },
+    { "cache_ttl", Parameter::PT_INT, "1:max32", "300", "seconds a cached verdict stays valid" },
+    { "cache_confidence", Parameter::PT_REAL, "0.5:1", "0.99", "minimum confidence of a verdict to be cached" },
+    { "scorer", Parameter::PT_STRING, nullptr, nullptr, "shared memory segment (e.g. /ml_classifiers) handing the timeouted connections to an external scorer" },
+    { "scorer_capacity", Parameter::PT_INT, "16:1048576", "65536", "flows the external scorer's rings hold" },
+    { "scorer_timeout", Parameter::PT_INT, "1:max32", "1000", "milliseconds to wait for the external scorer before scoring the flows natively" },
+    { "alert_thresholds", Parameter::PT_STRING, nullptr, nullptr, "per-class alert probabilities: space-separated class:probability pairs, or one probability for every attack class" },
+    { "routes", Parameter::PT_LIST, ml_route_params, nullptr, "flows scored by their own model, by server (or client) prefix and server port; the longest prefix wins" },
+    { "admission", Parameter::PT_BOOL, nullptr, "false", "only track flows answered by a second packet, counting single-packet probes in sketches" },
+    { "admission_slots", Parameter::PT_INT, "1024:max32", "65536", "flows the admission filter holds on probation" },
+    { "admission_timeout", Parameter::PT_INT, "1:3600", "10", "seconds a flow stays on probation before counting as a probe" },
+    { "scan_threshold", Parameter::PT_INT, "2:65535", "64", "distinct peers probed within scan_window reported as a scan (or flood)" },
+    { "scan_window", Parameter::PT_INT, "1:86400", "60", "seconds over which scans and floods are aggregated" },
+    { "quantized", Parameter::PT_BOOL, nullptr, "false", "run the native models on quantized features and weights" },
+    { "feature_profile", Parameter::PT_BOOL, nullptr, "true", "only maintain the flow state (flags, bulk, subflows, active/idle) the native models read" },
+    { "pool_threads", Parameter::PT_INT, "0:256", "0", "background pool threads scoring large batches of timeouted connections (0 = classification thread only)" },
+    { "pool_cpus", Parameter::PT_STRING, nullptr, nullptr, "cpus the background pool threads are pinned to, e.g. '2 3 4 5' (default: not pinned)" },
+    { "pool_grain", Parameter::PT_INT, "16:max32", "256", "flows per scoring task; smaller batches are scored on the classification thread" },
+    { "packet_time", Parameter::PT_BOOL, nullptr, "false", "expire connections on the packets' timestamps instead of the wall clock (deterministic pcap replays)" },
+    { "overload", Parameter::PT_BOOL, nullptr, "false", "shed work (flow sampling, then reduced features, then a cheap model) when packets exceed the latency or queue budget" },
+    { "overload_latency", Parameter::PT_INT, "1:max32", "50000", "mean packet processing time (in nanoseconds) above which the inspector is overloaded" },
+    { "overload_queue", Parameter::PT_INT, "1:max32", "65536", "timeouted connections waiting for a verdict above which the inspector is overloaded" },
+    { "overload_sampling", Parameter::PT_REAL, "0:1", "0.25", "share of the new flows tracked while sampling" },
+    { "overload_model", Parameter::PT_SELECT, "gnb | bnb | svc | dt", "dt", "cheap model scoring every flow at the last overload level" },
+    { "checkpoint", Parameter::PT_STRING, nullptr, nullptr, "file the connections are saved to (and restored from on startup)" },
+    { "checkpoint_interval", Parameter::PT_INT, "0:max32", "300", "seconds between background checkpoints (0 = only on shutdown)" },
     { nullptr, Parameter::PT_MAX, nullptr, nullptr, nullptr }
 };
 
+static int reload_model(lua_State*)
+{
+    LogMessage("[*] ml_classifiers: native model reload requested\n");
+    request_model_reload();
+    return 0;
+}
+
+static const Command ml_cmds[] =
+{
+    { "reload_model", reload_model, nullptr, "rebuild the native model from model_dir and swap it in" },
+    { nullptr, nullptr, nullptr, nullptr }
+};
+
 class MLClassifiersModule : public Module
 {
 public:
@@ -121,33 +356,280 @@ public:
     { }
 
     const PegInfo* get_pegs() const override
-    { return simple_pegs; }
+    { return ml_pegs; }
 
     PegCount* get_counts() const override
     { return (PegCount*)&ml_stats; }
 
-    ProfileStats* get_profile() const override
-    { return &ml_PerfStats; }
+    ProfileStats* get_profile(unsigned, const char*&, const char*&) const override;
 
+    const Command* get_commands() const override
+    { return ml_cmds; }
+
+    bool begin(const char*, int, SnortConfig*) override;
     bool set(const char*, Value& v, SnortConfig*) override;
+    bool end(const char*, int, SnortConfig*) override;
+    void sum_stats(bool) override;
 
     Usage get_usage() const override
     { return INSPECT; }
+
+private:
+    /* The routes entry being configured. */
+    ModelRoute route;
 };
 
-bool MLClassifiersModule::set(const char*, Value& v, SnortConfig*)
+ProfileStats* MLClassifiersModule::get_profile(unsigned index, const char*& name, const char*& parent) const
+{
+    switch ( index )
+    {
+    case 0:
+        name = s_name;
+        parent = nullptr;
+        return &ml_PerfStats;
+
+    case 1:
+        name = "ml_key";
+        parent = s_name;
+        return &ml_key_perf_stats;
+
+    case 2:
+        name = "ml_lookup";
+        parent = s_name;
+        return &ml_lookup_perf_stats;
+
+    case 3:
+        name = "ml_create";
+        parent = s_name;
+        return &ml_create_perf_stats;
+
+    case 4:
+        name = "ml_update";
+        parent = s_name;
+        return &ml_update_perf_stats;
+
+    case 5:
+        name = "ml_bulk";
+        parent = "ml_update";
+        return &ml_bulk_perf_stats;
+
+    case 6:
+        name = "ml_subflow";
+        parent = "ml_update";
+        return &ml_subflow_perf_stats;
+    }
+    return nullptr;
+}
+
+bool MLClassifiersModule::begin(const char* fqn, int idx, SnortConfig*)
+{
+    if (!strcmp(fqn, s_name)) {
+        ml_routes.clear();
+    } else if (!strcmp(fqn, "ml_classifiers.routes") && idx > 0) {
+        route = ModelRoute();
+    }
+    return true;
+}
+
+bool MLClassifiersModule::set(const char* fqn, Value& v, SnortConfig*)
 {
     LogMessage("[*] MLClassifiersModule::set\n");
-    LogMessage("[*] Key: ");
-    LogMessage(v.get_string());
-    LogMessage("\n");
-    
-    ml_technique = v.get_string();
-    std::cout << ml_technique << std::endl;
-    
+
+    /* A routes entry's key and alert_thresholds are its own, not the module's. */
+    if (!strncmp(fqn, "ml_classifiers.routes.", 22)) {
+        if (v.is("prefix")) {
+            route.prefix = v.get_string();
+        } else if (v.is("ports")) {
+            route.ports = v.get_string();
+        } else if (v.is("key")) {
+            route.technique = v.get_string();
+        } else if (v.is("alert_thresholds")) {
+            std::string error;
+
+            if (!parse_alert_thresholds(v.get_string(), route.thresholds, error)) {
+                ParseError("ml_classifiers: %s", error.c_str());
+                return false;
+            }
+        } else {
+            return false;
+        }
+        return true;
+    }
+
+    if (v.is("key")) {
+        LogMessage("[*] Key: ");
+        LogMessage(v.get_string());
+        LogMessage("\n");
+
+        ml_technique = v.get_string();
+        std::cout << ml_technique << std::endl;
+    } else if (v.is("model_dir")) {
+        ml_model_dir = v.get_string();
+    } else if (v.is("model_watch")) {
+        ml_model_watch = v.get_bool();
+    } else if (v.is("mode")) {
+        ml_mode = v.get_string();
+    } else if (v.is("cascade_first")) {
+        ml_cascade_first = v.get_string();
+    } else if (v.is("cascade_second")) {
+        ml_cascade_second = v.get_string();
+    } else if (v.is("uncertainty_min")) {
+        ml_uncertainty_min = v.get_real();
+    } else if (v.is("uncertainty_max")) {
+        ml_uncertainty_max = v.get_real();
+    } else if (v.is("cache")) {
+        ml_cache = v.get_bool();
+    } else if (v.is("cache_size")) {
+        ml_cache_size = v.get_uint32();
+    } else if (v.is("cache_ttl")) {
+        ml_cache_ttl = (int64_t)v.get_uint32() * 1000000;
+    } else if (v.is("cache_confidence")) {
+        ml_cache_confidence = v.get_real();
+    } else if (v.is("scorer")) {
+        ml_scorer = v.get_string();
+    } else if (v.is("scorer_capacity")) {
+        ml_scorer_capacity = v.get_uint32();
+    } else if (v.is("scorer_timeout")) {
+        ml_scorer_timeout = v.get_uint32();
+    } else if (v.is("alert_thresholds")) {
+        std::string error;
+
+        if (!parse_alert_thresholds(v.get_string(), ml_alert_thresholds, error)) {
+            ParseError("ml_classifiers: %s", error.c_str());
+            return false;
+        }
+    } else if (v.is("admission")) {
+        ml_admission = v.get_bool();
+    } else if (v.is("admission_slots")) {
+        ml_admission_slots = v.get_uint32();
+    } else if (v.is("admission_timeout")) {
+        ml_admission_timeout = (int64_t)v.get_uint32() * 1000000;
+    } else if (v.is("scan_threshold")) {
+        ml_scan_threshold = v.get_uint32();
+    } else if (v.is("scan_window")) {
+        ml_scan_window = (int64_t)v.get_uint32() * 1000000;
+    } else if (v.is("quantized")) {
+        ml_quantized = v.get_bool();
+    } else if (v.is("feature_profile")) {
+        ml_feature_profile = v.get_bool();
+    } else if (v.is("pool_threads")) {
+        ml_pool_threads = v.get_uint32();
+    } else if (v.is("pool_cpus")) {
+        std::istringstream cpus(v.get_string());
+        int cpu;
+
+        ml_pool_cpus.clear();
+        while (cpus >> cpu) ml_pool_cpus.push_back(cpu);
+    } else if (v.is("pool_grain")) {
+        ml_pool_grain = v.get_uint32();
+    } else if (v.is("packet_time")) {
+        ml_packet_time = v.get_bool();
+    } else if (v.is("overload")) {
+        ml_overload = v.get_bool();
+    } else if (v.is("overload_latency")) {
+        ml_overload_latency = v.get_uint32();
+    } else if (v.is("overload_queue")) {
+        ml_overload_queue = v.get_uint32();
+    } else if (v.is("overload_sampling")) {
+        ml_overload_sampling = v.get_real();
+    } else if (v.is("overload_model")) {
+        ml_overload_model = v.get_string();
+    } else if (v.is("checkpoint")) {
+        ml_checkpoint = v.get_string();
+    } else if (v.is("checkpoint_interval")) {
+        ml_checkpoint_interval = v.get_uint32();
+    } else {
+        return false;
+    }
+
+    return true;
+}
+
+bool MLClassifiersModule::end(const char* fqn, int idx, SnortConfig*)
+{
+    if (!strcmp(fqn, "ml_classifiers.routes")) {
+        if (idx == 0) return true;
+
+        RouteTable check;
+        std::string error;
+
+        if (route.technique.empty()) {
+            ParseError("ml_classifiers: route %s needs a key", route.prefix.c_str());
+            return false;
+        }
+
+        if (!check.add(route.prefix, route.ports, 0, error)) {
+            ParseError("ml_classifiers: %s", error.c_str());
+            return false;
+        }
+
+        ml_routes.push_back(route);
+        return true;
+    }
+
+    if (ml_uncertainty_min > ml_uncertainty_max) {
+        ParseError("ml_classifiers: uncertainty_min must not be greater than uncertainty_max");
+        return false;
+    }
     return true;
 }
 
+void MLClassifiersModule::sum_stats(bool accumulate_now_stats)
+{
+    /*
+        The classification counters are global (they're updated by the background thread),
+        so every thread reports the same values and their pegs are MAX, not SUM.
+    */
+    ml_stats.first_stage_flows = ml_classification_stats.first_stage_flows;
+    ml_stats.first_stage_usecs = ml_classification_stats.first_stage_usecs;
+    ml_stats.second_stage_flows = ml_classification_stats.second_stage_flows;
+    ml_stats.second_stage_usecs = ml_classification_stats.second_stage_usecs;
+    ml_stats.voted_flows = ml_classification_stats.voted_flows;
+    ml_stats.vote_usecs = ml_classification_stats.vote_usecs;
+    ml_stats.scorer_flows = ml_classification_stats.scorer_flows;
+    ml_stats.scorer_usecs = ml_classification_stats.scorer_usecs;
+    ml_stats.scorer_timeouts = ml_classification_stats.scorer_timeouts;
+    ml_stats.routed_flows = ml_classification_stats.routed_flows;
+    ml_stats.routed_usecs = ml_classification_stats.routed_usecs;
+    ml_stats.cache_lookups = ml_verdict_cache.stats.lookups;
+    ml_stats.cache_hits = ml_verdict_cache.stats.hits;
+    ml_stats.cache_inserts = ml_verdict_cache.stats.inserts;
+    ml_stats.cache_evictions = ml_verdict_cache.stats.evictions;
+    ml_stats.live_flows = ml_classification_stats.live_flows;
+    ml_stats.flows_expired = ml_classification_stats.flows_expired;
+    ml_stats.normal_flows = ml_classification_stats.normal_flows;
+    ml_stats.attack_flows = ml_classification_stats.attack_flows;
+    ml_stats.held_flows = ml_classification_stats.held_flows;
+    ml_stats.promoted_flows = ml_classification_stats.promoted_flows;
+    ml_stats.probe_flows = ml_classification_stats.probe_flows;
+    ml_stats.scan_events = ml_classification_stats.scan_events;
+    ml_stats.flood_events = ml_classification_stats.flood_events;
+    ml_stats.overload_level = ml_overload_controller.level();
+    ml_stats.overload_escalations = ml_overload_controller.stats.escalations;
+    ml_stats.shed_packets = ml_overload_controller.stats.shed_packets;
+    ml_stats.shed_permille = ml_overload_controller.shed_permille();
+    ml_stats.overload_flows = ml_overload_controller.stats.cheap_flows;
+    ml_stats.queue_depth = ml_classification_stats.queue_depth;
+    ml_stats.expiry_usecs = ml_classification_stats.expiry_usecs;
+    ml_stats.materialize_usecs = ml_classification_stats.materialize_usecs;
+    ml_stats.pool_batches = background_pool().parallel_batches;
+    ml_stats.pool_tasks = background_pool().tasks_run;
+    ml_stats.pool_steals = background_pool().tasks_stolen;
+
+    /* The latency histograms of every thread are merged before taking their percentiles. */
+    std::vector<uint64_t> packet_latency = ml_packet_latency.merge();
+    ml_stats.packet_nsecs_p50 = LatencyHistogram::quantile(packet_latency, 0.5);
+    ml_stats.packet_nsecs_p99 = LatencyHistogram::quantile(packet_latency, 0.99);
+    ml_stats.packet_nsecs_max = LatencyHistogram::quantile(packet_latency, 1.0);
+
+    std::vector<uint64_t> verdict_latency = ml_verdict_latency.merge();
+    ml_stats.verdict_usecs_p50 = LatencyHistogram::quantile(verdict_latency, 0.5);
+    ml_stats.verdict_usecs_p99 = LatencyHistogram::quantile(verdict_latency, 0.99);
+    ml_stats.verdict_usecs_max = LatencyHistogram::quantile(verdict_latency, 1.0);
+
+    Module::sum_stats(accumulate_now_stats);
+}
+
 //-------------------------------------------------------------------------
 // api stuff
 //-------------------------------------------------------------------------
@@ -169,6 +651,16 @@ static void ml_dtor(Inspector* p)
     delete p;
 }
 
+static void ml_tinit()
+{
+    start_service();
+}
+
+static void ml_tterm()
+{
+    stop_service();
+}
+
 static const InspectApi ml_api
 {
     {
@@ -189,8 +681,8 @@ static const InspectApi ml_api
     nullptr, // service
     nullptr, // pinit
     nullptr, // pterm
-    nullptr, // tinit
-    nullptr, // tterm
+    ml_tinit,
+    ml_tterm,
     ml_ctor,
     ml_dtor,
     nullptr, // ssn
@@ -1,43 +1,57 @@
 #include <boost/python.hpp>
 
 #include <map>
+#include <array>
+#include <atomic>
 #include <mutex>
 #include <chrono>
 #include <string>
 #include <thread>
 #include <vector>
+#include <cerrno>
 #include <cstdlib>
 #include <iomanip>
 #include <fstream>
 #include <sstream>
 #include <iostream>
 #include <algorithm>
+#include <poll.h>
+#include <unistd.h>
 #include <sys/time.h>
-
-#include <boost/accumulators/accumulators.hpp>
-#include <boost/accumulators/statistics/sum.hpp>
-#include <boost/accumulators/statistics/min.hpp>
-#include <boost/accumulators/statistics/max.hpp>
-#include <boost/accumulators/statistics/mean.hpp>
-#include <boost/accumulators/statistics/count.hpp>
-#include <boost/accumulators/statistics/variance.hpp>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
 
 #include "protocols/packet.h"
 #include "protocols/icmp4.h"
 #include "protocols/icmp6.h"
 #include "protocols/tcp.h"
 #include "protocols/udp.h"
+#include "profiler/profiler.h"
+
+#include "ml_cache.h"
+#include "ml_admission.h"
+#include "ml_overload.h"
+#include "ml_routing.h"
+#include "ml_stats.h"
+#include "ml_pool.h"
+#include "ml_shm.h"
+#include "ml_models.h"
+#include "ml_quantized.h"
+#include "ml_checkpoint.h"
+#include "ml_service.h"
 
 /* For convenience. */
 namespace bp = boost::python;
 
 using namespace snort;
-using namespace boost::accumulators;
 
-typedef accumulator_set< int64_t, features<tag::count, tag::sum, tag::min, tag::max, tag::mean, tag::variance > > intAcc;
-typedef accumulator_set< double, features<tag::count, tag::sum, tag::min, tag::max, tag::mean, tag::variance > > doubleAcc;
+/* Connection's optional state updates are timed by Snort's profiler (see ml_connection.h). */
+extern THREAD_LOCAL ProfileStats ml_bulk_perf_stats;
+extern THREAD_LOCAL ProfileStats ml_subflow_perf_stats;
+
+#define ML_PROFILE(stats) Profile profile(stats)
 
-class Connection;
+#include "ml_connection.h"
 
 /* Mutex. */
 std::mutex ml_mutex;
@@ -45,6 +59,250 @@ std::mutex ml_mutex;
 /* Selected Machine Learning Technique. */
 std::string ml_technique;
 
+/* Directory holding the native models (clf_<technique>.mlm). */
+std::string ml_model_dir = "/home/lnutimura/Desktop/ml_classifiers/joblibs";
+
+/* Classification mode: "single" (ml_technique only), "cascade" or "vote". */
+std::string ml_mode = "single";
+
+/* Cascade stages: a cheap model scores every flow, the uncertain ones go to the second stage. */
+std::string ml_cascade_first = "gnb";
+std::string ml_cascade_second = "rf";
+
+/* Flows whose first stage attack probability falls in [min, max] are uncertain. */
+double ml_uncertainty_min = 0.1;
+double ml_uncertainty_max = 0.9;
+
+/*
+    Per-class alert thresholds (see decide_class() in ml_models.h): an attack class is only
+    reported when its probability reaches its threshold, trading false positives for misses.
+    Empty: the most probable class wins.
+*/
+std::vector<double> ml_alert_thresholds;
+
+/*
+    Model routes (see ml_routing.h): the flows to a route's prefix and server ports are scored
+    by its model, with its alert thresholds (the module's when it has none), whatever the mode.
+    A flow is routed when its connection is created: on its server address, then on its
+    client address, both with its server port. Flows without a route follow the mode.
+    ml_routes only holds the configured routes: build_routes() compiles them into a new
+    ModelRouting and publishes it in ml_routing, as the models are, so the packet threads and
+    the classification never see a half-built table. Flows routed on a previous version of the
+    routes are routed again before they're classified (see classify_connections()).
+*/
+struct ModelRoute {
+    std::string prefix = "any";
+    std::string ports;
+    std::string technique;
+    std::vector<double> thresholds;
+};
+
+struct ModelRouting {
+    std::vector<ModelRoute> routes;
+    RouteTable table;
+    uint32_t version = 0;
+};
+
+std::vector<ModelRoute> ml_routes;
+Rcu<ModelRouting> ml_routing;
+
+/* Whether the native models run quantized (see ml_quantized.h). */
+bool ml_quantized = false;
+
+/*
+    Background thread pool (see ml_pool.h): batches of timeouted connections larger than
+    ml_pool_grain are scored in chunks of that many flows by ml_pool_threads workers and the
+    classification thread, and the native models are loaded on it. With 0 workers, everything
+    runs on the calling thread. Workers are pinned to ml_pool_cpus, if any.
+    The pool is created on first use, so its size is fixed by the first configuration. It's
+    defined before the background service, so the service is stopped before the pool's workers
+    are joined at exit.
+*/
+unsigned ml_pool_threads = 0;
+std::vector<int> ml_pool_cpus;
+size_t ml_pool_grain = 256;
+
+std::unique_ptr<TaskPool> ml_pool;
+std::once_flag ml_pool_created;
+
+/*
+    External scorer (see ml_shm.h): when ml_scorer names a shared memory segment, the timeouted
+    connections are handed to the process serving it (e.g. "ml_classifiers.py <key> --serve")
+    before the native models. Flows still without a verdict after ml_scorer_timeout milliseconds
+    are scored as if there were no external scorer.
+*/
+std::string ml_scorer;
+uint32_t ml_scorer_capacity = 65536;
+uint32_t ml_scorer_timeout = 1000;
+ScorerRing ml_scorer_ring;
+
+/* Numbers the batches handed to the external scorer (the upper half of the tags). */
+uint64_t ml_scorer_batch = 0;
+
+/*
+    Native models, one slot per technique (empty when there's no clf_<technique>.mlm).
+    xgb and lgbm are gradient-boosted trees imported by tools/ml_import.cc (native only), and
+    mlp is a small neural network (sklearn's MLPClassifier, see ml_gemm.h).
+*/
+const std::vector<std::string> ml_techniques = { "ab", "dt", "rf", "svc", "bnb", "gnb", "xgb", "lgbm", "mlp" };
+ModelRcu ml_models[9];
+
+/*
+    Classification counters. They're updated by the thread classifying the connections,
+    not by the packet threads, so they're global (see MLClassifiersModule::sum_stats).
+*/
+struct ClassificationStats {
+    std::atomic<uint64_t> first_stage_flows { 0 };
+    std::atomic<uint64_t> first_stage_usecs { 0 };
+    std::atomic<uint64_t> second_stage_flows { 0 };
+    std::atomic<uint64_t> second_stage_usecs { 0 };
+    std::atomic<uint64_t> voted_flows { 0 };
+    std::atomic<uint64_t> vote_usecs { 0 };
+    std::atomic<uint64_t> scorer_flows { 0 };
+    std::atomic<uint64_t> scorer_usecs { 0 };
+    std::atomic<uint64_t> scorer_timeouts { 0 };
+    std::atomic<uint64_t> routed_flows { 0 };
+    std::atomic<uint64_t> routed_usecs { 0 };
+
+    /* Flow accounting (flows_created is a per-thread SUM peg instead). */
+    std::atomic<uint64_t> live_flows { 0 };
+    std::atomic<uint64_t> flows_expired { 0 };
+    std::atomic<uint64_t> normal_flows { 0 };
+    std::atomic<uint64_t> attack_flows { 0 };
+
+    /* Admission filter: first packets held, flows promoted to connections, probes and aggregated events. */
+    std::atomic<uint64_t> held_flows { 0 };
+    std::atomic<uint64_t> promoted_flows { 0 };
+    std::atomic<uint64_t> probe_flows { 0 };
+    std::atomic<uint64_t> scan_events { 0 };
+    std::atomic<uint64_t> flood_events { 0 };
+
+    /* Timeouted connections waiting for a verdict. */
+    std::atomic<uint64_t> queue_depth { 0 };
+
+    /* Background stages (Snort's profiler only aggregates the packet threads). */
+    std::atomic<uint64_t> expiry_usecs { 0 };
+    std::atomic<uint64_t> materialize_usecs { 0 };
+};
+
+ClassificationStats ml_classification_stats;
+
+/*
+    Packet thread profiler scopes, nested under ml_classifiers (see MLClassifiersModule::get_profile):
+    flow key building, connections lookup, connection creation and update, and the bulk/subflow
+    tracking done by every update.
+*/
+THREAD_LOCAL ProfileStats ml_key_perf_stats;
+THREAD_LOCAL ProfileStats ml_lookup_perf_stats;
+THREAD_LOCAL ProfileStats ml_create_perf_stats;
+THREAD_LOCAL ProfileStats ml_update_perf_stats;
+THREAD_LOCAL ProfileStats ml_bulk_perf_stats;
+THREAD_LOCAL ProfileStats ml_subflow_perf_stats;
+
+/*
+    Latency histograms: packet processing (nanoseconds, one histogram per packet thread)
+    and flow expiry to verdict (microseconds, written by the classification thread).
+*/
+HistogramRegistry ml_packet_latency;
+THREAD_LOCAL LatencyHistogram* ml_packet_histogram = nullptr;
+
+HistogramRegistry ml_verdict_latency;
+LatencyHistogram* ml_verdict_histogram = ml_verdict_latency.create();
+
+/*
+    Verdict cache: flows towards the same server endpoint with the same coarse feature
+    signature reuse a previous verdict, as long as it was given with at least
+    ml_cache_confidence (see ml_cache.h).
+*/
+bool ml_cache = false;
+size_t ml_cache_size = 65536;
+int64_t ml_cache_ttl = 300000000;
+double ml_cache_confidence = 0.99;
+
+/* Features (0-based indexes of the feature vector) making up the cache signature. */
+const std::vector<size_t> ml_cache_features = { 1, 2, 3, 4, 5, 6, 10, 43, 44, 45, 46, 47, 48, 49, 50, 66, 67 };
+
+VerdictCache ml_verdict_cache;
+
+/*
+    Checkpoint of the connections map (see ml_checkpoint.h): restored on startup, saved every
+    ml_checkpoint_interval seconds (0 disables the periodic saves) and on shutdown.
+    An empty path disables checkpoints.
+*/
+std::string ml_checkpoint;
+uint32_t ml_checkpoint_interval = 300;
+
+/* Connections copied into records per hold of ml_mutex, so a large map doesn't stall the packet threads. */
+const size_t ml_checkpoint_chunk = 4096;
+
+/*
+    Packet time mode: connections expire on the packets' timestamps, checked by the packet
+    thread itself every ml_expiry_interval of packet time, instead of on the wall clock by
+    the background service. Every timing then follows the capture, so a pcap replayed as fast as
+    it can be read gives the same flows, features and verdicts every time.
+*/
+bool ml_packet_time = false;
+const int64_t ml_expiry_interval = 20000000;
+std::atomic<int64_t> ml_next_expiry { 0 };
+
+/* Whether only the state read by the native models is tracked (otherwise everything is). */
+bool ml_feature_profile = true;
+
+/* Whether model_dir is watched for new versions of the native model. */
+bool ml_model_watch = true;
+
+/* Tells the model watcher a reload was requested (eventfd). */
+int ml_reload_fd = -1;
+
+/* How many of the wake-ups pending in ml_reload_fd only ask to watch the configured model_dir again. */
+std::atomic<uint64_t> ml_watch_rearms { 0 };
+
+/* The watch of model_dir (inotify, only used by the watcher's job), and how often the job checks it (ms). */
+int ml_watch_fd = -1;
+const uint32_t ml_watch_interval = 1000;
+
+/* A flow on probation: its first packet and endpoints. */
+struct Probe {
+    FlowPacket first;
+    SfIp client_ip;
+    SfIp server_ip;
+};
+
+/*
+    Admission filter (see ml_admission.h): with ml_admission, a new flow's first packet is held
+    on probation (ml_admission_slots flows at most) and the flow only becomes a connection when
+    a second packet answers it. Probes that end without one (evicted, refused with a reset or
+    held for ml_admission_timeout) are counted per source (fan-out: scans) and per destination
+    endpoint (fan-in: floods), and those reaching ml_scan_threshold distinct peers within
+    ml_scan_window are reported as a single event.
+*/
+bool ml_admission = false;
+size_t ml_admission_slots = 65536;
+int64_t ml_admission_timeout = 10000000;
+uint32_t ml_scan_threshold = 64;
+int64_t ml_scan_window = 60000000;
+
+std::mutex ml_admission_mutex;
+ProbationTable<Probe> ml_probation;
+FanoutTracker ml_scan_sources;
+FanoutTracker ml_flood_targets;
+
+/*
+    Overload controller (see ml_overload.h): with ml_overload, packets taking more than
+    ml_overload_latency nanoseconds on average, or more than ml_overload_queue connections
+    waiting for a verdict, move the inspector to flow sampling (keeping ml_overload_sampling
+    of the new flows), then to reduced feature tracking, then to scoring every flow with
+    ml_overload_model, one step per ml_overload_interval.
+*/
+bool ml_overload = false;
+uint64_t ml_overload_latency = 50000;
+uint64_t ml_overload_queue = 65536;
+double ml_overload_sampling = 0.25;
+std::string ml_overload_model = "dt";
+const int64_t ml_overload_interval = 1000000000;
+
+OverloadController ml_overload_controller;
+
 /* Map of current active connections.*/
 std::map<std::string, Connection> connections;
 std::map<std::string, Connection>::iterator connections_it;
@@ -57,1051 +315,1068 @@ std::map<std::string, Connection>::iterator connections_it;
 struct TimeoutedConnections {
     std::vector<std::string> id;
     std::vector<Connection> connections;
-    std::vector<std::vector<double>> features;
+    std::vector<FeatureVector> features;
+
+    /* When each connection timeouted (steady clock, in microseconds). */
+    std::vector<int64_t> expired_at;
 };
 
 TimeoutedConnections t_connections;
 
-/* Auxiliary functions prototypes. */
-int64_t get_time_in_microseconds();
-int64_t get_time_in_microseconds(time_t tvsec, suseconds_t tvusec);
+/*
+    Held while connections are queued into t_connections and classified: by the background
+    service, by the packet thread that's due in packet time mode, or on shutdown.
+*/
+std::mutex ml_expiry_mutex;
 
-std::vector<std::string> get_id_candidates(Packet* p);
+/*
+    Background service (see ml_service.h): the process' only scheduler, running the timeout scan
+    every ml_expiry_interval (unless in packet time mode), the periodic checkpoints and the model
+    watcher. Its jobs follow the current configuration (see schedule_service()). It runs while at
+    least one packet thread does (see start_service()), and the last one to stop drains the
+    connections. Defined after the connections, so it's stopped before they're destroyed.
+*/
+BackgroundService ml_service;
+std::mutex ml_service_mutex;
+unsigned ml_service_threads = 0;
 
+/* Auxiliary functions prototypes. */
+std::vector<std::string> get_id_candidates(Packet* p);
+FlowPacket flow_packet(Packet* p);
+
+ModelRcu& native_model(const std::string& technique);
+std::vector<std::string> required_techniques();
+TaskPool& background_pool();
+void load_native_model(const std::string& technique);
+void load_native_models(const std::vector<std::string>& techniques = required_techniques());
+void update_feature_profile();
+void build_routes();
+void route_flow(Connection& connection, const SfIp& client_ip, const SfIp& server_ip, uint16_t server_port);
+void route_flow(Connection& connection, const ModelRouting& routing);
+void configure_admission();
+bool admit_flow(Packet* p, const std::vector<std::string>& id_candidates, const FlowPacket& packet, FlowPacket& first, std::string& id);
+void count_probe(const Probe& probe, int64_t now);
+void expire_probes(int64_t now);
+uint64_t flow_hash(const std::vector<std::string>& id_candidates);
+void track_overload(uint64_t packet_nsecs, int64_t now);
+void predict_routed(const ModelRouting& routing, const std::vector<size_t>& flows, std::vector<float>& predictions,
+                    std::vector<double>& confidences, std::vector<size_t>& unrouted);
+bool predict_native(const std::vector<size_t>& flows, std::vector<float>& predictions, std::vector<double>& confidences,
+                    const ModelRouting* routing);
+bool predict_mode(const std::vector<size_t>& flows, std::vector<float>& predictions, std::vector<double>& confidences);
+void predict_flows(const Model& model, const std::vector<size_t>& flows, size_t begin, size_t end, std::vector<float>& predictions,
+                   std::vector<double>& confidences, const std::vector<double>* thresholds);
+void open_scorer_ring();
+bool predict_external(const std::vector<size_t>& flows, std::vector<float>& predictions, std::vector<double>& confidences,
+                      std::vector<size_t>& unscored);
+void request_model_reload();
+void start_model_watcher();
+int watch_model_dir();
+void watch_models();
+void rearm_model_watch();
+uint64_t verdict_key(Connection& connection, const FeatureVector& features);
 void classify_connections();
 void check_connections(Packet* p);
+uint64_t queue_connection(std::map<std::string, Connection>::iterator it);
+void drain_connections();
+void check_packet_time(Packet* p, int64_t now);
 void verify_timeouts();
+void schedule_service();
+void start_service();
+void stop_service();
+bool save_checkpoint();
+void restore_checkpoint();
 
-/* This class' features are based on the CICFlowMeter's features. */
-class Connection {
-    public:
-        /*
-            Basic constructor:
-            Initializes most of this class' parameters.
-        */
-            Connection (Packet* p, std::string id) {
-            std::cout << "[+] " << id << std::endl;
+/* 
+    Auxiliary function used to retrieve possible strings for the flow id:
+        - id_candidates[0]: flow_id;
+        - id_candidates[1]: reversed flow_id.
+*/
+std::vector<std::string> get_id_candidates(Packet* p) {
+    std::vector<std::string> id_candidates;
 
-            /* Initializes the flags_counter and other parameters. */
-            init_flags();
-            init_parameters();
+    std::ostringstream iss, reversed_iss;
 
-            update_flow_bulk(p);
-            update_subflows(p);
+    if (p->is_tcp()) {
+        iss << "TCP"; reversed_iss << "TCP";
+    } else if (p->is_udp()) {
+        iss << "UDP"; reversed_iss << "UDP";
+    } else if (p->is_icmp()) {
+        iss << "ICMP"; reversed_iss << "ICMP";
+    }
 
-            /* Updates the flags_counter based on the packet's flags (TCP-only). */
-            if (p->is_tcp()) {
-                update_flags_counter(p);
-            }
+    SfIpString client_ip, server_ip;
+    p->flow->client_ip.ntop(client_ip);
+    p->flow->server_ip.ntop(server_ip);
 
-            flow_id = id;
-            protocol = (uint8_t)p->ip_proto_next;
+    iss << "-" << client_ip << ":" << p->flow->client_port << "-" << server_ip << ":" << p->flow->server_port;
+    reversed_iss << "-" << server_ip << ":" << p->flow->server_port << "-" << client_ip << ":" << p->flow->client_port;
 
-            /* The packet's timestamp in microseconds. */
-            //uint32_t packet_timestamp = p->pkth->ts.tv_usec;
-            int64_t packet_timestamp = get_time_in_microseconds(p->pkth->ts.tv_sec, p->pkth->ts.tv_usec);
-            
-            flow_first_seen = flow_last_seen =
-                start_active_time = end_active_time = packet_timestamp;
+    if (p->is_icmp()) {
+        iss << "-" << p->ptrs.icmph->s_icmp_id;
+        reversed_iss << "-" << p->ptrs.icmph->s_icmp_id;
+    }
 
-            flow_length((double)p->dsize);
+    id_candidates.push_back(iss.str());
+    id_candidates.push_back(reversed_iss.str());
 
-            p->flow->client_ip.ntop(client_ip);
-            client_port = p->flow->client_port;
+    return id_candidates;
+}
 
-            p->flow->server_ip.ntop(server_ip);
-            server_port = p->flow->server_port;
+/*
+    Auxiliary function used to retrieve what a connection reads from a packet.
+    The endpoints are left unset: they're only needed when a connection is created.
+*/
+FlowPacket flow_packet(Packet* p) {
+    FlowPacket packet;
+
+    packet.timestamp = get_time_in_microseconds(p->pkth->ts.tv_sec, p->pkth->ts.tv_usec);
+    packet.pktlen = p->pkth->pktlen;
+    packet.dsize = p->dsize;
+    packet.protocol = (uint8_t)p->ip_proto_next;
+    packet.tcp = p->is_tcp();
+    packet.from_client = p->is_from_client();
+
+    if (packet.tcp) {
+        packet.tcp_flags = p->ptrs.tcph->th_flags;
+        packet.window = p->ptrs.tcph->win();
+    }
+    return packet;
+}
 
-            /* Instead of comparing client_ip w/ packet_source,
-               I'll use "p->is_from_client()".
-             
-                SfIpString packet_source;
-                *(p->ptrs.ip_api.get_src())->ntop(packet_source);
-            */
-            
-            /* Checks whether this packet is coming from the client or the server. */
-            if (p->is_from_client()) {
-                /* Coming from client (forward direction). */
-                min_seg_size_forward = p->pkth->pktlen - p->dsize;
+/* Auxiliary function used to retrieve the native model slot of a technique. */
+ModelRcu& native_model(const std::string& technique) {
+    size_t index = std::find(ml_techniques.begin(), ml_techniques.end(), technique) - ml_techniques.begin();
+    return ml_models[(index < ml_techniques.size()) ? index : 0];
+}
 
-                if (p->is_tcp()) {
-                    init_win_bytes_forward = p->ptrs.tcph->win();
+/* Auxiliary function used to list the techniques the classification mode (and the model routes) need. */
+std::vector<std::string> required_techniques() {
+    std::vector<std::string> techniques;
 
-                    if (p->ptrs.tcph->are_flags_set(TH_PUSH)) {
-                        forward_PSH += 1;
-                    }
+    if (ml_mode == "cascade") {
+        techniques = { ml_cascade_first, ml_cascade_second };
+    } else if (ml_mode == "vote") {
+        techniques = ml_techniques;
+    } else {
+        techniques = { ml_technique };
+    }
 
-                    if (p->ptrs.tcph->are_flags_set(TH_URG)) {
-                        forward_URG += 1;
-                    }
-                }
+    Rcu<ModelRouting>::Reader routing(ml_routing);
 
-                /*
-                    Note: In CICFlowMeter's code, the authors
-                    update the flow_length one more time.
-                    (Does that makes any sense?)
-                    flow_length((double)p->dsize);
-                */
-                forward_pkt((double)p->dsize);
-                forward_bytes += p->dsize;
-                forward_hbytes += p->pkth->pktlen - p->dsize;
+    for (size_t r = 0; routing && r < routing->routes.size(); r++) {
+        if (std::find(techniques.begin(), techniques.end(), routing->routes[r].technique) == techniques.end()) {
+            techniques.push_back(routing->routes[r].technique);
+        }
+    }
 
-                forward_last_seen = packet_timestamp;
-                forward_count += 1;
+    /* Loaded beforehand, so it's ready when an overload needs it. */
+    if (ml_overload && std::find(techniques.begin(), techniques.end(), ml_overload_model) == techniques.end()) {
+        techniques.push_back(ml_overload_model);
+    }
+    return techniques;
+}
 
-            } else {
-                /* Coming from server (backward direction). */
-                if (p->is_tcp()) {
-                    init_win_bytes_backward = p->ptrs.tcph->win();
+/*
+    Auxiliary function used to load the native model of a technique.
+    If there isn't one, the timeouted connections are classified by ml_classifiers.py.
+    The model is fully built before being swapped in, so a failed (re)load keeps the current one.
+*/
+void load_native_model(const std::string& technique) {
+    ModelRcu& slot = native_model(technique);
+    std::string path = ml_model_dir + "/clf_" + technique + ".mlm";
+    std::string error;
+
+    /* The scaler is folded into the model, unless it's quantized (which works on scaled features). */
+    Model* model = load_model(path, error, !ml_quantized);
+
+    if (model && model->num_features != 78) {
+        error = path + " expects " + std::to_string(model->num_features) + " features";
+        delete model;
+        model = nullptr;
+    }
 
-                    if (p->ptrs.tcph->are_flags_set(TH_PUSH)) {
-                        backward_PSH += 1;
-                    }
+    if (model && ml_quantized) {
+        std::string quantize_error;
+        Model* quantized = quantize_model(model, quantize_error);
 
-                    if (p->ptrs.tcph->are_flags_set(TH_URG)) {
-                        backward_URG += 1;
-                    }
-                }
+        if (quantized)
+            model = quantized;
+        else
+            std::cout << "[*] Couldn't quantize " << path << " (" << quantize_error << "), using it as is." << std::endl;
+    }
 
-                /*
-                    Note: In CICFlowMeter's code, the authors
-                    update the flow_length one more time.
-                    (Does that makes any sense?)
-                    flow_length((double)p->dsize);
-                */
-                backward_pkt((double)p->dsize);
-                backward_bytes += p->dsize;
-                backward_hbytes += p->pkth->pktlen - p->dsize;
-
-                backward_last_seen = packet_timestamp;
-                backward_count += 1;
-            }
-        }
+    if (!model) {
+        if (slot.empty())
+            std::cout << "[*] No native model (" << error << ")." << std::endl;
+        else
+            std::cout << "[*] Couldn't reload the native model (" << error << "), keeping the current one." << std::endl;
+        return;
+    }
 
-        /* Method used to update a connection based on the packet's information. */
-        void add_packet(Packet* p) {
-            //uint32_t packet_timestamp = p->pkth->ts.tv_usec;
-            int64_t packet_timestamp = get_time_in_microseconds(p->pkth->ts.tv_sec, p->pkth->ts.tv_usec);
-            
-            /*
-            For some reason, the CICFlowMeter's authors kept these
-            three lines commented for a long time.
-            */
-            update_flow_bulk(p);
-            update_subflows(p);
-            
-            if (p->is_tcp()) {
-                update_flags_counter(p);
-            }
-            
-            
-            flow_length((double)p->dsize);
+    slot.replace(model);
+    std::cout << "[*] Loaded the native model " << path << "." << std::endl;
 
-            /*
-                SfIpString packet_source;
-                *(p->ptrs.ip_api.get_src())->ntop(packet_source);
-            */
+    update_feature_profile();
+}
 
-            if (p->is_from_client()) {
-                if (p->dsize >= 1.0f) {
-                    act_data_pkt_forward += 1;
-                }
+/* Auxiliary function used to retrieve the background thread pool (created on first use). */
+TaskPool& background_pool() {
+    std::call_once(ml_pool_created, []() {
+        ml_pool.reset(new TaskPool(ml_pool_threads, ml_pool_cpus));
+    });
+    return *ml_pool;
+}
 
-                if (p->is_tcp()) {
-                    if (p->ptrs.tcph->are_flags_set(TH_PUSH)) {
-                        backward_PSH += 1;
-                    }
+/* Auxiliary function used to load native models (by default, every one the classification mode needs) in parallel. */
+void load_native_models(const std::vector<std::string>& techniques) {
+    TaskGroup group;
 
-                    if (p->ptrs.tcph->are_flags_set(TH_URG)) {
-                        backward_URG += 1;
-                    }
-                }
+    for (const std::string& technique : techniques) {
+        background_pool().submit([technique]() { load_native_model(technique); }, &group);
+    }
+    background_pool().wait(group);
+}
 
-                forward_pkt((double)p->dsize);
-                forward_bytes += p->dsize;
-                forward_hbytes += p->pkth->pktlen - p->dsize;
+/*
+    Auxiliary function used to decide which optional flow state (TrackedState) is maintained:
+    only what the features read by the mode's native models need. Without a native model for
+    some technique, ml_classifiers.py may score the flows, so everything is tracked (and so it
+    is with an external scorer).
+    When a reloaded model reads more features, the connections already being tracked only
+    start maintaining that state from then on.
+*/
+void update_feature_profile() {
+    /* Models loaded in parallel: the last update must see every model swapped in before it. */
+    static std::mutex profile_mutex;
+    std::lock_guard<std::mutex> lock(profile_mutex);
 
-                forward_count += 1;
+    std::vector<bool> used(NUM_FEATURES, false);
+    bool native = false;
 
-                if (forward_count > 1) {
-                    forward_iat(packet_timestamp - forward_last_seen);
-                }
-                
-                forward_last_seen = packet_timestamp;
-                min_seg_size_forward = std::min((p->pkth->pktlen - p->dsize), min_seg_size_forward);
-        
-            } else {
-                if (p->is_tcp()) {
-                    init_win_bytes_backward = p->ptrs.tcph->win();
+    for (const std::string& technique : required_techniques()) {
+        ModelRcu::Reader model(native_model(technique));
 
-                    if (p->ptrs.tcph->are_flags_set(TH_PUSH)) {
-                        backward_PSH += 1;
-                    }
+        if (!model) {
+            /* Vote mode only uses the models available. */
+            if (ml_mode == "vote") continue;
 
-                    if (p->ptrs.tcph->are_flags_set(TH_URG)) {
-                        backward_URG += 1;
-                    }
-                }
+            used.assign(NUM_FEATURES, true);
+            break;
+        }
+        model->mark_used_features(used);
+        native = true;
+    }
 
-                backward_pkt((double)p->dsize);
-                backward_bytes += p->dsize;
-                backward_hbytes += p->pkth->pktlen - p->dsize;
+    /* The external scorer's model may read any feature, as may ml_classifiers.py's. */
+    if (!ml_feature_profile || !native || !ml_scorer.empty()) {
+        used.assign(NUM_FEATURES, true);
+    }
 
-                backward_count += 1;
+    uint32_t tracked = tracked_state(used);
 
-                if (backward_count > 1) {
-                    backward_iat(packet_timestamp - backward_last_seen);
-                }
-                
-                backward_last_seen = packet_timestamp;
-            }
+    /* Under overload, the optional state isn't maintained at all (see track_overload()). */
+    if (ml_overload && ml_overload_controller.level() >= OVERLOAD_REDUCED) {
+        tracked = 0;
+    }
+    ml_tracked_state = tracked;
 
-            flow_iat(packet_timestamp - flow_last_seen);
-            flow_last_seen = packet_timestamp;
-        }
+    std::cout << "[*] Feature profile: " << std::count(used.begin(), used.end(), true) << " of " << NUM_FEATURES
+              << " features read, tracking" << ((tracked & TRACK_FLAGS) ? " flags" : "")
+              << ((tracked & TRACK_BULK) ? " bulk" : "") << ((tracked & TRACK_SUBFLOWS) ? " subflows" : "")
+              << ((tracked & TRACK_ACTIVE_IDLE) ? " active/idle" : "") << "." << std::endl;
+}
 
-        /* Method used to initialize the flags counter. */
-        void init_flags() {
-            flags_counter["FIN"] = 0;
-            flags_counter["SYN"] = 0;
-            flags_counter["RST"] = 0;
-            flags_counter["PSH"] = 0;
-            flags_counter["ACK"] = 0;
-            flags_counter["URG"] = 0;
-            flags_counter["CWR"] = 0;
-            flags_counter["ECE"] = 0;
-        }
+/* Asks the model watcher to rebuild the native model (e.g. from the reload_model command). */
+void request_model_reload() {
+    uint64_t one = 1;
 
-        /* Method used to initialize most of this class' variables/parameters. */
-        void init_parameters() {
-            forward_count = 0;
-            backward_count = 0;
+    if (ml_reload_fd >= 0 && write(ml_reload_fd, &one, sizeof(one)) != sizeof(one)) {
+        std::cout << "[*] Couldn't request a model reload." << std::endl;
+    }
+}
 
-            flow_first_seen = 0;
-            flow_last_seen = 0;
+/*
+    Sets the model watcher up for the current configuration: the watcher's job (see
+    schedule_service()) watches the (maybe new) model_dir on its next run.
+*/
+void start_model_watcher() {
+    static std::once_flag created;
 
-            forward_last_seen = 0;
-            backward_last_seen = 0;
+    std::call_once(created, []() {
+        ml_reload_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    });
 
-            forward_PSH = 0;
-            forward_URG = 0;
-            backward_PSH = 0;
-            backward_URG = 0;
+    rearm_model_watch();
+}
 
-            forward_bytes = 0;
-            forward_hbytes = 0;
-            backward_bytes = 0;
-            backward_hbytes = 0;
+/* Auxiliary function used to ask the model watcher's job to watch the configured model_dir again. */
+void rearm_model_watch() {
+    if (ml_reload_fd < 0) return;
 
-            start_active_time = 0;
-            end_active_time = 0;
+    uint64_t one = 1;
+    ml_watch_rearms++;
 
-            act_data_pkt_forward = 0;
-            min_seg_size_forward = 0;
+    if (write(ml_reload_fd, &one, sizeof(one)) != sizeof(one)) {
+        ml_watch_rearms--;
+        std::cout << "[*] Couldn't update the model watcher." << std::endl;
+    }
+}
 
-            init_win_bytes_forward = 0;
-            init_win_bytes_backward = 0;
-       }
+/* Auxiliary function used to watch model_dir for new models (unless model_watch is off). Returns the inotify descriptor or -1. */
+int watch_model_dir() {
+    if (!ml_model_watch) return -1;
 
-        /* Method used to update the flags_counter (TCP-only). */
-        void update_flags_counter(Packet* p) {
-            const tcp::TCPHdr* tcpHeader = p->ptrs.tcph;
+    int inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
 
-            if (tcpHeader->are_flags_set(TH_FIN)) {
-                flags_counter["FIN"] += 1;
-            }
-            if (tcpHeader->are_flags_set(TH_SYN)) {
-                flags_counter["SYN"] += 1;
-            }
-            if (tcpHeader->are_flags_set(TH_RST)) {
-                flags_counter["RST"] += 1;
-            }
-            if (tcpHeader->are_flags_set(TH_PUSH)) {
-                flags_counter["PSH"] += 1;
-            }
-            if (tcpHeader->are_flags_set(TH_ACK)) {
-                flags_counter["ACK"] += 1;
-            }
-            if (tcpHeader->are_flags_set(TH_URG)) {
-                flags_counter["URG"] += 1;
-            }
-            if (tcpHeader->are_flags_set(TH_CWR)) {
-                flags_counter["CWR"] += 1;
-            }
-            if (tcpHeader->are_flags_set(TH_ECE)) {
-                flags_counter["ECE"] += 1;
-            }
-        }
+    if (inotify_fd >= 0 && inotify_add_watch(inotify_fd, ml_model_dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+        std::cout << "[*] Couldn't watch " << ml_model_dir << " for new models." << std::endl;
+        close(inotify_fd);
+        inotify_fd = -1;
+    }
+    return inotify_fd;
+}
 
-        /* Method used to update the bulk flow in the forward direction. */
-        void update_forward_bulk(Packet* p, int64_t op_bulk_last_timestamp) {
-            uint32_t size = p->dsize;
-            //uint32_t packet_timestamp = p->pkth->ts.tv_usec;
-            int64_t packet_timestamp = get_time_in_microseconds(p->pkth->ts.tv_sec, p->pkth->ts.tv_usec);
-            
-            if (op_bulk_last_timestamp > f_bulk_start_helper) f_bulk_start_helper = 0;
-            if (size <= 0) return;
-
-            if (f_bulk_start_helper == 0) {
-                f_bulk_size_helper = size;
-                f_bulk_packet_count_helper = 1;
-                f_bulk_start_helper = packet_timestamp;
-                f_bulk_last_timestamp = packet_timestamp;
-            } else {
-                if (((packet_timestamp - f_bulk_last_timestamp) / (double)1000000) > 1) {
-                    f_bulk_size_helper = size;
-                    f_bulk_packet_count_helper = 1;
-                    f_bulk_start_helper = packet_timestamp;
-                    f_bulk_last_timestamp = packet_timestamp;
-                } else {
-                    f_bulk_size_helper += size;
-                    f_bulk_packet_count_helper += 1;
-
-                    if (f_bulk_packet_count_helper == 4) {
-                        f_bulk_state_count += 1;
-                        f_bulk_packet_count += f_bulk_packet_count_helper;
-                        f_bulk_total_size += f_bulk_size_helper;
-                        f_bulk_duration += packet_timestamp - f_bulk_start_helper;
-                    } else if (f_bulk_packet_count_helper > 4) {
-                        f_bulk_packet_count += 1;
-                        f_bulk_total_size += size;
-                        f_bulk_duration += packet_timestamp - f_bulk_last_timestamp;
-                    }
+/*
+    Background service job watching for new models, every ml_watch_interval.
+    Rebuilds the native model in the background whenever clf_<technique>.mlm is written
+    (or moved) into model_dir or a reload is requested. The connections aren't touched
+    and batches already being classified finish on the previous model.
+    The techniques are those of the configuration current at each run, and a configuration
+    reload re-arms the watch (see start_model_watcher()), so a new key, mode, routes or
+    model_dir take effect without restarting Snort.
+*/
+void watch_models() {
+    /* poll() ignores negative descriptors, so a missing watch only leaves the reload requests. */
+    struct pollfd fds[2] = { { ml_reload_fd, POLLIN, 0 }, { ml_watch_fd, POLLIN, 0 } };
 
-                    f_bulk_last_timestamp = packet_timestamp;
-                }
-            }
-        }
+    if (poll(fds, 2, 0) <= 0) return;
 
-        /* Method used to update the bulk flow in the backward direction. */
-        void update_backward_bulk(Packet* p, uint32_t op_bulk_last_timestamp) {
-            uint32_t size = p->dsize;
-            //uint32_t packet_timestamp = p->pkth->ts.tv_usec;
-            int64_t packet_timestamp = get_time_in_microseconds(p->pkth->ts.tv_sec, p->pkth->ts.tv_usec);
-            
-            if (op_bulk_last_timestamp > b_bulk_start_helper) b_bulk_start_helper = 0;
-            if (size <= 0) return;
-
-            if (b_bulk_start_helper == 0) {
-                b_bulk_size_helper = size;
-                b_bulk_packet_count_helper = 1;
-                b_bulk_start_helper = packet_timestamp;
-                b_bulk_last_timestamp = packet_timestamp;
-            }
-            else {
-                if (((packet_timestamp - b_bulk_last_timestamp) / (double)1000000) > 1) {
-                    b_bulk_size_helper = size;
-                    b_bulk_packet_count_helper = 1;
-                    b_bulk_start_helper = packet_timestamp;
-                    b_bulk_last_timestamp = packet_timestamp;
-                }
-                else {
-                    b_bulk_size_helper += size;
-                    b_bulk_packet_count_helper += 1;
-
-                    if (b_bulk_packet_count_helper == 4) {
-                        b_bulk_state_count += 1;
-                        b_bulk_packet_count += b_bulk_packet_count_helper;
-                        b_bulk_total_size += b_bulk_size_helper;
-                        b_bulk_duration += packet_timestamp - b_bulk_start_helper;
-                    }
-                    else if (b_bulk_packet_count_helper > 4) {
-                        b_bulk_packet_count += 1;
-                        b_bulk_total_size += size;
-                        b_bulk_duration += packet_timestamp - b_bulk_last_timestamp;
-                    }
+    /* Techniques whose model has to be rebuilt. */
+    std::vector<std::string> techniques = required_techniques();
+    std::vector<std::string> reload;
+
+    /* Before a re-arm closes the descriptor. */
+    if (fds[1].revents & POLLIN) {
+        alignas(struct inotify_event) char buffer[4096];
+        ssize_t length;
 
-                    b_bulk_last_timestamp = packet_timestamp;
+        while ((length = read(ml_watch_fd, buffer, sizeof(buffer))) > 0) {
+            for (char* event_ptr = buffer; event_ptr < buffer + length; ) {
+                struct inotify_event* event = (struct inotify_event*)event_ptr;
+
+                for (const std::string& technique : techniques) {
+                    if (event->len > 0 && ("clf_" + technique + ".mlm") == event->name &&
+                        std::find(reload.begin(), reload.end(), technique) == reload.end()) {
+                        reload.push_back(technique);
+                    }
                 }
+                event_ptr += sizeof(struct inotify_event) + event->len;
             }
         }
+    }
 
-        /* Method used to update the bulk flow. */
-        void update_flow_bulk(Packet* p) {
-            /*
-                SfIpString packet_source;
-                *(p->ptrs.ip_api.get_src())->ntop(packet_source);
-            */
-            if (p->is_from_client()) {
-                update_forward_bulk(p, b_bulk_last_timestamp);
-            } else {
-                update_backward_bulk(p, f_bulk_last_timestamp);
+    if (fds[0].revents & POLLIN) {
+        uint64_t requests;
+
+        if (read(ml_reload_fd, &requests, sizeof(requests)) == sizeof(requests)) {
+            uint64_t rearms = ml_watch_rearms.exchange(0);
+
+            if (rearms > 0) {
+                if (ml_watch_fd >= 0) close(ml_watch_fd);
+                ml_watch_fd = watch_model_dir();
             }
+
+            /* The other wake-ups are reload requests. */
+            if (requests > rearms) reload = techniques;
         }
+    }
 
-        /* Method used to update both active and idle time of the flow. */
-        void update_active_idle_time(int64_t current_time, int64_t threshold) {
-            if ((current_time - end_active_time) > threshold) {
-                if ((end_active_time - start_active_time) > 0) {
-                    flow_active(end_active_time - start_active_time);
-                }
+    load_native_models(reload);
+}
 
-                flow_idle(current_time - end_active_time);
-                start_active_time = current_time;
-                end_active_time = current_time;
-            } else {
-                end_active_time = current_time;
-            }
+/*
+    Auxiliary function used to score the timeouted connections with the native models,
+    according to the classification mode:
+        - single: the ml_technique model scores every flow;
+        - cascade: the first stage scores every flow and only the uncertain ones
+          (attack probability within [ml_uncertainty_min, ml_uncertainty_max]) reach the second stage;
+        - vote: every available model votes and the majority wins (ties are Attacks).
+    Verdicts follow ml_alert_thresholds, when set. Flows with a model route in "routing" are
+    scored by their route's model instead (see predict_routed()).
+    Only the flows listed in "flows" (indexes into t_connections) are scored. Their verdict
+    and its confidence (the deciding model's probability, or the vote's share) are written
+    at the same indexes of "predictions" and "confidences".
+    The models are pinned for the whole batch, so a reload only affects the next one.
+    Large batches are split over the background pool; every flow's results go to its own
+    indexes, so they're merged in order.
+    Returns false when none of the needed models is available.
+*/
+bool predict_native(const std::vector<size_t>& flows, std::vector<float>& predictions, std::vector<double>& confidences,
+                    const ModelRouting* routing) {
+    /* Under overload, the cheap model scores every flow, routed or not (see ml_overload.h). */
+    if (ml_overload && ml_overload_controller.level() >= OVERLOAD_CHEAP) {
+        ModelRcu::Reader cheap(native_model(ml_overload_model));
+
+        if (cheap) {
+            background_pool().parallel_for(flows.size(), ml_pool_grain, [&](size_t begin, size_t end) {
+                predict_flows(*cheap.get(), flows, begin, end, predictions, confidences, &ml_alert_thresholds);
+            });
+
+            ml_overload_controller.stats.cheap_flows += flows.size();
+            return true;
         }
+    }
 
-        /* Method used to update subflows. */
-        void update_subflows(Packet* p) {
-            //uint32_t packet_timestamp = p->pkth->ts.tv_usec;
-            int64_t packet_timestamp = get_time_in_microseconds(p->pkth->ts.tv_sec, p->pkth->ts.tv_usec);
-            
-            if (sf_last_packet_timestamp == -1) {
-                sf_last_packet_timestamp = packet_timestamp;
-                sf_ac_helper = packet_timestamp;
-            }
+    if (!routing || routing->routes.empty()) return predict_mode(flows, predictions, confidences);
 
-            if (((packet_timestamp - sf_last_packet_timestamp) / (double)1000000) > 1) {
-                sf_count += 1;
-                int64_t last_sf_duration = packet_timestamp - sf_ac_helper;
-                update_active_idle_time(packet_timestamp - sf_last_packet_timestamp, 5000000);
-                sf_ac_helper = packet_timestamp;
-            }
+    std::vector<size_t> unrouted;
+    predict_routed(*routing, flows, predictions, confidences, unrouted);
 
-            sf_last_packet_timestamp = packet_timestamp;
-        }
+    return unrouted.empty() || predict_mode(unrouted, predictions, confidences);
+}
 
-        /* Features "getters". */
-        std::string get_flowid() {
-            return flow_id;
-        }
-        
-        int64_t get_flowfirstseen() {
-            return flow_first_seen;
-        }
+/*
+    Auxiliary function used to score the flows with a model route (see ml_routes), grouped by
+    route, so each route's model is pinned once per batch. The other flows (and those whose
+    route's model isn't available) are listed in "unrouted", in order.
+    Every flow was routed on "routing" (see classify_connections()).
+*/
+void predict_routed(const ModelRouting& routing, const std::vector<size_t>& flows, std::vector<float>& predictions,
+                    std::vector<double>& confidences, std::vector<size_t>& unrouted) {
+    const std::vector<ModelRoute>& routes = routing.routes;
+    std::vector<std::vector<size_t>> routed(routes.size());
+
+    for (size_t i : flows) {
+        int32_t route = t_connections.connections[i].get_route();
+
+        if (route >= 0 && (size_t)route < routed.size() && t_connections.connections[i].get_route_version() == routing.version)
+            routed[route].push_back(i);
+        else
+            unrouted.push_back(i);
+    }
 
-        int64_t get_flowlastseen() {
-            return flow_last_seen;
-        }
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    bool fallback = false;
 
-        double get_flowbytespersec() {
-            int64_t duration = flow_last_seen - flow_first_seen;
+    for (size_t r = 0; r < routed.size(); r++) {
+        if (routed[r].empty()) continue;
 
-            if (duration > 0) {
-                return ((double)(forward_bytes + backward_bytes)) / ((double)duration/1000000);
-            } else {
-                return 0;
-            }
+        ModelRcu::Reader model(native_model(routes[r].technique));
+
+        if (!model) {
+            unrouted.insert(unrouted.end(), routed[r].begin(), routed[r].end());
+            fallback = true;
+            continue;
         }
 
-        double get_flowpktspersec() {
-            int64_t duration = flow_last_seen - flow_first_seen;
-            uint32_t packet_count = forward_count + backward_count;
+        const std::vector<size_t>& batch = routed[r];
+        const std::vector<double>* thresholds = routes[r].thresholds.empty() ? &ml_alert_thresholds : &routes[r].thresholds;
 
-            if (duration > 0) {
-                return ((double)packet_count) / ((double)duration/1000000);
-            } else {
-                return 0;
-            }
-        }
+        background_pool().parallel_for(batch.size(), ml_pool_grain, [&](size_t begin, size_t end) {
+            predict_flows(*model.get(), batch, begin, end, predictions, confidences, thresholds);
+        });
 
-        double get_fpktspersec() {
-            int64_t duration = flow_last_seen - flow_first_seen;
+        ml_classification_stats.routed_flows += batch.size();
+    }
 
-            if (duration > 0) {
-                return ((double)forward_count) / ((double)duration/1000000);
-            } else {
-                return 0;
-            }
-        }
+    if (fallback) std::sort(unrouted.begin(), unrouted.end());
 
-        double get_bpktspersec() {
-            int64_t duration = flow_last_seen - flow_first_seen;
+    ml_classification_stats.routed_usecs += std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - start).count();
+}
 
-            if (duration > 0) {
-                return ((double)backward_count) / ((double)duration/1000000);
-            }
-            else {
-                return 0;
-            }
-        }
+/* Auxiliary function used to score flows according to the classification mode (see predict_native()). */
+bool predict_mode(const std::vector<size_t>& flows, std::vector<float>& predictions, std::vector<double>& confidences) {
+    const std::vector<FeatureVector>& features = t_connections.features;
+    size_t count = flows.size();
 
-        double get_downupratio() {
-            if (forward_count > 0) {
-                return ((double)backward_count / (double)forward_count);
-            } else {
-                return 0;
-            }
-        }
+    if (ml_mode == "vote") {
+        std::vector<std::unique_ptr<ModelRcu::Reader>> voters;
 
-        double get_avgpktsize() {
-            uint32_t packet_count = forward_count + backward_count;
-            if (packet_count > 0) {
-                return (sum(flow_length) / (double)packet_count);
-            } else {
-                return 0;
-            }
+        for (const std::string& technique : ml_techniques) {
+            std::unique_ptr<ModelRcu::Reader> voter(new ModelRcu::Reader(native_model(technique)));
+            if (*voter) voters.push_back(std::move(voter));
         }
 
-        double get_favgsegmentsize() {
-            if (forward_count > 0) {
-                return (sum(forward_pkt) / (double)forward_count);
-            } else {
-                return 0;
-            }
-        }
+        if (voters.empty()) return false;
 
-        double get_bavgsegmentsize() {
-            if (backward_count > 0) {
-                return (sum(backward_pkt) / (double)backward_count);
-            } else {
-                return 0;
-            }
-        }
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
 
-        double get_fsubflowbytes() {
-            if (sf_count > 0) {
-                return ((double)forward_bytes / (double)sf_count);
-            } else {
-                return 0;
-            }
-        }
+        background_pool().parallel_for(count, ml_pool_grain, [&](size_t begin, size_t end) {
+            for (size_t k = begin; k < end; k++) {
+                size_t i = flows[k];
+                size_t attack_votes = 0;
 
-        double get_fsubflowpkts() {
-            if (sf_count > 0) {
-                return ((double)forward_count / (double)sf_count);
-            } else {
-                return 0;
-            }
-        }
+                for (const std::unique_ptr<ModelRcu::Reader>& voter : voters) {
+                    if ((*voter)->predict(features[i].data(), nullptr, &ml_alert_thresholds) != 0) attack_votes++;
+                }
 
-        double get_bsubflowbytes() {
-            if (sf_count > 0) {
-                return ((double)backward_bytes / (double)sf_count);
-            } else {
-                return 0;
-            }
-        }
+                bool attack = (2 * attack_votes >= voters.size());
 
-        double get_bsubflowpkts() {
-            if (sf_count > 0) {
-                return ((double)backward_count / (double)sf_count);
-            } else {
-                return 0;
+                predictions[i] = attack ? 1.0f : 0.0f;
+                confidences[i] = (double)(attack ? attack_votes : voters.size() - attack_votes) / voters.size();
             }
-        }
+        });
 
-        uint32_t get_fbulkstatecount() {
-            return f_bulk_state_count;
-        }
+        ml_classification_stats.voted_flows += count;
+        ml_classification_stats.vote_usecs += std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - start).count();
+        return true;
+    }
 
-        uint32_t get_fbulktotalsize() {
-            return f_bulk_total_size;
-        }
+    bool cascade = (ml_mode == "cascade");
+    ModelRcu::Reader first(native_model(cascade ? ml_cascade_first : ml_technique));
 
-        uint32_t get_fbulkpktcount() {
-            return f_bulk_packet_count;
-        }
+    if (!cascade) {
+        if (!first) return false;
 
-        int64_t get_fbulkduration() {
-            return f_bulk_duration;
-        }
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
 
-        double get_fbulkduration_seconds() {
-            return f_bulk_duration / (double)1000000;
-        }
-        
-        uint32_t get_favgbytesperbulk() {
-            if (get_fbulkstatecount() != 0) {
-                return (get_fbulktotalsize() / get_fbulkstatecount());
+        background_pool().parallel_for(count, ml_pool_grain, [&](size_t begin, size_t end) {
+            predict_flows(*first.get(), flows, begin, end, predictions, confidences, &ml_alert_thresholds);
+        });
+
+        ml_classification_stats.first_stage_flows += count;
+        ml_classification_stats.first_stage_usecs += std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - start).count();
+        return true;
+    }
+
+    ModelRcu::Reader second(native_model(ml_cascade_second));
+
+    if (!first && !second) return false;
+
+    /* Without a first stage, every flow is uncertain. */
+    std::vector<double> first_scores(features.size(), 0.5);
+    std::vector<size_t> uncertain;
+
+    if (first) {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+        background_pool().parallel_for(count, ml_pool_grain, [&](size_t begin, size_t end) {
+            for (size_t k = begin; k < end; k++) {
+                size_t i = flows[k];
+                first_scores[i] = attack_probability(*first.get(), features[i].data());
+            }
+        });
+
+        /* The uncertain flows are listed in order, after the (parallel) scoring. */
+        for (size_t i : flows) {
+            if (first_scores[i] < ml_uncertainty_min) {
+                predictions[i] = 0.0f;
+                confidences[i] = 1.0 - first_scores[i];
+            } else if (first_scores[i] > ml_uncertainty_max) {
+                predictions[i] = 1.0f;
+                confidences[i] = first_scores[i];
             } else {
-                return 0;
+                uncertain.push_back(i);
             }
         }
 
-        uint32_t get_favgpktsperbulk() {
-            if (get_fbulkstatecount() != 0) {
-                return (get_fbulkpktcount() / get_fbulkstatecount());
-            } else {
-                return 0;
-            }
+        ml_classification_stats.first_stage_flows += count;
+        ml_classification_stats.first_stage_usecs += std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - start).count();
+    } else {
+        uncertain = flows;
+    }
+
+    if (second) {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+        background_pool().parallel_for(uncertain.size(), ml_pool_grain, [&](size_t begin, size_t end) {
+            predict_flows(*second.get(), uncertain, begin, end, predictions, confidences, &ml_alert_thresholds);
+        });
+
+        ml_classification_stats.second_stage_flows += uncertain.size();
+        ml_classification_stats.second_stage_usecs += std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - start).count();
+    } else {
+        /* Without a second stage, the first one decides on its own (against class 1's threshold, if any). */
+        double threshold = (ml_alert_thresholds.size() > 1 && ml_alert_thresholds[1] >= 0) ? ml_alert_thresholds[1] : 0.5;
+
+        for (size_t i : uncertain) {
+            predictions[i] = (first_scores[i] >= threshold) ? 1.0f : 0.0f;
+            confidences[i] = (first_scores[i] >= threshold) ? first_scores[i] : 1.0 - first_scores[i];
         }
+    }
+
+    return true;
+}
+
+/*
+    Auxiliary function used to score flows[begin .. end) (indexes into t_connections) with a model,
+    as one batch (see Model::predict_batch()), writing their verdicts and confidences at their indexes.
+*/
+void predict_flows(const Model& model, const std::vector<size_t>& flows, size_t begin, size_t end, std::vector<float>& predictions,
+                   std::vector<double>& confidences, const std::vector<double>* thresholds) {
+    size_t count = end - begin;
+
+    std::vector<const double*> rows(count);
+    std::vector<uint32_t> classes(count);
+    std::vector<double> batch_confidences(count);
+
+    for (size_t k = 0; k < count; k++) {
+        rows[k] = t_connections.features[flows[begin + k]].data();
+    }
+
+    model.predict_batch(rows.data(), count, classes.data(), batch_confidences.data(), thresholds);
+
+    for (size_t k = 0; k < count; k++) {
+        predictions[flows[begin + k]] = (float)classes[k];
+        confidences[flows[begin + k]] = batch_confidences[k];
+    }
+}
+
+/*
+    Auxiliary function used to create the external scorer's shared memory segment.
+    The segment is created once, so a reload doesn't pull it from under a scorer.
+*/
+void open_scorer_ring() {
+    if (ml_scorer.empty() || ml_scorer_ring.is_open()) return;
+
+    std::string error;
+
+    if (ml_scorer_ring.create(ml_scorer, ml_scorer_capacity, 78, error))
+        std::cout << "[*] External scorer ring: " << ml_scorer << " (" << ml_scorer_ring.capacity() << " flows)." << std::endl;
+    else
+        std::cout << "[*] No external scorer (" << error << ")." << std::endl;
+}
+
+/*
+    Auxiliary function used to score the timeouted connections with the external scorer.
+    The flows are queued on the request ring as it drains and the verdicts are collected
+    as they come back, until every flow has one or ml_scorer_timeout expires. The flows
+    left without a verdict are listed in "unscored".
+    Returns false when there's no external scorer, or none attached to the rings (no heartbeat
+    for ml_scorer_timeout, or a second if longer): the batch then goes to the native models
+    right away instead of waiting for verdicts that won't come.
+*/
+bool predict_external(const std::vector<size_t>& flows, std::vector<float>& predictions, std::vector<double>& confidences,
+                      std::vector<size_t>& unscored) {
+    if (!ml_scorer_ring.is_open()) return false;
+
+    int64_t liveness = std::max<int64_t>(ml_scorer_timeout, 1000) * 1000000;
+    if (!ml_scorer_ring.scorer_alive(liveness)) return false;
+
+    const std::vector<FeatureVector>& features = t_connections.features;
+    size_t count = flows.size();
+
+    std::vector<bool> scored(count, false);
+    std::vector<RingVerdict> verdicts(256);
+    size_t pushed = 0, received = 0;
+    unsigned idle = 0;
+
+    /* Tags are the batch number and the flow's index in "flows": late verdicts of a timed out batch are dropped. */
+    uint64_t batch = ++ml_scorer_batch << 32;
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    std::chrono::steady_clock::time_point deadline = start + std::chrono::milliseconds(ml_scorer_timeout);
+
+    while (received < count) {
+        while (pushed < count && ml_scorer_ring.push_request(batch | pushed, features[flows[pushed]].data())) pushed++;
+
+        size_t ready = ml_scorer_ring.pop_verdicts(verdicts.data(), verdicts.size());
+
+        for (size_t v = 0; v < ready; v++) {
+            size_t k = (size_t)(verdicts[v].tag & 0xffffffff);
 
-        uint32_t get_favgbulkrate() {
-            if (get_fbulkduration() != 0) {
-                return (uint32_t)(get_fbulktotalsize() / get_fbulkduration_seconds());
-            } else {
-                return 0;
-            }
-        }
+            if ((verdicts[v].tag & ~0xffffffffULL) != batch || k >= count || scored[k]) continue;
 
-        uint32_t get_bbulkstatecount() {
-            return b_bulk_state_count;
+            predictions[flows[k]] = verdicts[v].label;
+            confidences[flows[k]] = verdicts[v].confidence;
+            scored[k] = true;
+            received++;
         }
 
-        uint32_t get_bbulktotalsize() {
-            return b_bulk_total_size;
+        if (ready > 0) {
+            idle = 0;
+            continue;
         }
 
-        uint32_t get_bbulkpktcount() {
-            return b_bulk_packet_count;
-        }
+        /* The scorer detached (or died) while the batch was waiting. */
+        if (std::chrono::steady_clock::now() >= deadline || !ml_scorer_ring.scorer_alive(liveness)) break;
 
-        int64_t get_bbulkduration() {
-            return b_bulk_duration;
-        }
+        /* Spins for a microsecond hand-off, then backs off up to a millisecond between polls. */
+        if (++idle <= 64)
+            std::this_thread::yield();
+        else
+            std::this_thread::sleep_for(std::chrono::microseconds(1 << std::min(idle - 64, 10u)));
+    }
 
-        double get_bbulkduration_seconds() {
-            return b_bulk_duration / (double)1000000;
-        }
-        
-        uint32_t get_bavgbytesperbulk() {
-            if (get_bbulkstatecount() != 0) {
-                return (get_bbulktotalsize() / get_bbulkstatecount());
-            } else {
-                return 0;
-            }
-        }
+    for (size_t k = 0; k < count; k++) {
+        if (!scored[k]) unscored.push_back(flows[k]);
+    }
 
-        uint32_t get_bavgpktsperbulk() {
-            if (get_bbulkstatecount() != 0) {
-                return (get_bbulkpktcount() / get_bbulkstatecount());
-            } else {
-                return 0;
-            }
-        }
+    ml_classification_stats.scorer_flows += received;
+    ml_classification_stats.scorer_timeouts += count - received;
+    ml_classification_stats.scorer_usecs += std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - start).count();
+    return true;
+}
 
-        uint32_t get_bavgbulkrate() {
-            if (get_bbulkduration() != 0) {
-                return (uint32_t)(get_bbulktotalsize() / get_bbulkduration_seconds());
-            } else {
-                return 0;
-            }
-        }
+/*
+    Auxiliary function used to compile ml_routes into a new ModelRouting, off to the side, and
+    publish it in ml_routing: readers keep the routes they pinned, and the flows routed on them
+    are routed again (their route version is stale).
+    Routes were validated when configured, so every one of them compiles.
+*/
+void build_routes() {
+    static uint32_t version = 0;
 
-        /* Method used to print the feature vector. */
-        void print_feature_vector(std::vector<double> feature_vector) {
-            std::cout << "[";
-            for (int i = 0; i < feature_vector.size(); i++) {
-                std::cout << "(" << (i + 1) << "): " << feature_vector[i];
+    std::unique_ptr<ModelRouting> routing(new ModelRouting());
+    std::string error;
 
-                if (i < (feature_vector.size() - 1)) {
-                    std::cout << " ";
-                }
-            }
-            std::cout << "]" << std::endl;
-        }
+    routing->routes = ml_routes;
+    routing->version = ++version;
 
-        /* Method used to get the feature vector. */
-        std::vector<double> get_feature_vector() {
-            std::vector<double> feature_vector;
-
-            /*
-                MachineLearningCVE - Features
-                Destination Port, Flow Duration, Total Fwd Packets, Total Backward Packets,Total Length of Fwd Packets,
-                Total Length of Bwd Packets, Fwd Packet Length Max, Fwd Packet Length Min, Fwd Packet Length Mean, Fwd Packet Length Std,
-                Bwd Packet Length Max, Bwd Packet Length Min, Bwd Packet Length Mean, Bwd Packet Length Std,Flow Bytes/s, Flow Packets/s,
-                Flow IAT Mean, Flow IAT Std, Flow IAT Max, Flow IAT Min,Fwd IAT Total, Fwd IAT Mean, Fwd IAT Std, Fwd IAT Max, Fwd IAT Min,
-                Bwd IAT Total, Bwd IAT Mean, Bwd IAT Std, Bwd IAT Max, Bwd IAT Min,Fwd PSH Flags, Bwd PSH Flags, Fwd URG Flags, Bwd URG Flags,
-                Fwd Header Length, Bwd Header Length,Fwd Packets/s, Bwd Packets/s, Min Packet Length, Max Packet Length, Packet Length Mean,
-                Packet Length Std, Packet Length Variance,FIN Flag Count, SYN Flag Count, RST Flag Count, PSH Flag Count, ACK Flag Count,
-                URG Flag Count, CWE Flag Count, ECE Flag Count, Down/Up Ratio, Average Packet Size, Avg Fwd Segment Size, Avg Bwd Segment Size,
-                Fwd Header Length,Fwd Avg Bytes/Bulk, Fwd Avg Packets/Bulk, Fwd Avg Bulk Rate, Bwd Avg Bytes/Bulk, Bwd Avg Packets/Bulk,
-                Bwd Avg Bulk Rate,Subflow Fwd Packets, Subflow Fwd Bytes, Subflow Bwd Packets, Subflow Bwd Bytes,Init_Win_bytes_forward,
-                Init_Win_bytes_backward, act_data_pkt_fwd, min_seg_size_forward,Active Mean, Active Std, Active Max, Active Min,Idle Mean,
-                Idle Std, Idle Max, Idle Min, Label
-            */
-
-            int64_t duration = flow_last_seen - flow_first_seen;
-
-            feature_vector.push_back(server_port);                      /* 1  */
-
-            feature_vector.push_back(duration);                         /* 2  */
-
-            feature_vector.push_back(count(forward_pkt));               /* 3  */
-            feature_vector.push_back(count(backward_pkt));              /* 4  */
-            feature_vector.push_back(sum(forward_pkt));                 /* 5  */
-            feature_vector.push_back(sum(backward_pkt));                /* 6  */
-
-            /* Forward Packet Length. */
-            if (count(forward_pkt) > 0) {
-                feature_vector.push_back((max)(forward_pkt));           /* 7  */
-                feature_vector.push_back((min)(forward_pkt));           /* 8  */
-                feature_vector.push_back(mean(forward_pkt));            /* 9  */
-                feature_vector.push_back(sqrt(variance(forward_pkt)));  /* 10 */
-            } else {
-                feature_vector.push_back(0);
-                feature_vector.push_back(0);
-                feature_vector.push_back(0);
-                feature_vector.push_back(0);
-            }
+    for (size_t r = 0; r < routing->routes.size(); r++) {
+        routing->table.add(routing->routes[r].prefix, routing->routes[r].ports, (uint32_t)r, error);
+    }
+    routing->table.build();
 
-            /* Backward Packet Length. */
-            if (count(backward_pkt) > 0) {
-                feature_vector.push_back((max)(backward_pkt));          /* 11 */
-                feature_vector.push_back((min)(backward_pkt));          /* 12 */
-                feature_vector.push_back(mean(backward_pkt));           /* 13 */
-                feature_vector.push_back(sqrt(variance(backward_pkt))); /* 14 */
-            } else {
-                feature_vector.push_back(0);
-                feature_vector.push_back(0);
-                feature_vector.push_back(0);
-                feature_vector.push_back(0);
-            }
+    if (!routing->routes.empty()) {
+        std::cout << "[*] Model routes: " << routing->routes.size() << " (" << routing->table.memory() / 1024 << " KiB)." << std::endl;
+    }
 
-            feature_vector.push_back(get_flowbytespersec());            /* 15 */
-            feature_vector.push_back(get_flowpktspersec());             /* 16 */
-            
-            /* Flow IAT. */
-            if (count(flow_iat) > 0) {
-                feature_vector.push_back(mean(flow_iat));               /* 17 */
-                feature_vector.push_back(sqrt(variance(flow_iat)));     /* 18 */
-                feature_vector.push_back((max)(flow_iat));              /* 19 */
-                feature_vector.push_back((min)(flow_iat));              /* 20 */
-            } else {
-                feature_vector.push_back(0);
-                feature_vector.push_back(0);
-                feature_vector.push_back(0);
-                feature_vector.push_back(0);
-            }
+    ml_routing.replace(routing.release());
+}
 
-            /* Forward IAT. */
-            if (forward_count > 1) {
-                feature_vector.push_back(sum(forward_iat));             /* 21 */
-                feature_vector.push_back(mean(forward_iat));            /* 22 */
-                feature_vector.push_back(sqrt(variance(forward_iat)));  /* 23 */
-                feature_vector.push_back((max)(forward_iat));           /* 24 */
-                feature_vector.push_back((min)(forward_iat));           /* 25 */
-            } else {
-                feature_vector.push_back(0);
-                feature_vector.push_back(0);
-                feature_vector.push_back(0);
-                feature_vector.push_back(0);
-                feature_vector.push_back(0);
-            }
+/* Auxiliary function used to find a new flow's model route (-1: none), on its server address first. */
+void route_flow(Connection& connection, const SfIp& client_ip, const SfIp& server_ip, uint16_t server_port) {
+    Rcu<ModelRouting>::Reader routing(ml_routing);
 
-            /* Backward IAT. */
-            if (backward_count > 1) {
-                feature_vector.push_back(sum(backward_iat));            /* 26 */
-                feature_vector.push_back(mean(backward_iat));           /* 27 */
-                feature_vector.push_back(sqrt(variance(backward_iat))); /* 28 */
-                feature_vector.push_back((max)(backward_iat));          /* 29 */
-                feature_vector.push_back((min)(backward_iat));          /* 30 */
-            } else {
-                feature_vector.push_back(0);
-                feature_vector.push_back(0);
-                feature_vector.push_back(0);
-                feature_vector.push_back(0);
-                feature_vector.push_back(0);
-            }
+    if (!routing) return;
 
-            feature_vector.push_back(forward_PSH);                      /* 31 */
-            feature_vector.push_back(backward_PSH);                     /* 32 */
-            feature_vector.push_back(forward_URG);                      /* 33 */
-            feature_vector.push_back(backward_PSH);                     /* 34 */
-
-            feature_vector.push_back(forward_hbytes);                   /* 35 */
-            feature_vector.push_back(backward_hbytes);                  /* 36 */
-            feature_vector.push_back(get_fpktspersec());                /* 37 */
-            feature_vector.push_back(get_bpktspersec());                /* 38 */
-
-            /* Flow Length. */
-            if (count(flow_length) > 0) {
-                feature_vector.push_back((min)(flow_length));           /* 39 */
-                feature_vector.push_back((max)(flow_length));           /* 40 */
-                feature_vector.push_back(mean(flow_length));            /* 41 */
-                feature_vector.push_back(sqrt(variance(flow_length)));  /* 42 */
-                feature_vector.push_back(variance(flow_length));        /* 43 */
-            } else {
-                feature_vector.push_back(0);
-                feature_vector.push_back(0);
-                feature_vector.push_back(0);
-                feature_vector.push_back(0);
-                feature_vector.push_back(0);
-            }
+    int64_t route = -1;
 
-            feature_vector.push_back(flags_counter["FIN"]);             /* 44 */
-            feature_vector.push_back(flags_counter["SYN"]);             /* 45 */
-            feature_vector.push_back(flags_counter["RST"]);             /* 46 */
-            feature_vector.push_back(flags_counter["PSH"]);             /* 47 */
-            feature_vector.push_back(flags_counter["ACK"]);             /* 48 */
-            feature_vector.push_back(flags_counter["URG"]);             /* 49 */
-            feature_vector.push_back(flags_counter["CWR"]);             /* 50 */
-            feature_vector.push_back(flags_counter["ECE"]);             /* 51 */
-
-            feature_vector.push_back(get_downupratio());                /* 52 */
-            feature_vector.push_back(get_avgpktsize());                 /* 53 */
-            feature_vector.push_back(get_favgsegmentsize());            /* 54 */
-            feature_vector.push_back(get_bavgsegmentsize());            /* 55 */
-
-            feature_vector.push_back(forward_hbytes);                   /* 56
-                                                                           This feature is duplicated (35). 
-                                                                           I'm keeping it because the CICIDS2017's authors kept it in the CSV
-                                                                           files used to train the machine learning techniques.
-                                                                        */
-            
-            feature_vector.push_back(get_favgbytesperbulk());           /* 57 */
-            feature_vector.push_back(get_favgpktsperbulk());            /* 58 */
-            feature_vector.push_back(get_favgbulkrate());               /* 59 */
-            feature_vector.push_back(get_bavgbytesperbulk());           /* 60 */
-            feature_vector.push_back(get_bavgpktsperbulk());            /* 61 */
-            feature_vector.push_back(get_bavgbulkrate());               /* 62 */
-
-            feature_vector.push_back(get_fsubflowpkts());               /* 63 */
-            feature_vector.push_back(get_fsubflowbytes());              /* 64 */
-            feature_vector.push_back(get_bsubflowpkts());               /* 65 */
-            feature_vector.push_back(get_bsubflowbytes());              /* 66 */
-
-            feature_vector.push_back(init_win_bytes_forward);           /* 67 */
-            feature_vector.push_back(init_win_bytes_backward);          /* 68 */
-            feature_vector.push_back(act_data_pkt_forward);             /* 69 */
-            feature_vector.push_back(min_seg_size_forward);             /* 70 */
-
-            /* Flow Active. */
-            if (count(flow_active) > 0) {
-                feature_vector.push_back(mean(flow_active));            /* 71 */
-                feature_vector.push_back(sqrt(variance(flow_active)));  /* 72 */
-                feature_vector.push_back((max)(flow_active));           /* 73 */
-                feature_vector.push_back((min)(flow_active));           /* 74 */
-            } else {
-                feature_vector.push_back(0);
-                feature_vector.push_back(0);
-                feature_vector.push_back(0);
-                feature_vector.push_back(0);
-            }
+    if (!routing->table.empty()) {
+        auto address = [](const SfIp& ip) {
+            return ip.is_ip4() ? (const uint8_t*)ip.get_ip4_ptr() : (const uint8_t*)ip.get_ip6_ptr();
+        };
 
-            /* Flow Idle. */
-            if (count(flow_idle) > 0) {
-                feature_vector.push_back(mean(flow_idle));              /* 75 */
-                feature_vector.push_back(sqrt(variance(flow_idle)));    /* 76 */
-                feature_vector.push_back((max)(flow_idle));             /* 77 */
-                feature_vector.push_back((min)(flow_idle));             /* 78 */
-            }
-            else {
-                feature_vector.push_back(0);
-                feature_vector.push_back(0);
-                feature_vector.push_back(0);
-                feature_vector.push_back(0);
-            }
+        route = routing->table.lookup(address(server_ip), !server_ip.is_ip4(), server_port);
 
-            return feature_vector;
+        if (route < 0) {
+            route = routing->table.lookup(address(client_ip), !client_ip.is_ip4(), server_port);
         }
+    }
+    connection.set_route((int32_t)route, routing->version);
+}
 
-    /* 
-        These are meant to be private.
-        They're currently public for debugging purpose.
-    */
-    private:
-        /* Flow ID*/
-        std::string flow_id;
-
-        /* Client/Server IP Addresses */
-        SfIpString client_ip;
-        SfIpString server_ip;
-
-        /* Client/Server Ports */
-        uint16_t client_port;
-        uint16_t server_port;
-
-        /* Connection Protocol */
-        uint8_t protocol;
-
-        /* Count of packets sent in the forward/backward direction of the flow */
-        uint32_t forward_count;
-        uint32_t backward_count;
-
-        /* First and last time this flow was seen */
-        int64_t flow_first_seen;
-        int64_t flow_last_seen;
-
-        /* Last time the forward/backward direction of the flow was seen */
-        int64_t forward_last_seen;
-        int64_t backward_last_seen;
-
-        /* Start/end of this flow active time */
-        int64_t start_active_time;
-        int64_t end_active_time;
-
-        /* Flags counter (TCP) */
-        std::map<std::string, uint32_t> flags_counter;
-
-        /* PSH/URG flags counters for the forward/backward direction of the flow */
-        uint32_t forward_PSH;
-        uint32_t forward_URG;
-        uint32_t backward_PSH;
-        uint32_t backward_URG;
-
-        /* Bytes and header bytes counters for the forward/backward direction of the flow */
-        uint32_t forward_bytes;
-        uint32_t forward_hbytes;
-        uint32_t backward_bytes;
-        uint32_t backward_hbytes;
-
-        /* Count of packets with at least 1 byte of TCP data payload in the forward direction */
-        uint32_t act_data_pkt_forward;
-
-        /* Minimum segment size observed in the forward direction */
-        uint32_t min_seg_size_forward;
-
-        /* Total number of bytes sent in initial window in the forward direction */
-        uint32_t init_win_bytes_forward;
-
-        /* Total number of bytes sent in initial window in the backward direction */
-        uint32_t init_win_bytes_backward;
-
-        /*
-            Accumulator sets for flow's statistics:
-            - inter-arrival time of packets;
-            - time a flow was idle before becoming active;
-            - time a flow was active before becoming idle;
-            - total bytes of payload (flow and forward/backward direction of the flow).
-        */
-        intAcc flow_iat;
-        intAcc forward_iat;
-        intAcc backward_iat;
+/* Same as above, on "routing", from the connection's textual addresses (e.g. of a restored or stale connection). */
+void route_flow(Connection& connection, const ModelRouting& routing) {
+    int64_t route = -1;
 
-        intAcc flow_idle;
-        intAcc flow_active;
+    if (!routing.table.empty()) {
+        route = routing.table.lookup(connection.get_serverip(), connection.get_serverport());
 
-        doubleAcc flow_length;
-        doubleAcc forward_pkt;
-        doubleAcc backward_pkt;
+        if (route < 0) {
+            route = routing.table.lookup(connection.get_clientip(), connection.get_serverport());
+        }
+    }
+    connection.set_route((int32_t)route, routing.version);
+}
 
-    /*
-        Bulk related variables/parameters.
-    */
-        /* Subflows */
-        uint32_t sf_count = 0;
-        int64_t sf_ac_helper = -1;              /* This is initialized as -1, so it has to be int32_t. */
-        int64_t sf_last_packet_timestamp = -1;  /* This is initialized as -1, so it has to be int32_t. */
+/*
+    Auxiliary function used to size the admission filter's tables (see ml_admission).
+*/
+void configure_admission() {
+    std::lock_guard<std::mutex> lock(ml_admission_mutex);
 
-        /* Forward bulk flow. */
-        int64_t f_bulk_duration = 0;
-        uint32_t f_bulk_total_size = 0;
+    ml_probation.configure(ml_admission ? ml_admission_slots : 0, ml_admission_timeout);
+    ml_scan_sources.configure(ml_admission ? 1024 : 0, ml_scan_threshold, ml_scan_window);
+    ml_flood_targets.configure(ml_admission ? 1024 : 0, ml_scan_threshold, ml_scan_window);
+}
+
+/*
+    Auxiliary function used by the admission filter when a packet doesn't belong to any connection.
+    If its flow is on probation and the packet answers it (goes the other way, with anything but
+    a TCP reset), the flow is promoted: its first packet and flow id go to "first" and "id" and
+    true is returned. A packet going the same way as the held one (e.g. a retransmitted SYN)
+    leaves the flow on probation, as it was. Otherwise the packet is held as the first one of
+    its flow (or, if it's a reset, the probe is over).
+*/
+bool admit_flow(Packet* p, const std::vector<std::string>& id_candidates, const FlowPacket& packet, FlowPacket& first, std::string& id) {
+    std::lock_guard<std::mutex> lock(ml_admission_mutex);
+    Probe probe;
 
-        uint32_t f_bulk_state_count = 0;
-        uint32_t f_bulk_packet_count = 0;
+    for (const std::string& candidate : id_candidates) {
+        uint64_t key = fnv1a(14695981039346656037ULL, candidate.data(), candidate.size());
+        Probe* held = ml_probation.find(key);
 
-        uint32_t f_bulk_size_helper = 0;
-        int64_t f_bulk_start_helper = 0;
-        uint32_t f_bulk_packet_count_helper = 0;
+        if (!held) continue;
 
-        int64_t f_bulk_last_timestamp = 0;
+        /* A reset refuses the probe. */
+        if (packet.tcp && packet.has_flags(FLOW_RST)) {
+            ml_probation.release(key, probe);
+            count_probe(probe, packet.timestamp);
+            return false;
+        }
 
-        /* Backward bulk flow. */
-        int64_t b_bulk_duration = 0;
-        uint32_t b_bulk_total_size = 0;
+        /* Not an answer: the probe keeps its first packet and still times out when it was due to. */
+        if (packet.from_client == held->first.from_client) return false;
 
-        uint32_t b_bulk_state_count = 0;
-        uint32_t b_bulk_packet_count = 0;
+        ml_probation.release(key, probe);
 
-        uint32_t b_bulk_size_helper = 0;
-        int64_t b_bulk_start_helper = 0;
-        uint32_t b_bulk_packet_count_helper = 0;
+        /* Same flow, so same endpoints (the held packet's strings are gone). */
+        first = probe.first;
+        first.client_ip = packet.client_ip;
+        first.server_ip = packet.server_ip;
+        id = candidate;
 
-        int64_t b_bulk_last_timestamp = 0;
-};
+        ml_classification_stats.promoted_flows++;
+        return true;
+    }
+
+    probe.first = packet;
+    probe.client_ip = p->flow->client_ip;
+    probe.server_ip = p->flow->server_ip;
+
+    Probe evicted;
+    if (ml_probation.hold(fnv1a(14695981039346656037ULL, id_candidates[0].data(), id_candidates[0].size()),
+                          packet.timestamp, probe, evicted)) {
+        count_probe(evicted, packet.timestamp);
+    }
+
+    ml_classification_stats.held_flows++;
+    return false;
+}
 
 /*
-    Auxiliary function used to retrieve the current time in microseconds.
+    Auxiliary function used to count a flow that ended as a probe (with ml_admission_mutex held):
+    a probe of its destination endpoint by its source, and of its source by the destination.
 */
-int64_t get_time_in_microseconds() {
-    struct timeval timestamp;
-    gettimeofday(&timestamp, NULL);
-    return timestamp.tv_sec * (int)1e6 + timestamp.tv_usec;
-}
+void count_probe(const Probe& probe, int64_t now) {
+    std::vector<FanoutEvent> scans, floods;
+
+    uint64_t source = fnv1a(14695981039346656037ULL, probe.client_ip.get_ip6_ptr(), 16);
+    uint64_t destination = fnv1a(14695981039346656037ULL, probe.server_ip.get_ip6_ptr(), 16);
+    destination = fnv1a(destination, &probe.first.server_port, sizeof(probe.first.server_port));
+
+    ml_scan_sources.observe(source, destination, now, [&probe]() {
+        SfIpString ip;
+        probe.client_ip.ntop(ip);
+        return std::string(ip);
+    }, scans);
+
+    ml_flood_targets.observe(destination, fnv1a(source, &probe.first.client_port, sizeof(probe.first.client_port)), now, [&probe]() {
+        SfIpString ip;
+        probe.server_ip.ntop(ip);
+        return std::string(ip) + ":" + std::to_string(probe.first.server_port);
+    }, floods);
+
+    ml_classification_stats.probe_flows++;
+
+    for (const FanoutEvent& event : scans) {
+        std::cout << "[!] Scan from " << event.label << ": ~" << (uint64_t)event.peers << " destinations, "
+                  << event.probes << " probes" << (event.summary ? " in the last window." : " so far.") << std::endl;
+        if (!event.summary) ml_classification_stats.scan_events++;
+    }
 
-int64_t get_time_in_microseconds(time_t tvsec, suseconds_t tvusec) {
-    return tvsec * (int)1e6 + tvusec;
+    for (const FanoutEvent& event : floods) {
+        std::cout << "[!] Flood of " << event.label << ": ~" << (uint64_t)event.peers << " sources, "
+                  << event.probes << " probes" << (event.summary ? " in the last window." : " so far.") << std::endl;
+        if (!event.summary) ml_classification_stats.flood_events++;
+    }
 }
 
-/* 
-    Auxiliary function used to retrieve possible strings for the flow id:
-        - id_candidates[0]: flow_id;
-        - id_candidates[1]: reversed flow_id.
+/*
+    Auxiliary function used to end the probation of the flows held for longer than ml_admission_timeout.
 */
-std::vector<std::string> get_id_candidates(Packet* p) {
-    std::vector<std::string> id_candidates;
+void expire_probes(int64_t now) {
+    std::lock_guard<std::mutex> lock(ml_admission_mutex);
+    std::vector<Probe> expired;
 
-    std::ostringstream iss, reversed_iss;
+    ml_probation.expire(now, expired);
 
-    if (p->is_tcp()) {
-        iss << "TCP"; reversed_iss << "TCP";
-    } else if (p->is_udp()) {
-        iss << "UDP"; reversed_iss << "UDP";
-    } else if (p->is_icmp()) {
-        iss << "ICMP"; reversed_iss << "ICMP";
+    for (const Probe& probe : expired) {
+        count_probe(probe, now);
     }
+}
 
-    SfIpString client_ip, server_ip;
-    p->flow->client_ip.ntop(client_ip);
-    p->flow->server_ip.ntop(server_ip);
+/*
+    Auxiliary function used to hash a flow key for the overload controller's sampling. Both candidates
+    are hashed, so both directions of a flow get the same hash.
+*/
+uint64_t flow_hash(const std::vector<std::string>& id_candidates) {
+    return fnv1a(14695981039346656037ULL, id_candidates[0].data(), id_candidates[0].size()) ^
+           fnv1a(14695981039346656037ULL, id_candidates[1].data(), id_candidates[1].size());
+}
 
-    iss << "-" << client_ip << ":" << p->flow->client_port << "-" << server_ip << ":" << p->flow->server_port;
-    reversed_iss << "-" << server_ip << ":" << p->flow->server_port << "-" << client_ip << ":" << p->flow->client_port;
+/*
+    Auxiliary function used to feed a packet's processing time ("now" is the steady clock, in
+    nanoseconds) to the overload controller, and to apply its level when it changes: the feature
+    profile is updated when reduced tracking starts or ends.
+*/
+void track_overload(uint64_t packet_nsecs, int64_t now) {
+    uint32_t previous = ml_overload_controller.level();
 
-    if (p->is_icmp()) {
-        iss << "-" << p->ptrs.icmph->s_icmp_id;
-        reversed_iss << "-" << p->ptrs.icmph->s_icmp_id;
+    if (!ml_overload_controller.observe(packet_nsecs, now, ml_classification_stats.queue_depth)) return;
+
+    uint32_t level = ml_overload_controller.level();
+
+    std::cout << "[*] Overload level " << level << " (" << OverloadController::name(level) << "), "
+              << ml_overload_controller.shed_permille() << " per mille of the packets shed so far." << std::endl;
+
+    if ((previous >= OVERLOAD_REDUCED) != (level >= OVERLOAD_REDUCED)) {
+        update_feature_profile();
     }
+}
 
-    id_candidates.push_back(iss.str());
-    id_candidates.push_back(reversed_iss.str());
+/*
+    Auxiliary function used to build the verdict cache key of a connection:
+    the server endpoint (protocol, IP and port), the model route and the quantized ml_cache_features.
+*/
+uint64_t verdict_key(Connection& connection, const FeatureVector& features) {
+    uint64_t key = 14695981039346656037ULL;
 
-    return id_candidates;
+    std::string server_ip = connection.get_serverip();
+    uint16_t server_port = connection.get_serverport();
+    uint8_t protocol = connection.get_protocol();
+
+    key = fnv1a(key, &protocol, sizeof(protocol));
+    key = fnv1a(key, &server_port, sizeof(server_port));
+    key = fnv1a(key, server_ip.data(), server_ip.size());
+
+    /* Routed flows are scored by other models: their verdicts are cached apart (and per version of the routes). */
+    int32_t route = connection.get_route();
+    key = fnv1a(key, &route, sizeof(route));
+
+    if (route >= 0) {
+        uint32_t version = connection.get_route_version();
+        key = fnv1a(key, &version, sizeof(version));
+    }
+
+    for (size_t feature : ml_cache_features) {
+        uint8_t bucket = (uint8_t)quantize_feature(features[feature]);
+        key = fnv1a(key, &bucket, sizeof(bucket));
+    }
+    return key;
 }
 
 /*
     Auxiliary function used to classify the timeouted connections.
 */
 void classify_connections() {
-    /* Creates a file containing the feature vector of each timeouted connection. */
-    std::ofstream outputFile;
-    outputFile.open("/home/lnutimura/Desktop/ml_classifiers/tmp/timeouted_connections.txt", std::ios_base::trunc);
-    
-    for (int i = 0; i < t_connections.id.size(); i++) {
-        outputFile << std::fixed << std::setprecision(9);
-        
-        for (int j = 0; j < 78; j++) {
-            outputFile << t_connections.features[i][j];
-            
-            if (j == 77)
-                outputFile << std::scientific << "\n";
-            else
-                outputFile << " ";
+    size_t count = t_connections.id.size();
+
+    std::vector<float> predictions(count, 0.0f);
+    std::vector<double> confidences(count, 0.0);
+
+    /* Flows without a cached verdict, i.e. the ones the models have to score. */
+    std::vector<size_t> flows;
+    std::vector<uint64_t> keys(count, 0);
+
+    /* The routes are pinned for the whole batch; flows routed on replaced ones are routed again first. */
+    Rcu<ModelRouting>::Reader routing(ml_routing);
+
+    for (size_t i = 0; i < count; i++) {
+        Connection& connection = t_connections.connections[i];
+
+        if (routing && connection.get_route_version() != routing->version) route_flow(connection, *routing.get());
+
+        if (ml_cache) {
+            keys[i] = verdict_key(t_connections.connections[i], t_connections.features[i]);
+
+            /* TTLs are in flow time, so replayed pcaps age the cache like live traffic. */
+            if (ml_verdict_cache.lookup(keys[i], t_connections.connections[i].get_flowlastseen(), predictions[i])) continue;
         }
+        flows.push_back(i);
     }
-    outputFile.close();
-    
-    /* Executes the script that classifies every single feature vector in the timeouted_connections.txt file. */
-    std::string py_cmd = "python3 /home/lnutimura/Desktop/ml_classifiers/ml_classifiers.py " + ml_technique;
-    system(py_cmd.c_str());
-    
-    /* Reads the predictions of every single connection timeouted previously. */
-    std::ifstream inputFile ("/home/lnutimura/Desktop/ml_classifiers/tmp/timeouted_connections_results.txt");
-    
-    if (inputFile.is_open()) {
-        std::string line;
-        uint32_t index = 0;
-        
-        while (std::getline(inputFile, line)) {
-            float predictedValue;
-            
-            std::cout << "[-] " << t_connections.id[index] << std::endl;
-            t_connections.connections[index].print_feature_vector(t_connections.features[index]);
-            std::cout << "\tResult: ";
-            
-            std::istringstream iss (line);
-            iss >> predictedValue;
-            
-            if (predictedValue == 0.0f) {
-                std::cout << "Normal (" << predictedValue << ")" << std::endl;
-            } else {
-                std::cout << "Attack (" << predictedValue << ")" << std::endl;
+
+    /*
+        The external scorer (if any) scores the feature vectors first, then the native models
+        score the rest in-process; ml_classifiers.py is the fallback.
+    */
+    std::vector<size_t> unscored;
+    if (!predict_external(flows, predictions, confidences, unscored)) unscored = flows;
+
+    bool scored = unscored.empty() || predict_native(unscored, predictions, confidences, routing.get());
+
+    if (scored) {
+        if (ml_cache) {
+            for (size_t i : flows) {
+                if (confidences[i] >= ml_cache_confidence) {
+                    ml_verdict_cache.insert(keys[i], t_connections.connections[i].get_flowlastseen(), predictions[i]);
+                }
             }
-            
-            index++;
         }
-        
-        inputFile.close();
+    } else {
+        predictions.clear();
+
+        /* Creates a file containing the feature vector of each timeouted connection. */
+        std::ofstream outputFile;
+        outputFile.open("/home/lnutimura/Desktop/ml_classifiers/tmp/timeouted_connections.txt", std::ios_base::trunc);
+
+        for (int i = 0; i < t_connections.id.size(); i++) {
+            outputFile << std::fixed << std::setprecision(9);
+
+            for (int j = 0; j < 78; j++) {
+                outputFile << t_connections.features[i][j];
+
+                if (j == 77)
+                    outputFile << std::scientific << "\n";
+                else
+                    outputFile << " ";
+            }
+        }
+        outputFile.close();
+
+        /* Executes the script that classifies every single feature vector in the timeouted_connections.txt file. */
+        std::string py_cmd = "python3 /home/lnutimura/Desktop/ml_classifiers/ml_classifiers.py " + ml_technique;
+        system(py_cmd.c_str());
+
+        /* Reads the predictions of every single connection timeouted previously. */
+        std::ifstream inputFile ("/home/lnutimura/Desktop/ml_classifiers/tmp/timeouted_connections_results.txt");
+
+        if (inputFile.is_open()) {
+            std::string line;
+
+            while (std::getline(inputFile, line) && predictions.size() < t_connections.id.size()) {
+                float predictedValue;
+
+                std::istringstream iss (line);
+                iss >> predictedValue;
+                predictions.push_back(predictedValue);
+            }
+
+            inputFile.close();
+        }
     }
-    
+
+    int64_t now = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+
+    for (uint32_t index = 0; index < predictions.size(); index++) {
+        float predictedValue = predictions[index];
+
+        ml_verdict_histogram->record(now - t_connections.expired_at[index]);
+
+        if (predictedValue == 0.0f)
+            ml_classification_stats.normal_flows++;
+        else
+            ml_classification_stats.attack_flows++;
+
+        std::cout << "[-] " << t_connections.id[index] << std::endl;
+        t_connections.connections[index].print_feature_vector(t_connections.features[index]);
+        std::cout << "\tResult: ";
+
+        std::cout << (predictedValue == 0.0f ? "Normal (" : "Attack (") << predictedValue;
+
+        /* The deciding model's probability (cached verdicts and the script don't have one). */
+        if (scored && confidences[index] > 0)
+            std::cout << ", " << confidences[index];
+
+        std::cout << ")" << std::endl;
+    }
+
     t_connections.id.clear();
     t_connections.connections.clear();
     t_connections.features.clear();
+    t_connections.expired_at.clear();
+
+    ml_classification_stats.queue_depth = 0;
 }
 
 /*
@@ -1109,6 +1384,14 @@ void classify_connections() {
     and handle timeouted connections.
 */
 void check_connections(Packet* p) {
+    std::lock_guard<std::mutex> expiry_lock(ml_expiry_mutex);
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    uint64_t materialize_usecs = 0;
+
+    if (ml_admission) {
+        expire_probes(p ? get_time_in_microseconds(p->pkth->ts.tv_sec, p->pkth->ts.tv_usec) : get_time_in_microseconds());
+    }
+
     ml_mutex.lock();
     std::map<std::string, Connection> active_connections = connections;
     ml_mutex.unlock();
@@ -1142,22 +1425,16 @@ void check_connections(Packet* p) {
 
 
             if (t_it != connections.end()) {
-                /* Retrieves all the flow's information and puts them in a vector. */
-                std::vector<double> feature_vector = t_it->second.get_feature_vector();
-                
-                /* 
-                    Transfer the timeouted connection to a struct responsible for 
-                    holding it's informations.
-                */
-                t_connections.id.push_back(t_it->second.get_flowid());
-                t_connections.features.push_back(feature_vector);
-                t_connections.connections.push_back(t_it->second);
-                
-                connections.erase(t_it);
+                materialize_usecs += queue_connection(t_it);
             }
             ml_mutex.unlock();
         }
     }
+
+    ml_classification_stats.queue_depth = t_connections.id.size();
+    ml_classification_stats.materialize_usecs += materialize_usecs;
+    ml_classification_stats.expiry_usecs += std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - start).count() - materialize_usecs;
     
     /*
         If there are timeouted connections inside the t_connections struct,
@@ -1169,14 +1446,235 @@ void check_connections(Packet* p) {
 }
 
 /*
-    Thread's run function.
-    Runs every 20 sec.
+    Auxiliary function used to move a connection (with ml_mutex held) from the connections map
+    to t_connections, with its feature vector. Returns the time spent building the latter (in usecs).
+*/
+uint64_t queue_connection(std::map<std::string, Connection>::iterator it) {
+    /* Retrieves all the flow's information and puts them in a vector. */
+    std::chrono::steady_clock::time_point materialize_start = std::chrono::steady_clock::now();
+    FeatureVector feature_vector;
+    it->second.get_feature_vector(feature_vector.data());
+    std::chrono::steady_clock::time_point expired_at = std::chrono::steady_clock::now();
+
+    /* 
+        Transfer the timeouted connection to a struct responsible for 
+        holding it's informations.
+    */
+    t_connections.id.push_back(it->second.get_flowid());
+    t_connections.features.push_back(feature_vector);
+    t_connections.connections.push_back(it->second);
+    t_connections.expired_at.push_back(std::chrono::duration_cast<std::chrono::microseconds>(
+        expired_at.time_since_epoch()).count());
+
+    connections.erase(it);
+
+    ml_classification_stats.live_flows--;
+    ml_classification_stats.flows_expired++;
+
+    return std::chrono::duration_cast<std::chrono::microseconds>(expired_at - materialize_start).count();
+}
+
+/*
+    Auxiliary function used on shutdown: every connection still being tracked is classified
+    as if it had timeouted, so no flow goes without a verdict.
+*/
+void drain_connections() {
+    std::lock_guard<std::mutex> expiry_lock(ml_expiry_mutex);
+    uint64_t materialize_usecs = 0;
+
+    ml_mutex.lock();
+    size_t count = connections.size();
+
+    while (!connections.empty()) {
+        materialize_usecs += queue_connection(connections.begin());
+    }
+    ml_mutex.unlock();
+
+    ml_classification_stats.queue_depth = t_connections.id.size();
+    ml_classification_stats.materialize_usecs += materialize_usecs;
+
+    std::cout << "[*] Draining " << count << " connections." << std::endl;
+
+    if (t_connections.id.size() > 0) {
+        classify_connections();
+    }
+}
+
+/*
+    Packet time mode: called by eval() with the time of every packet, checks the connections
+    every ml_expiry_interval of packet time (the same cadence as verify_timeouts()).
+    With several packet threads, only the one moving ml_next_expiry forward checks them.
+*/
+void check_packet_time(Packet* p, int64_t now) {
+    int64_t next = ml_next_expiry.load(std::memory_order_relaxed);
+
+    /* The first packet only starts the first interval. */
+    if (next == 0) {
+        ml_next_expiry.compare_exchange_strong(next, now + ml_expiry_interval);
+        return;
+    }
+
+    if (now < next || !ml_next_expiry.compare_exchange_strong(next, now + ml_expiry_interval)) return;
+
+    check_connections(p);
+}
+
+/*
+    Background service job checking the connections on the wall clock.
+    Runs every ml_expiry_interval (20 sec). The connections being tracked are counted by the
+    live_flows peg, rather than printed on every scan.
 */
 void verify_timeouts() {
-    while (true) {
-        std::cout << "[+] verify_timeouts (" << connections.size() << ")" << std::endl;
+    check_connections(nullptr);
+}
+
+/*
+    Auxiliary function used to (re)schedule the background service's jobs for the current
+    configuration, whenever the inspector is configured: a reload's packet_time, checkpoint
+    and checkpoint_interval take effect right away, even while the service runs.
+*/
+void schedule_service() {
+    std::lock_guard<std::mutex> lock(ml_service_mutex);
+
+    ml_service.clear();
+
+    /* In packet time mode, eval() checks the connections itself. */
+    if (!ml_packet_time) {
+        ml_service.schedule(std::chrono::microseconds(ml_expiry_interval), verify_timeouts);
+    }
+
+    if (!ml_checkpoint.empty() && ml_checkpoint_interval > 0) {
+        ml_service.schedule(std::chrono::seconds(ml_checkpoint_interval), []() { save_checkpoint(); });
+    }
+
+    ml_service.schedule(std::chrono::milliseconds(ml_watch_interval), watch_models);
+}
+
+/*
+    Auxiliary function used when a packet thread starts (the plugin's tinit): the first one starts
+    the background service (its jobs are scheduled by the configuration, see schedule_service()).
+    Snort only starts packet threads to process traffic, so checking a configuration (snort -T)
+    starts no thread at all.
+*/
+void start_service() {
+    std::lock_guard<std::mutex> lock(ml_service_mutex);
+
+    if (ml_service_threads++ > 0) return;
+
+    ml_service.start();
+}
+
+/*
+    Auxiliary function used when a packet thread ends (the plugin's tterm): the last one stops the
+    background service (waiting for a scan or checkpoint in progress) and drains the connections,
+    unless they're kept in a checkpoint (saved by the inspector's destructor) for the next start.
+*/
+void stop_service() {
+    std::lock_guard<std::mutex> lock(ml_service_mutex);
+
+    if (ml_service_threads == 0 || --ml_service_threads > 0) return;
+
+    ml_service.stop();
+
+    /* The watch is set up again if the service restarts. */
+    if (ml_watch_fd >= 0) {
+        close(ml_watch_fd);
+        ml_watch_fd = -1;
+        rearm_model_watch();
+    }
 
-        check_connections(nullptr);
-        std::this_thread::sleep_for(std::chrono::milliseconds(20000));
+    if (ml_checkpoint.empty()) {
+        drain_connections();
     }
 }
+
+/*
+    Auxiliary function used to save the connections map into ml_checkpoint.
+    The map is only locked while a chunk of its connections is copied into records; the (slower)
+    write happens afterwards.
+*/
+bool save_checkpoint() {
+    if (ml_checkpoint.empty()) return false;
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    std::vector<FlowRecord> records;
+    int64_t saved_at = 0;
+
+    /*
+        The map is walked in chunks, resuming after the last id copied, with the packet threads
+        running in between: connections created meanwhile may or may not make it, and those
+        expired meanwhile are simply gone, as in a snapshot taken a bit later.
+    */
+    std::string last_id;
+    bool done = false;
+
+    while (!done) {
+        std::lock_guard<std::mutex> lock(ml_mutex);
+
+        auto it = records.empty() ? connections.begin() : connections.upper_bound(last_id);
+
+        for (size_t n = 0; n < ml_checkpoint_chunk && it != connections.end(); n++, it++) {
+            records.emplace_back();
+            it->second.to_record(records.back());
+            saved_at = std::max(saved_at, records.back().flow_last_seen);
+            last_id = it->first;
+        }
+        done = (it == connections.end());
+    }
+
+    if (!write_checkpoint(ml_checkpoint, records, saved_at)) {
+        std::cout << "[*] Couldn't save the checkpoint " << ml_checkpoint << "." << std::endl;
+        return false;
+    }
+
+    std::cout << "[*] Saved " << records.size() << " connections to " << ml_checkpoint << " ("
+              << std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count()
+              << " ms)." << std::endl;
+    return true;
+}
+
+/*
+    Auxiliary function used to restore the connections saved in ml_checkpoint (only once,
+    however many times the inspector is configured).
+    Timestamps are rebased so that the latest saved flow looks last seen right now, except
+    in packet time mode, where the capture's clock just carries on.
+*/
+void restore_checkpoint() {
+    static std::once_flag restored;
+
+    if (ml_checkpoint.empty()) return;
+
+    std::call_once(restored, []() {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        CheckpointFile checkpoint;
+        std::string error;
+
+        if (!checkpoint.open(ml_checkpoint, error)) {
+            std::cout << "[*] No checkpoint restored (" << error << ")." << std::endl;
+            return;
+        }
+
+        const CheckpointHeader* header = checkpoint.header();
+        const FlowRecord* records = checkpoint.records();
+        int64_t rebase = ml_packet_time ? 0 : get_time_in_microseconds() - header->saved_at;
+
+        Rcu<ModelRouting>::Reader routing(ml_routing);
+        std::lock_guard<std::mutex> lock(ml_mutex);
+
+        /* Records were saved in the map's order, so every insertion goes right at the end. */
+        for (uint64_t i = 0; i < header->num_records; i++) {
+            Connection connection(records[i], rebase);
+            std::string id = connection.get_flowid();
+
+            if (routing) route_flow(connection, *routing.get());
+
+            connections.emplace_hint(connections.end(), id, connection);
+        }
+
+        ml_classification_stats.live_flows = connections.size();
+
+        std::cout << "[*] Restored " << header->num_records << " connections from " << ml_checkpoint << " ("
+                  << std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count()
+                  << " ms)." << std::endl;
+    });
+}
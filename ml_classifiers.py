@@ -14,18 +14,149 @@ from sklearn.ensemble import AdaBoostClassifier, RandomForestClassifier
 
 from joblib import dump, load
 
-if len(sys.argv) != 2:
-    print('Something went wrong.\nUsage: python3 /path/to/ml_classifiers.py <algorithm_code>')
+if len(sys.argv) not in (2, 3, 4) or (len(sys.argv) > 2 and sys.argv[2] != '--serve'):
+    print('Something went wrong.\nUsage: python3 /path/to/ml_classifiers.py <algorithm_code> [--serve [<segment>]]')
     sys.exit(1)
 
+# Layout of the inspector's scorer rings (see ml_shm.h): the heartbeat is the 64-bit word at byte 24,
+# counters are 64-bit words from byte 64.
+RING_MAGIC = b'MLSR'
+RING_VERSION = 2
+RING_HEADER = 320
+REQUEST_HEAD, REQUEST_TAIL, RESPONSE_HEAD, RESPONSE_TAIL = 0, 8, 16, 24
+
+def attach(path):
+    """Maps the scorer rings once the inspector has created them. Returns numpy views of every field."""
+    import mmap
+
+    while True:
+        try:
+            with open(path, 'r+b') as segment_file:
+                memory = mmap.mmap(segment_file.fileno(), 0)
+            if memory[:4] == RING_MAGIC:
+                break
+            memory.close()
+        except (FileNotFoundError, ValueError):
+            pass
+        time.sleep(0.1)
+
+    version, num_features, capacity = (int(x) for x in np.frombuffer(memory, np.uint32, 3, 4))
+    if version != RING_VERSION:
+        print('{} is a version {} scorer ring.'.format(path, version))
+        sys.exit(1)
+
+    ring = {'capacity': capacity}
+    ring['epoch'] = np.frombuffer(memory, np.uint64, 1, 16)
+    ring['heartbeat'] = np.frombuffer(memory, np.uint64, 1, 24)
+    ring['counters'] = np.frombuffer(memory, np.uint64, RESPONSE_TAIL + 1, 64)
+
+    offset = RING_HEADER
+    for name, dtype, size in (('sequences', np.uint64, capacity), ('request_tags', np.uint64, capacity),
+                              ('request_features', np.float64, capacity * num_features),
+                              ('response_tags', np.uint64, capacity), ('response_confidences', np.float64, capacity),
+                              ('response_labels', np.float32, capacity)):
+        ring[name] = np.frombuffer(memory, dtype, size, offset)
+        offset += np.dtype(dtype).itemsize * size
+
+    ring['request_features'] = ring['request_features'].reshape(capacity, num_features)
+    return ring
+
+def serve(clf, scaler, segment):
+    """
+    Scores the flows the inspector hands over through the shared memory segment (its "scorer"
+    option), in batches of whatever is ready, until interrupted. The counters are plain aligned
+    64-bit loads and stores, which x86 orders as the rings need.
+    """
+    path = '/dev/shm/' + segment.lstrip('/')
+    ring = attach(path)
+    epoch = int(ring['epoch'][0])
+    idle = 0
+
+    print('#Serving {} ({} flows).'.format(path, ring['capacity']))
+
+    while True:
+        # The inspector recreated the segment (e.g. Snort restarted).
+        if int(ring['epoch'][0]) != epoch:
+            ring = attach(path)
+            epoch = int(ring['epoch'][0])
+
+        # Tells the inspector a scorer is attached (same clock as its std::chrono::steady_clock).
+        ring['heartbeat'][0] = time.monotonic_ns()
+
+        capacity, counters, sequences = ring['capacity'], ring['counters'], ring['sequences']
+        mask = np.uint64(capacity - 1)
+
+        # Only the slots the producers reserved (up to the request head) are looked at; the ready
+        # ones are those before the first still being written.
+        tail = counters[REQUEST_TAIL]
+        pending = int(counters[REQUEST_HEAD] - tail)
+        count = 0
+
+        if pending > 0:
+            positions = np.arange(pending, dtype=np.uint64)
+            slots = (tail + positions) & mask
+            ready = sequences[slots] == tail + positions + np.uint64(1)
+            count = pending if ready.all() else int(np.argmin(ready))
+
+        if count == 0:
+            # Spins for a while (microsecond hand-off), then backs off.
+            idle += 1
+            if idle > 1000:
+                time.sleep(0.0005)
+            continue
+        idle = 0
+
+        slots = slots[:count]
+        tags = ring['request_tags'][slots]
+        features = ring['request_features'][slots]
+
+        # Fancy indexing copied the slots, so they can be handed back to the inspector.
+        sequences[slots] = tail + positions[:count] + np.uint64(capacity)
+        counters[REQUEST_TAIL] = tail + np.uint64(count)
+
+        labels, confidences = score(clf, scaler.transform(features))
+
+        done = 0
+        while done < count:
+            head = counters[RESPONSE_HEAD]
+            room = min(count - done, capacity - int(head - counters[RESPONSE_TAIL]))
+            if room == 0:
+                time.sleep(0.0001)
+                continue
+
+            out = (head + positions[:room]) & mask
+            ring['response_tags'][out] = tags[done:done + room]
+            ring['response_confidences'][out] = confidences[done:done + room]
+            ring['response_labels'][out] = labels[done:done + room]
+            counters[RESPONSE_HEAD] = head + np.uint64(room)
+            done += room
+
+def score(clf, features):
+    """
+    Labels and confidences (the winning class' probability). Models without probabilities
+    (e.g. LinearSVC) report a confidence of 0: their decision values aren't calibrated, so
+    their verdicts are kept out of the inspector's confidence-gated verdict cache.
+    """
+    if hasattr(clf, 'predict_proba'):
+        probabilities = clf.predict_proba(features)
+        labels = clf.classes_[probabilities.argmax(axis=1)].astype(np.float32)
+        return labels, probabilities.max(axis=1)
+
+    labels = clf.predict(features).astype(np.float32)
+    return labels, np.zeros(len(labels))
+
 if __name__ == '__main__':
+    clf_joblibs = {'svc':'clf_svc.joblib', 'ab':'clf_ab.joblib', 'dt':'clf_dt.joblib', 'rf':'clf_rf.joblib', 'bnb':'clf_bnb.joblib', 'gnb':'clf_gnb.joblib', 'mlp':'clf_mlp.joblib'}
+    clf = load('/home/lnutimura/Desktop/ml_classifiers/joblibs/' + clf_joblibs[sys.argv[1]])
+    scaler = load('/home/lnutimura/Desktop/ml_classifiers/joblibs/scaler.joblib')
+
+    if len(sys.argv) > 2:
+        serve(clf, scaler, sys.argv[3] if len(sys.argv) > 3 else '/ml_classifiers')
+        sys.exit(0)
+
     input_data = []
     input_file = open ('/home/lnutimura/Desktop/ml_classifiers/tmp/timeouted_connections.txt', 'r')
     output_file = open ('/home/lnutimura/Desktop/ml_classifiers/tmp/timeouted_connections_results.txt', 'w')
-
-    clf_joblibs = {'svc':'clf_svc.joblib', 'ab':'clf_ab.joblib', 'dt':'clf_dt.joblib', 'rf':'clf_rf.joblib', 'bnb':'clf_bnb.joblib', 'gnb':'clf_gnb.joblib'}
-    clf = load('/home/lnutimura/Desktop/ml_classifiers/joblibs/' + clf_joblibs[sys.argv[1]])
-    scaler = load('/home/lnutimura/Desktop/ml_classifiers/joblibs/scaler.joblib')
     
     for line in input_file.readlines():
         features = line.strip().split(' ')
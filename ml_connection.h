@@ -0,0 +1,1238 @@
+#ifndef ML_CONNECTION_H
+#define ML_CONNECTION_H
+
+/*
+    Per-flow feature engine (the CICFlowMeter's features), independent from Snort:
+    connections are fed FlowPackets, which the inspector builds from Snort's packets
+    and ml_sensor decodes from the wire.
+*/
+
+#include <map>
+#include <array>
+#include <atomic>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <algorithm>
+#include <netinet/in.h>
+#include <sys/time.h>
+
+#include "ml_stats.h"
+#include "ml_checkpoint.h"
+
+/* Profiler scope around the optional state updates (the inspector maps it to Snort's profiler). */
+#ifndef ML_PROFILE
+#define ML_PROFILE(stats)
+#endif
+
+/* Per-flow statistics (count, sum, min, max, mean and variance), see ml_stats.h. */
+typedef RunningStats<int64_t> intAcc;
+typedef RunningStats<double> doubleAcc;
+
+/* Number of features (the CICIDS2017's MachineLearningCVE columns, without the label). */
+const size_t NUM_FEATURES = 78;
+typedef std::array<double, NUM_FEATURES> FeatureVector;
+
+/*
+    Optional per-flow state, only maintained when some loaded model reads the features
+    built from it (see update_feature_profile()):
+        - FLAGS: flags_counter (features 44-51);
+        - BULK: the forward/backward bulk state (57-62);
+        - SUBFLOWS: the subflow count (63-66), also needed to find the active/idle periods;
+        - ACTIVE_IDLE: the active/idle statistics (71-78).
+*/
+enum TrackedState : uint32_t {
+    TRACK_FLAGS = 1 << 0,
+    TRACK_BULK = 1 << 1,
+    TRACK_SUBFLOWS = 1 << 2,
+    TRACK_ACTIVE_IDLE = 1 << 3,
+    TRACK_ALL = (1 << 4) - 1
+};
+
+/* TCP flags, as in the TCP header. */
+enum FlowFlags : uint8_t {
+    FLOW_FIN = 0x01,
+    FLOW_SYN = 0x02,
+    FLOW_RST = 0x04,
+    FLOW_PSH = 0x08,
+    FLOW_ACK = 0x10,
+    FLOW_URG = 0x20,
+    FLOW_ECE = 0x40,
+    FLOW_CWR = 0x80
+};
+
+/* What a connection reads from a packet. */
+struct FlowPacket {
+    /* Capture time, in microseconds. */
+    int64_t timestamp = 0;
+
+    /* Whole packet and payload lengths (header bytes are the difference). */
+    uint32_t pktlen = 0;
+    uint16_t dsize = 0;
+
+    uint8_t protocol = 0;
+    bool tcp = false;
+
+    /* Whether the packet goes from the flow's client to its server (forward direction). */
+    bool from_client = true;
+
+    /* TCP-only. */
+    uint8_t tcp_flags = 0;
+    uint16_t window = 0;
+
+    /* Flow endpoints, only read when a connection is created. */
+    const char* client_ip = "";
+    const char* server_ip = "";
+    uint16_t client_port = 0;
+    uint16_t server_port = 0;
+
+    bool has_flags(uint8_t flags) const {
+        return (tcp_flags & flags) == flags;
+    }
+};
+
+/* Flag names of Connection::flags_counter, in checkpoint order. */
+const char* const checkpoint_flags[CHECKPOINT_FLAGS] = { "FIN", "SYN", "RST", "PSH", "ACK", "URG", "CWR", "ECE" };
+
+/* Per-flow state currently maintained (TrackedState bits). */
+std::atomic<uint32_t> ml_tracked_state { TRACK_ALL };
+
+/* Optional state (TrackedState bits) the features marked in "used" (NUM_FEATURES entries) are built from. */
+inline uint32_t tracked_state(const std::vector<bool>& used) {
+    uint32_t tracked = 0;
+
+    /* 0-based ranges of the features built from each optional state. */
+    auto any_used = [&used](size_t first, size_t last) {
+        return std::find(used.begin() + first, used.begin() + last + 1, true) != used.begin() + last + 1;
+    };
+
+    if (any_used(43, 50)) tracked |= TRACK_FLAGS;
+    if (any_used(56, 61)) tracked |= TRACK_BULK;
+    if (any_used(70, 77)) tracked |= TRACK_ACTIVE_IDLE | TRACK_SUBFLOWS;
+    if (any_used(62, 65)) tracked |= TRACK_SUBFLOWS;
+
+    return tracked;
+}
+
+/*
+    Auxiliary function used to retrieve the current time in microseconds.
+*/
+inline int64_t get_time_in_microseconds() {
+    struct timeval timestamp;
+    gettimeofday(&timestamp, NULL);
+    return timestamp.tv_sec * (int)1e6 + timestamp.tv_usec;
+}
+
+inline int64_t get_time_in_microseconds(time_t tvsec, suseconds_t tvusec) {
+    return tvsec * (int)1e6 + tvusec;
+}
+
+/* This class' features are based on the CICFlowMeter's features. */
+class Connection {
+    public:
+        /*
+            Basic constructor:
+            Initializes most of this class' parameters.
+        */
+        Connection (const FlowPacket& p, std::string id) {
+            /* Initializes the flags_counter and other parameters. */
+            init_flags();
+            init_parameters();
+
+            uint32_t tracked = ml_tracked_state.load(std::memory_order_relaxed);
+
+            if (tracked & TRACK_BULK) {
+                update_flow_bulk(p);
+            }
+
+            if (tracked & TRACK_SUBFLOWS) {
+                update_subflows(p, tracked);
+            }
+
+            /* Updates the flags_counter based on the packet's flags (TCP-only). */
+            if (p.tcp && (tracked & TRACK_FLAGS)) {
+                update_flags_counter(p);
+            }
+
+            flow_id = id;
+            protocol = p.protocol;
+
+            /* The packet's timestamp in microseconds. */
+            //uint32_t packet_timestamp = p->pkth->ts.tv_usec;
+            int64_t packet_timestamp = p.timestamp;
+            
+            flow_first_seen = flow_last_seen =
+                start_active_time = end_active_time = packet_timestamp;
+
+            flow_length((double)p.dsize);
+
+            strncpy(client_ip, p.client_ip, sizeof(client_ip) - 1);
+            client_ip[sizeof(client_ip) - 1] = '\0';
+            client_port = p.client_port;
+
+            strncpy(server_ip, p.server_ip, sizeof(server_ip) - 1);
+            server_ip[sizeof(server_ip) - 1] = '\0';
+            server_port = p.server_port;
+
+            /* Instead of comparing client_ip w/ packet_source,
+               I'll use "p.from_client".
+             
+                SfIpString packet_source;
+                *(p->ptrs.ip_api.get_src())->ntop(packet_source);
+            */
+            
+            /* Checks whether this packet is coming from the client or the server. */
+            if (p.from_client) {
+                /* Coming from client (forward direction). */
+                min_seg_size_forward = p.pktlen - p.dsize;
+
+                if (p.tcp) {
+                    init_win_bytes_forward = p.window;
+
+                    if (p.has_flags(FLOW_PSH)) {
+                        forward_PSH += 1;
+                    }
+
+                    if (p.has_flags(FLOW_URG)) {
+                        forward_URG += 1;
+                    }
+                }
+
+                /*
+                    Note: In CICFlowMeter's code, the authors
+                    update the flow_length one more time.
+                    (Does that makes any sense?)
+                    flow_length((double)p.dsize);
+                */
+                forward_pkt((double)p.dsize);
+                forward_bytes += p.dsize;
+                forward_hbytes += p.pktlen - p.dsize;
+
+                forward_last_seen = packet_timestamp;
+                forward_count += 1;
+
+            } else {
+                /* Coming from server (backward direction). */
+                if (p.tcp) {
+                    init_win_bytes_backward = p.window;
+
+                    if (p.has_flags(FLOW_PSH)) {
+                        backward_PSH += 1;
+                    }
+
+                    if (p.has_flags(FLOW_URG)) {
+                        backward_URG += 1;
+                    }
+                }
+
+                /*
+                    Note: In CICFlowMeter's code, the authors
+                    update the flow_length one more time.
+                    (Does that makes any sense?)
+                    flow_length((double)p.dsize);
+                */
+                backward_pkt((double)p.dsize);
+                backward_bytes += p.dsize;
+                backward_hbytes += p.pktlen - p.dsize;
+
+                backward_last_seen = packet_timestamp;
+                backward_count += 1;
+            }
+        }
+
+        /*
+            Checkpoint constructor:
+            Restores a connection saved by to_record(), shifting its timestamps by "rebase"
+            microseconds (the time Snort was down), so the downtime isn't seen as idle time.
+        */
+        Connection (const FlowRecord& record, int64_t rebase) {
+            init_flags();
+
+            flow_id.assign(record.flow_id, strnlen(record.flow_id, sizeof(record.flow_id)));
+            memcpy(client_ip, record.client_ip, sizeof(client_ip));
+            memcpy(server_ip, record.server_ip, sizeof(server_ip));
+            client_ip[sizeof(client_ip) - 1] = server_ip[sizeof(server_ip) - 1] = '\0';
+
+            client_port = record.client_port;
+            server_port = record.server_port;
+            protocol = record.protocol;
+
+            forward_count = record.forward_count;
+            backward_count = record.backward_count;
+
+            flow_first_seen = rebased(record.flow_first_seen, rebase);
+            flow_last_seen = rebased(record.flow_last_seen, rebase);
+            forward_last_seen = rebased(record.forward_last_seen, rebase);
+            backward_last_seen = rebased(record.backward_last_seen, rebase);
+            start_active_time = rebased(record.start_active_time, rebase);
+            end_active_time = rebased(record.end_active_time, rebase);
+
+            for (unsigned i = 0; i < CHECKPOINT_FLAGS; i++) {
+                flags_counter[checkpoint_flags[i]] = record.flags[i];
+            }
+
+            forward_PSH = record.forward_PSH;
+            forward_URG = record.forward_URG;
+            backward_PSH = record.backward_PSH;
+            backward_URG = record.backward_URG;
+
+            forward_bytes = record.forward_bytes;
+            forward_hbytes = record.forward_hbytes;
+            backward_bytes = record.backward_bytes;
+            backward_hbytes = record.backward_hbytes;
+
+            act_data_pkt_forward = record.act_data_pkt_forward;
+            min_seg_size_forward = record.min_seg_size_forward;
+            init_win_bytes_forward = record.init_win_bytes_forward;
+            init_win_bytes_backward = record.init_win_bytes_backward;
+
+            flow_iat = record.flow_iat;
+            forward_iat = record.forward_iat;
+            backward_iat = record.backward_iat;
+            flow_idle = record.flow_idle;
+            flow_active = record.flow_active;
+            flow_length = record.flow_length;
+            forward_pkt = record.forward_pkt;
+            backward_pkt = record.backward_pkt;
+
+            sf_count = record.sf_count;
+            sf_ac_helper = rebased(record.sf_ac_helper, rebase);
+            sf_last_packet_timestamp = rebased(record.sf_last_packet_timestamp, rebase);
+
+            f_bulk_duration = record.f_bulk_duration;
+            f_bulk_total_size = record.f_bulk_total_size;
+            f_bulk_state_count = record.f_bulk_state_count;
+            f_bulk_packet_count = record.f_bulk_packet_count;
+            f_bulk_size_helper = record.f_bulk_size_helper;
+            f_bulk_start_helper = rebased(record.f_bulk_start_helper, rebase);
+            f_bulk_packet_count_helper = record.f_bulk_packet_count_helper;
+            f_bulk_last_timestamp = rebased(record.f_bulk_last_timestamp, rebase);
+
+            b_bulk_duration = record.b_bulk_duration;
+            b_bulk_total_size = record.b_bulk_total_size;
+            b_bulk_state_count = record.b_bulk_state_count;
+            b_bulk_packet_count = record.b_bulk_packet_count;
+            b_bulk_size_helper = record.b_bulk_size_helper;
+            b_bulk_start_helper = rebased(record.b_bulk_start_helper, rebase);
+            b_bulk_packet_count_helper = record.b_bulk_packet_count_helper;
+            b_bulk_last_timestamp = rebased(record.b_bulk_last_timestamp, rebase);
+        }
+
+        /* Method used to save the connection in a checkpoint record. */
+        void to_record(FlowRecord& record) {
+            memset((void*)&record, 0, sizeof(record));
+
+            strncpy(record.flow_id, flow_id.c_str(), sizeof(record.flow_id) - 1);
+            strncpy(record.client_ip, client_ip, sizeof(record.client_ip) - 1);
+            strncpy(record.server_ip, server_ip, sizeof(record.server_ip) - 1);
+
+            record.client_port = client_port;
+            record.server_port = server_port;
+            record.protocol = protocol;
+
+            record.forward_count = forward_count;
+            record.backward_count = backward_count;
+
+            record.flow_first_seen = flow_first_seen;
+            record.flow_last_seen = flow_last_seen;
+            record.forward_last_seen = forward_last_seen;
+            record.backward_last_seen = backward_last_seen;
+            record.start_active_time = start_active_time;
+            record.end_active_time = end_active_time;
+
+            for (unsigned i = 0; i < CHECKPOINT_FLAGS; i++) {
+                record.flags[i] = flags_counter[checkpoint_flags[i]];
+            }
+
+            record.forward_PSH = forward_PSH;
+            record.forward_URG = forward_URG;
+            record.backward_PSH = backward_PSH;
+            record.backward_URG = backward_URG;
+
+            record.forward_bytes = forward_bytes;
+            record.forward_hbytes = forward_hbytes;
+            record.backward_bytes = backward_bytes;
+            record.backward_hbytes = backward_hbytes;
+
+            record.act_data_pkt_forward = act_data_pkt_forward;
+            record.min_seg_size_forward = min_seg_size_forward;
+            record.init_win_bytes_forward = init_win_bytes_forward;
+            record.init_win_bytes_backward = init_win_bytes_backward;
+
+            record.flow_iat = flow_iat;
+            record.forward_iat = forward_iat;
+            record.backward_iat = backward_iat;
+            record.flow_idle = flow_idle;
+            record.flow_active = flow_active;
+            record.flow_length = flow_length;
+            record.forward_pkt = forward_pkt;
+            record.backward_pkt = backward_pkt;
+
+            record.sf_count = sf_count;
+            record.sf_ac_helper = sf_ac_helper;
+            record.sf_last_packet_timestamp = sf_last_packet_timestamp;
+
+            record.f_bulk_duration = f_bulk_duration;
+            record.f_bulk_total_size = f_bulk_total_size;
+            record.f_bulk_state_count = f_bulk_state_count;
+            record.f_bulk_packet_count = f_bulk_packet_count;
+            record.f_bulk_size_helper = f_bulk_size_helper;
+            record.f_bulk_start_helper = f_bulk_start_helper;
+            record.f_bulk_packet_count_helper = f_bulk_packet_count_helper;
+            record.f_bulk_last_timestamp = f_bulk_last_timestamp;
+
+            record.b_bulk_duration = b_bulk_duration;
+            record.b_bulk_total_size = b_bulk_total_size;
+            record.b_bulk_state_count = b_bulk_state_count;
+            record.b_bulk_packet_count = b_bulk_packet_count;
+            record.b_bulk_size_helper = b_bulk_size_helper;
+            record.b_bulk_start_helper = b_bulk_start_helper;
+            record.b_bulk_packet_count_helper = b_bulk_packet_count_helper;
+            record.b_bulk_last_timestamp = b_bulk_last_timestamp;
+        }
+
+        /* Method used to update a connection based on the packet's information. */
+        void add_packet(const FlowPacket& p) {
+            //uint32_t packet_timestamp = p->pkth->ts.tv_usec;
+            int64_t packet_timestamp = p.timestamp;
+            
+            /* State no loaded model reads isn't maintained at all (see update_feature_profile()). */
+            uint32_t tracked = ml_tracked_state.load(std::memory_order_relaxed);
+
+            if (tracked & TRACK_BULK) {
+                ML_PROFILE(ml_bulk_perf_stats);
+                update_flow_bulk(p);
+            }
+
+            if (tracked & TRACK_SUBFLOWS) {
+                ML_PROFILE(ml_subflow_perf_stats);
+                update_subflows(p, tracked);
+            }
+            
+            if (p.tcp && (tracked & TRACK_FLAGS)) {
+                update_flags_counter(p);
+            }
+            
+            
+            flow_length((double)p.dsize);
+
+            /*
+                SfIpString packet_source;
+                *(p->ptrs.ip_api.get_src())->ntop(packet_source);
+            */
+
+            if (p.from_client) {
+                if (p.dsize >= 1.0f) {
+                    act_data_pkt_forward += 1;
+                }
+
+                if (p.tcp) {
+                    if (p.has_flags(FLOW_PSH)) {
+                        backward_PSH += 1;
+                    }
+
+                    if (p.has_flags(FLOW_URG)) {
+                        backward_URG += 1;
+                    }
+                }
+
+                forward_pkt((double)p.dsize);
+                forward_bytes += p.dsize;
+                forward_hbytes += p.pktlen - p.dsize;
+
+                forward_count += 1;
+
+                if (forward_count > 1) {
+                    forward_iat(packet_timestamp - forward_last_seen);
+                }
+                
+                forward_last_seen = packet_timestamp;
+                min_seg_size_forward = std::min((p.pktlen - p.dsize), min_seg_size_forward);
+        
+            } else {
+                if (p.tcp) {
+                    init_win_bytes_backward = p.window;
+
+                    if (p.has_flags(FLOW_PSH)) {
+                        backward_PSH += 1;
+                    }
+
+                    if (p.has_flags(FLOW_URG)) {
+                        backward_URG += 1;
+                    }
+                }
+
+                backward_pkt((double)p.dsize);
+                backward_bytes += p.dsize;
+                backward_hbytes += p.pktlen - p.dsize;
+
+                backward_count += 1;
+
+                if (backward_count > 1) {
+                    backward_iat(packet_timestamp - backward_last_seen);
+                }
+                
+                backward_last_seen = packet_timestamp;
+            }
+
+            flow_iat(packet_timestamp - flow_last_seen);
+            flow_last_seen = packet_timestamp;
+        }
+
+        /* Method used to initialize the flags counter. */
+        void init_flags() {
+            flags_counter["FIN"] = 0;
+            flags_counter["SYN"] = 0;
+            flags_counter["RST"] = 0;
+            flags_counter["PSH"] = 0;
+            flags_counter["ACK"] = 0;
+            flags_counter["URG"] = 0;
+            flags_counter["CWR"] = 0;
+            flags_counter["ECE"] = 0;
+        }
+
+        /* Method used to initialize most of this class' variables/parameters. */
+        void init_parameters() {
+            forward_count = 0;
+            backward_count = 0;
+
+            flow_first_seen = 0;
+            flow_last_seen = 0;
+
+            forward_last_seen = 0;
+            backward_last_seen = 0;
+
+            forward_PSH = 0;
+            forward_URG = 0;
+            backward_PSH = 0;
+            backward_URG = 0;
+
+            forward_bytes = 0;
+            forward_hbytes = 0;
+            backward_bytes = 0;
+            backward_hbytes = 0;
+
+            start_active_time = 0;
+            end_active_time = 0;
+
+            act_data_pkt_forward = 0;
+            min_seg_size_forward = 0;
+
+            init_win_bytes_forward = 0;
+            init_win_bytes_backward = 0;
+       }
+
+        /* Method used to update the flags_counter (TCP-only). */
+        void update_flags_counter(const FlowPacket& p) {
+            if (p.has_flags(FLOW_FIN)) {
+                flags_counter["FIN"] += 1;
+            }
+            if (p.has_flags(FLOW_SYN)) {
+                flags_counter["SYN"] += 1;
+            }
+            if (p.has_flags(FLOW_RST)) {
+                flags_counter["RST"] += 1;
+            }
+            if (p.has_flags(FLOW_PSH)) {
+                flags_counter["PSH"] += 1;
+            }
+            if (p.has_flags(FLOW_ACK)) {
+                flags_counter["ACK"] += 1;
+            }
+            if (p.has_flags(FLOW_URG)) {
+                flags_counter["URG"] += 1;
+            }
+            if (p.has_flags(FLOW_CWR)) {
+                flags_counter["CWR"] += 1;
+            }
+            if (p.has_flags(FLOW_ECE)) {
+                flags_counter["ECE"] += 1;
+            }
+        }
+
+        /* Method used to update the bulk flow in the forward direction. */
+        void update_forward_bulk(const FlowPacket& p, int64_t op_bulk_last_timestamp) {
+            uint32_t size = p.dsize;
+            //uint32_t packet_timestamp = p->pkth->ts.tv_usec;
+            int64_t packet_timestamp = p.timestamp;
+            
+            if (op_bulk_last_timestamp > f_bulk_start_helper) f_bulk_start_helper = 0;
+            if (size <= 0) return;
+
+            if (f_bulk_start_helper == 0) {
+                f_bulk_size_helper = size;
+                f_bulk_packet_count_helper = 1;
+                f_bulk_start_helper = packet_timestamp;
+                f_bulk_last_timestamp = packet_timestamp;
+            } else {
+                if (((packet_timestamp - f_bulk_last_timestamp) / (double)1000000) > 1) {
+                    f_bulk_size_helper = size;
+                    f_bulk_packet_count_helper = 1;
+                    f_bulk_start_helper = packet_timestamp;
+                    f_bulk_last_timestamp = packet_timestamp;
+                } else {
+                    f_bulk_size_helper += size;
+                    f_bulk_packet_count_helper += 1;
+
+                    if (f_bulk_packet_count_helper == 4) {
+                        f_bulk_state_count += 1;
+                        f_bulk_packet_count += f_bulk_packet_count_helper;
+                        f_bulk_total_size += f_bulk_size_helper;
+                        f_bulk_duration += packet_timestamp - f_bulk_start_helper;
+                    } else if (f_bulk_packet_count_helper > 4) {
+                        f_bulk_packet_count += 1;
+                        f_bulk_total_size += size;
+                        f_bulk_duration += packet_timestamp - f_bulk_last_timestamp;
+                    }
+
+                    f_bulk_last_timestamp = packet_timestamp;
+                }
+            }
+        }
+
+        /* Method used to update the bulk flow in the backward direction. */
+        void update_backward_bulk(const FlowPacket& p, uint32_t op_bulk_last_timestamp) {
+            uint32_t size = p.dsize;
+            //uint32_t packet_timestamp = p->pkth->ts.tv_usec;
+            int64_t packet_timestamp = p.timestamp;
+            
+            if (op_bulk_last_timestamp > b_bulk_start_helper) b_bulk_start_helper = 0;
+            if (size <= 0) return;
+
+            if (b_bulk_start_helper == 0) {
+                b_bulk_size_helper = size;
+                b_bulk_packet_count_helper = 1;
+                b_bulk_start_helper = packet_timestamp;
+                b_bulk_last_timestamp = packet_timestamp;
+            }
+            else {
+                if (((packet_timestamp - b_bulk_last_timestamp) / (double)1000000) > 1) {
+                    b_bulk_size_helper = size;
+                    b_bulk_packet_count_helper = 1;
+                    b_bulk_start_helper = packet_timestamp;
+                    b_bulk_last_timestamp = packet_timestamp;
+                }
+                else {
+                    b_bulk_size_helper += size;
+                    b_bulk_packet_count_helper += 1;
+
+                    if (b_bulk_packet_count_helper == 4) {
+                        b_bulk_state_count += 1;
+                        b_bulk_packet_count += b_bulk_packet_count_helper;
+                        b_bulk_total_size += b_bulk_size_helper;
+                        b_bulk_duration += packet_timestamp - b_bulk_start_helper;
+                    }
+                    else if (b_bulk_packet_count_helper > 4) {
+                        b_bulk_packet_count += 1;
+                        b_bulk_total_size += size;
+                        b_bulk_duration += packet_timestamp - b_bulk_last_timestamp;
+                    }
+
+                    b_bulk_last_timestamp = packet_timestamp;
+                }
+            }
+        }
+
+        /* Method used to update the bulk flow. */
+        void update_flow_bulk(const FlowPacket& p) {
+            /*
+                SfIpString packet_source;
+                *(p->ptrs.ip_api.get_src())->ntop(packet_source);
+            */
+            if (p.from_client) {
+                update_forward_bulk(p, b_bulk_last_timestamp);
+            } else {
+                update_backward_bulk(p, f_bulk_last_timestamp);
+            }
+        }
+
+        /* Method used to update both active and idle time of the flow. */
+        void update_active_idle_time(int64_t current_time, int64_t threshold) {
+            if ((current_time - end_active_time) > threshold) {
+                if ((end_active_time - start_active_time) > 0) {
+                    flow_active(end_active_time - start_active_time);
+                }
+
+                flow_idle(current_time - end_active_time);
+                start_active_time = current_time;
+                end_active_time = current_time;
+            } else {
+                end_active_time = current_time;
+            }
+        }
+
+        /* Method used to update subflows. */
+        void update_subflows(const FlowPacket& p, uint32_t tracked) {
+            //uint32_t packet_timestamp = p->pkth->ts.tv_usec;
+            int64_t packet_timestamp = p.timestamp;
+            
+            if (sf_last_packet_timestamp == -1) {
+                sf_last_packet_timestamp = packet_timestamp;
+                sf_ac_helper = packet_timestamp;
+            }
+
+            if (((packet_timestamp - sf_last_packet_timestamp) / (double)1000000) > 1) {
+                sf_count += 1;
+                int64_t last_sf_duration = packet_timestamp - sf_ac_helper;
+                if (tracked & TRACK_ACTIVE_IDLE) {
+                    update_active_idle_time(packet_timestamp - sf_last_packet_timestamp, 5000000);
+                }
+                sf_ac_helper = packet_timestamp;
+            }
+
+            sf_last_packet_timestamp = packet_timestamp;
+        }
+
+        /* Features "getters". */
+        std::string get_flowid() {
+            return flow_id;
+        }
+        
+        std::string get_clientip() {
+            return client_ip;
+        }
+
+        std::string get_serverip() {
+            return server_ip;
+        }
+
+        uint16_t get_serverport() {
+            return server_port;
+        }
+
+        uint8_t get_protocol() {
+            return protocol;
+        }
+
+        /*
+            Model route (index into the routes of ml_routing, -1: none), set when the connection is
+            created, and again if the routes it was set on were replaced since (see get_route_version()).
+        */
+        int32_t get_route() {
+            return route;
+        }
+
+        /* Version of the routes the route was found on (0: not routed yet). */
+        uint32_t get_route_version() {
+            return route_version;
+        }
+
+        void set_route(int32_t index, uint32_t version) {
+            route = index;
+            route_version = version;
+        }
+
+        int64_t get_flowfirstseen() {
+            return flow_first_seen;
+        }
+
+        int64_t get_flowlastseen() {
+            return flow_last_seen;
+        }
+
+        double get_flowbytespersec() {
+            int64_t duration = flow_last_seen - flow_first_seen;
+
+            if (duration > 0) {
+                return ((double)(forward_bytes + backward_bytes)) / ((double)duration/1000000);
+            } else {
+                return 0;
+            }
+        }
+
+        double get_flowpktspersec() {
+            int64_t duration = flow_last_seen - flow_first_seen;
+            uint32_t packet_count = forward_count + backward_count;
+
+            if (duration > 0) {
+                return ((double)packet_count) / ((double)duration/1000000);
+            } else {
+                return 0;
+            }
+        }
+
+        double get_fpktspersec() {
+            int64_t duration = flow_last_seen - flow_first_seen;
+
+            if (duration > 0) {
+                return ((double)forward_count) / ((double)duration/1000000);
+            } else {
+                return 0;
+            }
+        }
+
+        double get_bpktspersec() {
+            int64_t duration = flow_last_seen - flow_first_seen;
+
+            if (duration > 0) {
+                return ((double)backward_count) / ((double)duration/1000000);
+            }
+            else {
+                return 0;
+            }
+        }
+
+        double get_downupratio() {
+            if (forward_count > 0) {
+                return ((double)backward_count / (double)forward_count);
+            } else {
+                return 0;
+            }
+        }
+
+        double get_avgpktsize() {
+            uint32_t packet_count = forward_count + backward_count;
+            if (packet_count > 0) {
+                return (sum(flow_length) / (double)packet_count);
+            } else {
+                return 0;
+            }
+        }
+
+        double get_favgsegmentsize() {
+            if (forward_count > 0) {
+                return (sum(forward_pkt) / (double)forward_count);
+            } else {
+                return 0;
+            }
+        }
+
+        double get_bavgsegmentsize() {
+            if (backward_count > 0) {
+                return (sum(backward_pkt) / (double)backward_count);
+            } else {
+                return 0;
+            }
+        }
+
+        double get_fsubflowbytes() {
+            if (sf_count > 0) {
+                return ((double)forward_bytes / (double)sf_count);
+            } else {
+                return 0;
+            }
+        }
+
+        double get_fsubflowpkts() {
+            if (sf_count > 0) {
+                return ((double)forward_count / (double)sf_count);
+            } else {
+                return 0;
+            }
+        }
+
+        double get_bsubflowbytes() {
+            if (sf_count > 0) {
+                return ((double)backward_bytes / (double)sf_count);
+            } else {
+                return 0;
+            }
+        }
+
+        double get_bsubflowpkts() {
+            if (sf_count > 0) {
+                return ((double)backward_count / (double)sf_count);
+            } else {
+                return 0;
+            }
+        }
+
+        uint32_t get_fbulkstatecount() {
+            return f_bulk_state_count;
+        }
+
+        uint32_t get_fbulktotalsize() {
+            return f_bulk_total_size;
+        }
+
+        uint32_t get_fbulkpktcount() {
+            return f_bulk_packet_count;
+        }
+
+        int64_t get_fbulkduration() {
+            return f_bulk_duration;
+        }
+
+        double get_fbulkduration_seconds() {
+            return f_bulk_duration / (double)1000000;
+        }
+        
+        uint32_t get_favgbytesperbulk() {
+            if (get_fbulkstatecount() != 0) {
+                return (get_fbulktotalsize() / get_fbulkstatecount());
+            } else {
+                return 0;
+            }
+        }
+
+        uint32_t get_favgpktsperbulk() {
+            if (get_fbulkstatecount() != 0) {
+                return (get_fbulkpktcount() / get_fbulkstatecount());
+            } else {
+                return 0;
+            }
+        }
+
+        uint32_t get_favgbulkrate() {
+            if (get_fbulkduration() != 0) {
+                return (uint32_t)(get_fbulktotalsize() / get_fbulkduration_seconds());
+            } else {
+                return 0;
+            }
+        }
+
+        uint32_t get_bbulkstatecount() {
+            return b_bulk_state_count;
+        }
+
+        uint32_t get_bbulktotalsize() {
+            return b_bulk_total_size;
+        }
+
+        uint32_t get_bbulkpktcount() {
+            return b_bulk_packet_count;
+        }
+
+        int64_t get_bbulkduration() {
+            return b_bulk_duration;
+        }
+
+        double get_bbulkduration_seconds() {
+            return b_bulk_duration / (double)1000000;
+        }
+        
+        uint32_t get_bavgbytesperbulk() {
+            if (get_bbulkstatecount() != 0) {
+                return (get_bbulktotalsize() / get_bbulkstatecount());
+            } else {
+                return 0;
+            }
+        }
+
+        uint32_t get_bavgpktsperbulk() {
+            if (get_bbulkstatecount() != 0) {
+                return (get_bbulkpktcount() / get_bbulkstatecount());
+            } else {
+                return 0;
+            }
+        }
+
+        uint32_t get_bavgbulkrate() {
+            if (get_bbulkduration() != 0) {
+                return (uint32_t)(get_bbulktotalsize() / get_bbulkduration_seconds());
+            } else {
+                return 0;
+            }
+        }
+
+        /* Method used to print the feature vector. */
+        void print_feature_vector(const FeatureVector& feature_vector) {
+            std::cout << "[";
+            for (int i = 0; i < feature_vector.size(); i++) {
+                std::cout << "(" << (i + 1) << "): " << feature_vector[i];
+
+                if (i < (feature_vector.size() - 1)) {
+                    std::cout << " ";
+                }
+            }
+            std::cout << "]" << std::endl;
+        }
+
+        /*
+            Method used to get the feature vector, written straight into "feature_vector" (NUM_FEATURES
+            values): it's called once per flow, when the flow is classified, so nothing is cached.
+        */
+        void get_feature_vector(double* feature_vector) {
+            /*
+                MachineLearningCVE - Features
+                Destination Port, Flow Duration, Total Fwd Packets, Total Backward Packets,Total Length of Fwd Packets,
+                Total Length of Bwd Packets, Fwd Packet Length Max, Fwd Packet Length Min, Fwd Packet Length Mean, Fwd Packet Length Std,
+                Bwd Packet Length Max, Bwd Packet Length Min, Bwd Packet Length Mean, Bwd Packet Length Std,Flow Bytes/s, Flow Packets/s,
+                Flow IAT Mean, Flow IAT Std, Flow IAT Max, Flow IAT Min,Fwd IAT Total, Fwd IAT Mean, Fwd IAT Std, Fwd IAT Max, Fwd IAT Min,
+                Bwd IAT Total, Bwd IAT Mean, Bwd IAT Std, Bwd IAT Max, Bwd IAT Min,Fwd PSH Flags, Bwd PSH Flags, Fwd URG Flags, Bwd URG Flags,
+                Fwd Header Length, Bwd Header Length,Fwd Packets/s, Bwd Packets/s, Min Packet Length, Max Packet Length, Packet Length Mean,
+                Packet Length Std, Packet Length Variance,FIN Flag Count, SYN Flag Count, RST Flag Count, PSH Flag Count, ACK Flag Count,
+                URG Flag Count, CWE Flag Count, ECE Flag Count, Down/Up Ratio, Average Packet Size, Avg Fwd Segment Size, Avg Bwd Segment Size,
+                Fwd Header Length,Fwd Avg Bytes/Bulk, Fwd Avg Packets/Bulk, Fwd Avg Bulk Rate, Bwd Avg Bytes/Bulk, Bwd Avg Packets/Bulk,
+                Bwd Avg Bulk Rate,Subflow Fwd Packets, Subflow Fwd Bytes, Subflow Bwd Packets, Subflow Bwd Bytes,Init_Win_bytes_forward,
+                Init_Win_bytes_backward, act_data_pkt_fwd, min_seg_size_forward,Active Mean, Active Std, Active Max, Active Min,Idle Mean,
+                Idle Std, Idle Max, Idle Min, Label
+            */
+
+            double* f = feature_vector;
+
+            int64_t duration = flow_last_seen - flow_first_seen;
+
+            f[0] = server_port;                                     /* 1  */
+            f[1] = duration;                                        /* 2  */
+
+            f[14] = get_flowbytespersec();                          /* 15 */
+            f[15] = get_flowpktspersec();                           /* 16 */
+
+            /* Flow IAT. */
+            if (count(flow_iat) > 0) {
+                f[16] = mean(flow_iat);                             /* 17 */
+                f[17] = sqrt(variance(flow_iat));                   /* 18 */
+                f[18] = (max)(flow_iat);                            /* 19 */
+                f[19] = (min)(flow_iat);                            /* 20 */
+            } else {
+                f[16] = f[17] = f[18] = f[19] = 0;
+            }
+
+            f[36] = get_fpktspersec();                              /* 37 */
+            f[37] = get_bpktspersec();                              /* 38 */
+
+            /* Flow Length. */
+            if (count(flow_length) > 0) {
+                f[38] = (min)(flow_length);                         /* 39 */
+                f[39] = (max)(flow_length);                         /* 40 */
+                f[40] = mean(flow_length);                          /* 41 */
+                f[41] = sqrt(variance(flow_length));                /* 42 */
+                f[42] = variance(flow_length);                      /* 43 */
+            } else {
+                f[38] = f[39] = f[40] = f[41] = f[42] = 0;
+            }
+
+            f[51] = get_downupratio();                              /* 52 */
+            f[52] = get_avgpktsize();                               /* 53 */
+
+            f[62] = get_fsubflowpkts();                             /* 63 */
+            f[63] = get_fsubflowbytes();                            /* 64 */
+            f[64] = get_bsubflowpkts();                             /* 65 */
+            f[65] = get_bsubflowbytes();                            /* 66 */
+
+            f[2] = count(forward_pkt);                              /* 3  */
+            f[4] = sum(forward_pkt);                                /* 5  */
+
+            /* Forward Packet Length. */
+            if (count(forward_pkt) > 0) {
+                f[6] = (max)(forward_pkt);                          /* 7  */
+                f[7] = (min)(forward_pkt);                          /* 8  */
+                f[8] = mean(forward_pkt);                           /* 9  */
+                f[9] = sqrt(variance(forward_pkt));                 /* 10 */
+            } else {
+                f[6] = f[7] = f[8] = f[9] = 0;
+            }
+
+            /* Forward IAT. */
+            if (forward_count > 1) {
+                f[20] = sum(forward_iat);                           /* 21 */
+                f[21] = mean(forward_iat);                          /* 22 */
+                f[22] = sqrt(variance(forward_iat));                /* 23 */
+                f[23] = (max)(forward_iat);                         /* 24 */
+                f[24] = (min)(forward_iat);                         /* 25 */
+            } else {
+                f[20] = f[21] = f[22] = f[23] = f[24] = 0;
+            }
+
+            f[34] = forward_hbytes;                                 /* 35 */
+            f[53] = get_favgsegmentsize();                          /* 54 */
+
+            /*
+                This feature is duplicated (35).
+                I'm keeping it because the CICIDS2017's authors kept it in the CSV
+                files used to train the machine learning techniques.
+            */
+            f[55] = forward_hbytes;                                 /* 56 */
+
+            f[66] = init_win_bytes_forward;                         /* 67 */
+            f[68] = act_data_pkt_forward;                           /* 69 */
+            f[69] = min_seg_size_forward;                           /* 70 */
+
+            f[3] = count(backward_pkt);                             /* 4  */
+            f[5] = sum(backward_pkt);                               /* 6  */
+
+            /* Backward Packet Length. */
+            if (count(backward_pkt) > 0) {
+                f[10] = (max)(backward_pkt);                        /* 11 */
+                f[11] = (min)(backward_pkt);                        /* 12 */
+                f[12] = mean(backward_pkt);                         /* 13 */
+                f[13] = sqrt(variance(backward_pkt));               /* 14 */
+            } else {
+                f[10] = f[11] = f[12] = f[13] = 0;
+            }
+
+            /* Backward IAT. */
+            if (backward_count > 1) {
+                f[25] = sum(backward_iat);                          /* 26 */
+                f[26] = mean(backward_iat);                         /* 27 */
+                f[27] = sqrt(variance(backward_iat));               /* 28 */
+                f[28] = (max)(backward_iat);                        /* 29 */
+                f[29] = (min)(backward_iat);                        /* 30 */
+            } else {
+                f[25] = f[26] = f[27] = f[28] = f[29] = 0;
+            }
+
+            f[35] = backward_hbytes;                                /* 36 */
+            f[54] = get_bavgsegmentsize();                          /* 55 */
+            f[67] = init_win_bytes_backward;                        /* 68 */
+
+            f[30] = forward_PSH;                                    /* 31 */
+            f[31] = backward_PSH;                                   /* 32 */
+            f[32] = forward_URG;                                    /* 33 */
+            f[33] = backward_PSH;                                   /* 34 */
+
+            f[43] = flags_counter["FIN"];                           /* 44 */
+            f[44] = flags_counter["SYN"];                           /* 45 */
+            f[45] = flags_counter["RST"];                           /* 46 */
+            f[46] = flags_counter["PSH"];                           /* 47 */
+            f[47] = flags_counter["ACK"];                           /* 48 */
+            f[48] = flags_counter["URG"];                           /* 49 */
+            f[49] = flags_counter["CWR"];                           /* 50 */
+            f[50] = flags_counter["ECE"];                           /* 51 */
+
+            f[56] = get_favgbytesperbulk();                         /* 57 */
+            f[57] = get_favgpktsperbulk();                          /* 58 */
+            f[58] = get_favgbulkrate();                             /* 59 */
+            f[59] = get_bavgbytesperbulk();                         /* 60 */
+            f[60] = get_bavgpktsperbulk();                          /* 61 */
+            f[61] = get_bavgbulkrate();                             /* 62 */
+
+            /* Flow Active. */
+            if (count(flow_active) > 0) {
+                f[70] = mean(flow_active);                          /* 71 */
+                f[71] = sqrt(variance(flow_active));                /* 72 */
+                f[72] = (max)(flow_active);                         /* 73 */
+                f[73] = (min)(flow_active);                         /* 74 */
+            } else {
+                f[70] = f[71] = f[72] = f[73] = 0;
+            }
+
+            /* Flow Idle. */
+            if (count(flow_idle) > 0) {
+                f[74] = mean(flow_idle);                            /* 75 */
+                f[75] = sqrt(variance(flow_idle));                  /* 76 */
+                f[76] = (max)(flow_idle);                           /* 77 */
+                f[77] = (min)(flow_idle);                           /* 78 */
+            } else {
+                f[74] = f[75] = f[76] = f[77] = 0;
+            }
+        }
+
+    /* 
+        These are meant to be private.
+        They're currently public for debugging purpose.
+    */
+    private:
+        /* Timestamps left unset (0 or -1) stay unset when rebased. */
+        static int64_t rebased(int64_t timestamp, int64_t rebase) {
+            return (timestamp > 0) ? timestamp + rebase : timestamp;
+        }
+
+        /* Flow ID*/
+        std::string flow_id;
+
+        /* Client/Server IP Addresses */
+        char client_ip[INET6_ADDRSTRLEN];
+        char server_ip[INET6_ADDRSTRLEN];
+
+        /* Client/Server Ports */
+        uint16_t client_port;
+        uint16_t server_port;
+
+        /* Connection Protocol */
+        uint8_t protocol;
+
+        /* Model route */
+        int32_t route = -1;
+        uint32_t route_version = 0;
+
+        /* Count of packets sent in the forward/backward direction of the flow */
+        uint32_t forward_count;
+        uint32_t backward_count;
+
+        /* First and last time this flow was seen */
+        int64_t flow_first_seen;
+        int64_t flow_last_seen;
+
+        /* Last time the forward/backward direction of the flow was seen */
+        int64_t forward_last_seen;
+        int64_t backward_last_seen;
+
+        /* Start/end of this flow active time */
+        int64_t start_active_time;
+        int64_t end_active_time;
+
+        /* Flags counter (TCP) */
+        std::map<std::string, uint32_t> flags_counter;
+
+        /* PSH/URG flags counters for the forward/backward direction of the flow */
+        uint32_t forward_PSH;
+        uint32_t forward_URG;
+        uint32_t backward_PSH;
+        uint32_t backward_URG;
+
+        /* Bytes and header bytes counters for the forward/backward direction of the flow */
+        uint32_t forward_bytes;
+        uint32_t forward_hbytes;
+        uint32_t backward_bytes;
+        uint32_t backward_hbytes;
+
+        /* Count of packets with at least 1 byte of TCP data payload in the forward direction */
+        uint32_t act_data_pkt_forward;
+
+        /* Minimum segment size observed in the forward direction */
+        uint32_t min_seg_size_forward;
+
+        /* Total number of bytes sent in initial window in the forward direction */
+        uint32_t init_win_bytes_forward;
+
+        /* Total number of bytes sent in initial window in the backward direction */
+        uint32_t init_win_bytes_backward;
+
+        /*
+            Accumulator sets for flow's statistics:
+            - inter-arrival time of packets;
+            - time a flow was idle before becoming active;
+            - time a flow was active before becoming idle;
+            - total bytes of payload (flow and forward/backward direction of the flow).
+        */
+        intAcc flow_iat;
+        intAcc forward_iat;
+        intAcc backward_iat;
+
+        intAcc flow_idle;
+        intAcc flow_active;
+
+        doubleAcc flow_length;
+        doubleAcc forward_pkt;
+        doubleAcc backward_pkt;
+
+    /*
+        Bulk related variables/parameters.
+    */
+        /* Subflows */
+        uint32_t sf_count = 0;
+        int64_t sf_ac_helper = -1;              /* This is initialized as -1, so it has to be int32_t. */
+        int64_t sf_last_packet_timestamp = -1;  /* This is initialized as -1, so it has to be int32_t. */
+
+        /* Forward bulk flow. */
+        int64_t f_bulk_duration = 0;
+        uint32_t f_bulk_total_size = 0;
+
+        uint32_t f_bulk_state_count = 0;
+        uint32_t f_bulk_packet_count = 0;
+
+        uint32_t f_bulk_size_helper = 0;
+        int64_t f_bulk_start_helper = 0;
+        uint32_t f_bulk_packet_count_helper = 0;
+
+        int64_t f_bulk_last_timestamp = 0;
+
+        /* Backward bulk flow. */
+        int64_t b_bulk_duration = 0;
+        uint32_t b_bulk_total_size = 0;
+
+        uint32_t b_bulk_state_count = 0;
+        uint32_t b_bulk_packet_count = 0;
+
+        uint32_t b_bulk_size_helper = 0;
+        int64_t b_bulk_start_helper = 0;
+        uint32_t b_bulk_packet_count_helper = 0;
+
+        int64_t b_bulk_last_timestamp = 0;
+};
+
+#endif
@@ -0,0 +1,194 @@
+#ifndef ML_DECODE_H
+#define ML_DECODE_H
+
+/*
+    Minimal L2-L4 decoder for the standalone sensor (tools/ml_sensor.cc): Ethernet (with
+    802.1Q/802.1ad tags), IPv4, IPv6 (skipping the extension headers) and TCP/UDP/ICMP,
+    which is all a Connection reads. There's no reassembly: non-first fragments are
+    reported as such (AF_PACKET's fanout defragments before the sensor sees them).
+*/
+
+#include <cstdint>
+#include <cstring>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+enum DecodeResult {
+    DECODE_OK,
+    DECODE_NOT_IP,          /* ARP, LLDP... */
+    DECODE_UNSUPPORTED,     /* IP, but neither TCP, UDP nor ICMP. */
+    DECODE_FRAGMENT,        /* Non-first fragment (no L4 header). */
+    DECODE_TRUNCATED
+};
+
+struct DecodedPacket {
+    /* Capture time, in microseconds. */
+    int64_t timestamp = 0;
+
+    /* Packet length on the wire and L4 payload length (from the IP length, so without Ethernet padding). */
+    uint32_t pktlen = 0;
+    uint16_t dsize = 0;
+
+    /* AF_INET or AF_INET6; IPv4 addresses take the first 4 bytes. */
+    uint8_t family = 0;
+    uint8_t protocol = 0;
+    uint8_t src[16] = { };
+    uint8_t dst[16] = { };
+
+    /* Host byte order; 0 for ICMP. */
+    uint16_t src_port = 0;
+    uint16_t dst_port = 0;
+
+    /* ICMP echo identifier, as read from the header (like Snort's s_icmp_id). */
+    uint16_t icmp_id = 0;
+
+    uint8_t tcp_flags = 0;
+    uint16_t window = 0;
+
+    bool is_tcp() const { return protocol == IPPROTO_TCP; }
+    bool is_icmp() const { return protocol == IPPROTO_ICMP || protocol == IPPROTO_ICMPV6; }
+    size_t address_size() const { return (family == AF_INET) ? 4 : 16; }
+};
+
+static inline uint16_t read16(const uint8_t* data) {
+    return (uint16_t)((data[0] << 8) | data[1]);
+}
+
+/* Decodes the L4 header at "data" ("size" bytes of the IP payload, of which "caplen" were captured). */
+inline DecodeResult decode_l4(const uint8_t* data, uint32_t size, uint32_t caplen, DecodedPacket& packet) {
+    uint32_t header_size;
+
+    switch (packet.protocol) {
+        case IPPROTO_TCP:
+            if (caplen < 20) return DECODE_TRUNCATED;
+
+            packet.src_port = read16(data);
+            packet.dst_port = read16(data + 2);
+            packet.tcp_flags = data[13];
+            packet.window = read16(data + 14);
+            header_size = (uint32_t)(data[12] >> 4) * 4;
+            break;
+
+        case IPPROTO_UDP:
+            if (caplen < 8) return DECODE_TRUNCATED;
+
+            packet.src_port = read16(data);
+            packet.dst_port = read16(data + 2);
+            header_size = 8;
+            break;
+
+        case IPPROTO_ICMP:
+        case IPPROTO_ICMPV6:
+            /* Type, code, checksum and the 4 bytes of "rest of header" (id/sequence for echos). */
+            if (caplen < 8) return DECODE_TRUNCATED;
+
+            memcpy(&packet.icmp_id, data + 4, sizeof(packet.icmp_id));
+            header_size = 8;
+            break;
+
+        default:
+            return DECODE_UNSUPPORTED;
+    }
+
+    packet.dsize = (size > header_size) ? (uint16_t)(size - header_size) : 0;
+    return DECODE_OK;
+}
+
+inline DecodeResult decode_ipv4(const uint8_t* data, uint32_t caplen, DecodedPacket& packet) {
+    if (caplen < 20) return DECODE_TRUNCATED;
+
+    uint32_t header_size = (uint32_t)(data[0] & 0x0f) * 4;
+    uint32_t total_size = read16(data + 2);
+
+    if (header_size < 20 || caplen < header_size || total_size < header_size) return DECODE_TRUNCATED;
+
+    packet.family = AF_INET;
+    packet.protocol = data[9];
+    memcpy(packet.src, data + 12, 4);
+    memcpy(packet.dst, data + 16, 4);
+
+    /* Fragment offset != 0: no L4 header. */
+    if (read16(data + 6) & 0x1fff) return DECODE_FRAGMENT;
+
+    return decode_l4(data + header_size, total_size - header_size, caplen - header_size, packet);
+}
+
+inline DecodeResult decode_ipv6(const uint8_t* data, uint32_t caplen, DecodedPacket& packet) {
+    if (caplen < 40) return DECODE_TRUNCATED;
+
+    uint32_t size = read16(data + 4);
+    uint8_t next = data[6];
+
+    packet.family = AF_INET6;
+    memcpy(packet.src, data + 8, 16);
+    memcpy(packet.dst, data + 24, 16);
+
+    data += 40;
+    caplen -= 40;
+
+    /* Extension headers: hop-by-hop, routing, destination options and fragment. */
+    while (next == IPPROTO_HOPOPTS || next == IPPROTO_ROUTING || next == IPPROTO_DSTOPTS || next == IPPROTO_FRAGMENT) {
+        if (caplen < 8) return DECODE_TRUNCATED;
+
+        uint32_t header_size = (next == IPPROTO_FRAGMENT) ? 8 : ((uint32_t)data[1] + 1) * 8;
+
+        if (next == IPPROTO_FRAGMENT && (read16(data + 2) & 0xfff8)) {
+            packet.protocol = data[0];
+            return DECODE_FRAGMENT;
+        }
+
+        if (caplen < header_size || size < header_size) return DECODE_TRUNCATED;
+
+        next = data[0];
+        data += header_size;
+        caplen -= header_size;
+        size -= header_size;
+    }
+
+    packet.protocol = next;
+    return decode_l4(data, size, caplen, packet);
+}
+
+/* Decodes an IP packet (either version). */
+inline DecodeResult decode_ip(const uint8_t* data, uint32_t caplen, DecodedPacket& packet) {
+    if (caplen < 1) return DECODE_TRUNCATED;
+
+    switch (data[0] >> 4) {
+        case 4: return decode_ipv4(data, caplen, packet);
+        case 6: return decode_ipv6(data, caplen, packet);
+        default: return DECODE_NOT_IP;
+    }
+}
+
+/* Decodes an Ethernet frame. */
+inline DecodeResult decode_ethernet(const uint8_t* data, uint32_t caplen, DecodedPacket& packet) {
+    if (caplen < 14) return DECODE_TRUNCATED;
+
+    uint16_t type = read16(data + 12);
+    uint32_t offset = 14;
+
+    /* VLAN tags (802.1Q, 802.1ad). */
+    while (type == 0x8100 || type == 0x88a8) {
+        if (caplen < offset + 4) return DECODE_TRUNCATED;
+
+        type = read16(data + offset + 2);
+        offset += 4;
+    }
+
+    if (type != 0x0800 && type != 0x86dd) return DECODE_NOT_IP;
+
+    return decode_ip(data + offset, caplen - offset, packet);
+}
+
+/* Decodes a Linux "cooked" frame (captures on the "any" interface). */
+inline DecodeResult decode_sll(const uint8_t* data, uint32_t caplen, DecodedPacket& packet) {
+    if (caplen < 16) return DECODE_TRUNCATED;
+
+    uint16_t type = read16(data + 14);
+    if (type != 0x0800 && type != 0x86dd) return DECODE_NOT_IP;
+
+    return decode_ip(data + 16, caplen - 16, packet);
+}
+
+#endif
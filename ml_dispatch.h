@@ -0,0 +1,300 @@
+#ifndef ML_DISPATCH_H
+#define ML_DISPATCH_H
+
+/*
+    RSS-style flow dispatch to per-core shards.
+
+    Packets are hashed with the Toeplitz function NICs use for RSS, keyed with the
+    symmetric 0x6d5a key: swapping the source and destination (addresses and ports)
+    doesn't change the hash, so both directions of a flow land on the same shard and
+    each shard owns its connections outright. Like a NIC, the hash picks an entry of an
+    indirection table, which names the shard.
+
+    Shards are fed through single-producer/single-consumer rings. The dispatcher counts
+    the packets of every indirection entry, so load_report() can tell how unevenly the
+    shards are loaded and what a rebalanced table would achieve.
+*/
+
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <algorithm>
+
+#include "ml_decode.h"
+
+/* Toeplitz hash of up to 36 bytes (IPv6 addresses and ports), table-driven: one lookup per input byte. */
+class ToeplitzHash {
+    public:
+        static const size_t max_input = 36;
+
+        ToeplitzHash() {
+            /* The symmetric key: 0x6d5a repeated (40 bytes, as NICs use). */
+            uint8_t key[max_input + 4];
+            for (size_t i = 0; i < sizeof(key); i++) key[i] = (i % 2 == 0) ? 0x6d : 0x5a;
+
+            for (size_t byte = 0; byte < max_input; byte++) {
+                for (unsigned value = 0; value < 256; value++) {
+                    uint32_t result = 0;
+
+                    for (unsigned bit = 0; bit < 8; bit++) {
+                        if (!(value & (0x80 >> bit))) continue;
+
+                        /* The 32 key bits starting at the input bit's position. */
+                        size_t position = byte * 8 + bit;
+                        uint64_t window = ((uint64_t)key[position / 8] << 32) | ((uint64_t)key[position / 8 + 1] << 24) |
+                                          ((uint64_t)key[position / 8 + 2] << 16) | ((uint64_t)key[position / 8 + 3] << 8) |
+                                          (uint64_t)key[position / 8 + 4];
+                        result ^= (uint32_t)(window >> (8 - position % 8));
+                    }
+                    table[byte][value] = result;
+                }
+            }
+        }
+
+        uint32_t operator()(const uint8_t* input, size_t size) const {
+            uint32_t result = 0;
+            for (size_t i = 0; i < size; i++) result ^= table[i][input[i]];
+            return result;
+        }
+
+        /* RSS input: source address, destination address, source port, destination port (network order). */
+        uint32_t operator()(const DecodedPacket& packet) const {
+            uint8_t input[max_input];
+            size_t size = packet.address_size();
+
+            memcpy(input, packet.src, size);
+            memcpy(input + size, packet.dst, size);
+            input[2 * size] = (uint8_t)(packet.src_port >> 8);
+            input[2 * size + 1] = (uint8_t)packet.src_port;
+            input[2 * size + 2] = (uint8_t)(packet.dst_port >> 8);
+            input[2 * size + 3] = (uint8_t)packet.dst_port;
+
+            return (*this)(input, 2 * size + 4);
+        }
+
+    private:
+        uint32_t table[max_input][256];
+};
+
+/* Bounded single-producer/single-consumer queue (capacity rounded up to a power of two). */
+template <typename T>
+class SpscRing {
+    public:
+        explicit SpscRing(size_t capacity) {
+            size_t size = 1;
+            while (size < capacity) size <<= 1;
+
+            slots.resize(size);
+            mask = size - 1;
+        }
+
+        /* Producer side. False if the ring is full. */
+        bool push(const T& item) {
+            size_t tail = this->tail.load(std::memory_order_relaxed);
+
+            if (tail - cached_head > mask) {
+                cached_head = head.load(std::memory_order_acquire);
+                if (tail - cached_head > mask) return false;
+            }
+
+            slots[tail & mask] = item;
+            this->tail.store(tail + 1, std::memory_order_release);
+            return true;
+        }
+
+        /* Consumer side. Pops up to "max_items" items into "items", returns how many. */
+        size_t pop(T* items, size_t max_items) {
+            size_t head = this->head.load(std::memory_order_relaxed);
+
+            if (cached_tail == head) {
+                cached_tail = tail.load(std::memory_order_acquire);
+                if (cached_tail == head) return 0;
+            }
+
+            size_t count = std::min(max_items, cached_tail - head);
+            for (size_t i = 0; i < count; i++) items[i] = slots[(head + i) & mask];
+
+            this->head.store(head + count, std::memory_order_release);
+            return count;
+        }
+
+        /* Items waiting (approximate when read by a third thread). */
+        size_t size() const {
+            return tail.load(std::memory_order_acquire) - head.load(std::memory_order_acquire);
+        }
+
+    private:
+        std::vector<T> slots;
+        size_t mask = 0;
+
+        /*
+            Producer and consumer indexes on their own cache lines, each with a cached copy of
+            the other (padded rather than alignas, which heap allocation doesn't honor in C++11).
+        */
+        char padding0[64];
+        std::atomic<size_t> tail { 0 };
+        size_t cached_head = 0;
+        char padding1[64];
+        std::atomic<size_t> head { 0 };
+        size_t cached_tail = 0;
+        char padding2[64];
+};
+
+/* What each shard reports back (written by the shard's thread only). */
+struct ShardLoad {
+    std::atomic<uint64_t> packets { 0 };
+    std::atomic<uint64_t> flows { 0 };
+    std::atomic<uint64_t> busy_nsecs { 0 };
+};
+
+class FlowDispatcher {
+    public:
+        /* Entries of the indirection table (as many as common NICs have). */
+        static const size_t table_size = 128;
+
+        FlowDispatcher(unsigned num_shards, size_t queue_size) : num_shards(num_shards), loads(num_shards),
+                                                                  peak_depths(num_shards, 0), full_waits(num_shards, 0) {
+            for (unsigned s = 0; s < num_shards; s++) {
+                queues.emplace_back(new SpscRing<DecodedPacket>(queue_size));
+            }
+
+            /* Round robin, like a NIC's default table. */
+            for (size_t i = 0; i < table_size; i++) {
+                indirection[i] = (uint32_t)(i % num_shards);
+            }
+        }
+
+        unsigned shard_of(const DecodedPacket& packet) const {
+            return indirection[hash(packet) % table_size];
+        }
+
+        /*
+            Producer side (a single thread). Waits while the shard's queue is full ("stopping"
+            aborts the wait), so no packet is lost past the capture.
+        */
+        bool dispatch(const DecodedPacket& packet, const std::atomic<bool>& stopping) {
+            size_t entry = hash(packet) % table_size;
+            unsigned shard = indirection[entry];
+            SpscRing<DecodedPacket>& queue = *queues[shard];
+
+            entry_packets[entry]++;
+
+            if (!queue.push(packet)) {
+                full_waits[shard]++;
+
+                do {
+                    if (stopping) return false;
+                    std::this_thread::yield();
+                } while (!queue.push(packet));
+            }
+
+            /* Sampled, so the depth is only read every 64 packets. */
+            if ((++dispatched & 63) == 0) {
+                peak_depths[shard] = std::max<uint64_t>(peak_depths[shard], queue.size());
+            }
+            return true;
+        }
+
+        SpscRing<DecodedPacket>& queue(unsigned shard) {
+            return *queues[shard];
+        }
+
+        ShardLoad& load(unsigned shard) {
+            return loads[shard];
+        }
+
+        /* Per-shard load, imbalance (busiest shard over the mean) and what a rebalanced table would give. */
+        void load_report(std::ostream& out) const {
+            uint64_t total = 0;
+            for (unsigned s = 0; s < num_shards; s++) total += loads[s].packets;
+
+            out << "[*] Shard load (" << num_shards << " shards, " << total << " packets):" << std::endl;
+
+            for (unsigned s = 0; s < num_shards; s++) {
+                uint64_t packets = loads[s].packets;
+
+                out << "\t[*] Shard " << s << ": " << packets << " packets (" << std::fixed << std::setprecision(1)
+                    << (total ? 100.0 * packets / total : 0.0) << "%), " << loads[s].flows << " flows, "
+                    << loads[s].busy_nsecs / 1000000 << " ms busy, peak queue " << peak_depths[s]
+                    << ", " << full_waits[s] << " full queue waits." << std::endl;
+            }
+
+            std::vector<uint64_t> current(num_shards, 0);
+            for (size_t i = 0; i < table_size; i++) current[indirection[i]] += entry_packets[i];
+
+            uint32_t rebalanced[table_size];
+            std::vector<uint64_t> balanced = rebalance(rebalanced);
+
+            size_t moved = 0;
+            for (size_t i = 0; i < table_size; i++) moved += (rebalanced[i] != indirection[i]);
+
+            out << "[*] Imbalance: " << std::setprecision(2) << imbalance(current) << " (busiest shard / mean); "
+                << "moving " << moved << " of " << table_size << " indirection entries would give "
+                << imbalance(balanced) << "." << std::endl;
+            out.unsetf(std::ios::floatfield);
+        }
+
+        /*
+            Indirection table balancing the packets counted so far, starting from the current one:
+            while it helps, the heaviest entry that fits in the gap moves from the busiest shard to
+            the least loaded one, so few entries (flows) move. Returns the shards' load under it.
+            (Applying it to live traffic would move flows between shards, so it's only reported.)
+        */
+        std::vector<uint64_t> rebalance(uint32_t* table) const {
+            std::vector<uint64_t> shard_packets(num_shards, 0);
+
+            for (size_t i = 0; i < table_size; i++) {
+                table[i] = indirection[i];
+                shard_packets[table[i]] += entry_packets[i];
+            }
+
+            for (size_t moves = 0; moves < table_size; moves++) {
+                unsigned busiest = (unsigned)(std::max_element(shard_packets.begin(), shard_packets.end()) - shard_packets.begin());
+                unsigned lightest = (unsigned)(std::min_element(shard_packets.begin(), shard_packets.end()) - shard_packets.begin());
+                uint64_t gap = shard_packets[busiest] - shard_packets[lightest];
+
+                size_t best = table_size;
+                for (size_t i = 0; i < table_size; i++) {
+                    if (table[i] == busiest && entry_packets[i] > 0 && entry_packets[i] < gap &&
+                        (best == table_size || entry_packets[i] > entry_packets[best])) best = i;
+                }
+
+                if (best == table_size) break;
+
+                table[best] = lightest;
+                shard_packets[busiest] -= entry_packets[best];
+                shard_packets[lightest] += entry_packets[best];
+            }
+            return shard_packets;
+        }
+
+    private:
+        static double imbalance(const std::vector<uint64_t>& shard_packets) {
+            uint64_t total = 0, busiest = 0;
+
+            for (uint64_t packets : shard_packets) {
+                total += packets;
+                busiest = std::max(busiest, packets);
+            }
+            return total ? (double)busiest * shard_packets.size() / total : 1.0;
+        }
+
+        ToeplitzHash hash;
+        unsigned num_shards;
+        uint32_t indirection[table_size];
+
+        std::vector<std::unique_ptr<SpscRing<DecodedPacket>>> queues;
+        std::vector<ShardLoad> loads;
+
+        /* Producer-side counters (read once the producer is done). */
+        uint64_t entry_packets[table_size] = { };
+        uint64_t dispatched = 0;
+        std::vector<uint64_t> peak_depths;
+        std::vector<uint64_t> full_waits;
+};
+
+#endif
@@ -0,0 +1,535 @@
+#ifndef ML_GEMM_H
+#define ML_GEMM_H
+
+/*
+    GEMM kernels of the dense layers (see MLPModel in ml_models.h and QuantizedMLP in ml_quantized.h).
+
+    A layer computes Y = activation(X * W^T + b) over a batch X of rows, one per flow. W is packed
+    once, at load time, into panels of GEMM_PANEL outputs: for every input k, a panel holds the
+    weights of its outputs next to each other. The micro-kernel keeps a tile of GEMM_ROWS rows by
+    one panel in registers, broadcasting an input of each row against a vector of weights per step,
+    and adds the bias and applies the activation before storing the tile.
+    Rows are taken GEMM_BLOCK at a time, and every panel goes over the block's rows before the next
+    one, so the panel stays in L1 and the block's rows in L2. Layers have at most a few hundred
+    inputs, so the inputs aren't blocked.
+
+        - float32: FMA on AVX-512 (8 rows x 16 outputs) or AVX2 (4 rows x 16 outputs).
+        - int8: int8 weights (one scale per output) against int16 inputs (one scale per row),
+          multiplied in pairs of inputs by pmaddwd (vpdpwssd with AVX-512 VNNI).
+
+    As in ml_quantized.h, the instruction set is picked at compile time; without AVX2 the kernels
+    are plain loops, left to the compiler.
+*/
+
+#include <cmath>
+#include <limits>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+enum Activation : uint32_t {
+    ACTIVATION_IDENTITY = 0,
+    ACTIVATION_RELU = 1,
+    ACTIVATION_TANH = 2,
+    ACTIVATION_LOGISTIC = 3,
+    ACTIVATION_SOFTMAX = 4      /* Output layers only (applied by the model, not the kernels). */
+};
+
+/* Outputs per panel (one AVX-512 vector of floats), and rows per panel pass. */
+static const size_t GEMM_PANEL = 16;
+static const size_t GEMM_BLOCK = 64;
+
+#if defined(__AVX512F__)
+static const size_t GEMM_ROWS = 8;
+#else
+static const size_t GEMM_ROWS = 4;
+#endif
+
+/* The sums of a tile only stay in registers if the loops over its rows are unrolled, which -O2 doesn't do. */
+#if defined(__clang__)
+#define GEMM_UNROLL _Pragma("unroll")
+#elif defined(__GNUC__)
+#define GEMM_UNROLL _Pragma("GCC unroll 16")
+#else
+#define GEMM_UNROLL
+#endif
+
+inline size_t gemm_padded(size_t size) {
+    return (size + GEMM_PANEL - 1) / GEMM_PANEL * GEMM_PANEL;
+}
+
+/* Activations of the portable kernels. */
+inline void activate(float* values, size_t size, uint32_t activation) {
+    if (activation == ACTIVATION_TANH) {
+        for (size_t i = 0; i < size; i++) values[i] = std::tanh(values[i]);
+    } else if (activation == ACTIVATION_LOGISTIC) {
+        for (size_t i = 0; i < size; i++) values[i] = 1.0f / (1.0f + std::exp(-values[i]));
+    } else if (activation == ACTIVATION_RELU) {
+        for (size_t i = 0; i < size; i++) values[i] = std::max(values[i], 0.0f);
+    }
+}
+
+/*
+    Flushes denormals to zero (FTZ and DAZ) while in scope. Folding the scaler leaves tiny weights
+    on the features with the widest ranges, and their products are often denormal, which takes
+    a microcode assist per FMA. Denormal weights still slow the FMAs down under DAZ, so they're
+    dropped when packing. Together, this made a tanh model 2.5x faster.
+*/
+class FlushDenormals {
+    public:
+#if defined(__SSE2__)
+        FlushDenormals() : saved(_mm_getcsr()) {
+            _mm_setcsr(saved | 0x8040);
+        }
+
+        ~FlushDenormals() {
+            _mm_setcsr(saved);
+        }
+
+    private:
+        unsigned int saved;
+#endif
+};
+
+/*
+    Vector activations, applied to a tile still in registers. exp() is Cephes' expf (2^n times a
+    polynomial of the remainder, within 2 ulp), tanh(x) is 2 * logistic(2x) - 1.
+*/
+#if defined(__AVX512F__)
+inline __m512 exp_ps(__m512 x) {
+    x = _mm512_min_ps(_mm512_max_ps(x, _mm512_set1_ps(-87.3f)), _mm512_set1_ps(88.3f));
+
+    __m512 n = _mm512_roundscale_ps(_mm512_mul_ps(x, _mm512_set1_ps(1.44269504f)), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+    __m512 r = _mm512_fnmadd_ps(n, _mm512_set1_ps(0.693359375f), x);
+    r = _mm512_fnmadd_ps(n, _mm512_set1_ps(-2.12194440e-4f), r);
+
+    __m512 p = _mm512_set1_ps(1.9875691500e-4f);
+    p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(1.3981999507e-3f));
+    p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(8.3334519073e-3f));
+    p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(4.1665795894e-2f));
+    p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(1.6666665459e-1f));
+    p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(5.0000001201e-1f));
+    p = _mm512_fmadd_ps(p, _mm512_mul_ps(r, r), _mm512_add_ps(r, _mm512_set1_ps(1.0f)));
+
+    __m512i exponent = _mm512_slli_epi32(_mm512_add_epi32(_mm512_cvtps_epi32(n), _mm512_set1_epi32(127)), 23);
+    return _mm512_mul_ps(p, _mm512_castsi512_ps(exponent));
+}
+
+inline __m512 activate_ps(__m512 values, uint32_t activation) {
+    __m512 one = _mm512_set1_ps(1.0f);
+
+    switch (activation) {
+        case ACTIVATION_RELU: return _mm512_max_ps(values, _mm512_setzero_ps());
+        case ACTIVATION_LOGISTIC: return _mm512_div_ps(one, _mm512_add_ps(one, exp_ps(_mm512_sub_ps(_mm512_setzero_ps(), values))));
+        case ACTIVATION_TANH: {
+            __m512 logistic = _mm512_div_ps(one, _mm512_add_ps(one, exp_ps(_mm512_mul_ps(values, _mm512_set1_ps(-2.0f)))));
+            return _mm512_fmsub_ps(logistic, _mm512_set1_ps(2.0f), one);
+        }
+        default: return values;
+    }
+}
+#endif
+
+#if defined(__AVX2__)
+inline __m256 madd_ps(__m256 a, __m256 b, __m256 c) {
+#if defined(__FMA__)
+    return _mm256_fmadd_ps(a, b, c);
+#else
+    return _mm256_add_ps(_mm256_mul_ps(a, b), c);
+#endif
+}
+
+inline __m256 exp_ps(__m256 x) {
+    x = _mm256_min_ps(_mm256_max_ps(x, _mm256_set1_ps(-87.3f)), _mm256_set1_ps(88.3f));
+
+    __m256 n = _mm256_round_ps(_mm256_mul_ps(x, _mm256_set1_ps(1.44269504f)), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+    __m256 r = _mm256_sub_ps(x, _mm256_mul_ps(n, _mm256_set1_ps(0.693359375f)));
+    r = _mm256_sub_ps(r, _mm256_mul_ps(n, _mm256_set1_ps(-2.12194440e-4f)));
+
+    __m256 p = _mm256_set1_ps(1.9875691500e-4f);
+    p = madd_ps(p, r, _mm256_set1_ps(1.3981999507e-3f));
+    p = madd_ps(p, r, _mm256_set1_ps(8.3334519073e-3f));
+    p = madd_ps(p, r, _mm256_set1_ps(4.1665795894e-2f));
+    p = madd_ps(p, r, _mm256_set1_ps(1.6666665459e-1f));
+    p = madd_ps(p, r, _mm256_set1_ps(5.0000001201e-1f));
+    p = madd_ps(p, _mm256_mul_ps(r, r), _mm256_add_ps(r, _mm256_set1_ps(1.0f)));
+
+    __m256i exponent = _mm256_slli_epi32(_mm256_add_epi32(_mm256_cvtps_epi32(n), _mm256_set1_epi32(127)), 23);
+    return _mm256_mul_ps(p, _mm256_castsi256_ps(exponent));
+}
+
+inline __m256 activate_ps(__m256 values, uint32_t activation) {
+    __m256 one = _mm256_set1_ps(1.0f);
+
+    switch (activation) {
+        case ACTIVATION_RELU: return _mm256_max_ps(values, _mm256_setzero_ps());
+        case ACTIVATION_LOGISTIC: return _mm256_div_ps(one, _mm256_add_ps(one, exp_ps(_mm256_sub_ps(_mm256_setzero_ps(), values))));
+        case ACTIVATION_TANH: {
+            __m256 logistic = _mm256_div_ps(one, _mm256_add_ps(one, exp_ps(_mm256_mul_ps(values, _mm256_set1_ps(-2.0f)))));
+            return _mm256_sub_ps(_mm256_add_ps(logistic, logistic), one);
+        }
+        default: return values;
+    }
+}
+#endif
+
+/*
+    Single precision layer. "weights" has one row of "inputs" weights per output; padding outputs
+    get zero weights and biases. Panel p holds weights[p * GEMM_PANEL + j][k] at (k * GEMM_PANEL + j).
+*/
+struct PackedLayer {
+    uint32_t inputs = 0;
+    uint32_t outputs = 0;
+    uint32_t activation = ACTIVATION_IDENTITY;
+
+    std::vector<float> panels;
+    std::vector<float> biases;
+
+    void pack(const double* weights, const double* bias, uint32_t inputs, uint32_t outputs, uint32_t activation) {
+        this->inputs = inputs;
+        this->outputs = outputs;
+        this->activation = activation;
+
+        panels.assign(gemm_padded(outputs) * inputs, 0.0f);
+        biases.assign(gemm_padded(outputs), 0.0f);
+
+        for (uint32_t j = 0; j < outputs; j++) {
+            float* panel = panels.data() + (j / GEMM_PANEL) * GEMM_PANEL * inputs;
+
+            /* Weights below the smallest normal float are dropped (see FlushDenormals). */
+            for (uint32_t k = 0; k < inputs; k++) {
+                double weight = weights[(size_t)j * inputs + k];
+                if (std::fabs(weight) >= std::numeric_limits<float>::min()) panel[k * GEMM_PANEL + j % GEMM_PANEL] = (float)weight;
+            }
+            biases[j] = (float)bias[j];
+        }
+    }
+
+    size_t padded_outputs() const {
+        return biases.size();
+    }
+
+    size_t bytes() const {
+        return (panels.size() + biases.size()) * sizeof(float);
+    }
+};
+
+/* One tile: ROWS rows of x (ldx apart) by one panel, into y (ldy apart). */
+template <size_t ROWS>
+inline void gemm_tile(const float* x, size_t ldx, const float* panel, const float* bias, uint32_t inputs,
+                      uint32_t activation, float* y, size_t ldy) {
+#if defined(__AVX512F__)
+    __m512 sums[ROWS];
+    GEMM_UNROLL
+    for (size_t r = 0; r < ROWS; r++) sums[r] = _mm512_loadu_ps(bias);
+
+    for (uint32_t k = 0; k < inputs; k++) {
+        __m512 w = _mm512_loadu_ps(panel + k * GEMM_PANEL);
+        GEMM_UNROLL
+        for (size_t r = 0; r < ROWS; r++) sums[r] = _mm512_fmadd_ps(_mm512_set1_ps(x[r * ldx + k]), w, sums[r]);
+    }
+
+    GEMM_UNROLL
+    for (size_t r = 0; r < ROWS; r++) _mm512_storeu_ps(y + r * ldy, activate_ps(sums[r], activation));
+#elif defined(__AVX2__)
+    __m256 sums[ROWS][2];
+    GEMM_UNROLL
+    for (size_t r = 0; r < ROWS; r++) {
+        sums[r][0] = _mm256_loadu_ps(bias);
+        sums[r][1] = _mm256_loadu_ps(bias + 8);
+    }
+
+    for (uint32_t k = 0; k < inputs; k++) {
+        __m256 w0 = _mm256_loadu_ps(panel + k * GEMM_PANEL);
+        __m256 w1 = _mm256_loadu_ps(panel + k * GEMM_PANEL + 8);
+
+        GEMM_UNROLL
+        for (size_t r = 0; r < ROWS; r++) {
+            __m256 value = _mm256_set1_ps(x[r * ldx + k]);
+            sums[r][0] = madd_ps(value, w0, sums[r][0]);
+            sums[r][1] = madd_ps(value, w1, sums[r][1]);
+        }
+    }
+
+    GEMM_UNROLL
+    for (size_t r = 0; r < ROWS; r++) {
+        _mm256_storeu_ps(y + r * ldy, activate_ps(sums[r][0], activation));
+        _mm256_storeu_ps(y + r * ldy + 8, activate_ps(sums[r][1], activation));
+    }
+#else
+    float sums[ROWS][GEMM_PANEL];
+    GEMM_UNROLL
+    for (size_t r = 0; r < ROWS; r++) std::copy(bias, bias + GEMM_PANEL, sums[r]);
+
+    for (uint32_t k = 0; k < inputs; k++) {
+        const float* w = panel + k * GEMM_PANEL;
+
+        GEMM_UNROLL
+        for (size_t r = 0; r < ROWS; r++) {
+            float value = x[r * ldx + k];
+            for (size_t j = 0; j < GEMM_PANEL; j++) sums[r][j] += value * w[j];
+        }
+    }
+
+    GEMM_UNROLL
+    for (size_t r = 0; r < ROWS; r++) {
+        activate(sums[r], GEMM_PANEL, activation);
+        std::copy(sums[r], sums[r] + GEMM_PANEL, y + r * ldy);
+    }
+#endif
+}
+
+/* Y = activation(X * W^T + b) for "count" rows; y has room for the layer's padded outputs. */
+inline void gemm_layer(const PackedLayer& layer, const float* x, size_t ldx, size_t count, float* y, size_t ldy) {
+    size_t num_panels = layer.padded_outputs() / GEMM_PANEL;
+
+    for (size_t block = 0; block < count; block += GEMM_BLOCK) {
+        size_t block_end = std::min(count, block + GEMM_BLOCK);
+
+        for (size_t p = 0; p < num_panels; p++) {
+            const float* panel = layer.panels.data() + p * GEMM_PANEL * layer.inputs;
+            const float* bias = layer.biases.data() + p * GEMM_PANEL;
+            size_t row = block;
+
+            for (; row + GEMM_ROWS <= block_end; row += GEMM_ROWS) {
+                gemm_tile<GEMM_ROWS>(x + row * ldx, ldx, panel, bias, layer.inputs, layer.activation,
+                                     y + row * ldy + p * GEMM_PANEL, ldy);
+            }
+            for (; row < block_end; row++) {
+                gemm_tile<1>(x + row * ldx, ldx, panel, bias, layer.inputs, layer.activation,
+                             y + row * ldy + p * GEMM_PANEL, ldy);
+            }
+        }
+    }
+}
+
+/*
+    Dynamic int16 quantization of a row of activations (scaled by its largest magnitude, rounded
+    to nearest), padded with zeros to "padded" values. Returns the scale (value ~= quantized * scale).
+    Non-finite values are quantized to 0.
+*/
+inline float quantize_activations(const float* values, size_t size, size_t padded, int16_t* quantized) {
+    const float finite = std::numeric_limits<float>::max();
+    float max_value = 0;
+    size_t i = 0;
+
+#if defined(__AVX2__)
+    __m256 sign = _mm256_set1_ps(-0.0f);
+    __m256 maxima = _mm256_setzero_ps();
+
+    for (; i + 8 <= size; i += 8) {
+        __m256 magnitudes = _mm256_andnot_ps(sign, _mm256_loadu_ps(values + i));
+        magnitudes = _mm256_and_ps(magnitudes, _mm256_cmp_ps(magnitudes, _mm256_set1_ps(finite), _CMP_LE_OQ));
+        maxima = _mm256_max_ps(maxima, magnitudes);
+    }
+
+    float lanes[8];
+    _mm256_storeu_ps(lanes, maxima);
+    for (size_t lane = 0; lane < 8; lane++) max_value = std::max(max_value, lanes[lane]);
+#endif
+
+    for (; i < size; i++) {
+        float magnitude = std::fabs(values[i]);
+        if (magnitude > max_value && magnitude <= finite) max_value = magnitude;
+    }
+
+    float scale = (max_value > 0) ? max_value / 32767.0f : 1.0f;
+    float inverse = 1.0f / scale;
+    i = 0;
+
+#if defined(__AVX2__)
+    __m256 limit = _mm256_set1_ps(max_value);
+
+    for (; i + 8 <= size; i += 8) {
+        __m256 value = _mm256_loadu_ps(values + i);
+        __m256 valid = _mm256_cmp_ps(_mm256_andnot_ps(sign, value), limit, _CMP_LE_OQ);
+        __m256i rounded = _mm256_cvtps_epi32(_mm256_and_ps(_mm256_mul_ps(value, _mm256_set1_ps(inverse)), valid));
+
+        __m128i packed = _mm_packs_epi32(_mm256_castsi256_si128(rounded), _mm256_extracti128_si256(rounded, 1));
+        _mm_storeu_si128((__m128i*)(quantized + i), packed);
+    }
+#endif
+
+    for (; i < size; i++) {
+        quantized[i] = (std::fabs(values[i]) <= max_value) ? (int16_t)std::nearbyint(values[i] * inverse) : 0;
+    }
+    std::fill(quantized + size, quantized + padded, 0);
+    return scale;
+}
+
+/*
+    int8 layer. Inputs go in pairs (pmaddwd multiplies two int16 pairs and adds them), so panel p
+    holds, for every pair q and output j, weights[p * GEMM_PANEL + j][2q, 2q + 1] at ((q * GEMM_PANEL + j) * 2).
+    Products fit in 23 bits, and there are at most QUANTIZED_MAX_FEATURES inputs, so the int32
+    sums can't overflow.
+*/
+struct QuantizedLayer {
+    uint32_t inputs = 0;
+    uint32_t outputs = 0;
+    uint32_t activation = ACTIVATION_IDENTITY;
+
+    std::vector<int8_t> panels;
+    std::vector<float> scales;
+    std::vector<float> biases;
+
+    void pack(const double* weights, const double* bias, uint32_t inputs, uint32_t outputs, uint32_t activation) {
+        this->inputs = inputs;
+        this->outputs = outputs;
+        this->activation = activation;
+
+        size_t pairs = padded_inputs() / 2;
+        std::vector<int8_t> row(inputs);
+
+        panels.assign(gemm_padded(outputs) * pairs * 2, 0);
+        scales.assign(gemm_padded(outputs), 0.0f);
+        biases.assign(gemm_padded(outputs), 0.0f);
+
+        for (uint32_t j = 0; j < outputs; j++) {
+            const double* source = weights + (size_t)j * inputs;
+            int8_t* panel = panels.data() + (j / GEMM_PANEL) * GEMM_PANEL * pairs * 2;
+
+            double max_value = 0;
+            for (uint32_t k = 0; k < inputs; k++) max_value = std::max(max_value, std::fabs(source[k]));
+
+            double scale = (max_value > 0) ? max_value / 127.0 : 1.0;
+
+            for (uint32_t k = 0; k < inputs; k++) {
+                panel[((k / 2) * GEMM_PANEL + j % GEMM_PANEL) * 2 + k % 2] = (int8_t)std::lround(source[k] / scale);
+            }
+            scales[j] = (float)scale;
+            biases[j] = (float)bias[j];
+        }
+    }
+
+    /* Quantized inputs are padded to an even number. */
+    size_t padded_inputs() const {
+        return (inputs + 1) / 2 * 2;
+    }
+
+    size_t padded_outputs() const {
+        return biases.size();
+    }
+
+    size_t bytes() const {
+        return panels.size() * sizeof(int8_t) + (scales.size() + biases.size()) * sizeof(float);
+    }
+};
+
+/* One int8 tile: ROWS rows of x (ldx apart, with their scales) by one panel of "pairs" input pairs. */
+template <size_t ROWS>
+inline void gemm_tile(const int16_t* x, size_t ldx, const float* x_scales, const int8_t* panel, const float* scales,
+                      const float* bias, size_t pairs, uint32_t activation, float* y, size_t ldy) {
+    int32_t pair[ROWS];
+
+#if defined(__AVX512BW__)
+    __m512i sums[ROWS];
+    GEMM_UNROLL
+    for (size_t r = 0; r < ROWS; r++) sums[r] = _mm512_setzero_si512();
+
+    for (size_t q = 0; q < pairs; q++) {
+        __m512i w = _mm512_cvtepi8_epi16(_mm256_loadu_si256((const __m256i*)(panel + q * GEMM_PANEL * 2)));
+
+        GEMM_UNROLL
+        for (size_t r = 0; r < ROWS; r++) {
+            memcpy(&pair[r], x + r * ldx + 2 * q, sizeof(int32_t));
+#if defined(__AVX512VNNI__)
+            sums[r] = _mm512_dpwssd_epi32(sums[r], _mm512_set1_epi32(pair[r]), w);
+#else
+            sums[r] = _mm512_add_epi32(sums[r], _mm512_madd_epi16(_mm512_set1_epi32(pair[r]), w));
+#endif
+        }
+    }
+
+    GEMM_UNROLL
+    for (size_t r = 0; r < ROWS; r++) {
+        __m512 factors = _mm512_mul_ps(_mm512_loadu_ps(scales), _mm512_set1_ps(x_scales[r]));
+        __m512 values = _mm512_fmadd_ps(_mm512_cvtepi32_ps(sums[r]), factors, _mm512_loadu_ps(bias));
+
+        _mm512_storeu_ps(y + r * ldy, activate_ps(values, activation));
+    }
+#elif defined(__AVX2__)
+    __m256i sums[ROWS][2];
+    GEMM_UNROLL
+    for (size_t r = 0; r < ROWS; r++) sums[r][0] = sums[r][1] = _mm256_setzero_si256();
+
+    for (size_t q = 0; q < pairs; q++) {
+        const int8_t* w = panel + q * GEMM_PANEL * 2;
+        __m256i w0 = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i*)w));
+        __m256i w1 = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i*)(w + 16)));
+
+        GEMM_UNROLL
+        for (size_t r = 0; r < ROWS; r++) {
+            memcpy(&pair[r], x + r * ldx + 2 * q, sizeof(int32_t));
+
+            __m256i value = _mm256_set1_epi32(pair[r]);
+            sums[r][0] = _mm256_add_epi32(sums[r][0], _mm256_madd_epi16(value, w0));
+            sums[r][1] = _mm256_add_epi32(sums[r][1], _mm256_madd_epi16(value, w1));
+        }
+    }
+
+    GEMM_UNROLL
+    for (size_t r = 0; r < ROWS; r++) {
+        for (size_t half = 0; half < 2; half++) {
+            __m256 factors = _mm256_mul_ps(_mm256_loadu_ps(scales + half * 8), _mm256_set1_ps(x_scales[r]));
+            __m256 values = madd_ps(_mm256_cvtepi32_ps(sums[r][half]), factors, _mm256_loadu_ps(bias + half * 8));
+
+            _mm256_storeu_ps(y + r * ldy + half * 8, activate_ps(values, activation));
+        }
+    }
+#else
+    int32_t sums[ROWS][GEMM_PANEL] = { };
+
+    for (size_t q = 0; q < pairs; q++) {
+        const int8_t* w = panel + q * GEMM_PANEL * 2;
+
+        GEMM_UNROLL
+        for (size_t r = 0; r < ROWS; r++) {
+            const int16_t* values = x + r * ldx + 2 * q;
+            for (size_t j = 0; j < GEMM_PANEL; j++) sums[r][j] += w[2 * j] * values[0] + w[2 * j + 1] * values[1];
+        }
+    }
+
+    GEMM_UNROLL
+    for (size_t r = 0; r < ROWS; r++) {
+        float* values = y + r * ldy;
+
+        for (size_t j = 0; j < GEMM_PANEL; j++) values[j] = sums[r][j] * scales[j] * x_scales[r] + bias[j];
+        activate(values, GEMM_PANEL, activation);
+    }
+    (void)pair;
+#endif
+}
+
+/* Same as the float32 gemm_layer(), for int16 rows quantized by quantize_activations(). */
+inline void gemm_layer(const QuantizedLayer& layer, const int16_t* x, size_t ldx, const float* x_scales, size_t count,
+                       float* y, size_t ldy) {
+    size_t num_panels = layer.padded_outputs() / GEMM_PANEL;
+    size_t pairs = layer.padded_inputs() / 2;
+
+    for (size_t block = 0; block < count; block += GEMM_BLOCK) {
+        size_t block_end = std::min(count, block + GEMM_BLOCK);
+
+        for (size_t p = 0; p < num_panels; p++) {
+            const int8_t* panel = layer.panels.data() + p * GEMM_PANEL * pairs * 2;
+            const float* scales = layer.scales.data() + p * GEMM_PANEL;
+            const float* bias = layer.biases.data() + p * GEMM_PANEL;
+            size_t row = block;
+
+            for (; row + GEMM_ROWS <= block_end; row += GEMM_ROWS) {
+                gemm_tile<GEMM_ROWS>(x + row * ldx, ldx, x_scales + row, panel, scales, bias, pairs, layer.activation,
+                                     y + row * ldy + p * GEMM_PANEL, ldy);
+            }
+            for (; row < block_end; row++) {
+                gemm_tile<1>(x + row * ldx, ldx, x_scales + row, panel, scales, bias, pairs, layer.activation,
+                             y + row * ldy + p * GEMM_PANEL, ldy);
+            }
+        }
+    }
+}
+
+#endif
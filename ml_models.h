@@ -0,0 +1,1472 @@
+#ifndef ML_MODELS_H
+#define ML_MODELS_H
+
+/*
+    Native model format (.mlm) and inference engines.
+
+    A .mlm file is little-endian and laid out as:
+        - header: magic "MLCM", version, model kind, number of features, number of classes;
+        - scaler: flag + per-feature scale/offset (x' = x * scale + offset), as exported from scaler.joblib;
+        - the model's own parameters (see each engine's load/save).
+
+    The same file is written by tools/ml_train.cc, tools/ml_import.cc and export_native_models.py, and read
+    by the inspector.
+*/
+
+#include <cmath>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sstream>
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+
+#include "ml_gemm.h"
+
+static const char ml_model_magic[4] = { 'M', 'L', 'C', 'M' };
+static const uint32_t ml_model_version = 1;
+
+enum ModelKind : uint32_t {
+    MODEL_TREES = 1,            /* Decision Tree / Random Forest. */
+    MODEL_ADABOOST_SAMME_R = 2, /* AdaBoost (SAMME.R): same trees, log-probability aggregation. */
+    MODEL_LINEAR = 3,           /* Linear SVC. */
+    MODEL_GAUSSIAN_NB = 4,
+    MODEL_BERNOULLI_NB = 5,
+    MODEL_BOOSTED_TREES = 6,    /* Gradient-boosted trees (imported from XGBoost/LightGBM by tools/ml_import.cc). */
+    MODEL_MLP = 7,              /* Multi-layer perceptron (sklearn's MLPClassifier). */
+    MODEL_ADABOOST_SAMME = 8    /* AdaBoost (SAMME): one-hot leaves, weighted votes through sklearn's softmax. */
+};
+
+/*
+    Binary reader/writer helpers.
+    Both keep a sticky error flag, so callers only need to check it once at the end.
+*/
+class ModelReader {
+    public:
+        explicit ModelReader(FILE* file) : file(file) { }
+
+        template <typename T>
+        T read() {
+            T value = T();
+            if (ok && fread(&value, sizeof(T), 1, file) != 1) ok = false;
+            return value;
+        }
+
+        template <typename T>
+        void read_vector(std::vector<T>& values, size_t size) {
+            /* Sizes come from the file itself, so they're bounded before allocating. */
+            if (!ok || size > (1u << 28)) {
+                ok = false;
+                return;
+            }
+            values.resize(size);
+            if (size && fread(values.data(), sizeof(T), size, file) != size) ok = false;
+        }
+
+        bool ok = true;
+
+    private:
+        FILE* file;
+};
+
+class ModelWriter {
+    public:
+        explicit ModelWriter(FILE* file) : file(file) { }
+
+        template <typename T>
+        void write(const T& value) {
+            if (ok && fwrite(&value, sizeof(T), 1, file) != 1) ok = false;
+        }
+
+        template <typename T>
+        void write_vector(const std::vector<T>& values) {
+            if (ok && !values.empty() && fwrite(values.data(), sizeof(T), values.size(), file) != values.size()) ok = false;
+        }
+
+        bool ok = true;
+
+    private:
+        FILE* file;
+};
+
+/* In-place log-softmax (turns joint log-likelihoods into log-posteriors). */
+inline void log_softmax(double* values, uint32_t size) {
+    double max_value = *std::max_element(values, values + size);
+    double total = 0;
+
+    for (uint32_t i = 0; i < size; i++) {
+        total += std::exp(values[i] - max_value);
+    }
+
+    double log_total = max_value + std::log(total);
+    for (uint32_t i = 0; i < size; i++) {
+        values[i] -= log_total;
+    }
+}
+
+/*
+    Picks a class from its probabilities, given per-class alert thresholds (negative or missing:
+    no threshold). A class > 0 with a threshold is only picked when its probability reaches it,
+    and then wins over the classes without one; otherwise the most probable class among class 0
+    and the classes without a threshold wins. Without thresholds, that's the most probable class.
+*/
+inline uint32_t decide_class(const double* proba, uint32_t num_classes, const std::vector<double>* thresholds) {
+    uint32_t best = 0;
+    bool alert = false;
+
+    for (uint32_t c = 1; c < num_classes; c++) {
+        double threshold = (thresholds && c < thresholds->size()) ? (*thresholds)[c] : -1.0;
+
+        if (threshold >= 0) {
+            if (proba[c] >= threshold && (!alert || proba[c] > proba[best])) {
+                best = c;
+                alert = true;
+            }
+        } else if (!alert && proba[c] > proba[best]) {
+            best = c;
+        }
+    }
+    return best;
+}
+
+/*
+    Parses per-class alert thresholds: space-separated "class:probability" pairs, or a bare
+    probability for every class > 0 (classes without one get -1, i.e. no threshold).
+*/
+inline bool parse_alert_thresholds(const std::string& text, std::vector<double>& thresholds, std::string& error) {
+    std::istringstream stream(text);
+    std::string item;
+
+    thresholds.clear();
+
+    while (stream >> item) {
+        size_t colon = item.find(':');
+        char* end = nullptr;
+        long label = -1;
+
+        if (colon != std::string::npos) {
+            label = strtol(item.c_str(), &end, 10);
+            if (end != item.c_str() + colon || label < 1 || label > 255) {
+                error = "bad class in alert threshold " + item;
+                return false;
+            }
+        }
+
+        const char* value = item.c_str() + (colon == std::string::npos ? 0 : colon + 1);
+        double probability = strtod(value, &end);
+
+        if (end == value || *end || probability < 0 || probability > 1) {
+            error = "bad probability in alert threshold " + item;
+            return false;
+        }
+
+        if (label < 0) {
+            thresholds.assign(256, probability);
+            thresholds[0] = -1.0;
+        } else {
+            if (thresholds.size() <= (size_t)label) thresholds.resize(label + 1, -1.0);
+            thresholds[label] = probability;
+        }
+    }
+    return true;
+}
+
+/* Maps a double to an integer with the same order (-0 and 0 both map to 0), and back. */
+inline int64_t ordered_bits(double value) {
+    int64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    return (bits < 0) ? INT64_MIN - bits : bits;
+}
+
+inline double from_ordered_bits(int64_t bits) {
+    if (bits < 0) bits = INT64_MIN - bits;
+
+    double value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+/*
+    Largest double x such that passes(x), for a "passes" that holds up to some point and never
+    after (e.g. a split on a feature scaled by a positive factor). Brackets it around "guess" and
+    bisects over the doubles themselves, so the result is exact. False if it can't be bracketed.
+*/
+template <typename Passes>
+bool last_passing(Passes passes, double guess, double& result) {
+    if (!std::isfinite(guess)) return false;
+
+    double low = guess, high = guess;
+
+    for (double step = std::max(std::fabs(guess), 1.0) * 1e-6; !passes(low); step *= 2) {
+        low = guess - step;
+        if (!std::isfinite(low)) return false;
+    }
+
+    for (double step = std::max(std::fabs(guess), 1.0) * 1e-6; passes(high); step *= 2) {
+        high = guess + step;
+        if (!std::isfinite(high)) return false;
+    }
+
+    int64_t pass = ordered_bits(low), fail = ordered_bits(high);
+
+    while ((uint64_t)fail - (uint64_t)pass > 1) {
+        int64_t middle = pass + (int64_t)(((uint64_t)fail - (uint64_t)pass) / 2);
+
+        if (passes(from_ordered_bits(middle)))
+            pass = middle;
+        else
+            fail = middle;
+    }
+
+    result = from_ordered_bits(pass);
+    return true;
+}
+
+/* In-place softmax (also turns joint log-likelihoods into posteriors). */
+inline void softmax(double* values, uint32_t size) {
+    double max_value = *std::max_element(values, values + size);
+    double total = 0;
+
+    for (uint32_t i = 0; i < size; i++) {
+        values[i] = std::exp(values[i] - max_value);
+        total += values[i];
+    }
+
+    for (uint32_t i = 0; i < size; i++) {
+        values[i] /= total;
+    }
+}
+
+/* Base class of every native engine. */
+class Model {
+    public:
+        virtual ~Model() { }
+
+        /* Fills proba[0 .. num_classes) with the class probabilities of an already scaled feature vector. */
+        virtual void predict_proba_scaled(const double* features, double* proba) const = 0;
+
+        /*
+            Fills scores[0 .. num_classes) with the engine's own per-class scores of an already scaled
+            feature vector: vote fractions (trees), weighted margins (AdaBoost), decision values (linear)
+            or log-posteriors (Naive Bayes). Engines without one return the probabilities.
+        */
+        virtual void decision_scaled(const double* features, double* scores) const {
+            predict_proba_scaled(features, scores);
+        }
+
+        /* Reads/writes the engine-specific part of the file. */
+        virtual bool load_parameters(ModelReader& reader) = 0;
+        virtual void save_parameters(ModelWriter& writer) const = 0;
+
+        /* Sets used[f] for every feature the predictions depend on (used has num_features entries). */
+        virtual void mark_used_features(std::vector<bool>& used) const = 0;
+
+        /* Bytes of parameters read at inference time (the scaler aside). */
+        virtual size_t parameter_bytes() const = 0;
+
+        /* Model footprint at inference time. */
+        size_t memory_bytes() const {
+            return parameter_bytes() + (scale.size() + offset.size()) * sizeof(double);
+        }
+
+        /* Class probabilities of a raw feature vector (as returned by Connection::get_feature_vector()). */
+        void predict_proba(const double* features, double* proba) const {
+            if (scale.empty()) {
+                predict_proba_scaled(features, proba);
+                return;
+            }
+
+            std::vector<double>& scaled = scratch(num_features, SCRATCH_SCALED);
+            scale_features(features, scaled.data());
+            predict_proba_scaled(scaled.data(), proba);
+        }
+
+        /* Per-class scores of a raw feature vector (see decision_scaled()). */
+        void decision_function(const double* features, double* scores) const {
+            if (scale.empty()) {
+                decision_scaled(features, scores);
+                return;
+            }
+
+            std::vector<double> scaled(num_features);
+            scale_features(features, scaled.data());
+            decision_scaled(scaled.data(), scores);
+        }
+
+        /*
+            Folds the scaler into the engine's parameters, so inference reads the raw features
+            directly instead of a scaled copy of them. Engines that can't fold it keep the scaler.
+            A folded model is for inference only: save_model() and quantize_model() refuse it.
+        */
+        bool fold_scaler() {
+            if (scale.empty()) return true;
+            if (!fold_parameters()) return false;
+
+            scale.clear();
+            offset.clear();
+            folded = true;
+            return true;
+        }
+
+        /* Predicted class: the most probable one, or as decided by per-class alert thresholds (see decide_class()). */
+        uint32_t predict(const double* features, double* confidence = nullptr, const std::vector<double>* thresholds = nullptr) const {
+            std::vector<double>& proba = scratch(num_classes, SCRATCH_PROBA);
+            predict_proba(features, proba.data());
+
+            uint32_t best = decide_class(proba.data(), num_classes, thresholds);
+
+            /* The winning class' probability. */
+            if (confidence) *confidence = proba[best];
+            return best;
+        }
+
+        /*
+            Class probabilities of "count" raw feature vectors, row after row in "proba".
+            Engines with a batched traversal override it; the others score row by row.
+        */
+        virtual void predict_proba_batch(const double* const* rows, size_t count, double* proba) const {
+            for (size_t i = 0; i < count; i++) {
+                predict_proba(rows[i], proba + i * num_classes);
+            }
+        }
+
+        /* Same as predict(), for "count" raw feature vectors (see predict_proba_batch()). */
+        void predict_batch(const double* const* rows, size_t count, uint32_t* classes, double* confidences = nullptr,
+                           const std::vector<double>* thresholds = nullptr) const {
+            std::vector<double>& proba = scratch(count * num_classes, SCRATCH_PROBA);
+            predict_proba_batch(rows, count, proba.data());
+
+            for (size_t i = 0; i < count; i++) {
+                const double* row_proba = proba.data() + i * num_classes;
+
+                classes[i] = decide_class(row_proba, num_classes, thresholds);
+                if (confidences) confidences[i] = row_proba[classes[i]];
+            }
+        }
+
+        ModelKind kind;
+        uint32_t num_features = 0;
+        uint32_t num_classes = 0;
+
+        /* Optional affine scaler applied before the model (empty when the model reads raw features). */
+        std::vector<double> scale;
+        std::vector<double> offset;
+
+        /* Whether the scaler was folded into the parameters (see fold_scaler()). */
+        bool folded = false;
+
+    protected:
+        /* Rewrites the parameters for raw features; leaves them untouched when it returns false. */
+        virtual bool fold_parameters() {
+            return false;
+        }
+
+        /* Whether every feature is scaled by a finite positive factor (order-preserving scaling). */
+        bool positive_scale() const {
+            for (uint32_t i = 0; i < num_features; i++) {
+                if (!(scale[i] > 0) || !std::isfinite(scale[i]) || !std::isfinite(offset[i])) return false;
+            }
+            return true;
+        }
+
+        void scale_features(const double* features, double* scaled) const {
+            for (uint32_t i = 0; i < num_features; i++) {
+                scaled[i] = features[i] * scale[i] + offset[i];
+            }
+        }
+
+        enum ScratchSlot { SCRATCH_PROBA, SCRATCH_SCALED, NUM_SCRATCH_SLOTS };
+
+        /*
+            One of the calling thread's buffers, grown to at least "size" doubles: they only ever
+            grow, so predict() doesn't allocate once warmed up. Engines never call predict() or
+            predict_proba() themselves, so a slot is never in use twice at once.
+        */
+        static std::vector<double>& scratch(size_t size, ScratchSlot slot) {
+            static thread_local std::vector<double> buffers[NUM_SCRATCH_SLOTS];
+
+            if (buffers[slot].size() < size) buffers[slot].resize(size);
+            return buffers[slot];
+        }
+};
+
+/*
+    Flat tree arena shared by every tree of an ensemble.
+    Internal nodes send a sample to "left" when features[feature] <= threshold.
+    Leaves have feature == -1 and "value" indexes num_classes fractions in "values".
+    As in sklearn, features are compared in single precision, except in boosted trees, whose
+    thresholds are imported for double precision comparisons (see tools/ml_import.cc).
+
+    Boosted trees' leaves hold per-class margins instead (zero but for the tree's class); the
+    weighted sum of every tree's leaf goes through a softmax, which for a binary model (margins
+    only on class 1) is the usual sigmoid. The base score is a tree made of a single leaf.
+*/
+struct TreeNode {
+    double threshold;
+    int32_t feature;
+    int32_t left;
+    int32_t right;
+    int32_t value;
+};
+
+class TreeEnsemble : public Model {
+    public:
+        explicit TreeEnsemble(ModelKind kind = MODEL_TREES) {
+            this->kind = kind;
+        }
+
+        void predict_proba_scaled(const double* features, double* proba) const override {
+            aggregate([this, features](size_t t) { return find_leaf(roots[t], features); }, proba);
+        }
+
+        /*
+            Blocks of rows go down each tree together: the tree's nodes stay in cache for the
+            whole block and the rows' independent traversals overlap their memory accesses.
+        */
+        void predict_proba_batch(const double* const* rows, size_t count, double* proba) const override {
+            if (!scale.empty()) {
+                Model::predict_proba_batch(rows, count, proba);
+                return;
+            }
+
+            std::vector<int32_t> leaves(roots.size() * batch_block);
+
+            for (size_t first = 0; first < count; first += batch_block) {
+                size_t size = (count - first < batch_block) ? count - first : batch_block;
+
+                for (size_t t = 0; t < roots.size(); t++) {
+                    if (exact_splits())
+                        find_leaves<true>(roots[t], rows + first, size, leaves.data() + t * batch_block);
+                    else
+                        find_leaves<false>(roots[t], rows + first, size, leaves.data() + t * batch_block);
+                }
+
+                for (size_t r = 0; r < size; r++) {
+                    aggregate([&leaves, r](size_t t) { return leaves[t * batch_block + r]; }, proba + (first + r) * num_classes);
+                }
+            }
+        }
+
+        /* Weighted vote fractions (RF, SAMME AdaBoost's normalized votes) or SAMME.R's margins. */
+        void decision_scaled(const double* features, double* scores) const override {
+            margins([this, features](size_t t) { return find_leaf(roots[t], features); }, scores);
+        }
+
+        /*
+            Combines the leaves reached in every tree into class probabilities.
+            "leaf_of(t)" returns the index of the leaf reached in tree t, so other traversals
+            (e.g. QuantizedTrees') share the aggregation.
+        */
+        template <typename LeafOf>
+        void aggregate(LeafOf leaf_of, double* proba) const {
+            if (kind == MODEL_ADABOOST_SAMME_R) {
+                aggregate_samme_r(leaf_of, proba);
+                return;
+            }
+
+            if (kind == MODEL_BOOSTED_TREES) {
+                boosted_margins(leaf_of, proba);
+                softmax(proba, num_classes);
+                return;
+            }
+
+            std::fill(proba, proba + num_classes, 0.0);
+
+            for (size_t t = 0; t < roots.size(); t++) {
+                const double* leaf = values.data() + nodes[leaf_of(t)].value;
+
+                for (uint32_t c = 0; c < num_classes; c++) {
+                    proba[c] += weights[t] * leaf[c];
+                }
+            }
+
+            for (uint32_t c = 0; c < num_classes; c++) {
+                proba[c] /= total_weight;
+            }
+
+            /*
+                sklearn's AdaBoostClassifier.predict_proba() for SAMME: the vote fractions f give the
+                decision (C * f - 1) / (C - 1), which goes through a softmax scaled by 1 / (C - 1)
+                (for two classes, the sigmoid of 4 * f[1] - 2). The softmax ignores the constant term.
+            */
+            if (kind == MODEL_ADABOOST_SAMME) {
+                double scale = (double)num_classes / ((num_classes - 1.0) * (num_classes - 1.0));
+
+                for (uint32_t c = 0; c < num_classes; c++) {
+                    proba[c] *= scale;
+                }
+                softmax(proba, num_classes);
+            }
+        }
+
+        /*
+            Per-class scores from the leaves reached in every tree: each tree gives its weight to
+            its leaf's majority class (a one-hot SAMME leaf votes for its class), divided by the
+            total weight (for binary SAMME, sklearn's decision_function() is 4 * scores[1] - 2).
+            SAMME.R and boosted trees give their summed margins instead, before the softmax.
+        */
+        template <typename LeafOf>
+        void margins(LeafOf leaf_of, double* scores) const {
+            if (kind == MODEL_ADABOOST_SAMME_R) {
+                aggregate_samme_r(leaf_of, scores, false);
+                return;
+            }
+
+            if (kind == MODEL_BOOSTED_TREES) {
+                boosted_margins(leaf_of, scores);
+                return;
+            }
+
+            std::fill(scores, scores + num_classes, 0.0);
+
+            for (size_t t = 0; t < roots.size(); t++) {
+                const double* leaf = values.data() + nodes[leaf_of(t)].value;
+                scores[std::max_element(leaf, leaf + num_classes) - leaf] += weights[t];
+            }
+
+            for (uint32_t c = 0; c < num_classes; c++) {
+                scores[c] /= total_weight;
+            }
+        }
+
+        /* Index of the leaf reached by a feature vector, starting from node "root". */
+        int32_t find_leaf(int32_t root, const double* features) const {
+            int32_t index = root;
+
+            /* sklearn compares float32 features; folded thresholds already account for it (see fold_parameters()). */
+            if (exact_splits()) {
+                while (nodes[index].feature >= 0) {
+                    const TreeNode& node = nodes[index];
+                    index = (features[node.feature] <= node.threshold) ? node.left : node.right;
+                }
+                return index;
+            }
+
+            while (nodes[index].feature >= 0) {
+                const TreeNode& node = nodes[index];
+                index = ((float)features[node.feature] <= node.threshold) ? node.left : node.right;
+            }
+            return index;
+        }
+
+        /*
+            Appends a tree to the arena. Node indices inside "tree" are relative to
+            the tree and value indices are relative to "tree_values".
+        */
+        void add_tree(const std::vector<TreeNode>& tree, const std::vector<double>& tree_values, double weight) {
+            int32_t node_base = (int32_t)nodes.size();
+            int32_t value_base = (int32_t)values.size();
+
+            roots.push_back(node_base);
+            weights.push_back(weight);
+            total_weight += weight;
+
+            for (TreeNode node : tree) {
+                if (node.feature >= 0) {
+                    node.left += node_base;
+                    node.right += node_base;
+                } else {
+                    node.value += value_base;
+                }
+                nodes.push_back(node);
+            }
+            values.insert(values.end(), tree_values.begin(), tree_values.end());
+        }
+
+        bool load_parameters(ModelReader& reader) override {
+            uint32_t num_trees = reader.read<uint32_t>();
+            uint32_t num_nodes = reader.read<uint32_t>();
+            uint32_t num_values = reader.read<uint32_t>();
+
+            reader.read_vector(roots, num_trees);
+            reader.read_vector(weights, num_trees);
+            reader.read_vector(nodes, num_nodes);
+            reader.read_vector(values, num_values);
+
+            if (!reader.ok || num_trees == 0) return false;
+
+            total_weight = 0;
+            for (double weight : weights) total_weight += weight;
+
+            return validate();
+        }
+
+        void save_parameters(ModelWriter& writer) const override {
+            writer.write((uint32_t)roots.size());
+            writer.write((uint32_t)nodes.size());
+            writer.write((uint32_t)values.size());
+
+            writer.write_vector(roots);
+            writer.write_vector(weights);
+            writer.write_vector(nodes);
+            writer.write_vector(values);
+        }
+
+        /* Features some split tests. */
+        void mark_used_features(std::vector<bool>& used) const override {
+            for (const TreeNode& node : nodes) {
+                if (node.feature >= 0) used[node.feature] = true;
+            }
+        }
+
+        size_t parameter_bytes() const override {
+            return roots.size() * sizeof(int32_t) + weights.size() * sizeof(double) +
+                   nodes.size() * sizeof(TreeNode) + values.size() * sizeof(double);
+        }
+
+        std::vector<int32_t> roots;
+        std::vector<double> weights;
+        std::vector<TreeNode> nodes;
+        std::vector<double> values;
+        double total_weight = 0;
+
+    protected:
+        /*
+            Every split becomes features[f] <= T, with T the largest double that the scaled path
+            ((float)(x * scale + offset) <= threshold) still sends left: both paths are monotonic
+            in x, so they agree on every input, NaNs included.
+        */
+        bool fold_parameters() override {
+            if (!positive_scale()) return false;
+
+            std::vector<TreeNode> folded_nodes(nodes);
+
+            for (TreeNode& node : folded_nodes) {
+                if (node.feature < 0) continue;
+
+                double factor = scale[node.feature], shift = offset[node.feature], threshold = node.threshold;
+                bool exact = exact_splits();
+
+                auto left = [factor, shift, threshold, exact](double x) {
+                    return exact ? (x * factor + shift <= threshold) : ((float)(x * factor + shift) <= threshold);
+                };
+
+                if (!last_passing(left, (threshold - shift) / factor, node.threshold)) return false;
+            }
+
+            nodes.swap(folded_nodes);
+            return true;
+        }
+
+    private:
+        /* Rows per block of predict_proba_batch(). */
+        static const size_t batch_block = 16;
+
+        /* Whether splits compare the features in double precision (folded or boosted trees). */
+        bool exact_splits() const {
+            return folded || kind == MODEL_BOOSTED_TREES;
+        }
+
+        /* find_leaf() of tree "root" for "size" rows. */
+        template <bool exact>
+        void find_leaves(int32_t root, const double* const* rows, size_t size, int32_t* leaves) const {
+            for (size_t r = 0; r < size; r++) {
+                int32_t index = root;
+
+                while (nodes[index].feature >= 0) {
+                    const TreeNode& node = nodes[index];
+                    double feature = rows[r][node.feature];
+                    bool left = exact ? (feature <= node.threshold) : ((float)feature <= node.threshold);
+
+                    index = left ? node.left : node.right;
+                }
+                leaves[r] = index;
+            }
+        }
+
+        /* Weighted sum of the leaves' margins (the base score's single-leaf tree included). */
+        template <typename LeafOf>
+        void boosted_margins(LeafOf leaf_of, double* margins) const {
+            std::fill(margins, margins + num_classes, 0.0);
+
+            for (size_t t = 0; t < roots.size(); t++) {
+                const double* leaf = values.data() + nodes[leaf_of(t)].value;
+
+                for (uint32_t c = 0; c < num_classes; c++) {
+                    margins[c] += weights[t] * leaf[c];
+                }
+            }
+        }
+
+        /*
+            sklearn's AdaBoostClassifier.predict_proba() for SAMME.R: every tree contributes
+            (C - 1) * (log p - mean(log p)) and the sum goes through a softmax scaled by 1 / (C - 1).
+            Without "probabilities", the sum divided by the total weight is left as is (the margins
+            of sklearn's decision_function()).
+        */
+        template <typename LeafOf>
+        void aggregate_samme_r(LeafOf leaf_of, double* proba, bool probabilities = true) const {
+            const double epsilon = 2.220446049250313e-16;
+            std::vector<double> log_proba(num_classes);
+
+            std::fill(proba, proba + num_classes, 0.0);
+
+            for (size_t t = 0; t < roots.size(); t++) {
+                const double* leaf = values.data() + nodes[leaf_of(t)].value;
+                double mean = 0;
+
+                for (uint32_t c = 0; c < num_classes; c++) {
+                    log_proba[c] = std::log(std::max(leaf[c], epsilon));
+                    mean += log_proba[c] / num_classes;
+                }
+
+                for (uint32_t c = 0; c < num_classes; c++) {
+                    proba[c] += (num_classes - 1) * (log_proba[c] - mean);
+                }
+            }
+
+            if (!probabilities) {
+                for (uint32_t c = 0; c < num_classes; c++) {
+                    proba[c] /= total_weight;
+                }
+                return;
+            }
+
+            for (uint32_t c = 0; c < num_classes; c++) {
+                proba[c] /= total_weight * (num_classes - 1);
+            }
+            softmax(proba, num_classes);
+        }
+
+        /* Makes sure a corrupted file can't send find_leaf() out of bounds or into a loop. */
+        bool validate() const {
+            int32_t num_nodes = (int32_t)nodes.size();
+
+            for (int32_t root : roots) {
+                if (root < 0 || root >= num_nodes) return false;
+            }
+
+            for (int32_t i = 0; i < num_nodes; i++) {
+                const TreeNode& node = nodes[i];
+
+                if (node.feature >= 0) {
+                    if ((uint32_t)node.feature >= num_features) return false;
+                    if (node.left <= i || node.left >= num_nodes) return false;
+                    if (node.right <= i || node.right >= num_nodes) return false;
+                } else if (node.value < 0 || (size_t)node.value + num_classes > values.size()) {
+                    return false;
+                }
+            }
+            return true;
+        }
+};
+
+/*
+    Linear SVC: one row of coefficients (plus intercept) per decision function.
+    Binary models have a single row and their probability is the sigmoid of the
+    decision value; multi-class (one-vs-rest) models take the softmax of the rows.
+*/
+class LinearModel : public Model {
+    public:
+        LinearModel() {
+            kind = MODEL_LINEAR;
+        }
+
+        void predict_proba_scaled(const double* features, double* proba) const override {
+            uint32_t num_rows = (uint32_t)intercepts.size();
+            std::vector<double> decisions(num_rows);
+
+            decision_values(features, decisions.data());
+
+            if (num_rows == 1) {
+                proba[1] = 1.0 / (1.0 + std::exp(-decisions[0]));
+                proba[0] = 1.0 - proba[1];
+            } else {
+                std::copy(decisions.begin(), decisions.end(), proba);
+                softmax(proba, num_classes);
+            }
+        }
+
+        /* The decision values; a binary model's single one is split as -d (class 0) and d (class 1). */
+        void decision_scaled(const double* features, double* scores) const override {
+            if (intercepts.size() == 1) {
+                decision_values(features, scores + 1);
+                scores[0] = -scores[1];
+                return;
+            }
+            decision_values(features, scores);
+        }
+
+        /* One decision value per row of coefficients. */
+        void decision_values(const double* features, double* decisions) const {
+            for (uint32_t r = 0; r < (uint32_t)intercepts.size(); r++) {
+                const double* row = coefficients.data() + (size_t)r * num_features;
+                double decision = intercepts[r];
+
+                for (uint32_t f = 0; f < num_features; f++) {
+                    decision += row[f] * features[f];
+                }
+                decisions[r] = decision;
+            }
+        }
+
+        bool load_parameters(ModelReader& reader) override {
+            uint32_t num_rows = (num_classes == 2) ? 1 : num_classes;
+
+            reader.read_vector(coefficients, (size_t)num_rows * num_features);
+            reader.read_vector(intercepts, num_rows);
+
+            return reader.ok;
+        }
+
+        void save_parameters(ModelWriter& writer) const override {
+            writer.write_vector(coefficients);
+            writer.write_vector(intercepts);
+        }
+
+        /* Features with a nonzero weight in any row. */
+        void mark_used_features(std::vector<bool>& used) const override {
+            for (size_t i = 0; i < coefficients.size(); i++) {
+                if (coefficients[i] != 0.0) used[i % num_features] = true;
+            }
+        }
+
+        size_t parameter_bytes() const override {
+            return (coefficients.size() + intercepts.size()) * sizeof(double);
+        }
+
+        std::vector<double> coefficients;
+        std::vector<double> intercepts;
+
+    protected:
+        /* w . (x * scale + offset) + b = (w * scale) . x + (b + w . offset). */
+        bool fold_parameters() override {
+            for (uint32_t i = 0; i < num_features; i++) {
+                if (!std::isfinite(scale[i]) || !std::isfinite(offset[i])) return false;
+            }
+
+            for (size_t r = 0; r < intercepts.size(); r++) {
+                double* row = coefficients.data() + r * num_features;
+
+                for (uint32_t f = 0; f < num_features; f++) {
+                    intercepts[r] += row[f] * offset[f];
+                    row[f] *= scale[f];
+                }
+            }
+            return true;
+        }
+};
+
+/*
+    Gaussian Naive Bayes (sklearn's GaussianNB): class priors, per-class feature means and variances.
+    The per-class normalization term is precomputed at load time.
+*/
+class GaussianNB : public Model {
+    public:
+        GaussianNB() {
+            kind = MODEL_GAUSSIAN_NB;
+        }
+
+        void predict_proba_scaled(const double* features, double* proba) const override {
+            joint_log_likelihood(features, proba);
+            softmax(proba, num_classes);
+        }
+
+        /* Log-posteriors. */
+        void decision_scaled(const double* features, double* scores) const override {
+            joint_log_likelihood(features, scores);
+            log_softmax(scores, num_classes);
+        }
+
+        void joint_log_likelihood(const double* features, double* joint) const {
+            for (uint32_t c = 0; c < num_classes; c++) {
+                const double* mean = means.data() + (size_t)c * num_features;
+                const double* variance = variances.data() + (size_t)c * num_features;
+                joint[c] = log_norms[c];
+
+                for (uint32_t f = 0; f < num_features; f++) {
+                    double difference = features[f] - mean[f];
+                    joint[c] -= 0.5 * difference * difference / variance[f];
+                }
+            }
+        }
+
+        bool load_parameters(ModelReader& reader) override {
+            reader.read_vector(priors, num_classes);
+            reader.read_vector(means, (size_t)num_classes * num_features);
+            reader.read_vector(variances, (size_t)num_classes * num_features);
+
+            if (!reader.ok) return false;
+
+            log_norms.assign(num_classes, 0.0);
+            for (uint32_t c = 0; c < num_classes; c++) {
+                log_norms[c] = std::log(priors[c]);
+
+                for (uint32_t f = 0; f < num_features; f++) {
+                    double variance = variances[(size_t)c * num_features + f];
+                    if (!(variance > 0)) return false;
+
+                    log_norms[c] -= 0.5 * std::log(2.0 * 3.141592653589793 * variance);
+                }
+            }
+            return true;
+        }
+
+        void save_parameters(ModelWriter& writer) const override {
+            writer.write_vector(priors);
+            writer.write_vector(means);
+            writer.write_vector(variances);
+        }
+
+        /* A feature with the same mean and variance in every class adds the same term to every class. */
+        void mark_used_features(std::vector<bool>& used) const override {
+            for (uint32_t c = 1; c < num_classes; c++) {
+                for (uint32_t f = 0; f < num_features; f++) {
+                    size_t index = (size_t)c * num_features + f;
+
+                    if (means[index] != means[f] || variances[index] != variances[f]) used[f] = true;
+                }
+            }
+        }
+
+        size_t parameter_bytes() const override {
+            return (means.size() + variances.size() + log_norms.size()) * sizeof(double);
+        }
+
+        std::vector<double> priors;
+        std::vector<double> means;
+        std::vector<double> variances;
+
+    protected:
+        /*
+            (x * scale + offset - mean)^2 / variance = (x - (mean - offset) / scale)^2 / (variance / scale^2).
+            log_norms keep the scaled variances', so the joint log-likelihoods don't change.
+        */
+        bool fold_parameters() override {
+            for (uint32_t i = 0; i < num_features; i++) {
+                if (!(scale[i] != 0) || !std::isfinite(scale[i]) || !std::isfinite(offset[i])) return false;
+            }
+
+            for (uint32_t c = 0; c < num_classes; c++) {
+                for (uint32_t f = 0; f < num_features; f++) {
+                    size_t index = (size_t)c * num_features + f;
+
+                    means[index] = (means[index] - offset[f]) / scale[f];
+                    variances[index] /= scale[f] * scale[f];
+                }
+            }
+            return true;
+        }
+
+    private:
+        friend class QuantizedGaussianNB;
+
+        std::vector<double> log_norms;
+};
+
+/*
+    Bernoulli Naive Bayes (sklearn's BernoulliNB): features are binarized (x > binarize)
+    and scored against the per-class log-probabilities of each feature being set.
+*/
+class BernoulliNB : public Model {
+    public:
+        BernoulliNB() {
+            kind = MODEL_BERNOULLI_NB;
+        }
+
+        void predict_proba_scaled(const double* features, double* proba) const override {
+            joint_log_likelihood(features, proba);
+            softmax(proba, num_classes);
+        }
+
+        /* Log-posteriors. */
+        void decision_scaled(const double* features, double* scores) const override {
+            joint_log_likelihood(features, scores);
+            log_softmax(scores, num_classes);
+        }
+
+        void joint_log_likelihood(const double* features, double* joint) const {
+            for (uint32_t c = 0; c < num_classes; c++) {
+                const double* delta = deltas.data() + (size_t)c * num_features;
+                joint[c] = biases[c];
+
+                for (uint32_t f = 0; f < num_features; f++) {
+                    double value = has_binarize ? (features[f] > thresholds[f] ? 1.0 : 0.0) : features[f];
+                    joint[c] += delta[f] * value;
+                }
+            }
+        }
+
+        bool load_parameters(ModelReader& reader) override {
+            has_binarize = reader.read<uint32_t>() != 0;
+            binarize = reader.read<double>();
+            reader.read_vector(class_log_priors, num_classes);
+            reader.read_vector(feature_log_probs, (size_t)num_classes * num_features);
+
+            if (!reader.ok) return false;
+
+            /* Per feature, as folding the scaler gives every feature its own. */
+            thresholds.assign(num_features, binarize);
+
+            /* jll = x . (log p - log(1 - p)) + log prior + sum(log(1 - p)). */
+            deltas.resize(feature_log_probs.size());
+            biases.assign(class_log_priors.begin(), class_log_priors.end());
+
+            for (uint32_t c = 0; c < num_classes; c++) {
+                for (uint32_t f = 0; f < num_features; f++) {
+                    size_t index = (size_t)c * num_features + f;
+                    double negative = std::log(1.0 - std::exp(feature_log_probs[index]));
+
+                    deltas[index] = feature_log_probs[index] - negative;
+                    biases[c] += negative;
+                }
+            }
+            return true;
+        }
+
+        void save_parameters(ModelWriter& writer) const override {
+            writer.write((uint32_t)(has_binarize ? 1 : 0));
+            writer.write(binarize);
+            writer.write_vector(class_log_priors);
+            writer.write_vector(feature_log_probs);
+        }
+
+        /* Same reasoning as GaussianNB's: a feature with the same probabilities in every class doesn't matter. */
+        void mark_used_features(std::vector<bool>& used) const override {
+            for (uint32_t c = 1; c < num_classes; c++) {
+                for (uint32_t f = 0; f < num_features; f++) {
+                    if (feature_log_probs[(size_t)c * num_features + f] != feature_log_probs[f]) used[f] = true;
+                }
+            }
+        }
+
+        size_t parameter_bytes() const override {
+            return (deltas.size() + biases.size()) * sizeof(double);
+        }
+
+        bool has_binarize = true;
+        double binarize = 0;
+        std::vector<double> class_log_priors;
+        std::vector<double> feature_log_probs;
+
+    protected:
+        /*
+            Binarized, x * scale + offset > binarize becomes x > T, T found as for the trees' splits.
+            Otherwise, as for the linear models: delta . (x * scale + offset) = (delta * scale) . x + delta . offset.
+        */
+        bool fold_parameters() override {
+            if (has_binarize) {
+                if (!positive_scale()) return false;
+
+                std::vector<double> folded_thresholds(num_features);
+
+                for (uint32_t f = 0; f < num_features; f++) {
+                    double factor = scale[f], shift = offset[f], threshold = binarize;
+                    auto unset = [factor, shift, threshold](double x) { return !(x * factor + shift > threshold); };
+
+                    if (!last_passing(unset, (threshold - shift) / factor, folded_thresholds[f])) return false;
+                }
+
+                thresholds.swap(folded_thresholds);
+                return true;
+            }
+
+            for (uint32_t i = 0; i < num_features; i++) {
+                if (!std::isfinite(scale[i]) || !std::isfinite(offset[i])) return false;
+            }
+
+            for (uint32_t c = 0; c < num_classes; c++) {
+                for (uint32_t f = 0; f < num_features; f++) {
+                    size_t index = (size_t)c * num_features + f;
+
+                    biases[c] += deltas[index] * offset[f];
+                    deltas[index] *= scale[f];
+                }
+            }
+            return true;
+        }
+
+    private:
+        friend class QuantizedBernoulliNB;
+
+        std::vector<double> deltas;
+        std::vector<double> biases;
+        std::vector<double> thresholds;
+};
+
+/*
+    Multi-layer perceptron (sklearn's MLPClassifier): dense layers with ReLU, tanh, logistic or
+    identity activations, then an output layer with a single logistic unit (binary models) or a
+    softmax. Each layer is stored as its number of outputs, its activation, one row of weights per
+    output and the biases; its inputs are the previous layer's outputs (the features, for the first).
+
+    The double precision parameters are what save_model() writes; inference runs in single
+    precision, one GEMM per layer over a batch of flows (see ml_gemm.h).
+*/
+class MLPModel : public Model {
+    public:
+        MLPModel() {
+            kind = MODEL_MLP;
+        }
+
+        struct Layer {
+            uint32_t inputs;
+            uint32_t outputs;
+            uint32_t activation;
+            std::vector<double> weights;
+            std::vector<double> biases;
+        };
+
+        void predict_proba_scaled(const double* features, double* proba) const override {
+            forward(&features, 1, false, proba);
+        }
+
+        /* Whole batches go through the GEMMs, the scaler applied on the way in. */
+        void predict_proba_batch(const double* const* rows, size_t count, double* proba) const override {
+            forward(rows, count, true, proba);
+        }
+
+        bool load_parameters(ModelReader& reader) override {
+            uint32_t num_layers = reader.read<uint32_t>();
+            uint32_t inputs = num_features;
+
+            if (!reader.ok || num_layers == 0 || num_layers > max_layers) return false;
+
+            layers.resize(num_layers);
+
+            for (uint32_t l = 0; l < num_layers; l++) {
+                Layer& layer = layers[l];
+                bool output = (l + 1 == num_layers);
+
+                layer.inputs = inputs;
+                layer.outputs = reader.read<uint32_t>();
+                layer.activation = reader.read<uint32_t>();
+
+                if (!reader.ok || layer.outputs == 0 || layer.outputs > max_outputs) return false;
+
+                /* The output layer matches the classes, and only it has a softmax. */
+                if (output && layer.outputs != ((num_classes == 2) ? 1 : num_classes)) return false;
+                if (output && layer.activation != ((num_classes == 2) ? ACTIVATION_LOGISTIC : ACTIVATION_SOFTMAX)) return false;
+                if (!output && layer.activation > ACTIVATION_LOGISTIC) return false;
+
+                reader.read_vector(layer.weights, (size_t)layer.outputs * layer.inputs);
+                reader.read_vector(layer.biases, layer.outputs);
+                inputs = layer.outputs;
+            }
+
+            if (!reader.ok) return false;
+
+            pack();
+            return true;
+        }
+
+        void save_parameters(ModelWriter& writer) const override {
+            writer.write<uint32_t>((uint32_t)layers.size());
+
+            for (const Layer& layer : layers) {
+                writer.write<uint32_t>(layer.outputs);
+                writer.write<uint32_t>(layer.activation);
+                writer.write_vector(layer.weights);
+                writer.write_vector(layer.biases);
+            }
+        }
+
+        /* Features with a nonzero weight into any unit of the first layer. */
+        void mark_used_features(std::vector<bool>& used) const override {
+            const Layer& first = layers.front();
+
+            for (size_t i = 0; i < first.weights.size(); i++) {
+                if (first.weights[i] != 0.0) used[i % num_features] = true;
+            }
+        }
+
+        size_t parameter_bytes() const override {
+            size_t bytes = 0;
+            for (const PackedLayer& layer : packed) bytes += layer.bytes();
+            return bytes;
+        }
+
+        /* Class probabilities from the output layer's values (sklearn's out_activation_). */
+        static void output_proba(const float* values, uint32_t num_classes, double* proba) {
+            if (num_classes == 2) {
+                proba[1] = 1.0 / (1.0 + std::exp(-(double)values[0]));
+                proba[0] = 1.0 - proba[1];
+                return;
+            }
+
+            std::copy(values, values + num_classes, proba);
+            softmax(proba, num_classes);
+        }
+
+        std::vector<Layer> layers;
+
+        /* Flows per pass through the layers, which bounds the activation buffers. */
+        static const size_t batch_rows = 256;
+
+    protected:
+        /* As for the linear models, on the first layer: w . (x * scale + offset) + b = (w * scale) . x + (b + w . offset). */
+        bool fold_parameters() override {
+            for (uint32_t i = 0; i < num_features; i++) {
+                if (!std::isfinite(scale[i]) || !std::isfinite(offset[i])) return false;
+            }
+
+            Layer& first = layers.front();
+
+            for (uint32_t j = 0; j < first.outputs; j++) {
+                double* row = first.weights.data() + (size_t)j * num_features;
+
+                for (uint32_t f = 0; f < num_features; f++) {
+                    first.biases[j] += row[f] * offset[f];
+                    row[f] *= scale[f];
+                }
+            }
+
+            pack();
+            return true;
+        }
+
+    private:
+        static const uint32_t max_layers = 64;
+        static const uint32_t max_outputs = 4096;
+
+        void pack() {
+            packed.resize(layers.size());
+
+            for (size_t l = 0; l < layers.size(); l++) {
+                const Layer& layer = layers[l];
+
+                /* The output activation is applied in double precision, by output_proba(). */
+                uint32_t activation = (l + 1 == layers.size()) ? (uint32_t)ACTIVATION_IDENTITY : layer.activation;
+                packed[l].pack(layer.weights.data(), layer.biases.data(), layer.inputs, layer.outputs, activation);
+            }
+        }
+
+        /* Runs "count" rows through the layers, batch_rows at a time (scaling them first with "apply_scaler"). */
+        void forward(const double* const* rows, size_t count, bool apply_scaler, double* proba) const {
+            size_t width = num_features;
+            for (const PackedLayer& layer : packed) width = std::max(width, layer.padded_outputs());
+
+            size_t block = (count < batch_rows) ? count : batch_rows;
+            std::vector<float> input(block * width), output(block * width);
+            FlushDenormals flush;
+
+            for (size_t first = 0; first < count; first += block) {
+                size_t rows_here = std::min(block, count - first);
+
+                for (size_t i = 0; i < rows_here; i++) {
+                    const double* row = rows[first + i];
+                    float* values = input.data() + i * num_features;
+
+                    for (uint32_t f = 0; f < num_features; f++) {
+                        values[f] = (float)((apply_scaler && !scale.empty()) ? row[f] * scale[f] + offset[f] : row[f]);
+                    }
+                }
+
+                size_t ldx = num_features;
+
+                for (const PackedLayer& layer : packed) {
+                    gemm_layer(layer, input.data(), ldx, rows_here, output.data(), layer.padded_outputs());
+
+                    input.swap(output);
+                    ldx = layer.padded_outputs();
+                }
+
+                for (size_t i = 0; i < rows_here; i++) {
+                    output_proba(input.data() + i * ldx, num_classes, proba + (first + i) * num_classes);
+                }
+            }
+        }
+
+        std::vector<PackedLayer> packed;
+};
+
+/* Creates an empty engine for a model kind. */
+inline Model* create_model(uint32_t kind) {
+    switch (kind) {
+        case MODEL_TREES: return new TreeEnsemble();
+        case MODEL_ADABOOST_SAMME: return new TreeEnsemble(MODEL_ADABOOST_SAMME);
+        case MODEL_ADABOOST_SAMME_R: return new TreeEnsemble(MODEL_ADABOOST_SAMME_R);
+        case MODEL_BOOSTED_TREES: return new TreeEnsemble(MODEL_BOOSTED_TREES);
+        case MODEL_LINEAR: return new LinearModel();
+        case MODEL_GAUSSIAN_NB: return new GaussianNB();
+        case MODEL_BERNOULLI_NB: return new BernoulliNB();
+        case MODEL_MLP: return new MLPModel();
+        default: return nullptr;
+    }
+}
+
+/* Probability of anything but class 0 (Normal), the score used by the cascade and the thresholds. */
+inline double attack_probability(const Model& model, const double* features) {
+    std::vector<double> proba(model.num_classes);
+
+    model.predict_proba(features, proba.data());
+    return 1.0 - proba[0];
+}
+
+/*
+    Loads a .mlm file. Returns nullptr (and sets "error") on failure.
+    With "fold", the scaler is folded into the parameters (see Model::fold_scaler()).
+*/
+inline Model* load_model(const std::string& path, std::string& error, bool fold = true) {
+    FILE* file = fopen(path.c_str(), "rb");
+
+    if (!file) {
+        error = "couldn't open " + path;
+        return nullptr;
+    }
+
+    ModelReader reader(file);
+    char magic[4];
+
+    for (int i = 0; i < 4; i++) magic[i] = reader.read<char>();
+    uint32_t version = reader.read<uint32_t>();
+    uint32_t kind = reader.read<uint32_t>();
+    uint32_t num_features = reader.read<uint32_t>();
+    uint32_t num_classes = reader.read<uint32_t>();
+
+    if (!reader.ok || memcmp(magic, ml_model_magic, 4) != 0 || version != ml_model_version) {
+        fclose(file);
+        error = path + " isn't a version " + std::to_string(ml_model_version) + " .mlm file";
+        return nullptr;
+    }
+
+    std::unique_ptr<Model> model(create_model(kind));
+
+    if (!model || num_features == 0 || num_classes < 2 || num_classes > 256) {
+        fclose(file);
+        error = path + " has an unsupported model kind or shape";
+        return nullptr;
+    }
+
+    model->num_features = num_features;
+    model->num_classes = num_classes;
+
+    if (reader.read<uint32_t>()) {
+        reader.read_vector(model->scale, num_features);
+        reader.read_vector(model->offset, num_features);
+    }
+
+    bool ok = reader.ok && model->load_parameters(reader);
+    fclose(file);
+
+    if (!ok) {
+        error = path + " is truncated or corrupted";
+        return nullptr;
+    }
+
+    if (fold) model->fold_scaler();
+    return model.release();
+}
+
+/*
+    RCU-style holder of the active model (or of any other object read on the hot path, e.g.
+    the compiled model routes).
+    Readers pin the current object with a Reader (two atomic operations, never a lock), so
+    a batch that started on a model finishes on it. replace() publishes a fully built object
+    with a single pointer swap and frees the previous one only after every reader that
+    could still see it has left (two counter generations, as in userspace RCU).
+*/
+template <typename T>
+class Rcu {
+    public:
+        class Reader {
+            public:
+                explicit Reader(Rcu& rcu) : rcu(rcu) {
+                    slot = rcu.generation.load() & 1;
+                    rcu.readers[slot].fetch_add(1);
+                    object = rcu.current.load();
+                }
+
+                ~Reader() {
+                    rcu.readers[slot].fetch_sub(1);
+                }
+
+                const T* get() const {
+                    return object;
+                }
+
+                const T* operator->() const {
+                    return object;
+                }
+
+                explicit operator bool() const {
+                    return object != nullptr;
+                }
+
+            private:
+                Reader(const Reader&) = delete;
+                Reader& operator=(const Reader&) = delete;
+
+                Rcu& rcu;
+                unsigned slot;
+                const T* object;
+        };
+
+        Rcu() {
+            readers[0] = 0;
+            readers[1] = 0;
+        }
+
+        ~Rcu() {
+            delete current.load();
+        }
+
+        /* Swaps "object" in (it may be null) and deletes the previous one once it's unreachable. */
+        void replace(T* object) {
+            std::lock_guard<std::mutex> lock(writer_mutex);
+
+            T* previous = current.exchange(object);
+            synchronize();
+            delete previous;
+        }
+
+        bool empty() const {
+            return current.load() == nullptr;
+        }
+
+    private:
+        /* Waits until the readers of both generations that existed before the swap are gone. */
+        void synchronize() {
+            for (int phase = 0; phase < 2; phase++) {
+                unsigned slot = generation.fetch_add(1) & 1;
+
+                while (readers[slot].load() != 0) {
+                    std::this_thread::yield();
+                }
+            }
+        }
+
+        std::atomic<T*> current { nullptr };
+        std::atomic<unsigned> generation { 0 };
+        std::atomic<unsigned> readers[2];
+        std::mutex writer_mutex;
+};
+
+typedef Rcu<Model> ModelRcu;
+
+/* Writes a .mlm file. */
+inline bool save_model(const Model& model, const std::string& path) {
+    if (model.folded) return false;
+
+    FILE* file = fopen(path.c_str(), "wb");
+
+    if (!file) return false;
+
+    ModelWriter writer(file);
+
+    for (int i = 0; i < 4; i++) writer.write(ml_model_magic[i]);
+    writer.write(ml_model_version);
+    writer.write((uint32_t)model.kind);
+    writer.write(model.num_features);
+    writer.write(model.num_classes);
+
+    writer.write((uint32_t)(model.scale.empty() ? 0 : 1));
+    if (!model.scale.empty()) {
+        writer.write_vector(model.scale);
+        writer.write_vector(model.offset);
+    }
+
+    model.save_parameters(writer);
+
+    bool ok = writer.ok;
+    ok = (fclose(file) == 0) && ok;
+    return ok;
+}
+
+#endif
@@ -0,0 +1,227 @@
+#ifndef ML_NPY_H
+#define ML_NPY_H
+
+/*
+    Minimal reader/writer for numpy's .npy format (version 1.0).
+    Used by the native tools to emit matrices that numpy opens with np.load(..., mmap_mode='r')
+    and to map them back without copying.
+*/
+
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
+#include <sstream>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+template <typename T> inline const char* npy_descr();
+template <> inline const char* npy_descr<float>() { return "<f4"; }
+template <> inline const char* npy_descr<double>() { return "<f8"; }
+template <> inline const char* npy_descr<uint8_t>() { return "|u1"; }
+template <> inline const char* npy_descr<int32_t>() { return "<i4"; }
+
+/*
+    Streams rows into a .npy file.
+    The number of rows isn't known up front, so the header is written with a fixed
+    size (padded with spaces) and rewritten with the final shape on close().
+*/
+class NpyWriter {
+    public:
+        /* A num_columns of 0 means an one-dimensional array. */
+        bool open(const std::string& path, const char* descr, uint64_t num_columns) {
+            file = fopen(path.c_str(), "wb");
+            if (!file) return false;
+
+            this->descr = descr;
+            this->num_columns = num_columns;
+            this->num_rows = 0;
+            this->item_size = (descr[2] - '0');
+
+            return write_header();
+        }
+
+        bool append(const void* data, uint64_t rows) {
+            uint64_t items = rows * (num_columns ? num_columns : 1);
+
+            if (items && fwrite(data, item_size, items, file) != items) return false;
+
+            num_rows += rows;
+            return true;
+        }
+
+        bool close() {
+            if (!file) return false;
+
+            bool ok = (fseek(file, 0, SEEK_SET) == 0) && write_header();
+            ok = (fclose(file) == 0) && ok;
+            file = nullptr;
+
+            return ok;
+        }
+
+        uint64_t rows() const {
+            return num_rows;
+        }
+
+        ~NpyWriter() {
+            if (file) fclose(file);
+        }
+
+    private:
+        /* Magic (6) + version (2) + header length (2) + header, padded to a multiple of 64. */
+        static const size_t header_size = 128;
+
+        bool write_header() {
+            std::ostringstream header;
+
+            header << "{'descr': '" << descr << "', 'fortran_order': False, 'shape': (" << num_rows;
+            if (num_columns)
+                header << ", " << num_columns << "), }";
+            else
+                header << ",), }";
+
+            std::string dict = header.str();
+            dict.resize(header_size - 10 - 1, ' ');
+            dict += '\n';
+
+            const char preamble[8] = { '\x93', 'N', 'U', 'M', 'P', 'Y', 1, 0 };
+            uint16_t length = (uint16_t)dict.size();
+            unsigned char length_le[2] = { (unsigned char)(length & 0xff), (unsigned char)(length >> 8) };
+
+            return fwrite(preamble, 1, 8, file) == 8 &&
+                   fwrite(length_le, 1, 2, file) == 2 &&
+                   fwrite(dict.data(), 1, dict.size(), file) == dict.size();
+        }
+
+        FILE* file = nullptr;
+        const char* descr = nullptr;
+        uint64_t num_columns = 0;
+        uint64_t num_rows = 0;
+        size_t item_size = 0;
+};
+
+/* Read-only, memory-mapped view of a C-ordered .npy file. */
+class NpyArray {
+    public:
+        bool open(const std::string& path, std::string& error) {
+            int fd = ::open(path.c_str(), O_RDONLY);
+
+            if (fd < 0) {
+                error = "couldn't open " + path;
+                return false;
+            }
+
+            struct stat st;
+            if (fstat(fd, &st) < 0 || st.st_size < 10) {
+                ::close(fd);
+                error = path + " is too short";
+                return false;
+            }
+
+            void* addr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            ::close(fd);
+
+            if (addr == MAP_FAILED) {
+                error = "couldn't map " + path;
+                return false;
+            }
+
+            map = (const char*)addr;
+            map_size = st.st_size;
+
+            const unsigned char* bytes = (const unsigned char*)map;
+            if (bytes[0] != 0x93 || std::string(map + 1, 5) != "NUMPY" || bytes[6] != 1) {
+                error = path + " isn't a version 1.0 .npy file";
+                return false;
+            }
+
+            size_t header_length = bytes[8] | (bytes[9] << 8);
+            if (10 + header_length > map_size) {
+                error = path + " has a truncated header";
+                return false;
+            }
+
+            std::string header(map + 10, header_length);
+
+            descr = dict_value(header, "descr");
+            if (descr.size() >= 2) descr = descr.substr(1, descr.size() - 2);
+
+            if (dict_value(header, "fortran_order") != "False") {
+                error = path + " isn't C-ordered";
+                return false;
+            }
+
+            /* shape: "(rows, columns)" or "(rows,)". */
+            std::string shape_value = dict_value(header, "shape");
+            const char* p = shape_value.c_str();
+            while (*p) {
+                if (*p >= '0' && *p <= '9') {
+                    char* next;
+                    shape.push_back(strtoull(p, &next, 10));
+                    p = next;
+                } else {
+                    p++;
+                }
+            }
+
+            size_t items = 1;
+            for (uint64_t dimension : shape) items *= dimension;
+
+            data_offset = 10 + header_length;
+            if (descr.size() < 3 || shape.empty() || data_offset + items * item_size() > map_size) {
+                error = path + " has an unexpected dtype/shape or is truncated";
+                return false;
+            }
+
+            return true;
+        }
+
+        uint64_t rows() const {
+            return shape[0];
+        }
+
+        uint64_t columns() const {
+            return (shape.size() > 1) ? shape[1] : 1;
+        }
+
+        size_t item_size() const {
+            return (size_t)(descr[2] - '0');
+        }
+
+        template <typename T>
+        const T* data() const {
+            return (const T*)(map + data_offset);
+        }
+
+        ~NpyArray() {
+            if (map) munmap((void*)map, map_size);
+        }
+
+        std::string descr;
+        std::vector<uint64_t> shape;
+
+    private:
+        /* Returns the raw text of a key in the header's python dict. */
+        static std::string dict_value(const std::string& header, const std::string& key) {
+            size_t start = header.find("'" + key + "'");
+            if (start == std::string::npos) return "";
+
+            start = header.find(':', start);
+            if (start == std::string::npos) return "";
+            start = header.find_first_not_of(' ', start + 1);
+
+            size_t end = (header[start] == '(') ? header.find(')', start) + 1 : header.find(',', start);
+            return header.substr(start, end - start);
+        }
+
+        const char* map = nullptr;
+        size_t map_size = 0;
+        size_t data_offset = 0;
+};
+
+#endif
@@ -0,0 +1,137 @@
+#ifndef ML_OVERLOAD_H
+#define ML_OVERLOAD_H
+
+/*
+    Overload controller.
+    When packets come in faster than the inspector handles them, doing the full work for
+    every one of them only makes Snort drop packets at the DAQ, blindly. Instead, the
+    controller watches the mean packet processing time and the classification backlog
+    (timeouted connections waiting for a verdict) and, under pressure, sheds work one
+    level at a time:
+        - SAMPLING: only a fraction of the new flows become connections. The decision is a
+          hash of the flow key (the same for both directions), so a flow is either tracked
+          from its first packet or not at all, never half of it;
+        - REDUCED: on top of that, the optional flow state (flags, bulk, subflows, active/idle)
+          isn't maintained anymore, whatever the models read (see update_feature_profile());
+        - CHEAP: on top of that, every flow is scored by a single cheap model.
+    The level moves at most one step per interval, up when the budget is exceeded and down
+    once both signals are back under half of it, so it doesn't flap around the threshold.
+*/
+
+#include <atomic>
+#include <cstdint>
+
+#include "ml_admission.h"
+
+enum OverloadLevel : uint32_t {
+    OVERLOAD_NONE = 0,
+    OVERLOAD_SAMPLING = 1,
+    OVERLOAD_REDUCED = 2,
+    OVERLOAD_CHEAP = 3
+};
+
+class OverloadController {
+    public:
+        /* Level and shedding counters, read by the inspector's pegs. */
+        struct Stats {
+            std::atomic<uint64_t> escalations { 0 };
+            std::atomic<uint64_t> packets { 0 };
+            std::atomic<uint64_t> shed_packets { 0 };
+            std::atomic<uint64_t> cheap_flows { 0 };
+        };
+
+        /*
+            Sets the budget: "latency" nanoseconds of mean packet processing time and "queue"
+            connections waiting for a verdict, checked every "interval" nanoseconds. Under
+            sampling, "sampling" of the new flows (0 to 1) are kept.
+        */
+        void configure(uint64_t latency, uint64_t queue, double sampling, int64_t interval) {
+            latency_budget = latency;
+            queue_limit = queue;
+            check_interval = interval;
+
+            /* A flow is kept when its (mixed) hash falls in the first "sampling" of the 64-bit range. */
+            keep_threshold = (sampling >= 1.0) ? UINT64_MAX : (uint64_t)(sampling * 18446744073709551616.0);
+
+            current_level = OVERLOAD_NONE;
+            next_check = 0;
+        }
+
+        uint32_t level() const {
+            return current_level.load(std::memory_order_relaxed);
+        }
+
+        /* Whether a new flow, given the hash of its key, is tracked at the current level. */
+        bool sampled(uint64_t flow_hash) const {
+            return level() < OVERLOAD_SAMPLING || mix64(flow_hash) < keep_threshold;
+        }
+
+        /* Counts a packet of a flow that wasn't sampled. */
+        void shed() {
+            stats.shed_packets++;
+        }
+
+        /*
+            Records a packet's processing time ("now" is the steady clock, in nanoseconds).
+            Once per interval, one of the packet threads compares the interval's mean with the
+            budget and moves the level by one step. Returns true when it changed.
+        */
+        bool observe(uint64_t packet_nsecs, int64_t now, uint64_t queue_depth) {
+            interval_nsecs.fetch_add(packet_nsecs, std::memory_order_relaxed);
+            interval_packets.fetch_add(1, std::memory_order_relaxed);
+            stats.packets++;
+
+            int64_t check = next_check.load(std::memory_order_relaxed);
+            if (now < check) return false;
+
+            /* Only the thread moving next_check forward checks the budget. */
+            if (!next_check.compare_exchange_strong(check, now + check_interval)) return false;
+
+            uint64_t nsecs = interval_nsecs.exchange(0);
+            uint64_t packets = interval_packets.exchange(0);
+
+            /* The first packet only starts the first interval. */
+            if (check == 0 || packets == 0) return false;
+
+            uint64_t mean = nsecs / packets;
+            uint32_t current = level();
+
+            if ((mean > latency_budget || queue_depth > queue_limit) && current < OVERLOAD_CHEAP) {
+                current_level = current + 1;
+                stats.escalations++;
+                return true;
+            }
+
+            if (mean <= latency_budget / 2 && queue_depth <= queue_limit / 2 && current > OVERLOAD_NONE) {
+                current_level = current - 1;
+                return true;
+            }
+            return false;
+        }
+
+        /* Share of the packets seen that were shed, in per mille. */
+        uint64_t shed_permille() const {
+            uint64_t packets = stats.packets;
+            return packets ? stats.shed_packets * 1000 / packets : 0;
+        }
+
+        static const char* name(uint32_t level) {
+            static const char* const names[] = { "none", "sampling", "reduced features", "cheap model" };
+            return (level <= OVERLOAD_CHEAP) ? names[level] : "unknown";
+        }
+
+        Stats stats;
+
+    private:
+        uint64_t latency_budget = 50000;
+        uint64_t queue_limit = 65536;
+        uint64_t keep_threshold = UINT64_MAX;
+        int64_t check_interval = 1000000000;
+
+        std::atomic<uint32_t> current_level { OVERLOAD_NONE };
+        std::atomic<int64_t> next_check { 0 };
+        std::atomic<uint64_t> interval_nsecs { 0 };
+        std::atomic<uint64_t> interval_packets { 0 };
+};
+
+#endif
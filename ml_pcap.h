@@ -0,0 +1,177 @@
+#ifndef ML_PCAP_H
+#define ML_PCAP_H
+
+/*
+    Minimal reader for the classic pcap format (microsecond and nanosecond timestamps,
+    either byte order), used by the sensor to replay captures on packet time.
+    The file is mapped, so records are handed out without copying.
+    The writer (microseconds, Ethernet) saves ml_traffic's synthetic packets.
+*/
+
+#include <string>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "ml_decode.h"
+
+/* The link types the sensor decodes. */
+enum PcapLinkType {
+    LINKTYPE_ETHERNET = 1,
+    LINKTYPE_RAW = 101,
+    LINKTYPE_LINUX_SLL = 113,
+    LINKTYPE_IPV4 = 228,
+    LINKTYPE_IPV6 = 229
+};
+
+struct PcapRecord {
+    /* Capture time, in microseconds. */
+    int64_t timestamp;
+
+    /* Length on the wire and captured bytes. */
+    uint32_t pktlen;
+    uint32_t caplen;
+    const uint8_t* data;
+};
+
+class PcapReader {
+    public:
+        bool open(const std::string& path, std::string& error) {
+            int fd = ::open(path.c_str(), O_RDONLY);
+            if (fd < 0) {
+                error = "couldn't open " + path;
+                return false;
+            }
+
+            struct stat st;
+            if (fstat(fd, &st) < 0 || st.st_size < 24) {
+                ::close(fd);
+                error = path + " isn't a pcap file";
+                return false;
+            }
+
+            size = (size_t)st.st_size;
+            void* addr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            ::close(fd);
+
+            if (addr == MAP_FAILED) {
+                error = "couldn't map " + path;
+                return false;
+            }
+
+            base = (const uint8_t*)addr;
+            madvise(addr, size, MADV_SEQUENTIAL);
+
+            uint32_t magic;
+            memcpy(&magic, base, 4);
+
+            switch (magic) {
+                case 0xa1b2c3d4: swapped = false; nanoseconds = false; break;
+                case 0xa1b23c4d: swapped = false; nanoseconds = true; break;
+                case 0xd4c3b2a1: swapped = true; nanoseconds = false; break;
+                case 0x4d3cb2a1: swapped = true; nanoseconds = true; break;
+                default:
+                    error = path + " isn't a pcap file (pcapng isn't supported)";
+                    return false;
+            }
+
+            link_type = read32(base + 20) & 0x0fffffff;
+            offset = 24;
+            return true;
+        }
+
+        /* False at the end of the file (or at a truncated record). */
+        bool next(PcapRecord& record) {
+            if (offset + 16 > size) return false;
+
+            const uint8_t* header = base + offset;
+            uint32_t seconds = read32(header);
+            uint32_t fraction = read32(header + 4);
+
+            record.caplen = read32(header + 8);
+            record.pktlen = read32(header + 12);
+            record.timestamp = (int64_t)seconds * 1000000 + (nanoseconds ? fraction / 1000 : fraction);
+
+            if (offset + 16 + record.caplen > size) return false;
+
+            record.data = header + 16;
+            offset += 16 + record.caplen;
+            return true;
+        }
+
+        uint32_t linktype() const {
+            return link_type;
+        }
+
+        ~PcapReader() {
+            if (base) munmap((void*)base, size);
+        }
+
+    private:
+        uint32_t read32(const uint8_t* data) const {
+            uint32_t value;
+            memcpy(&value, data, 4);
+            return swapped ? __builtin_bswap32(value) : value;
+        }
+
+        const uint8_t* base = nullptr;
+        size_t size = 0;
+        size_t offset = 0;
+        bool swapped = false;
+        bool nanoseconds = false;
+        uint32_t link_type = 0;
+};
+
+class PcapWriter {
+    public:
+        bool open(const std::string& path, std::string& error) {
+            file = fopen(path.c_str(), "wb");
+            if (!file) {
+                error = "couldn't create " + path;
+                return false;
+            }
+
+            /* Magic, version 2.4, no timezone/accuracy, 64K snaplen, Ethernet (host byte order). */
+            uint32_t header[6] = { 0xa1b2c3d4, 0x00040002, 0, 0, 65535, LINKTYPE_ETHERNET };
+            return write(header, sizeof(header), error);
+        }
+
+        /* Appends a frame captured at "timestamp" (in microseconds). */
+        bool write(int64_t timestamp, const uint8_t* data, uint32_t size, std::string& error) {
+            uint32_t header[4] = { (uint32_t)(timestamp / 1000000), (uint32_t)(timestamp % 1000000), size, size };
+            return write(header, sizeof(header), error) && write(data, size, error);
+        }
+
+        ~PcapWriter() {
+            if (file) fclose(file);
+        }
+
+    private:
+        bool write(const void* data, size_t size, std::string& error) {
+            if (fwrite(data, 1, size, file) == size) return true;
+
+            error = "couldn't write the capture";
+            return false;
+        }
+
+        FILE* file = nullptr;
+};
+
+/* Decodes a record according to the file's link type. */
+inline DecodeResult decode_link(uint32_t link_type, const uint8_t* data, uint32_t caplen, DecodedPacket& packet) {
+    switch (link_type) {
+        case LINKTYPE_ETHERNET: return decode_ethernet(data, caplen, packet);
+        case LINKTYPE_RAW:
+        case LINKTYPE_IPV4:
+        case LINKTYPE_IPV6: return decode_ip(data, caplen, packet);
+        case LINKTYPE_LINUX_SLL: return decode_sll(data, caplen, packet);
+        default: return DECODE_NOT_IP;
+    }
+}
+
+#endif
@@ -0,0 +1,225 @@
+#ifndef ML_POOL_H
+#define ML_POOL_H
+
+/*
+    Work-stealing thread pool for the background work (batch scoring, model loads).
+
+    Every worker owns a deque: it pushes and pops its own tasks at the back, and when it
+    runs out it steals from the front of the others' (the oldest, usually largest, work).
+    Tasks submitted from outside the pool are dealt round robin over the workers' deques.
+    A thread waiting for a group of tasks runs that group's tasks itself instead of blocking,
+    so a pool of 0 workers simply runs everything on the caller. It never runs another group's
+    tasks: the waiter may hold something they wait for (e.g. a model load waiting for the
+    readers of the batch being scored), and running one would deadlock it.
+*/
+
+#include <mutex>
+#include <deque>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <algorithm>
+#include <functional>
+#include <condition_variable>
+
+#include <pthread.h>
+
+/* Tasks still pending in a group; TaskPool::wait() returns once it drops to 0. */
+struct TaskGroup {
+    std::atomic<size_t> pending { 0 };
+};
+
+class TaskPool {
+    public:
+        /* Worker i is pinned to cpus[i % cpus.size()] (not pinned if "cpus" is empty). */
+        explicit TaskPool(unsigned num_threads, const std::vector<int>& cpus = std::vector<int>()) {
+            for (unsigned i = 0; i < num_threads; i++) {
+                queues.emplace_back(new WorkerQueue());
+            }
+
+            for (unsigned i = 0; i < num_threads; i++) {
+                threads.push_back(std::thread(&TaskPool::run, this, i));
+
+                if (!cpus.empty()) {
+                    cpu_set_t set;
+                    CPU_ZERO(&set);
+                    CPU_SET(cpus[i % cpus.size()], &set);
+                    pthread_setaffinity_np(threads.back().native_handle(), sizeof(set), &set);
+                }
+            }
+        }
+
+        ~TaskPool() {
+            {
+                std::lock_guard<std::mutex> lock(sleep_mutex);
+                stopping = true;
+            }
+            wakeup.notify_all();
+
+            for (std::thread& thread : threads) {
+                thread.join();
+            }
+        }
+
+        unsigned size() const {
+            return (unsigned)threads.size();
+        }
+
+        void submit(std::function<void()> function, TaskGroup* group = nullptr) {
+            if (group) group->pending++;
+
+            if (queues.empty()) {
+                execute(Task { std::move(function), group });
+                return;
+            }
+
+            /* From a worker, onto its own deque (it'll likely run it itself, with warm caches). */
+            unsigned index = (current_pool == this) ? current_worker : next_queue++ % queues.size();
+
+            {
+                std::lock_guard<std::mutex> lock(queues[index]->mutex);
+                queues[index]->tasks.push_back(Task { std::move(function), group });
+                queued++;
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(sleep_mutex);
+            }
+            wakeup.notify_one();
+        }
+
+        /* Runs pending tasks of "group" until every one of them is done. */
+        void wait(TaskGroup& group) {
+            while (group.pending > 0) {
+                Task task;
+
+                if (take(current_pool == this ? current_worker : 0, task, &group))
+                    execute(task);
+                else
+                    std::this_thread::yield();
+            }
+        }
+
+        /*
+            Calls function(begin, end) over [0, count) in chunks of "grain" items, on the pool
+            and the calling thread, and returns once every chunk is done. Chunks write to their
+            own items, so the results stay in order.
+        */
+        template <typename Function>
+        void parallel_for(size_t count, size_t grain, Function function) {
+            grain = std::max<size_t>(grain, 1);
+
+            if (queues.empty() || count <= grain) {
+                if (count > 0) function((size_t)0, count);
+                return;
+            }
+
+            TaskGroup group;
+            parallel_batches++;
+
+            for (size_t begin = 0; begin < count; begin += grain) {
+                size_t end = std::min(count, begin + grain);
+                submit([&function, begin, end]() { function(begin, end); }, &group);
+            }
+
+            wait(group);
+        }
+
+        /* Counters (tasks run, of which stolen, and batches split over the pool). */
+        std::atomic<uint64_t> tasks_run { 0 };
+        std::atomic<uint64_t> tasks_stolen { 0 };
+        std::atomic<uint64_t> parallel_batches { 0 };
+
+    private:
+        struct Task {
+            std::function<void()> function;
+            TaskGroup* group;
+        };
+
+        struct WorkerQueue {
+            std::mutex mutex;
+            std::deque<Task> tasks;
+        };
+
+        void execute(const Task& task) {
+            task.function();
+            tasks_run++;
+
+            if (task.group) task.group->pending--;
+        }
+
+        /*
+            Pops from the back of queue "index", or steals from the front of another one.
+            With a "group", only that group's tasks are taken (the closest to the back, or front).
+        */
+        bool take(unsigned index, Task& task, const TaskGroup* group = nullptr) {
+            if (queued == 0 || queues.empty()) return false;
+
+            for (size_t i = 0; i < queues.size(); i++) {
+                WorkerQueue& queue = *queues[(index + i) % queues.size()];
+                std::lock_guard<std::mutex> lock(queue.mutex);
+
+                if (queue.tasks.empty()) continue;
+
+                std::deque<Task>::iterator it;
+
+                if (i == 0) {
+                    it = queue.tasks.end();
+                    while (it != queue.tasks.begin() && group && (it - 1)->group != group) --it;
+                    if (it == queue.tasks.begin()) continue;
+                    --it;
+                } else {
+                    it = queue.tasks.begin();
+                    while (it != queue.tasks.end() && group && it->group != group) ++it;
+                    if (it == queue.tasks.end()) continue;
+                    tasks_stolen++;
+                }
+
+                task = std::move(*it);
+                queue.tasks.erase(it);
+
+                queued--;
+                return true;
+            }
+            return false;
+        }
+
+        void run(unsigned index) {
+            current_pool = this;
+            current_worker = index;
+
+            while (true) {
+                Task task;
+
+                if (take(index, task)) {
+                    execute(task);
+                    continue;
+                }
+
+                std::unique_lock<std::mutex> lock(sleep_mutex);
+                wakeup.wait(lock, [this]() { return stopping || queued > 0; });
+
+                if (stopping && queued == 0) return;
+            }
+        }
+
+        std::vector<std::unique_ptr<WorkerQueue>> queues;
+        std::vector<std::thread> threads;
+
+        std::atomic<size_t> queued { 0 };
+        std::atomic<size_t> next_queue { 0 };
+
+        std::mutex sleep_mutex;
+        std::condition_variable wakeup;
+        bool stopping = false;
+
+        /* The pool and the worker index of the calling thread, if it's one of the workers. */
+        static thread_local TaskPool* current_pool;
+        static thread_local unsigned current_worker;
+};
+
+thread_local TaskPool* TaskPool::current_pool = nullptr;
+thread_local unsigned TaskPool::current_worker = 0;
+
+#endif
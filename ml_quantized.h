@@ -0,0 +1,621 @@
+#ifndef ML_QUANTIZED_H
+#define ML_QUANTIZED_H
+
+/*
+    Quantized inference engines, built at load time from the native (double precision) ones.
+
+        - Trees: every feature is encoded once per flow as its rank among the thresholds the
+          ensemble tests on it, so splits compare 16-bit integers. The encoding is exact:
+          x <= threshold_k if and only if rank(x) <= k.
+        - Linear SVC and Naive Bayes: weights are quantized to int8 (int16 for GaussianNB, one
+          scale per row) and the features to int16, and the dot products run on integers
+          (SSE2/AVX2 pmaddwd).
+        - MLP: every layer runs as an int8 GEMM (see ml_gemm.h), its inputs quantized to int16
+          per flow.
+          Unlike the trees, these are approximations; tools/ml_quantize.cc reports the drift.
+
+    The double precision model is kept (it's what save_model() writes), but inference only
+    touches the quantized parameters.
+*/
+
+#include <cmath>
+#include <limits>
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#include "ml_models.h"
+
+/* Quantized rows and vectors are padded with zeros to a multiple of this many lanes. */
+static const size_t QUANTIZED_LANES = 16;
+
+/* Per-flow buffers live on the stack, so quantized models have at most this many features. */
+static const size_t QUANTIZED_MAX_FEATURES = 256;
+
+inline size_t quantized_size(size_t size) {
+    return (size + QUANTIZED_LANES - 1) / QUANTIZED_LANES * QUANTIZED_LANES;
+}
+
+/* Symmetric int8 quantization of "size" weights. Returns the scale (weight ~= quantized * scale). */
+inline double quantize_weights(const double* weights, size_t size, int8_t* quantized) {
+    double max_value = 0;
+    for (size_t i = 0; i < size; i++) max_value = std::max(max_value, std::fabs(weights[i]));
+
+    double scale = (max_value > 0) ? max_value / 127.0 : 1.0;
+    for (size_t i = 0; i < size; i++) quantized[i] = (int8_t)std::lround(weights[i] / scale);
+
+    return scale;
+}
+
+/* Same, to int16 (for the weights 8 bits can't represent). */
+inline double quantize_weights(const double* weights, size_t size, int16_t* quantized) {
+    double max_value = 0;
+    for (size_t i = 0; i < size; i++) max_value = std::max(max_value, std::fabs(weights[i]));
+
+    double scale = (max_value > 0) ? max_value / 32767.0 : 1.0;
+    for (size_t i = 0; i < size; i++) quantized[i] = (int16_t)std::lround(weights[i] / scale);
+
+    return scale;
+}
+
+/*
+    Dynamic int16 quantization of a feature vector (scaled by its largest magnitude).
+    Returns the scale (value ~= quantized * scale). Non-finite features are quantized to 0.
+*/
+inline double quantize_features(const double* features, size_t size, int16_t* quantized) {
+    double max_value = 0;
+    for (size_t i = 0; i < size; i++) {
+        double magnitude = std::fabs(features[i]);
+        if (magnitude > max_value && magnitude <= std::numeric_limits<double>::max()) max_value = magnitude;
+    }
+
+    double scale = (max_value > 0) ? max_value / 32767.0 : 1.0;
+    double inverse = 1.0 / scale;
+
+    /* Rounded half away from zero; |features[i] * inverse| <= 32767 for every finite feature. */
+    for (size_t i = 0; i < size; i++) {
+        double value = features[i] * inverse;
+        quantized[i] = (std::fabs(features[i]) <= max_value) ? (int16_t)(value + (value < 0 ? -0.5 : 0.5)) : 0;
+    }
+    return scale;
+}
+
+/*
+    Integer dot product of int8 weights and int16 features, both padded (see QUANTIZED_LANES).
+    Every product fits in 23 bits, so the int32 accumulators can't overflow for any realistic
+    number of features.
+*/
+inline int32_t dot_int8(const int8_t* weights, const int16_t* features, size_t size) {
+#if defined(__AVX2__)
+    __m256i sum = _mm256_setzero_si256();
+
+    for (size_t i = 0; i < size; i += 16) {
+        __m256i w = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i*)(weights + i)));
+        __m256i x = _mm256_loadu_si256((const __m256i*)(features + i));
+        sum = _mm256_add_epi32(sum, _mm256_madd_epi16(w, x));
+    }
+
+    __m128i total = _mm_add_epi32(_mm256_castsi256_si128(sum), _mm256_extracti128_si256(sum, 1));
+#elif defined(__SSE2__)
+    __m128i total = _mm_setzero_si128();
+
+    for (size_t i = 0; i < size; i += 8) {
+        /* Sign-extends 8 weights to 16 bits (SSE2 has no pmovsxbw). */
+        __m128i bytes = _mm_loadl_epi64((const __m128i*)(weights + i));
+        __m128i w = _mm_srai_epi16(_mm_unpacklo_epi8(bytes, bytes), 8);
+        __m128i x = _mm_loadu_si128((const __m128i*)(features + i));
+        total = _mm_add_epi32(total, _mm_madd_epi16(w, x));
+    }
+#endif
+
+#if defined(__SSE2__)
+    total = _mm_add_epi32(total, _mm_shuffle_epi32(total, _MM_SHUFFLE(1, 0, 3, 2)));
+    total = _mm_add_epi32(total, _mm_shuffle_epi32(total, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtsi128_si32(total);
+#else
+    int32_t sum = 0;
+    for (size_t i = 0; i < size; i++) sum += (int32_t)weights[i] * features[i];
+    return sum;
+#endif
+}
+
+/*
+    Integer dot product of int16 weights and int16 features (both padded, neither -32768).
+    A pmaddwd lane holds at most 2 * 32767^2 < 2^31, and lanes are accumulated in 64 bits.
+*/
+inline int64_t dot_int16(const int16_t* weights, const int16_t* features, size_t size) {
+#if defined(__AVX2__)
+    __m256i sum = _mm256_setzero_si256();
+
+    for (size_t i = 0; i < size; i += 16) {
+        __m256i w = _mm256_loadu_si256((const __m256i*)(weights + i));
+        __m256i x = _mm256_loadu_si256((const __m256i*)(features + i));
+        __m256i products = _mm256_madd_epi16(w, x);
+
+        sum = _mm256_add_epi64(sum, _mm256_cvtepi32_epi64(_mm256_castsi256_si128(products)));
+        sum = _mm256_add_epi64(sum, _mm256_cvtepi32_epi64(_mm256_extracti128_si256(products, 1)));
+    }
+
+    int64_t lanes[4];
+    _mm256_storeu_si256((__m256i*)lanes, sum);
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3];
+#else
+    int64_t sum = 0;
+    for (size_t i = 0; i < size; i++) sum += (int32_t)weights[i] * features[i];
+    return sum;
+#endif
+}
+
+/* Base class of the quantized engines: owns the source model and mirrors its header. */
+class QuantizedModel : public Model {
+    public:
+        explicit QuantizedModel(Model* source) : source(source) {
+            kind = source->kind;
+            num_features = source->num_features;
+            num_classes = source->num_classes;
+            scale = source->scale;
+            offset = source->offset;
+        }
+
+        /* Quantized models are only built from loaded ones. */
+        bool load_parameters(ModelReader&) override {
+            return false;
+        }
+
+        void save_parameters(ModelWriter& writer) const override {
+            source->save_parameters(writer);
+        }
+
+        void mark_used_features(std::vector<bool>& used) const override {
+            source->mark_used_features(used);
+        }
+
+    protected:
+        std::unique_ptr<Model> source;
+};
+
+class QuantizedTrees : public QuantizedModel {
+    public:
+        /* Ranks are 16-bit, so every feature can be tested against at most 65535 distinct thresholds. */
+        static bool supports(const TreeEnsemble& trees, std::string& error) {
+            std::vector<std::vector<float>> thresholds = feature_thresholds(trees);
+
+            for (const std::vector<float>& feature : thresholds) {
+                if (feature.size() > 65535) {
+                    error = "too many distinct thresholds on a single feature";
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        explicit QuantizedTrees(TreeEnsemble* trees) : QuantizedModel(trees), trees(trees) {
+            std::vector<std::vector<float>> thresholds = feature_thresholds(*trees);
+
+            threshold_offsets.push_back(0);
+            for (const std::vector<float>& feature : thresholds) {
+                threshold_values.insert(threshold_values.end(), feature.begin(), feature.end());
+                threshold_offsets.push_back((uint32_t)threshold_values.size());
+            }
+
+            nodes.resize(trees->nodes.size());
+
+            for (size_t i = 0; i < nodes.size(); i++) {
+                const TreeNode& node = trees->nodes[i];
+
+                if (node.feature < 0) {
+                    nodes[i] = { 0, leaf_feature, 0, 0 };
+                    continue;
+                }
+
+                const std::vector<float>& feature = thresholds[node.feature];
+                float threshold = float_threshold(node.threshold);
+                uint16_t rank = (uint16_t)(std::lower_bound(feature.begin(), feature.end(), threshold) - feature.begin());
+
+                nodes[i] = { rank, (uint16_t)node.feature, node.left, node.right };
+            }
+        }
+
+        void predict_proba_scaled(const double* features, double* proba) const override {
+            /* Features are ranked the first time a split tests them: small trees only test a few. */
+            int32_t ranks[QUANTIZED_MAX_FEATURES];
+            std::fill(ranks, ranks + num_features, (int32_t)unranked);
+
+            trees->aggregate([this, features, &ranks](size_t t) { return find_leaf(t, features, ranks); }, proba);
+        }
+
+        void decision_scaled(const double* features, double* scores) const override {
+            int32_t ranks[QUANTIZED_MAX_FEATURES];
+            std::fill(ranks, ranks + num_features, (int32_t)unranked);
+
+            trees->margins([this, features, &ranks](size_t t) { return find_leaf(t, features, ranks); }, scores);
+        }
+
+        size_t parameter_bytes() const override {
+            size_t bytes = nodes.size() * sizeof(QuantizedNode) + trees->values.size() * sizeof(double) +
+                           trees->weights.size() * sizeof(double) + trees->roots.size() * sizeof(int32_t);
+
+            return bytes + threshold_values.size() * sizeof(float) + threshold_offsets.size() * sizeof(uint32_t);
+        }
+
+    private:
+        /* Leaf of tree "t", ranking the features it tests that aren't ranked yet. */
+        int32_t find_leaf(size_t t, const double* features, int32_t* ranks) const {
+            int32_t index = trees->roots[t];
+
+            while (nodes[index].feature != leaf_feature) {
+                const QuantizedNode& node = nodes[index];
+                int32_t& rank = ranks[node.feature];
+
+                if (rank == unranked) rank = rank_of(node.feature, features[node.feature]);
+                index = (rank <= node.threshold) ? node.left : node.right;
+            }
+            return index;
+        }
+
+        /* 12 bytes instead of TreeNode's 24. Leaves keep their index, so the source's values still apply. */
+        struct QuantizedNode {
+            uint16_t threshold;
+            uint16_t feature;
+            int32_t left;
+            int32_t right;
+        };
+
+        static const uint16_t leaf_feature = 0xffff;
+        static const int32_t unranked = -1;
+
+        /* Number of thresholds below the feature (branchless binary search over its sorted thresholds). */
+        int32_t rank_of(uint32_t f, double feature) const {
+            float value = (float)feature;
+
+            /* NaN goes right at every split, as with the float comparisons. */
+            if (value != value) return 0xffff;
+
+            const float* base = threshold_values.data() + threshold_offsets[f];
+            uint32_t size = threshold_offsets[f + 1] - threshold_offsets[f];
+
+            if (size == 0) return 0;
+
+            while (size > 1) {
+                uint32_t half = size / 2;
+                base = (base[half - 1] < value) ? base + half : base;
+                size -= half;
+            }
+            return (int32_t)(base - (threshold_values.data() + threshold_offsets[f]) + (*base < value));
+        }
+
+        /*
+            Largest float not above a threshold: features are compared in single precision,
+            so (float)x <= threshold if and only if (float)x <= float_threshold(threshold).
+        */
+        static float float_threshold(double threshold) {
+            float rounded = (float)threshold;
+
+            if ((double)rounded > threshold) rounded = std::nextafter(rounded, -INFINITY);
+            return rounded;
+        }
+
+        /* Sorted, distinct (single precision) thresholds of every feature. */
+        static std::vector<std::vector<float>> feature_thresholds(const TreeEnsemble& trees) {
+            std::vector<std::vector<float>> thresholds(trees.num_features);
+
+            for (const TreeNode& node : trees.nodes) {
+                if (node.feature >= 0) thresholds[node.feature].push_back(float_threshold(node.threshold));
+            }
+
+            for (std::vector<float>& feature : thresholds) {
+                std::sort(feature.begin(), feature.end());
+                feature.erase(std::unique(feature.begin(), feature.end()), feature.end());
+            }
+            return thresholds;
+        }
+
+        const TreeEnsemble* trees;
+        std::vector<QuantizedNode> nodes;
+        std::vector<float> threshold_values;
+        std::vector<uint32_t> threshold_offsets;
+};
+
+class QuantizedLinear : public QuantizedModel {
+    public:
+        explicit QuantizedLinear(LinearModel* linear) : QuantizedModel(linear), intercepts(linear->intercepts) {
+            size_t num_rows = intercepts.size();
+
+            padded_features = quantized_size(num_features);
+            weights.assign(num_rows * padded_features, 0);
+            row_scales.resize(num_rows);
+
+            for (size_t r = 0; r < num_rows; r++) {
+                row_scales[r] = quantize_weights(linear->coefficients.data() + r * num_features, num_features,
+                                                 weights.data() + r * padded_features);
+            }
+        }
+
+        void predict_proba_scaled(const double* features, double* proba) const override {
+            alignas(32) int16_t quantized[QUANTIZED_MAX_FEATURES] = { };
+            double feature_scale = quantize_features(features, num_features, quantized);
+
+            /* One row per class (or a single one for binary problems), so the decisions go straight to proba. */
+            uint32_t num_rows = (uint32_t)intercepts.size();
+
+            for (uint32_t r = 0; r < num_rows; r++) {
+                int32_t dot = dot_int8(weights.data() + (size_t)r * padded_features, quantized, padded_features);
+                proba[r] = intercepts[r] + row_scales[r] * feature_scale * dot;
+            }
+
+            if (num_rows == 1) {
+                proba[1] = 1.0 / (1.0 + std::exp(-proba[0]));
+                proba[0] = 1.0 - proba[1];
+            } else {
+                softmax(proba, num_classes);
+            }
+        }
+
+        size_t parameter_bytes() const override {
+            return weights.size() * sizeof(int8_t) + (row_scales.size() + intercepts.size()) * sizeof(double);
+        }
+
+    private:
+        size_t padded_features = 0;
+        std::vector<int8_t> weights;
+        std::vector<double> row_scales;
+        std::vector<double> intercepts;
+};
+
+/*
+    GaussianNB's joint log-likelihood is a quadratic form of the features:
+        log_norm_c - 0.5 * sum((x - mean)^2 / var) = constant_c + sum(squares_c * x^2) + sum(linears_c * x)
+    x and x^2 are quantized per flow, like the linear models' features. The weights span several
+    orders of magnitude (some variances are tiny), so they're int16 rather than int8: with 8 bits,
+    around 1 flow in 20 changes class.
+*/
+class QuantizedGaussianNB : public QuantizedModel {
+    public:
+        explicit QuantizedGaussianNB(GaussianNB* nb) : QuantizedModel(nb) {
+            padded_features = quantized_size(num_features);
+
+            squares.assign((size_t)num_classes * padded_features, 0);
+            linears.assign((size_t)num_classes * padded_features, 0);
+            square_row_scales.resize(num_classes);
+            linear_row_scales.resize(num_classes);
+            constants.resize(num_classes);
+
+            std::vector<double> square_weights(num_features), linear_weights(num_features);
+
+            for (uint32_t c = 0; c < num_classes; c++) {
+                constants[c] = nb->log_norms[c];
+
+                for (uint32_t f = 0; f < num_features; f++) {
+                    size_t index = (size_t)c * num_features + f;
+                    double mean = nb->means[index], variance = nb->variances[index];
+
+                    square_weights[f] = -0.5 / variance;
+                    linear_weights[f] = mean / variance;
+                    constants[c] -= 0.5 * mean * mean / variance;
+                }
+
+                square_row_scales[c] = quantize_weights(square_weights.data(), num_features, squares.data() + (size_t)c * padded_features);
+                linear_row_scales[c] = quantize_weights(linear_weights.data(), num_features, linears.data() + (size_t)c * padded_features);
+            }
+        }
+
+        void predict_proba_scaled(const double* features, double* proba) const override {
+            double feature_squares[QUANTIZED_MAX_FEATURES];
+            alignas(32) int16_t quantized[QUANTIZED_MAX_FEATURES] = { };
+            alignas(32) int16_t quantized_squares[QUANTIZED_MAX_FEATURES] = { };
+
+            for (uint32_t f = 0; f < num_features; f++) {
+                feature_squares[f] = features[f] * features[f];
+            }
+
+            double feature_scale = quantize_features(features, num_features, quantized);
+            double square_scale = quantize_features(feature_squares, num_features, quantized_squares);
+
+            for (uint32_t c = 0; c < num_classes; c++) {
+                size_t row = (size_t)c * padded_features;
+
+                proba[c] = constants[c] +
+                           square_row_scales[c] * square_scale * dot_int16(squares.data() + row, quantized_squares, padded_features) +
+                           linear_row_scales[c] * feature_scale * dot_int16(linears.data() + row, quantized, padded_features);
+            }
+            softmax(proba, num_classes);
+        }
+
+        size_t parameter_bytes() const override {
+            return (squares.size() + linears.size()) * sizeof(int16_t) +
+                   (constants.size() + square_row_scales.size() + linear_row_scales.size()) * sizeof(double);
+        }
+
+    private:
+        size_t padded_features = 0;
+
+        std::vector<int16_t> squares;
+        std::vector<int16_t> linears;
+        std::vector<double> square_row_scales;
+        std::vector<double> linear_row_scales;
+        std::vector<double> constants;
+};
+
+class QuantizedBernoulliNB : public QuantizedModel {
+    public:
+        explicit QuantizedBernoulliNB(BernoulliNB* nb) : QuantizedModel(nb), has_binarize(nb->has_binarize),
+                                                         binarize(nb->binarize), biases(nb->biases) {
+            padded_features = quantized_size(num_features);
+            deltas.assign((size_t)num_classes * padded_features, 0);
+            row_scales.resize(num_classes);
+
+            for (uint32_t c = 0; c < num_classes; c++) {
+                row_scales[c] = quantize_weights(nb->deltas.data() + (size_t)c * num_features, num_features,
+                                                 deltas.data() + (size_t)c * padded_features);
+            }
+        }
+
+        void predict_proba_scaled(const double* features, double* proba) const override {
+            alignas(32) int16_t quantized[QUANTIZED_MAX_FEATURES] = { };
+            double feature_scale = 1.0;
+
+            /* Binarized features are exactly 0/1; raw ones are quantized like the linear model's. */
+            if (has_binarize) {
+                for (uint32_t f = 0; f < num_features; f++) quantized[f] = (features[f] > binarize) ? 1 : 0;
+            } else {
+                feature_scale = quantize_features(features, num_features, quantized);
+            }
+
+            for (uint32_t c = 0; c < num_classes; c++) {
+                int32_t dot = dot_int8(deltas.data() + (size_t)c * padded_features, quantized, padded_features);
+                proba[c] = biases[c] + row_scales[c] * feature_scale * dot;
+            }
+            softmax(proba, num_classes);
+        }
+
+        size_t parameter_bytes() const override {
+            return deltas.size() * sizeof(int8_t) + (row_scales.size() + biases.size()) * sizeof(double);
+        }
+
+    private:
+        bool has_binarize;
+        double binarize;
+        size_t padded_features = 0;
+        std::vector<int8_t> deltas;
+        std::vector<double> row_scales;
+        std::vector<double> biases;
+};
+
+/*
+    MLP with int8 weights (one scale per unit). Each layer's inputs, i.e. the features or the
+    previous layer's activations, are quantized per flow to int16, so the layers chain as int8
+    GEMMs with a float32 epilogue (bias and activation).
+*/
+class QuantizedMLP : public QuantizedModel {
+    public:
+        static bool supports(const MLPModel& mlp, std::string& error) {
+            for (const MLPModel::Layer& layer : mlp.layers) {
+                if (layer.inputs > QUANTIZED_MAX_FEATURES) {
+                    error = "a layer has more than " + std::to_string(QUANTIZED_MAX_FEATURES) + " inputs";
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        explicit QuantizedMLP(MLPModel* mlp) : QuantizedModel(mlp) {
+            layers.resize(mlp->layers.size());
+
+            for (size_t l = 0; l < layers.size(); l++) {
+                const MLPModel::Layer& layer = mlp->layers[l];
+                uint32_t activation = (l + 1 == layers.size()) ? (uint32_t)ACTIVATION_IDENTITY : layer.activation;
+
+                layers[l].pack(layer.weights.data(), layer.biases.data(), layer.inputs, layer.outputs, activation);
+            }
+        }
+
+        void predict_proba_scaled(const double* features, double* proba) const override {
+            forward(&features, 1, false, proba);
+        }
+
+        void predict_proba_batch(const double* const* rows, size_t count, double* proba) const override {
+            forward(rows, count, true, proba);
+        }
+
+        size_t parameter_bytes() const override {
+            size_t bytes = 0;
+            for (const QuantizedLayer& layer : layers) bytes += layer.bytes();
+            return bytes;
+        }
+
+    private:
+        /* Same as MLPModel::forward(), quantizing the inputs of every layer. */
+        void forward(const double* const* rows, size_t count, bool apply_scaler, double* proba) const {
+            size_t width = num_features;
+            for (const QuantizedLayer& layer : layers) width = std::max(width, std::max(layer.padded_inputs(), layer.padded_outputs()));
+
+            size_t block = (count < MLPModel::batch_rows) ? count : MLPModel::batch_rows;
+            std::vector<float> values(block * width), row_scales(block);
+            std::vector<int16_t> quantized(block * width);
+            FlushDenormals flush;
+
+            for (size_t first = 0; first < count; first += block) {
+                size_t rows_here = std::min(block, count - first);
+                size_t ldy = num_features;
+
+                for (size_t i = 0; i < rows_here; i++) {
+                    const double* row = rows[first + i];
+                    float* features = values.data() + i * ldy;
+
+                    for (uint32_t f = 0; f < num_features; f++) {
+                        features[f] = (float)((apply_scaler && !scale.empty()) ? row[f] * scale[f] + offset[f] : row[f]);
+                    }
+                }
+
+                /* Each layer's inputs (the features, then the previous layer's activations) are quantized per flow. */
+                for (const QuantizedLayer& layer : layers) {
+                    size_t ld = layer.padded_inputs();
+
+                    for (size_t i = 0; i < rows_here; i++) {
+                        row_scales[i] = quantize_activations(values.data() + i * ldy, layer.inputs, ld, quantized.data() + i * ld);
+                    }
+
+                    ldy = layer.padded_outputs();
+                    gemm_layer(layer, quantized.data(), ld, row_scales.data(), rows_here, values.data(), ldy);
+                }
+
+                for (size_t i = 0; i < rows_here; i++) {
+                    MLPModel::output_proba(values.data() + i * ldy, num_classes, proba + (first + i) * num_classes);
+                }
+            }
+        }
+
+        std::vector<QuantizedLayer> layers;
+};
+
+/*
+    Builds the quantized engine of a loaded model.
+    On success, the returned model owns "model"; on failure, nullptr is returned (with the
+    reason in "error") and "model" is left untouched.
+*/
+inline Model* quantize_model(Model* model, std::string& error) {
+    if (model->num_features > QUANTIZED_MAX_FEATURES) {
+        error = "too many features";
+        return nullptr;
+    }
+
+    /* Quantization ranges are picked on scaled features (load the model with fold = false). */
+    if (model->folded) {
+        error = "the scaler is folded into the model";
+        return nullptr;
+    }
+
+    switch (model->kind) {
+        case MODEL_TREES:
+        case MODEL_ADABOOST_SAMME:
+        case MODEL_ADABOOST_SAMME_R: {
+            TreeEnsemble* trees = static_cast<TreeEnsemble*>(model);
+
+            if (!QuantizedTrees::supports(*trees, error)) return nullptr;
+            return new QuantizedTrees(trees);
+        }
+        case MODEL_BOOSTED_TREES:
+            error = "boosted trees split on double precision features";
+            return nullptr;
+        case MODEL_LINEAR: return new QuantizedLinear(static_cast<LinearModel*>(model));
+        case MODEL_GAUSSIAN_NB: return new QuantizedGaussianNB(static_cast<GaussianNB*>(model));
+        case MODEL_BERNOULLI_NB: return new QuantizedBernoulliNB(static_cast<BernoulliNB*>(model));
+        case MODEL_MLP: {
+            MLPModel* mlp = static_cast<MLPModel*>(model);
+
+            if (!QuantizedMLP::supports(*mlp, error)) return nullptr;
+            return new QuantizedMLP(mlp);
+        }
+    }
+
+    error = "unknown model kind";
+    return nullptr;
+}
+
+#endif
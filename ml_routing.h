@@ -0,0 +1,341 @@
+#ifndef ML_ROUTING_H
+#define ML_ROUTING_H
+
+/*
+    Per-subnet and per-service model routing.
+    A route sends the flows of a prefix (e.g. "10.1.0.0/16", "2001:db8::/32", or "any") and
+    of a set of server ports (e.g. "22 3389 8000-8099", or every port) to its own target,
+    i.e. a model and its alert thresholds.
+
+    Routes are compiled into one multibit trie per address family, using controlled prefix
+    expansion and leaf pushing. Strides are 16 bits, then 8 bits (as in DIR-16-8-8): each
+    entry holds either a child node or the prefix group of the longest matching prefix, so
+    a lookup is one read per stride (at most 3 for IPv4 and 15 for IPv6).
+    A prefix group lists the port rules of its prefix (specific ports first), then those of
+    the prefixes covering it. The first rule matching the port wins.
+*/
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <algorithm>
+
+#include <arpa/inet.h>
+
+/* Parses "address/length" (or a bare address) into "address" (4 or 16 bytes), clearing the bits past the prefix. */
+inline bool parse_prefix(const std::string& text, uint8_t* address, bool& ip6, unsigned& length, std::string& error) {
+    size_t slash = text.find('/');
+    std::string host = text.substr(0, slash);
+
+    memset(address, 0, 16);
+    ip6 = (host.find(':') != std::string::npos);
+
+    if (inet_pton(ip6 ? AF_INET6 : AF_INET, host.c_str(), address) != 1) {
+        error = "invalid address in route prefix '" + text + "'";
+        return false;
+    }
+
+    unsigned bits = ip6 ? 128 : 32;
+    length = bits;
+
+    if (slash != std::string::npos) {
+        char* end = nullptr;
+        unsigned long parsed = strtoul(text.c_str() + slash + 1, &end, 10);
+
+        if (end == text.c_str() + slash + 1 || *end != '\0' || parsed > bits) {
+            error = "invalid length in route prefix '" + text + "'";
+            return false;
+        }
+        length = (unsigned)parsed;
+    }
+
+    for (unsigned bit = length; bit < bits; bit++) {
+        address[bit / 8] &= (uint8_t)~(0x80 >> (bit % 8));
+    }
+    return true;
+}
+
+/* Inclusive range of server ports. */
+struct PortRange {
+    uint16_t low;
+    uint16_t high;
+};
+
+/* Parses space-separated ports and ranges (e.g. "22 8000-8099"). Empty: every port. */
+inline bool parse_port_ranges(const std::string& text, std::vector<PortRange>& ranges, std::string& error) {
+    std::istringstream tokens(text);
+    std::string token;
+
+    ranges.clear();
+
+    while (tokens >> token) {
+        size_t dash = token.find('-');
+        char* end = nullptr;
+
+        unsigned long low = strtoul(token.c_str(), &end, 10);
+        unsigned long high = low;
+        bool valid = (end != token.c_str()) && (dash == std::string::npos ? *end == '\0' : end == token.c_str() + dash);
+
+        if (valid && dash != std::string::npos) {
+            high = strtoul(token.c_str() + dash + 1, &end, 10);
+            valid = (end != token.c_str() + dash + 1) && *end == '\0';
+        }
+
+        if (!valid || low > high || high > 65535) {
+            error = "invalid port (or range) '" + token + "' in route";
+            return false;
+        }
+        ranges.push_back({ (uint16_t)low, (uint16_t)high });
+    }
+
+    if (ranges.empty()) ranges.push_back({ 0, 65535 });
+    return true;
+}
+
+/*
+    Multibit trie of 4-byte (IPv4) or 16-byte (IPv6) prefixes, mapping every address to the
+    group of its longest matching prefix (0: none). The root node has 65536 entries (the
+    first 16 bits) and the other nodes 256 (the next 8 bits); nodes are laid out in one array.
+*/
+class PrefixTrie {
+    public:
+        void clear() {
+            entries.clear();
+        }
+
+        /*
+            Maps the first "length" bits of "address" to "group". Prefixes must be inserted by
+            ascending length (leaf pushing overwrites everything below a new prefix).
+            Returns the group of the longest prefix covering it that was inserted before (0: none).
+        */
+        uint32_t insert(const uint8_t* address, unsigned length, uint32_t group) {
+            if (entries.empty()) entries.assign(1 << root_stride, 0);
+
+            uint32_t node = 0;
+            unsigned start = 0;
+
+            while (true) {
+                unsigned stride = (start == 0) ? root_stride : node_stride;
+                uint32_t index = stride_bits(address, start);
+
+                if (length <= start + stride) {
+                    uint32_t span = 1u << (start + stride - length);
+                    index &= ~(span - 1);
+
+                    uint32_t covering = first_group(node + index);
+
+                    for (uint32_t i = 0; i < span; i++) {
+                        fill(node + index + i, group);
+                    }
+                    return covering;
+                }
+
+                /* A leaf on the way becomes a node inheriting its group. */
+                if (!(entries[node + index] & child_bit)) {
+                    uint32_t child = (uint32_t)entries.size();
+                    uint32_t inherited = entries[node + index];
+
+                    entries.resize(child + (1 << node_stride), inherited);
+                    entries[node + index] = child | child_bit;
+                }
+
+                node = entries[node + index] & ~child_bit;
+                start += stride;
+            }
+        }
+
+        uint32_t lookup(const uint8_t* address) const {
+            if (entries.empty()) return 0;
+
+            uint32_t entry = entries[stride_bits(address, 0)];
+            unsigned start = root_stride;
+
+            while (entry & child_bit) {
+                entry = entries[(entry & ~child_bit) + address[start / 8]];
+                start += node_stride;
+            }
+            return entry;
+        }
+
+        size_t memory() const {
+            return entries.size() * sizeof(uint32_t);
+        }
+
+    private:
+        static const unsigned root_stride = 16;
+        static const unsigned node_stride = 8;
+        static const uint32_t child_bit = 0x80000000u;
+
+        /* The stride starting at bit "start" (a multiple of 8) of "address". */
+        static uint32_t stride_bits(const uint8_t* address, unsigned start) {
+            if (start == 0) return ((uint32_t)address[0] << 8) | address[1];
+            return address[start / 8];
+        }
+
+        /* The group of an entry (its first leaf's, for a node). */
+        uint32_t first_group(uint32_t position) const {
+            while (entries[position] & child_bit) {
+                position = entries[position] & ~child_bit;
+            }
+            return entries[position];
+        }
+
+        /* Sets "group" on an entry and every leaf below it. */
+        void fill(uint32_t position, uint32_t group) {
+            if (entries[position] & child_bit) {
+                uint32_t child = entries[position] & ~child_bit;
+
+                for (uint32_t i = 0; i < (1u << node_stride); i++) {
+                    fill(child + i, group);
+                }
+            } else {
+                entries[position] = group;
+            }
+        }
+
+        std::vector<uint32_t> entries;
+};
+
+/* Routes of prefixes and server ports to targets (e.g. indexes of a configuration table). */
+class RouteTable {
+    public:
+        /* Adds a route to "target" for "prefix" ("any": both families) and "ports" (see parse_port_ranges()). */
+        bool add(const std::string& prefix, const std::string& ports, uint32_t target, std::string& error) {
+            std::vector<PortRange> ranges;
+            if (!parse_port_ranges(ports, ranges, error)) return false;
+
+            if (prefix.empty() || prefix == "any") {
+                uint8_t zero[16] = { 0 };
+
+                add_rules(zero, false, 0, ranges, target);
+                add_rules(zero, true, 0, ranges, target);
+                return true;
+            }
+
+            uint8_t address[16];
+            bool ip6;
+            unsigned length;
+
+            if (!parse_prefix(prefix, address, ip6, length, error)) return false;
+
+            add_rules(address, ip6, length, ranges, target);
+            return true;
+        }
+
+        /* Compiles the routes added so far into the tries. */
+        void build() {
+            trie4.clear();
+            trie6.clear();
+
+            rules.clear();
+            group_first.assign(2, 0);
+
+            std::vector<size_t> order(prefixes.size());
+            for (size_t i = 0; i < order.size(); i++) order[i] = i;
+
+            std::stable_sort(order.begin(), order.end(), [this](size_t a, size_t b) {
+                return prefixes[a].length < prefixes[b].length;
+            });
+
+            for (size_t i : order) {
+                Prefix& prefix = prefixes[i];
+                uint32_t group = (uint32_t)group_first.size() - 1;
+                uint32_t covering = (prefix.ip6 ? trie6 : trie4).insert(prefix.address, prefix.length, group);
+
+                /* Port-specific rules first, so a prefix's "every port" rule doesn't hide them. */
+                std::stable_partition(prefix.rules.begin(), prefix.rules.end(), [](const Rule& rule) {
+                    return rule.low != 0 || rule.high != 65535;
+                });
+
+                rules.insert(rules.end(), prefix.rules.begin(), prefix.rules.end());
+
+                for (uint32_t r = group_first[covering]; r < group_first[covering + 1]; r++) {
+                    Rule inherited = rules[r];
+                    rules.push_back(inherited);
+                }
+                group_first.push_back((uint32_t)rules.size());
+            }
+        }
+
+        /* The target of a flow to "port" of "address" (4 or 16 bytes, network order), or -1. */
+        int64_t lookup(const uint8_t* address, bool ip6, uint16_t port) const {
+            uint32_t group = (ip6 ? trie6 : trie4).lookup(address);
+
+            for (uint32_t r = group_first[group]; r < group_first[group + 1]; r++) {
+                if (rules[r].low <= port && port <= rules[r].high) return rules[r].target;
+            }
+            return -1;
+        }
+
+        /* Same as lookup(), from the textual address. */
+        int64_t lookup(const std::string& address, uint16_t port) const {
+            uint8_t bytes[16];
+            bool ip6 = (address.find(':') != std::string::npos);
+
+            if (inet_pton(ip6 ? AF_INET6 : AF_INET, address.c_str(), bytes) != 1) return -1;
+            return lookup(bytes, ip6, port);
+        }
+
+        bool empty() const {
+            return prefixes.empty();
+        }
+
+        void clear() {
+            prefixes.clear();
+            build();
+        }
+
+        size_t memory() const {
+            return trie4.memory() + trie6.memory() + rules.size() * sizeof(Rule);
+        }
+
+    private:
+        struct Rule {
+            uint16_t low;
+            uint16_t high;
+            uint32_t target;
+        };
+
+        struct Prefix {
+            uint8_t address[16];
+            bool ip6;
+            unsigned length;
+            std::vector<Rule> rules;
+        };
+
+        /* Routes of the same prefix share its entry (and group). */
+        void add_rules(const uint8_t* address, bool ip6, unsigned length, const std::vector<PortRange>& ranges, uint32_t target) {
+            auto same = [&](const Prefix& prefix) {
+                return prefix.ip6 == ip6 && prefix.length == length && memcmp(prefix.address, address, 16) == 0;
+            };
+
+            std::vector<Prefix>::iterator prefix = std::find_if(prefixes.begin(), prefixes.end(), same);
+
+            if (prefix == prefixes.end()) {
+                prefixes.push_back(Prefix());
+                prefix = prefixes.end() - 1;
+
+                memcpy(prefix->address, address, 16);
+                prefix->ip6 = ip6;
+                prefix->length = length;
+            }
+
+            for (const PortRange& range : ranges) {
+                prefix->rules.push_back({ range.low, range.high, target });
+            }
+        }
+
+        std::vector<Prefix> prefixes;
+
+        PrefixTrie trie4;
+        PrefixTrie trie6;
+
+        /* Group g's rules are rules[group_first[g]..group_first[g + 1]); group 0 has none. */
+        std::vector<Rule> rules;
+        std::vector<uint32_t> group_first = { 0, 0 };
+};
+
+#endif
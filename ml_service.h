@@ -0,0 +1,128 @@
+#ifndef ML_SERVICE_H
+#define ML_SERVICE_H
+
+/*
+    Background service: a single thread running periodic jobs (the timeout scan, checkpoints).
+    It sleeps on a condition variable until the next job is due, so stopping it wakes it up
+    right away and joins it, instead of leaving a detached thread in a fixed sleep. Jobs run
+    one at a time, in the order they're due; a job running late doesn't make the next runs
+    pile up, they're just pushed back. Jobs can be replaced while the thread runs (e.g. on a
+    configuration reload): a job in progress finishes, and the new ones first run one interval
+    after they were scheduled.
+*/
+
+#include <mutex>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <cstdint>
+#include <functional>
+#include <condition_variable>
+
+class BackgroundService {
+    public:
+        ~BackgroundService() {
+            stop();
+        }
+
+        /* Adds a job run every "interval", first one interval from now. */
+        void schedule(std::chrono::steady_clock::duration interval, std::function<void()> function) {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                jobs.push_back(Job { std::move(function), interval, std::chrono::steady_clock::now() + interval });
+                generation++;
+            }
+            wakeup.notify_all();
+        }
+
+        /* Removes every job (a job in progress still finishes). */
+        void clear() {
+            std::lock_guard<std::mutex> lock(mutex);
+            jobs.clear();
+            generation++;
+        }
+
+        /* Starts the thread, each job first running one interval from now. */
+        void start() {
+            if (thread.joinable()) return;
+
+            std::lock_guard<std::mutex> lock(mutex);
+
+            std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+            for (Job& job : jobs) job.due = now + job.interval;
+
+            stopping = false;
+            thread = std::thread(&BackgroundService::run, this);
+        }
+
+        /* Wakes the thread up and waits for it (and the job it may be running) to finish. */
+        void stop() {
+            if (!thread.joinable()) return;
+
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stopping = true;
+            }
+            wakeup.notify_all();
+            thread.join();
+        }
+
+        bool running() const {
+            return thread.joinable();
+        }
+
+    private:
+        struct Job {
+            std::function<void()> function;
+            std::chrono::steady_clock::duration interval;
+            std::chrono::steady_clock::time_point due;
+        };
+
+        void run() {
+            std::unique_lock<std::mutex> lock(mutex);
+
+            while (!stopping) {
+                if (jobs.empty()) {
+                    wakeup.wait(lock, [this]() { return stopping || !jobs.empty(); });
+                    continue;
+                }
+
+                size_t next = 0;
+                for (size_t i = 1; i < jobs.size(); i++) {
+                    if (jobs[i].due < jobs[next].due) next = i;
+                }
+
+                /* Woken up early by new jobs: look for the next one again. */
+                uint64_t scheduled = generation;
+
+                if (wakeup.wait_until(lock, jobs[next].due, [this, scheduled]() { return stopping || generation != scheduled; })) {
+                    if (stopping) break;
+                    continue;
+                }
+
+                /* The job runs unlocked (on a copy, as the jobs may be replaced meanwhile), so stop() can be requested. */
+                std::function<void()> function = jobs[next].function;
+
+                lock.unlock();
+                function();
+                lock.lock();
+
+                if (generation != scheduled) continue;
+
+                std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+                jobs[next].due += jobs[next].interval;
+                if (jobs[next].due < now) jobs[next].due = now + jobs[next].interval;
+            }
+        }
+
+        std::vector<Job> jobs;
+        std::thread thread;
+        std::mutex mutex;
+        std::condition_variable wakeup;
+        bool stopping = false;
+
+        /* Bumped whenever the jobs change. */
+        uint64_t generation = 0;
+};
+
+#endif
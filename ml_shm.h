@@ -0,0 +1,320 @@
+#ifndef ML_SHM_H
+#define ML_SHM_H
+
+/*
+    Shared memory rings between the inspector and an external scorer process (see
+    "ml_classifiers.py --serve"): finalized feature vectors go out through a request ring
+    and verdicts come back through a response ring, without spawning anything or
+    serializing to text.
+
+    The segment (POSIX shared memory, /dev/shm/<name> on Linux) is laid out as:
+        - header (64 bytes): magic "MLSR", version, number of features, capacity
+          (a power of two), epoch (changes every time the inspector creates the segment),
+          heartbeat (the scorer's monotonic clock, in nanoseconds, updated as it polls);
+        - four counters, one per cache line: request head (producers), request tail (scorer),
+          response head (scorer) and response tail (inspector);
+        - request ring: sequence (uint64) and tag (uint64) per slot, then the slots' features
+          (capacity x number of features doubles);
+        - response ring: tag (uint64), confidence (double) and label (float) per slot.
+
+    The request ring is multi-producer (Vyukov's bounded queue): a producer claims a slot by
+    advancing the head, writes it and publishes it by setting its sequence to position + 1; the
+    scorer reads the ready slots in order and frees them by setting their sequence to position +
+    capacity. The response ring is single-producer, single-consumer: the scorer writes verdicts
+    and advances the response head, the inspector reads them and advances the response tail.
+    Tags are opaque to the scorer and come back with the verdicts.
+
+    The heartbeat tells the inspector whether a scorer is attached at all: without one, there's
+    no point in waiting for verdicts. Both sides read CLOCK_MONOTONIC (std::chrono::steady_clock
+    and Python's time.monotonic_ns() on Linux), so the clocks compare across processes.
+*/
+
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static const char ml_ring_magic[4] = { 'M', 'L', 'S', 'R' };
+static const uint32_t ml_ring_version = 2;
+
+/* A verdict of the external scorer. */
+struct RingVerdict {
+    uint64_t tag;
+    float label;
+    double confidence;
+};
+
+class ScorerRing {
+    public:
+        ScorerRing() = default;
+        ScorerRing(const ScorerRing&) = delete;
+        ScorerRing& operator=(const ScorerRing&) = delete;
+
+        ~ScorerRing() {
+            close();
+        }
+
+        /* Creates (or resets) the segment "name" (e.g. "/ml_classifiers"). "capacity" is rounded up to a power of two. */
+        bool create(const std::string& name, uint32_t capacity, uint32_t num_features, std::string& error) {
+            close();
+
+            uint32_t size = 1;
+            while (size < capacity) size <<= 1;
+
+            int fd = shm_open(name.c_str(), O_RDWR | O_CREAT, 0600);
+            if (fd < 0) {
+                error = "couldn't create the shared memory segment " + name;
+                return false;
+            }
+
+            size_t bytes = segment_bytes(size, num_features);
+            if (ftruncate(fd, (off_t)bytes) < 0 || !map(fd, bytes)) {
+                ::close(fd);
+                error = "couldn't map the shared memory segment " + name;
+                return false;
+            }
+            ::close(fd);
+
+            /* The magic goes last: a scorer attaching meanwhile waits for it. */
+            memset(base, 0, sizeof(RingHeader));
+
+            header()->version = ml_ring_version;
+            header()->num_features = num_features;
+            header()->capacity = size;
+            header()->epoch = (uint64_t)std::chrono::steady_clock::now().time_since_epoch().count();
+
+            layout(size, num_features);
+
+            for (uint32_t i = 0; i < size; i++) {
+                request_sequences[i].store(i, std::memory_order_relaxed);
+            }
+
+            std::atomic_thread_fence(std::memory_order_release);
+            memcpy(header()->magic, ml_ring_magic, sizeof(ml_ring_magic));
+            return true;
+        }
+
+        /* Attaches to an existing segment (scorer side). */
+        bool attach(const std::string& name, std::string& error) {
+            close();
+
+            int fd = shm_open(name.c_str(), O_RDWR, 0600);
+            struct stat st;
+
+            if (fd < 0 || fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(RingHeader) || !map(fd, (size_t)st.st_size)) {
+                if (fd >= 0) ::close(fd);
+                error = "couldn't map the shared memory segment " + name;
+                return false;
+            }
+            ::close(fd);
+
+            std::atomic_thread_fence(std::memory_order_acquire);
+
+            if (memcmp(header()->magic, ml_ring_magic, sizeof(ml_ring_magic)) != 0 || header()->version != ml_ring_version ||
+                segment_bytes(header()->capacity, header()->num_features) > mapped_bytes) {
+                close();
+                error = name + " isn't a version " + std::to_string(ml_ring_version) + " scorer ring";
+                return false;
+            }
+
+            layout(header()->capacity, header()->num_features);
+            return true;
+        }
+
+        void close() {
+            if (base) munmap(base, mapped_bytes);
+            base = nullptr;
+            mapped_bytes = 0;
+        }
+
+        bool is_open() const {
+            return base != nullptr;
+        }
+
+        uint32_t capacity() const {
+            return header()->capacity;
+        }
+
+        uint32_t num_features() const {
+            return header()->num_features;
+        }
+
+        /* Scorer side: tells the inspector it's still polling. */
+        void beat() {
+            header()->heartbeat.store(steady_nsecs(), std::memory_order_relaxed);
+        }
+
+        /* Inspector side: whether a scorer polled the rings in the last "window" nanoseconds. */
+        bool scorer_alive(int64_t window) const {
+            uint64_t heartbeat = header()->heartbeat.load(std::memory_order_relaxed);
+            return heartbeat != 0 && (int64_t)(steady_nsecs() - heartbeat) < window;
+        }
+
+        /* Producer side (any thread): queues a feature vector. False when the ring is full. */
+        bool push_request(uint64_t tag, const double* features) {
+            uint64_t mask = header()->capacity - 1;
+            uint64_t position = header()->request_head.load(std::memory_order_relaxed);
+
+            while (true) {
+                uint64_t sequence = request_sequences[position & mask].load(std::memory_order_acquire);
+                int64_t difference = (int64_t)(sequence - position);
+
+                if (difference == 0) {
+                    if (header()->request_head.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) break;
+                } else if (difference < 0) {
+                    return false;
+                } else {
+                    position = header()->request_head.load(std::memory_order_relaxed);
+                }
+            }
+
+            size_t slot = position & mask;
+
+            request_tags[slot] = tag;
+            memcpy(request_features + slot * header()->num_features, features, header()->num_features * sizeof(double));
+            request_sequences[slot].store(position + 1, std::memory_order_release);
+            return true;
+        }
+
+        /* Scorer side: takes up to "max" ready requests (in order). Returns how many. */
+        size_t pop_requests(uint64_t* tags, double* features, size_t max) {
+            uint64_t mask = header()->capacity - 1;
+            uint64_t position = header()->request_tail.load(std::memory_order_relaxed);
+            size_t count = 0;
+
+            for (; count < max; count++, position++) {
+                size_t slot = position & mask;
+                if (request_sequences[slot].load(std::memory_order_acquire) != position + 1) break;
+
+                tags[count] = request_tags[slot];
+                memcpy(features + count * header()->num_features, request_features + slot * header()->num_features,
+                       header()->num_features * sizeof(double));
+                request_sequences[slot].store(position + header()->capacity, std::memory_order_release);
+            }
+
+            header()->request_tail.store(position, std::memory_order_release);
+            return count;
+        }
+
+        /* Scorer side: returns up to "count" verdicts. Returns how many fitted. */
+        size_t push_verdicts(const RingVerdict* verdicts, size_t count) {
+            uint64_t mask = header()->capacity - 1;
+            uint64_t head = header()->response_head.load(std::memory_order_relaxed);
+            uint64_t tail = header()->response_tail.load(std::memory_order_acquire);
+
+            count = std::min<size_t>(count, header()->capacity - (head - tail));
+
+            for (size_t i = 0; i < count; i++) {
+                size_t slot = (head + i) & mask;
+
+                response_tags[slot] = verdicts[i].tag;
+                response_confidences[slot] = verdicts[i].confidence;
+                response_labels[slot] = verdicts[i].label;
+            }
+
+            header()->response_head.store(head + count, std::memory_order_release);
+            return count;
+        }
+
+        /* Inspector side (a single thread): takes up to "max" verdicts. Returns how many. */
+        size_t pop_verdicts(RingVerdict* verdicts, size_t max) {
+            uint64_t mask = header()->capacity - 1;
+            uint64_t tail = header()->response_tail.load(std::memory_order_relaxed);
+            uint64_t head = header()->response_head.load(std::memory_order_acquire);
+            size_t count = std::min<size_t>(max, head - tail);
+
+            for (size_t i = 0; i < count; i++) {
+                size_t slot = (tail + i) & mask;
+
+                verdicts[i].tag = response_tags[slot];
+                verdicts[i].confidence = response_confidences[slot];
+                verdicts[i].label = response_labels[slot];
+            }
+
+            header()->response_tail.store(tail + count, std::memory_order_release);
+            return count;
+        }
+
+    private:
+        /* One counter per cache line, so the inspector and the scorer don't share lines they write. */
+        struct RingHeader {
+            char magic[4];
+            uint32_t version;
+            uint32_t num_features;
+            uint32_t capacity;
+            uint64_t epoch;
+            std::atomic<uint64_t> heartbeat;
+            char padding0[32];
+
+            std::atomic<uint64_t> request_head;
+            char padding1[56];
+            std::atomic<uint64_t> request_tail;
+            char padding2[56];
+            std::atomic<uint64_t> response_head;
+            char padding3[56];
+            std::atomic<uint64_t> response_tail;
+            char padding4[56];
+        };
+
+        static_assert(sizeof(RingHeader) == 320, "the scorers rely on the header's layout");
+
+        static size_t segment_bytes(uint64_t capacity, uint64_t num_features) {
+            return sizeof(RingHeader) + capacity * (2 * sizeof(uint64_t) + num_features * sizeof(double) +
+                                                    sizeof(uint64_t) + sizeof(double) + sizeof(float));
+        }
+
+        bool map(int fd, size_t bytes) {
+            void* address = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            if (address == MAP_FAILED) return false;
+
+            base = (uint8_t*)address;
+            mapped_bytes = bytes;
+            return true;
+        }
+
+        void layout(uint64_t capacity, uint64_t num_features) {
+            uint8_t* next = base + sizeof(RingHeader);
+
+            request_sequences = (std::atomic<uint64_t>*)next;
+            next += capacity * sizeof(uint64_t);
+            request_tags = (uint64_t*)next;
+            next += capacity * sizeof(uint64_t);
+            request_features = (double*)next;
+            next += capacity * num_features * sizeof(double);
+
+            response_tags = (uint64_t*)next;
+            next += capacity * sizeof(uint64_t);
+            response_confidences = (double*)next;
+            next += capacity * sizeof(double);
+            response_labels = (float*)next;
+        }
+
+        RingHeader* header() const {
+            return (RingHeader*)base;
+        }
+
+        static uint64_t steady_nsecs() {
+            return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+        }
+
+        uint8_t* base = nullptr;
+        size_t mapped_bytes = 0;
+
+        std::atomic<uint64_t>* request_sequences = nullptr;
+        uint64_t* request_tags = nullptr;
+        double* request_features = nullptr;
+
+        uint64_t* response_tags = nullptr;
+        double* response_confidences = nullptr;
+        float* response_labels = nullptr;
+};
+
+#endif
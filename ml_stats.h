@@ -0,0 +1,152 @@
+#ifndef ML_STATS_H
+#define ML_STATS_H
+
+/*
+    Statistics helpers:
+        - RunningStats: the connections' per-flow statistics;
+        - LatencyHistogram/HistogramRegistry: latency histograms for the inspector's pegs.
+*/
+
+#include <mutex>
+#include <limits>
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <cstdint>
+
+/*
+    Count, sum, min, max, mean and (population) variance of a stream of samples.
+    It follows boost::accumulators' count/sum/min/max/mean/variance features, update for update
+    (the recursive variance included), so the features don't change, but it's a plain struct:
+    it can be copied into a checkpoint and restored as is.
+*/
+template <typename T>
+struct RunningStats {
+    uint64_t samples = 0;
+    T total = 0;
+    T lowest = std::numeric_limits<T>::max();
+    T highest = std::numeric_limits<T>::lowest();
+    double var = 0;
+
+    void operator()(T sample) {
+        samples++;
+        total += sample;
+
+        if (sample < lowest) lowest = sample;
+        if (sample > highest) highest = sample;
+
+        if (samples > 1) {
+            double deviation = sample - (double)total / samples;
+            var = var * (samples - 1) / samples + deviation * deviation / (samples - 1);
+        }
+    }
+};
+
+/* Extractors, named like boost::accumulators' ones. */
+template <typename T> inline uint64_t count(const RunningStats<T>& stats) { return stats.samples; }
+template <typename T> inline T sum(const RunningStats<T>& stats) { return stats.total; }
+template <typename T> inline T (min)(const RunningStats<T>& stats) { return stats.lowest; }
+template <typename T> inline T (max)(const RunningStats<T>& stats) { return stats.highest; }
+template <typename T> inline double mean(const RunningStats<T>& stats) { return (double)stats.total / stats.samples; }
+template <typename T> inline double variance(const RunningStats<T>& stats) { return stats.var; }
+
+/*
+    Latency histograms.
+    Buckets are log-linear, like HdrHistogram's: every power of two is split in 8 linear
+    sub-buckets, so any recorded value is reported within 12.5% of its real value, from
+    nanoseconds to hours, in a fixed amount of memory.
+
+    Each histogram has a single writer (its own packet thread, or the classification thread)
+    that only does relaxed loads/stores; readers merge every histogram of a registry
+    whenever the stats are dumped. Nothing is locked on the hot path.
+*/
+
+class LatencyHistogram {
+    public:
+        static const unsigned sub_bucket_bits = 3;
+        static const unsigned sub_buckets = 1 << sub_bucket_bits;
+        static const unsigned num_buckets = (64 - sub_bucket_bits + 1) * sub_buckets;
+
+        /* Only the owning thread records, so a load + store is enough (no read-modify-write). */
+        void record(uint64_t value) {
+            std::atomic<uint64_t>& count = counts[bucket_of(value)];
+            count.store(count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        }
+
+        /* Adds this histogram's counts to "merged" (num_buckets entries). */
+        void merge_into(std::vector<uint64_t>& merged) const {
+            for (unsigned i = 0; i < num_buckets; i++) {
+                merged[i] += counts[i].load(std::memory_order_relaxed);
+            }
+        }
+
+        static unsigned bucket_of(uint64_t value) {
+            if (value < sub_buckets) return (unsigned)value;
+
+            unsigned msb = 63 - __builtin_clzll(value);
+            unsigned shift = msb - sub_bucket_bits;
+
+            return (shift + 1) * sub_buckets + (unsigned)((value >> shift) & (sub_buckets - 1));
+        }
+
+        /* Highest value that falls in a bucket. */
+        static uint64_t bucket_value(unsigned bucket) {
+            if (bucket < sub_buckets) return bucket;
+
+            unsigned shift = bucket / sub_buckets - 1;
+            uint64_t sub_bucket = sub_buckets + bucket % sub_buckets;
+
+            return (sub_bucket << shift) + ((uint64_t)1 << shift) - 1;
+        }
+
+        /* Value at quantile "q" (0..1) of merged counts, 0 when nothing was recorded. */
+        static uint64_t quantile(const std::vector<uint64_t>& merged, double q) {
+            uint64_t total = 0;
+            for (uint64_t count : merged) total += count;
+
+            if (total == 0) return 0;
+
+            uint64_t rank = (uint64_t)(q * (total - 1)) + 1;
+            uint64_t seen = 0;
+
+            for (unsigned i = 0; i < num_buckets; i++) {
+                seen += merged[i];
+                if (seen >= rank) return bucket_value(i);
+            }
+            return bucket_value(num_buckets - 1);
+        }
+
+    private:
+        std::atomic<uint64_t> counts[num_buckets] = {};
+};
+
+/*
+    Set of histograms measuring the same thing, one per writer thread.
+    Histograms are created on a thread's first record and kept until shutdown,
+    so their counts outlive the thread (like the SUM pegs do).
+*/
+class HistogramRegistry {
+    public:
+        LatencyHistogram* create() {
+            std::lock_guard<std::mutex> lock(mutex);
+
+            histograms.emplace_back(new LatencyHistogram());
+            return histograms.back().get();
+        }
+
+        std::vector<uint64_t> merge() {
+            std::lock_guard<std::mutex> lock(mutex);
+            std::vector<uint64_t> merged(LatencyHistogram::num_buckets, 0);
+
+            for (const std::unique_ptr<LatencyHistogram>& histogram : histograms) {
+                histogram->merge_into(merged);
+            }
+            return merged;
+        }
+
+    private:
+        std::mutex mutex;
+        std::vector<std::unique_ptr<LatencyHistogram>> histograms;
+};
+
+#endif
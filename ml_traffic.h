@@ -0,0 +1,471 @@
+#ifndef ML_TRAFFIC_H
+#define ML_TRAFFIC_H
+
+/*
+    Deterministic synthetic traffic, for stress and memory tests of the flow tracker without
+    production traffic. New flows of each kind arrive at their own rate (Poisson arrivals),
+    and the packets of every live flow come out in timestamp order:
+        - bulk: long TCP transfers (handshake, bursts of full segments acknowledged every other
+          one, idle gaps between the bursts, FIN exchange), in either direction, which exercise
+          the bulk, subflow and active/idle state;
+        - udp: short request/response exchanges (DNS-like);
+        - echo: ICMP echo flood from random (spoofed) sources to a single victim, a few echos each;
+        - scan: SYN scans sweeping the ports of the servers, mostly answered with a reset.
+    IPv4 clients are 10.0.0.0/8 and servers 172.16.0.0/12. Everything (addresses, ports, sizes,
+    gaps) comes from a seeded splitmix64, so the same mix and seed always give the same packets.
+    Packets come out as the sensor decodes them (DecodedPacket) and, with encode_frame(), as
+    Ethernet frames to write to a pcap (e.g. for snort -r).
+*/
+
+#include <cmath>
+#include <queue>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "ml_decode.h"
+
+/* New flows per second of each kind, and their shapes. */
+struct TrafficMix {
+    double bulk_rate = 10;
+    double udp_rate = 1000;
+    double echo_rate = 0;
+    double scan_rate = 0;
+
+    /* Data segments of a bulk transfer (on average). */
+    uint32_t bulk_segments = 1000;
+
+    /* Client and server addresses in use. */
+    uint32_t clients = 65536;
+    uint32_t servers = 1024;
+
+    uint64_t seed = 1;
+};
+
+/* A generated packet: the decoded view, plus what's only needed to encode it. */
+struct TrafficPacket {
+    DecodedPacket decoded;
+    uint32_t seq = 0;
+    uint32_t ack = 0;
+    uint8_t icmp_type = 0;
+    uint16_t icmp_seq = 0;
+};
+
+enum TrafficKind : uint8_t {
+    TRAFFIC_BULK = 0,
+    TRAFFIC_UDP = 1,
+    TRAFFIC_ECHO = 2,
+    TRAFFIC_SCAN = 3,
+    TRAFFIC_KINDS = 4
+};
+
+class TrafficGenerator {
+    public:
+        /* "start" is the first packet's time (in microseconds). */
+        TrafficGenerator(const TrafficMix& mix, int64_t start) : mix(mix), state(mix.seed) {
+            double rates[TRAFFIC_KINDS] = { mix.bulk_rate, mix.udp_rate, mix.echo_rate, mix.scan_rate };
+
+            for (int kind = 0; kind < TRAFFIC_KINDS; kind++) {
+                this->rates[kind] = rates[kind];
+                next_arrival[kind] = (rates[kind] > 0) ? start + interarrival(rates[kind]) : INT64_MAX;
+            }
+        }
+
+        /* The next packet, in timestamp order. Returns false when no kind has a rate. */
+        bool next(TrafficPacket& packet) {
+            while (true) {
+                int kind = 0;
+                for (int k = 1; k < TRAFFIC_KINDS; k++) {
+                    if (next_arrival[k] < next_arrival[kind]) kind = k;
+                }
+
+                /* A flow's next packet goes first, unless a new flow arrives before it. */
+                if (!events.empty() && events.top().time <= next_arrival[kind]) {
+                    Event event = events.top();
+                    events.pop();
+
+                    if (step(event, packet)) return true;
+                    continue;
+                }
+
+                if (next_arrival[kind] == INT64_MAX) return false;
+
+                int64_t now = next_arrival[kind];
+                next_arrival[kind] += interarrival(rates[kind]);
+
+                start_flow((TrafficKind)kind, now);
+            }
+        }
+
+        uint64_t flows_started(TrafficKind kind) const {
+            return started[kind];
+        }
+
+        /* Flows still sending packets. */
+        size_t live_flows() const {
+            return flows.size() - free_slots.size();
+        }
+
+    private:
+        struct Flow {
+            TrafficKind kind;
+            uint32_t client;
+            uint32_t server;
+            uint16_t client_port;
+            uint16_t server_port;
+            uint16_t icmp_id;
+
+            /* Packets sent so far and, for each kind, what's left to send. */
+            uint32_t sent;
+            uint32_t remaining;
+            uint32_t burst;
+            bool from_client;       /* Bulk: direction of the data. */
+            bool answered;          /* Scan: whether the port is open (SYN/ACK) or closed (reset). */
+            bool pending_ack;
+
+            uint32_t client_seq;
+            uint32_t server_seq;
+            int64_t rtt;
+        };
+
+        struct Event {
+            int64_t time;
+            uint64_t order;
+            uint32_t flow;
+
+            bool operator>(const Event& other) const {
+                return (time != other.time) ? time > other.time : order > other.order;
+            }
+        };
+
+        uint64_t random() {
+            uint64_t value = (state += 0x9e3779b97f4a7c15ULL);
+            value = (value ^ (value >> 30)) * 0xbf58476d1ce4e5b9ULL;
+            value = (value ^ (value >> 27)) * 0x94d049bb133111ebULL;
+            return value ^ (value >> 31);
+        }
+
+        /* Uniform in (0, 1). */
+        double uniform() {
+            return ((random() >> 11) + 0.5) * (1.0 / 9007199254740992.0);
+        }
+
+        /* Exponential gap (in microseconds, at least 1) with the given mean. */
+        int64_t exponential(double mean) {
+            return 1 + (int64_t)(-std::log(uniform()) * mean);
+        }
+
+        int64_t interarrival(double rate) {
+            return exponential(1000000.0 / rate);
+        }
+
+        void schedule(uint32_t flow, int64_t time) {
+            events.push(Event { time, order++, flow });
+        }
+
+        void start_flow(TrafficKind kind, int64_t now) {
+            Flow flow;
+            memset(&flow, 0, sizeof(flow));
+
+            flow.kind = kind;
+            flow.client = 0x0a000000 + (uint32_t)(random() % mix.clients);
+            flow.server = 0xac100000 + (uint32_t)(random() % mix.servers);
+            flow.client_port = (uint16_t)(32768 + random() % 28232);
+            flow.client_seq = (uint32_t)random();
+            flow.server_seq = (uint32_t)random();
+            flow.rtt = 200 + (int64_t)(random() % 20000);
+
+            switch (kind) {
+                case TRAFFIC_BULK:
+                    flow.server_port = (random() % 2) ? 443 : 22;
+                    flow.remaining = (uint32_t)(1 + random() % (2 * (uint64_t)mix.bulk_segments));
+                    flow.from_client = (random() % 2) != 0;
+                    break;
+
+                case TRAFFIC_UDP:
+                    flow.server_port = (random() % 4) ? 53 : 123;
+                    flow.remaining = (uint32_t)(2 * (1 + random() % 3));
+                    break;
+
+                case TRAFFIC_ECHO:
+                    /* Spoofed sources (anywhere in 10/8), one victim. */
+                    flow.client = 0x0a000000 + (uint32_t)(random() & 0x00ffffff);
+                    flow.server = 0xac100000;
+                    flow.client_port = 0;
+                    flow.icmp_id = (uint16_t)random();
+                    flow.remaining = (uint32_t)(2 * (1 + random() % 4));
+                    break;
+
+                case TRAFFIC_SCAN: {
+                    /* A single scanner sweeping every port of every server in turn. */
+                    uint64_t probe = started[TRAFFIC_SCAN];
+
+                    flow.client = 0x0a000001;
+                    flow.client_port = 40000;
+                    flow.server = 0xac100000 + (uint32_t)((probe / 65535) % mix.servers);
+                    flow.server_port = (uint16_t)(1 + probe % 65535);
+                    flow.answered = (random() % 10) == 0;
+                    flow.remaining = flow.answered ? 3 : 2;
+                    break;
+                }
+
+                default:
+                    break;
+            }
+
+            uint32_t slot;
+            if (!free_slots.empty()) {
+                slot = free_slots.back();
+                free_slots.pop_back();
+                flows[slot] = flow;
+            } else {
+                slot = (uint32_t)flows.size();
+                flows.push_back(flow);
+            }
+
+            started[kind]++;
+            schedule(slot, now);
+        }
+
+        void end_flow(uint32_t slot) {
+            free_slots.push_back(slot);
+        }
+
+        /* Fills "packet" with a flow's next packet and schedules the one after, if any. */
+        bool step(const Event& event, TrafficPacket& packet) {
+            Flow& flow = flows[event.flow];
+            int64_t next = 0;
+
+            switch (flow.kind) {
+                case TRAFFIC_BULK: next = bulk_packet(flow, packet); break;
+                case TRAFFIC_UDP: next = udp_packet(flow, packet); break;
+                case TRAFFIC_ECHO: next = echo_packet(flow, packet); break;
+                case TRAFFIC_SCAN: next = scan_packet(flow, packet); break;
+                default: break;
+            }
+
+            packet.decoded.timestamp = event.time;
+            flow.sent++;
+
+            if (next > 0)
+                schedule(event.flow, event.time + next);
+            else
+                end_flow(event.flow);
+            return true;
+        }
+
+        /* Addresses, ports and lengths of a flow's packet ("payload" bytes after the L4 header). */
+        void fill(const Flow& flow, bool from_client, uint8_t protocol, uint16_t payload, TrafficPacket& packet) {
+            DecodedPacket& decoded = packet.decoded;
+            uint32_t source = htonl(from_client ? flow.client : flow.server);
+            uint32_t destination = htonl(from_client ? flow.server : flow.client);
+            uint16_t l4_size = (protocol == IPPROTO_TCP) ? 20 : 8;
+
+            decoded = DecodedPacket();
+            decoded.family = AF_INET;
+            decoded.protocol = protocol;
+            memcpy(decoded.src, &source, 4);
+            memcpy(decoded.dst, &destination, 4);
+            decoded.src_port = from_client ? flow.client_port : flow.server_port;
+            decoded.dst_port = from_client ? flow.server_port : flow.client_port;
+            decoded.dsize = payload;
+            decoded.pktlen = 14 + 20 + l4_size + payload;
+
+            packet.seq = from_client ? flow.client_seq : flow.server_seq;
+            packet.ack = from_client ? flow.server_seq : flow.client_seq;
+            packet.icmp_type = 0;
+            packet.icmp_seq = 0;
+        }
+
+        void tcp(Flow& flow, bool from_client, uint8_t flags, uint16_t payload, TrafficPacket& packet) {
+            fill(flow, from_client, IPPROTO_TCP, payload, packet);
+
+            packet.decoded.tcp_flags = flags;
+            packet.decoded.window = from_client ? 64240 : 65160;
+
+            /* SYN and FIN take a sequence number, like the payload's bytes. */
+            uint32_t length = payload + ((flags & 0x03) ? 1 : 0);
+            (from_client ? flow.client_seq : flow.server_seq) += length;
+        }
+
+        int64_t bulk_packet(Flow& flow, TrafficPacket& packet) {
+            const uint8_t FIN = 0x01, SYN = 0x02, PSH = 0x08, ACK = 0x10;
+
+            /* Handshake. */
+            if (flow.sent == 0) { tcp(flow, true, SYN, 0, packet); return flow.rtt / 2; }
+            if (flow.sent == 1) { tcp(flow, false, SYN | ACK, 0, packet); return flow.rtt / 2; }
+            if (flow.sent == 2) { tcp(flow, true, ACK, 0, packet); return 50; }
+
+            /* Every other segment is acknowledged right away. */
+            if (flow.pending_ack) {
+                flow.pending_ack = false;
+                tcp(flow, !flow.from_client, ACK, 0, packet);
+
+                if (flow.remaining > 0 && flow.burst == 0) {
+                    /* Idle between bursts: mostly short, sometimes long enough to end an active period. */
+                    flow.burst = (uint32_t)(8 + random() % 56);
+                    return (random() % 10 == 0) ? 5000000 + exponential(2000000) : exponential(200000);
+                }
+                return (flow.remaining > 0) ? 30 : flow.rtt / 2;
+            }
+
+            if (flow.remaining > 0) {
+                if (flow.burst == 0) flow.burst = (uint32_t)(8 + random() % 56);
+
+                flow.remaining--;
+                flow.burst = (flow.remaining > 0) ? flow.burst - 1 : 0;
+                flow.pending_ack = (flow.remaining % 2 == 0) || flow.burst == 0;
+
+                tcp(flow, flow.from_client, (flow.burst == 0) ? (PSH | ACK) : ACK, 1448, packet);
+                return 20;
+            }
+
+            /* Teardown: FIN/ACK from each side, then the last ACK. */
+            switch (flow.burst++) {
+                case 0: tcp(flow, true, FIN | ACK, 0, packet); return flow.rtt / 2;
+                case 1: tcp(flow, false, FIN | ACK, 0, packet); return flow.rtt / 2;
+                default: tcp(flow, true, ACK, 0, packet); return 0;
+            }
+        }
+
+        int64_t udp_packet(Flow& flow, TrafficPacket& packet) {
+            bool query = (flow.sent % 2 == 0);
+
+            fill(flow, query, IPPROTO_UDP, (uint16_t)(query ? 30 + random() % 50 : 100 + random() % 400), packet);
+
+            if (--flow.remaining == 0) return 0;
+            return query ? flow.rtt : exponential(50000);
+        }
+
+        int64_t echo_packet(Flow& flow, TrafficPacket& packet) {
+            bool request = (flow.sent % 2 == 0);
+
+            fill(flow, request, IPPROTO_ICMP, 56, packet);
+
+            packet.icmp_type = request ? 8 : 0;
+            packet.icmp_seq = (uint16_t)(flow.sent / 2);
+            memcpy(&packet.decoded.icmp_id, &flow.icmp_id, sizeof(flow.icmp_id));
+
+            if (--flow.remaining == 0) return 0;
+            return request ? flow.rtt : 1000;
+        }
+
+        int64_t scan_packet(Flow& flow, TrafficPacket& packet) {
+            const uint8_t SYN = 0x02, RST = 0x04, ACK = 0x10;
+
+            switch (flow.sent) {
+                case 0: tcp(flow, true, SYN, 0, packet); break;
+                case 1: tcp(flow, false, flow.answered ? (SYN | ACK) : (RST | ACK), 0, packet); break;
+                default: tcp(flow, true, RST, 0, packet); break;
+            }
+
+            if (--flow.remaining == 0) return 0;
+            return flow.rtt / 2;
+        }
+
+        TrafficMix mix;
+        uint64_t state;
+        uint64_t order = 0;
+
+        double rates[TRAFFIC_KINDS];
+        int64_t next_arrival[TRAFFIC_KINDS];
+        uint64_t started[TRAFFIC_KINDS] = { 0, 0, 0, 0 };
+
+        std::vector<Flow> flows;
+        std::vector<uint32_t> free_slots;
+        std::priority_queue<Event, std::vector<Event>, std::greater<Event>> events;
+};
+
+/* Internet checksum of "size" bytes, added to "sum". */
+inline uint32_t checksum_add(uint32_t sum, const uint8_t* data, size_t size) {
+    for (size_t i = 0; i + 1 < size; i += 2) sum += (uint32_t)((data[i] << 8) | data[i + 1]);
+    if (size % 2) sum += (uint32_t)(data[size - 1] << 8);
+    return sum;
+}
+
+inline uint16_t checksum_fold(uint32_t sum) {
+    while (sum >> 16) sum = (sum & 0xffff) + (sum >> 16);
+    return (uint16_t)~sum;
+}
+
+/*
+    Encodes a generated packet as an Ethernet frame (IPv4, zero payload) with valid checksums,
+    so Snort inspects it like a captured one.
+*/
+inline void encode_frame(const TrafficPacket& packet, std::vector<uint8_t>& frame) {
+    const DecodedPacket& decoded = packet.decoded;
+    size_t l4_size = decoded.is_tcp() ? 20 : 8;
+    size_t ip_size = 20 + l4_size + decoded.dsize;
+
+    frame.assign(14 + ip_size, 0);
+
+    /* Locally administered MACs, IPv4. */
+    uint8_t* ethernet = frame.data();
+    ethernet[0] = 0x02; ethernet[5] = 0x02;
+    ethernet[6] = 0x02; ethernet[11] = 0x01;
+    ethernet[12] = 0x08;
+
+    uint8_t* ip = ethernet + 14;
+    ip[0] = 0x45;
+    ip[2] = (uint8_t)(ip_size >> 8);
+    ip[3] = (uint8_t)ip_size;
+    ip[6] = 0x40;
+    ip[8] = 64;
+    ip[9] = decoded.protocol;
+    memcpy(ip + 12, decoded.src, 4);
+    memcpy(ip + 16, decoded.dst, 4);
+
+    uint16_t ip_checksum = checksum_fold(checksum_add(0, ip, 20));
+    ip[10] = (uint8_t)(ip_checksum >> 8);
+    ip[11] = (uint8_t)ip_checksum;
+
+    uint8_t* l4 = ip + 20;
+    size_t l4_length = l4_size + decoded.dsize;
+    uint32_t sum = 0;
+
+    if (decoded.protocol == IPPROTO_ICMP) {
+        l4[0] = packet.icmp_type;
+        memcpy(l4 + 4, &decoded.icmp_id, 2);
+        l4[6] = (uint8_t)(packet.icmp_seq >> 8);
+        l4[7] = (uint8_t)packet.icmp_seq;
+    } else {
+        l4[0] = (uint8_t)(decoded.src_port >> 8);
+        l4[1] = (uint8_t)decoded.src_port;
+        l4[2] = (uint8_t)(decoded.dst_port >> 8);
+        l4[3] = (uint8_t)decoded.dst_port;
+
+        /* Pseudo header. */
+        sum = checksum_add(sum, ip + 12, 8);
+        sum += decoded.protocol + (uint32_t)l4_length;
+    }
+
+    if (decoded.is_tcp()) {
+        for (int i = 0; i < 4; i++) {
+            l4[4 + i] = (uint8_t)(packet.seq >> (24 - 8 * i));
+            l4[8 + i] = (uint8_t)(packet.ack >> (24 - 8 * i));
+        }
+        l4[12] = 0x50;
+        l4[13] = decoded.tcp_flags;
+        l4[14] = (uint8_t)(decoded.window >> 8);
+        l4[15] = (uint8_t)decoded.window;
+    } else if (decoded.protocol == IPPROTO_UDP) {
+        l4[4] = (uint8_t)(l4_length >> 8);
+        l4[5] = (uint8_t)l4_length;
+    }
+
+    /* The payload is zeros, so only the header is summed. */
+    uint16_t l4_checksum = checksum_fold(checksum_add(sum, l4, l4_size));
+
+    /* A UDP checksum of 0 means "none". */
+    if (decoded.protocol == IPPROTO_UDP && l4_checksum == 0) l4_checksum = 0xffff;
+    size_t offset = decoded.is_tcp() ? 16 : (decoded.protocol == IPPROTO_UDP ? 6 : 2);
+
+    l4[offset] = (uint8_t)(l4_checksum >> 8);
+    l4[offset + 1] = (uint8_t)l4_checksum;
+}
+
+#endif
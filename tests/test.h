@@ -0,0 +1,32 @@
+#ifndef ML_TEST_H
+#define ML_TEST_H
+
+/*
+    Minimal test harness of the unit tests (registered with CTest, see CMakeLists.txt).
+    A test is a program: CHECK() reports every failed condition and test_result() turns
+    them into the exit status.
+*/
+
+#include <iostream>
+
+static int test_failures = 0;
+
+#define CHECK(condition) \
+    do { \
+        if (!(condition)) { \
+            std::cerr << "[*] Error! " << __FILE__ << ":" << __LINE__ << ": " << #condition << std::endl; \
+            test_failures++; \
+        } \
+    } while (0)
+
+inline int test_result(const char* name) {
+    if (test_failures == 0) {
+        std::cout << "[*] " << name << ": OK." << std::endl;
+        return 0;
+    }
+
+    std::cout << "[*] " << name << ": " << test_failures << " failed checks." << std::endl;
+    return 1;
+}
+
+#endif
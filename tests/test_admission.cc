@@ -0,0 +1,160 @@
+// test_admission.cc
+
+/*
+    Unit tests of the admission filter (ml_admission.h): the probe sketches and the
+    probation table.
+*/
+
+#include "../ml_admission.h"
+#include "test.h"
+
+static void test_count_min() {
+    CountMinSketch sketch;
+    sketch.configure(1024, 4);
+
+    for (uint32_t i = 1; i <= 100; i++) {
+        CHECK(sketch.add(7) == i);
+    }
+
+    /* Never underestimates, and with far fewer keys than counters, collisions barely overestimate. */
+    uint32_t total_error = 0;
+
+    for (uint64_t key = 1000; key < 1100; key++) {
+        uint32_t estimate = sketch.add(key);
+
+        CHECK(estimate >= 1);
+        total_error += estimate - 1;
+    }
+    CHECK(total_error <= 5);
+    CHECK(sketch.add(7) >= 101);
+
+    sketch.clear();
+    CHECK(sketch.add(7) == 1);
+}
+
+static void test_hyperloglog() {
+    HyperLogLog peers;
+    CHECK(peers.estimate() == 0);
+
+    /* Retries of the same peers don't count. */
+    for (int retry = 0; retry < 10; retry++) {
+        for (uint64_t peer = 0; peer < 4; peer++) peers.add(peer);
+    }
+    CHECK(peers.estimate() > 3.5 && peers.estimate() < 4.5);
+
+    /* A scan: about 13% standard error, checked at three times that. */
+    for (uint64_t peer = 0; peer < 1000; peer++) peers.add(peer);
+    CHECK(peers.estimate() > 600 && peers.estimate() < 1400);
+
+    peers.clear();
+    CHECK(peers.estimate() == 0);
+}
+
+static void test_fanout() {
+    FanoutTracker tracker;
+    tracker.configure(16, 64, 1000);
+
+    std::vector<FanoutEvent> events;
+    auto scanner = []() { return std::string("scanner"); };
+    auto retrier = []() { return std::string("retrier"); };
+
+    /* A key retrying a few peers is never reported, one probing many is reported once. */
+    for (uint64_t peer = 0; peer < 200; peer++) {
+        tracker.observe(1, peer, 10, scanner, events);
+        tracker.observe(2, peer % 3, 10, retrier, events);
+    }
+
+    CHECK(events.size() == 1);
+    CHECK(events[0].label == "scanner" && !events[0].summary);
+    CHECK(events[0].peers >= 64);
+
+    /* The window's end summarizes it, with every probe counted once tracked. */
+    events.clear();
+    tracker.observe(3, 0, 1010, scanner, events);
+
+    CHECK(events.size() == 1);
+    CHECK(events[0].label == "scanner" && events[0].summary);
+    CHECK(events[0].probes == 200);
+}
+
+/* The parts of a held probe the table's users read. */
+struct HeldPacket {
+    int id = 0;
+    bool from_client = true;
+};
+
+/*
+    Same decision as admit_flow() in ml_classifiers.h: a packet of a held flow promotes it
+    only if it goes the other way, otherwise the flow stays on probation as it was.
+    Returns true (and the held packet) when the flow is promoted.
+*/
+static bool answer(ProbationTable<HeldPacket>& probation, uint64_t key, bool from_client, HeldPacket& first) {
+    HeldPacket* held = probation.find(key);
+
+    if (!held || held->from_client == from_client) return false;
+    return probation.release(key, first);
+}
+
+static void test_answer() {
+    ProbationTable<HeldPacket> probation;
+    probation.configure(16, 1000);
+
+    HeldPacket syn, evicted, first;
+    syn.id = 1;
+
+    CHECK(!probation.hold(42, 0, syn, evicted));
+    CHECK(probation.size() == 1);
+
+    CHECK(answer(probation, 42, false, first));
+    CHECK(first.id == 1);
+    CHECK(probation.size() == 0);
+    CHECK(probation.find(42) == nullptr);
+}
+
+static void test_retransmit() {
+    ProbationTable<HeldPacket> probation;
+    probation.configure(16, 1000);
+
+    HeldPacket syn, evicted, first;
+    syn.id = 1;
+
+    probation.hold(42, 0, syn, evicted);
+
+    /* A retransmitted SYN: still on probation, with its first packet. */
+    CHECK(!answer(probation, 42, true, first));
+    CHECK(probation.size() == 1);
+    CHECK(probation.find(42) != nullptr && probation.find(42)->id == 1);
+
+    /* Retransmissions don't extend the probation: it still times out when the first packet was due to. */
+    std::vector<HeldPacket> expired;
+    probation.expire(1001, expired);
+
+    CHECK(expired.size() == 1 && expired[0].id == 1);
+    CHECK(probation.size() == 0);
+}
+
+static void test_eviction() {
+    ProbationTable<HeldPacket> probation;
+    probation.configure(1, 1000);
+
+    HeldPacket a, b, evicted;
+    a.id = 1;
+    b.id = 2;
+
+    CHECK(!probation.hold(1, 0, a, evicted));
+    CHECK(probation.hold(2, 0, b, evicted));
+    CHECK(evicted.id == 1);
+    CHECK(probation.size() == 1);
+    CHECK(probation.find(1) == nullptr);
+}
+
+int main() {
+    test_count_min();
+    test_hyperloglog();
+    test_fanout();
+    test_answer();
+    test_retransmit();
+    test_eviction();
+
+    return test_result("test_admission");
+}
@@ -0,0 +1,88 @@
+// test_cache.cc
+
+/*
+    Unit tests of the verdict cache (ml_cache.h).
+    Keys that are multiples of 16 all go to the first shard, so a cache of 32 entries
+    gives them a shard of 2 to evict from.
+*/
+
+#include "../ml_cache.h"
+#include "test.h"
+
+static void test_lookup() {
+    VerdictCache cache;
+    cache.configure(32, 100);
+
+    float verdict = -1;
+
+    CHECK(!cache.lookup(16, 0, verdict));
+
+    cache.insert(16, 0, 0.75f);
+    CHECK(cache.lookup(16, 100, verdict) && verdict == 0.75f);
+
+    /* Expired once "now" is past its TTL. */
+    CHECK(!cache.lookup(16, 101, verdict));
+
+    /* Refreshing an entry replaces the verdict and the TTL. */
+    cache.insert(16, 101, 0.25f);
+    CHECK(cache.lookup(16, 201, verdict) && verdict == 0.25f);
+
+    CHECK(cache.stats.lookups == 4);
+    CHECK(cache.stats.hits == 2);
+    CHECK(cache.stats.inserts == 2);
+    CHECK(cache.stats.evictions == 0);
+}
+
+static void test_clock() {
+    VerdictCache cache;
+    cache.configure(32, 1000);
+
+    float verdict;
+
+    cache.insert(0, 0, 1);
+    cache.insert(16, 0, 2);
+
+    /* A hit gives the entry a second chance: the hand skips it and evicts the other one. */
+    CHECK(cache.lookup(0, 0, verdict));
+    cache.insert(32, 0, 3);
+
+    CHECK(cache.lookup(0, 0, verdict) && verdict == 1);
+    CHECK(!cache.lookup(16, 0, verdict));
+    CHECK(cache.lookup(32, 0, verdict) && verdict == 3);
+    CHECK(cache.stats.evictions == 1);
+
+    /* Both entries were hit since: the hand clears them in a full turn and evicts the one it started from. */
+    cache.insert(48, 0, 4);
+
+    CHECK(!cache.lookup(0, 0, verdict));
+    CHECK(cache.lookup(32, 0, verdict) && verdict == 3);
+    CHECK(cache.lookup(48, 0, verdict) && verdict == 4);
+    CHECK(cache.stats.evictions == 2);
+}
+
+static void test_expired_first() {
+    VerdictCache cache;
+    cache.configure(32, 100);
+
+    float verdict;
+
+    cache.insert(0, 0, 1);
+    cache.insert(16, 50, 2);
+
+    /* Referenced but expired: no second chance. */
+    CHECK(cache.lookup(0, 100, verdict));
+    CHECK(cache.lookup(16, 100, verdict));
+    cache.insert(32, 120, 3);
+
+    CHECK(!cache.lookup(0, 120, verdict));
+    CHECK(cache.lookup(16, 120, verdict) && verdict == 2);
+    CHECK(cache.lookup(32, 120, verdict) && verdict == 3);
+}
+
+int main() {
+    test_lookup();
+    test_clock();
+    test_expired_first();
+
+    return test_result("test_cache");
+}
@@ -0,0 +1,182 @@
+// test_checkpoint.cc
+
+/*
+    Unit tests of the checkpoints (ml_checkpoint.h) and of the Connection <-> FlowRecord
+    round trip (ml_connection.h).
+*/
+
+#include <cmath>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+#include "../ml_connection.h"
+#include "test.h"
+
+static FlowPacket packet(int64_t timestamp, bool from_client, uint8_t flags, uint16_t dsize) {
+    FlowPacket p;
+
+    p.timestamp = timestamp;
+    p.pktlen = dsize + 54;
+    p.dsize = dsize;
+    p.protocol = 6;
+    p.tcp = true;
+    p.from_client = from_client;
+    p.tcp_flags = flags;
+    p.window = from_client ? 64240 : 65160;
+    p.client_ip = "10.0.0.1";
+    p.server_ip = "2001:db8::80";
+    p.client_port = 40000;
+    p.server_port = 80;
+    return p;
+}
+
+static bool same_features(Connection& a, Connection& b) {
+    double fa[NUM_FEATURES], fb[NUM_FEATURES];
+
+    a.get_feature_vector(fa);
+    b.get_feature_vector(fb);
+
+    for (size_t i = 0; i < NUM_FEATURES; i++) {
+        if (fa[i] != fb[i] && !(std::isnan(fa[i]) && std::isnan(fb[i]))) {
+            std::cerr << "[*] Feature " << i << ": " << fa[i] << " != " << fb[i] << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+    A probe seen while only the flags were tracked: the subflow helpers still hold -1 and the
+    bulk ones 0, which mean "unset" and must survive a restore (rebased, they'd look like times).
+*/
+static void test_sentinels() {
+    ml_tracked_state = TRACK_FLAGS;
+    Connection probe(packet(1000000, true, FLOW_SYN, 0), "probe");
+    ml_tracked_state = TRACK_ALL;
+
+    FlowRecord record;
+    probe.to_record(record);
+
+    CHECK(record.flow_first_seen == 1000000);
+    CHECK(record.sf_ac_helper == -1);
+    CHECK(record.sf_last_packet_timestamp == -1);
+    CHECK(record.f_bulk_start_helper == 0);
+    CHECK(record.b_bulk_last_timestamp == 0);
+
+    /* Only the set timestamps are shifted. */
+    Connection restored(record, 5000000);
+
+    FlowRecord again;
+    restored.to_record(again);
+
+    CHECK(again.flow_first_seen == 6000000);
+    CHECK(again.flow_last_seen == record.flow_last_seen + 5000000);
+    CHECK(again.sf_ac_helper == -1);
+    CHECK(again.sf_last_packet_timestamp == -1);
+    CHECK(again.f_bulk_start_helper == 0);
+    CHECK(again.f_bulk_last_timestamp == 0);
+    CHECK(again.b_bulk_start_helper == 0);
+    CHECK(again.b_bulk_last_timestamp == 0);
+    CHECK(strcmp(again.flow_id, "probe") == 0);
+    CHECK(strcmp(again.server_ip, "2001:db8::80") == 0);
+
+    /* Once the subflows are tracked again, the restored probe starts them from its next packet. */
+    restored.add_packet(packet(6000100, false, FLOW_RST, 0));
+    restored.to_record(again);
+
+    CHECK(again.sf_ac_helper == 6000100);
+    CHECK(again.sf_last_packet_timestamp == 6000100);
+}
+
+/* Saved mid-flow, restored after a downtime, fed the rest of the flow shifted by that downtime. */
+static void test_round_trip() {
+    const int64_t downtime = 3600000000LL;
+
+    std::vector<FlowPacket> first = {
+        packet(1000000, true, FLOW_SYN, 0),
+        packet(1000150, false, FLOW_SYN | FLOW_ACK, 0),
+        packet(1000300, true, FLOW_ACK, 0),
+        packet(1000400, true, FLOW_PSH | FLOW_ACK, 500),
+        packet(1000500, true, FLOW_ACK, 1400),
+        packet(1000600, true, FLOW_ACK, 1400),
+        packet(1000700, true, FLOW_PSH | FLOW_ACK, 1400),
+    };
+    std::vector<FlowPacket> rest = {
+        packet(1200000, false, FLOW_ACK, 0),
+        packet(1200100, false, FLOW_PSH | FLOW_ACK, 900),
+        packet(3500000, true, FLOW_ACK, 20),
+        packet(3500100, true, FLOW_FIN | FLOW_ACK, 0),
+        packet(3500200, false, FLOW_FIN | FLOW_ACK, 0),
+    };
+
+    Connection original(first[0], "flow");
+    for (size_t i = 1; i < first.size(); i++) original.add_packet(first[i]);
+
+    FlowRecord saved;
+    original.to_record(saved);
+
+    std::string path = "/tmp/test_checkpoint." + std::to_string(getpid());
+    CHECK(write_checkpoint(path, std::vector<FlowRecord>(1, saved), saved.flow_last_seen));
+
+    CheckpointFile file;
+    std::string error;
+
+    CHECK(file.open(path, error));
+    CHECK(file.header()->num_records == 1);
+    CHECK(file.header()->saved_at == 1000700);
+    CHECK(memcmp(&file.records()[0], &saved, sizeof(saved)) == 0);
+
+    Connection same(file.records()[0], 0);
+    Connection restored(file.records()[0], downtime);
+
+    CHECK(same_features(original, same));
+    CHECK(same_features(original, restored));
+
+    for (const FlowPacket& p : rest) {
+        FlowPacket shifted = p;
+        shifted.timestamp += downtime;
+
+        original.add_packet(p);
+        restored.add_packet(shifted);
+    }
+
+    CHECK(restored.get_flowfirstseen() == original.get_flowfirstseen() + downtime);
+    CHECK(same_features(original, restored));
+
+    unlink(path.c_str());
+}
+
+static void test_refused() {
+    std::string path = "/tmp/test_checkpoint." + std::to_string(getpid());
+    std::string error;
+
+    CHECK(write_checkpoint(path, std::vector<FlowRecord>(2), 0));
+
+    /* Truncated: the header announces two records. */
+    CHECK(truncate(path.c_str(), sizeof(CheckpointHeader) + sizeof(FlowRecord)) == 0);
+    {
+        CheckpointFile file;
+        CHECK(!file.open(path, error) && error.find("truncated") != std::string::npos);
+    }
+
+    CHECK(truncate(path.c_str(), 8) == 0);
+    {
+        CheckpointFile file;
+        CHECK(!file.open(path, error) && error.find("too short") != std::string::npos);
+    }
+
+    unlink(path.c_str());
+
+    CheckpointFile missing;
+    CHECK(!missing.open(path, error));
+}
+
+int main() {
+    test_sentinels();
+    test_round_trip();
+    test_refused();
+
+    return test_result("test_checkpoint");
+}
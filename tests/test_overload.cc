@@ -0,0 +1,104 @@
+// test_overload.cc
+
+/*
+    Unit tests of the overload controller (ml_overload.h).
+*/
+
+#include "../ml_overload.h"
+#include "test.h"
+
+/* Feeds an interval of packets taking "nsecs" each, the last one crossing into the next interval. */
+static bool run_interval(OverloadController& overload, int64_t& now, uint64_t nsecs, uint64_t queue) {
+    for (int i = 0; i < 9; i++) {
+        CHECK(!overload.observe(nsecs, now, queue));
+        now += 100;
+    }
+    return overload.observe(nsecs, now, queue);
+}
+
+static void test_levels() {
+    OverloadController overload;
+    overload.configure(1000, 100, 0.5, 1000);
+
+    int64_t now = 1;
+
+    /* The first packet only starts the first interval. */
+    CHECK(!overload.observe(5000, now, 0));
+    now += 100;
+    CHECK(overload.level() == OVERLOAD_NONE);
+
+    /* Over the latency budget: one step per interval, up to CHEAP. */
+    CHECK(run_interval(overload, now, 5000, 0));
+    CHECK(overload.level() == OVERLOAD_SAMPLING);
+    now += 100;
+
+    CHECK(run_interval(overload, now, 5000, 0));
+    CHECK(overload.level() == OVERLOAD_REDUCED);
+    now += 100;
+
+    /* The backlog alone escalates too. */
+    CHECK(run_interval(overload, now, 10, 101));
+    CHECK(overload.level() == OVERLOAD_CHEAP);
+    now += 100;
+
+    CHECK(!run_interval(overload, now, 5000, 0));
+    CHECK(overload.level() == OVERLOAD_CHEAP);
+    CHECK(overload.stats.escalations == 3);
+    now += 100;
+
+    /* Between half the budget and the budget, the level holds. */
+    CHECK(!run_interval(overload, now, 800, 0));
+    CHECK(overload.level() == OVERLOAD_CHEAP);
+    now += 100;
+
+    /* Under half of both, one step down per interval. */
+    CHECK(run_interval(overload, now, 100, 10));
+    CHECK(overload.level() == OVERLOAD_REDUCED);
+    now += 100;
+
+    CHECK(!run_interval(overload, now, 100, 60));
+    CHECK(overload.level() == OVERLOAD_REDUCED);
+    now += 100;
+
+    CHECK(run_interval(overload, now, 100, 0));
+    now += 100;
+
+    CHECK(run_interval(overload, now, 100, 0));
+    CHECK(overload.level() == OVERLOAD_NONE);
+}
+
+static void test_sampling() {
+    OverloadController overload;
+    overload.configure(1000, 100, 0.25, 1000);
+
+    int64_t now = 1;
+
+    /* Every flow is tracked until the controller samples. */
+    for (uint64_t flow = 0; flow < 1000; flow++) CHECK(overload.sampled(flow));
+
+    overload.observe(5000, now, 0);
+    now += 100;
+    CHECK(run_interval(overload, now, 5000, 0));
+    CHECK(overload.level() == OVERLOAD_SAMPLING);
+
+    /* About a quarter of the flows, and always the same ones. */
+    int kept = 0;
+
+    for (uint64_t flow = 0; flow < 10000; flow++) {
+        if (overload.sampled(flow)) {
+            kept++;
+            CHECK(overload.sampled(flow));
+        }
+    }
+    CHECK(kept > 2300 && kept < 2700);
+
+    for (int i = 0; i < 3; i++) overload.shed();
+    CHECK(overload.shed_permille() == 3 * 1000 / overload.stats.packets);
+}
+
+int main() {
+    test_levels();
+    test_sampling();
+
+    return test_result("test_overload");
+}
@@ -0,0 +1,88 @@
+// test_pool.cc
+
+/*
+    Unit tests of the work-stealing pool (ml_pool.h).
+*/
+
+#include <atomic>
+#include <vector>
+
+#include <unistd.h>
+
+#include "../ml_pool.h"
+#include "test.h"
+
+/* Every item is visited exactly once, whatever the pool and grain sizes. */
+static void test_parallel_for() {
+    for (unsigned workers : { 0, 1, 4 }) {
+        TaskPool pool(workers);
+
+        for (size_t count : { 0, 1, 7, 1000 }) {
+            for (size_t grain : { 0, 1, 16, 2000 }) {
+                std::vector<std::atomic<int>> visits(count);
+                for (std::atomic<int>& v : visits) v = 0;
+
+                pool.parallel_for(count, grain, [&](size_t begin, size_t end) {
+                    CHECK(begin < end && end <= count);
+                    for (size_t i = begin; i < end; i++) visits[i]++;
+                });
+
+                for (size_t i = 0; i < count; i++) CHECK(visits[i] == 1);
+            }
+        }
+    }
+}
+
+/* A task splitting its work over the pool again waits for its own chunks only. */
+static void test_nested() {
+    TaskPool pool(2);
+    std::atomic<int> total { 0 };
+
+    pool.parallel_for(8, 1, [&](size_t, size_t) {
+        pool.parallel_for(100, 10, [&](size_t begin, size_t end) {
+            total += (int)(end - begin);
+        });
+    });
+
+    CHECK(total == 800);
+}
+
+/*
+    The caller of wait() holds something the tasks of another group wait for (the readers
+    of a batch, for a model load). Those are queued first and the worker is stuck in one of
+    them, so the batch only completes if the caller runs its own tasks and none of the others.
+*/
+static void test_group_only() {
+    for (int round = 0; round < 100; round++) {
+        TaskPool pool(1);
+        TaskGroup loads, batch;
+
+        std::atomic<bool> reading { true };
+        std::atomic<int> scored { 0 };
+
+        for (int i = 0; i < 4; i++) {
+            pool.submit([&]() { while (reading) std::this_thread::yield(); }, &loads);
+        }
+        for (int i = 0; i < 64; i++) {
+            pool.submit([&]() { scored++; }, &batch);
+        }
+
+        pool.wait(batch);
+        CHECK(scored == 64);
+
+        reading = false;
+        pool.wait(loads);
+        CHECK(loads.pending == 0);
+    }
+}
+
+int main() {
+    /* A deadlock is a failure too, not a hung test. */
+    alarm(60);
+
+    test_parallel_for();
+    test_nested();
+    test_group_only();
+
+    return test_result("test_pool");
+}
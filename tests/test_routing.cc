@@ -0,0 +1,104 @@
+// test_routing.cc
+
+/*
+    Unit tests of the model routing table (ml_routing.h).
+*/
+
+#include "../ml_routing.h"
+#include "test.h"
+
+static void test_longest_match() {
+    RouteTable table;
+    std::string error;
+
+    /* Added in no particular order: build() sorts the prefixes by length. */
+    CHECK(table.add("10.1.2.0/24", "", 3, error));
+    CHECK(table.add("10.0.0.0/8", "", 1, error));
+    CHECK(table.add("10.1.0.0/16", "", 2, error));
+    CHECK(table.add("10.1.2.128/25", "", 4, error));
+    CHECK(table.add("10.1.2.200/32", "", 5, error));
+    table.build();
+
+    CHECK(table.lookup("10.9.9.9", 80) == 1);
+    CHECK(table.lookup("10.1.9.9", 80) == 2);
+    CHECK(table.lookup("10.1.2.1", 80) == 3);
+    CHECK(table.lookup("10.1.2.127", 80) == 3);
+    CHECK(table.lookup("10.1.2.128", 80) == 4);
+    CHECK(table.lookup("10.1.2.200", 80) == 5);
+    CHECK(table.lookup("10.1.2.201", 80) == 4);
+    CHECK(table.lookup("11.0.0.1", 80) == -1);
+    CHECK(table.lookup("not an address", 80) == -1);
+}
+
+static void test_ports() {
+    RouteTable table;
+    std::string error;
+
+    CHECK(table.add("any", "", 0, error));
+    CHECK(table.add("192.168.0.0/16", "", 1, error));
+    CHECK(table.add("192.168.0.0/16", "22 8000-8099", 2, error));
+    CHECK(table.add("192.168.1.0/24", "53", 3, error));
+    table.build();
+
+    /* A prefix's specific ports come before its "every port" route, even when added after it. */
+    CHECK(table.lookup("192.168.5.5", 22) == 2);
+    CHECK(table.lookup("192.168.5.5", 8050) == 2);
+    CHECK(table.lookup("192.168.5.5", 8100) == 1);
+
+    /* A longer prefix only takes its own ports, the others fall back to the prefixes covering it. */
+    CHECK(table.lookup("192.168.1.5", 53) == 3);
+    CHECK(table.lookup("192.168.1.5", 22) == 2);
+    CHECK(table.lookup("192.168.1.5", 443) == 1);
+
+    /* "any" covers both families. */
+    CHECK(table.lookup("172.16.0.1", 443) == 0);
+    CHECK(table.lookup("2001:db8::1", 443) == 0);
+}
+
+static void test_ip6() {
+    RouteTable table;
+    std::string error;
+
+    CHECK(table.add("2001:db8::/32", "", 1, error));
+    CHECK(table.add("2001:db8:0:1::/64", "", 2, error));
+    CHECK(table.add("2001:db8:0:1::42/128", "", 3, error));
+    table.build();
+
+    CHECK(table.lookup("2001:db8:5::1", 80) == 1);
+    CHECK(table.lookup("2001:db8:0:1::1", 80) == 2);
+    CHECK(table.lookup("2001:db8:0:1::42", 80) == 3);
+    CHECK(table.lookup("2001:db9::1", 80) == -1);
+
+    /* Families don't mix. */
+    CHECK(table.lookup("32.1.13.184", 80) == -1);
+}
+
+static void test_errors() {
+    RouteTable table;
+    std::string error;
+
+    CHECK(!table.add("10.0.0.0/33", "", 1, error) && !error.empty());
+    CHECK(!table.add("10.0.0/8", "", 1, error));
+    CHECK(!table.add("10.0.0.0/8", "80-22", 1, error));
+    CHECK(!table.add("10.0.0.0/8", "70000", 1, error));
+    CHECK(!table.add("10.0.0.0/8", "http", 1, error));
+    CHECK(table.empty());
+
+    /* Bits past the prefix length are ignored. */
+    CHECK(table.add("10.1.2.3/8", "", 1, error));
+    table.build();
+    CHECK(table.lookup("10.200.0.1", 80) == 1);
+
+    table.clear();
+    CHECK(table.empty());
+    CHECK(table.lookup("10.200.0.1", 80) == -1);
+}
+
+int main() {
+    test_longest_match();
+    test_ports();
+    test_ip6();
+    test_errors();
+
+    return test_result("test_routing");
+}
@@ -0,0 +1,89 @@
+// test_service.cc
+
+/*
+    Unit tests of the background service (ml_service.h).
+*/
+
+#include <atomic>
+
+#include "../ml_service.h"
+#include "test.h"
+
+static void wait_for(const std::atomic<int>& counter, int value) {
+    for (int i = 0; i < 2000 && counter < value; i++) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+}
+
+static void test_periodic() {
+    BackgroundService service;
+    std::atomic<int> runs { 0 };
+
+    service.schedule(std::chrono::milliseconds(5), [&runs]() { runs++; });
+    service.start();
+    CHECK(service.running());
+
+    wait_for(runs, 3);
+    service.stop();
+
+    CHECK(runs >= 3);
+    CHECK(!service.running());
+}
+
+/* A reload replaces the jobs while the service runs: the old ones stop, the new ones start. */
+static void test_reschedule() {
+    BackgroundService service;
+    std::atomic<int> old_runs { 0 }, new_runs { 0 };
+
+    service.schedule(std::chrono::milliseconds(5), [&old_runs]() { old_runs++; });
+    service.start();
+    wait_for(old_runs, 1);
+
+    service.clear();
+    int stopped_at = old_runs;
+    service.schedule(std::chrono::milliseconds(5), [&new_runs]() { new_runs++; });
+
+    wait_for(new_runs, 3);
+    service.stop();
+
+    CHECK(new_runs >= 3);
+    CHECK(old_runs <= stopped_at + 1);
+}
+
+/* Jobs scheduled on a running service without any job yet (e.g. a first configuration after start()). */
+static void test_late_jobs() {
+    BackgroundService service;
+    std::atomic<int> runs { 0 };
+
+    service.start();
+    service.schedule(std::chrono::milliseconds(5), [&runs]() { runs++; });
+
+    wait_for(runs, 1);
+    service.stop();
+
+    CHECK(runs >= 1);
+}
+
+/* Stopping wakes the thread up instead of waiting for the next job. */
+static void test_stop() {
+    BackgroundService service;
+    std::atomic<int> runs { 0 };
+
+    service.schedule(std::chrono::hours(1), [&runs]() { runs++; });
+    service.start();
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    service.stop();
+
+    CHECK(std::chrono::steady_clock::now() - start < std::chrono::seconds(1));
+    CHECK(runs == 0);
+}
+
+int main() {
+    test_periodic();
+    test_reschedule();
+    test_late_jobs();
+    test_stop();
+
+    return test_result("test_service");
+}
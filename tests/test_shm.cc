@@ -0,0 +1,180 @@
+// test_shm.cc
+
+/*
+    Unit tests of the external scorer's rings (ml_shm.h). Both ends are mapped in this
+    process, the scorer side through attach() as the Python scorer does.
+*/
+
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "../ml_shm.h"
+#include "test.h"
+
+static const uint32_t num_features = 3;
+
+static void features_of(uint64_t tag, double* features) {
+    for (uint32_t i = 0; i < num_features; i++) features[i] = tag * 10.0 + i;
+}
+
+/* Many laps of a small ring, in uneven batches, so every slot wraps around many times. */
+static void test_wraparound(const std::string& name) {
+    ScorerRing inspector, scorer;
+    std::string error;
+
+    CHECK(inspector.create(name, 5, num_features, error));
+    CHECK(inspector.capacity() == 8);
+    CHECK(scorer.attach(name, error));
+    CHECK(scorer.capacity() == 8 && scorer.num_features() == num_features);
+
+    uint64_t next_tag = 0, next_request = 0, next_verdict = 0;
+    double features[8 * num_features];
+    uint64_t tags[8];
+    RingVerdict verdicts[8];
+
+    for (int round = 0; round < 100; round++) {
+        size_t batch = 1 + round % 7;
+
+        for (size_t i = 0; i < batch; i++) {
+            features_of(next_tag, features);
+            CHECK(inspector.push_request(next_tag++, features));
+        }
+
+        /* Popped in two goes, in order, with their own features. */
+        size_t popped = scorer.pop_requests(tags, features, batch / 2);
+        popped += scorer.pop_requests(tags + popped, features + popped * num_features, 8);
+        CHECK(popped == batch);
+
+        for (size_t i = 0; i < popped; i++) {
+            CHECK(tags[i] == next_request);
+            CHECK(features[i * num_features] == next_request * 10.0);
+            CHECK(features[i * num_features + num_features - 1] == next_request * 10.0 + num_features - 1);
+
+            verdicts[i].tag = tags[i];
+            verdicts[i].label = (float)(tags[i] % 2);
+            verdicts[i].confidence = 0.5;
+            next_request++;
+        }
+
+        CHECK(scorer.push_verdicts(verdicts, popped) == popped);
+        CHECK(inspector.pop_verdicts(verdicts, 8) == popped);
+
+        for (size_t i = 0; i < popped; i++) {
+            CHECK(verdicts[i].tag == next_verdict);
+            CHECK(verdicts[i].label == (float)(next_verdict % 2));
+            next_verdict++;
+        }
+    }
+
+    CHECK(next_verdict == next_tag && next_tag > 3 * 8 * 8);
+}
+
+/* A full ring refuses requests (and verdicts) until the other side frees a slot. */
+static void test_full(const std::string& name) {
+    ScorerRing inspector, scorer;
+    std::string error;
+
+    CHECK(inspector.create(name, 4, num_features, error));
+    CHECK(scorer.attach(name, error));
+
+    double features[4 * num_features] = { 0 };
+    uint64_t tags[4];
+
+    for (uint64_t tag = 0; tag < 4; tag++) CHECK(inspector.push_request(tag, features));
+    CHECK(!inspector.push_request(4, features));
+
+    CHECK(scorer.pop_requests(tags, features, 1) == 1 && tags[0] == 0);
+    CHECK(inspector.push_request(4, features));
+    CHECK(!inspector.push_request(5, features));
+
+    CHECK(scorer.pop_requests(tags, features, 4) == 4 && tags[0] == 1 && tags[3] == 4);
+    CHECK(scorer.pop_requests(tags, features, 4) == 0);
+
+    RingVerdict verdicts[6] = {};
+    CHECK(scorer.push_verdicts(verdicts, 6) == 4);
+    CHECK(scorer.push_verdicts(verdicts, 1) == 0);
+    CHECK(inspector.pop_verdicts(verdicts, 2) == 2);
+    CHECK(scorer.push_verdicts(verdicts, 6) == 2);
+}
+
+/* Several producers at once: every request comes out exactly once. */
+static void test_producers(const std::string& name) {
+    ScorerRing inspector, scorer;
+    std::string error;
+
+    CHECK(inspector.create(name, 64, num_features, error));
+    CHECK(scorer.attach(name, error));
+
+    const uint64_t per_thread = 20000;
+    const unsigned num_threads = 4;
+    std::vector<std::thread> producers;
+
+    for (unsigned t = 0; t < num_threads; t++) {
+        producers.push_back(std::thread([&inspector, t, per_thread]() {
+            double features[num_features];
+
+            for (uint64_t i = 0; i < per_thread; i++) {
+                uint64_t tag = t * per_thread + i;
+                features_of(tag, features);
+                while (!inspector.push_request(tag, features)) std::this_thread::yield();
+            }
+        }));
+    }
+
+    std::vector<int> seen(num_threads * per_thread, 0);
+    double features[64 * num_features];
+    uint64_t tags[64];
+    size_t total = 0;
+
+    while (total < seen.size()) {
+        size_t count = scorer.pop_requests(tags, features, 64);
+
+        for (size_t i = 0; i < count; i++) {
+            CHECK(tags[i] < seen.size() && features[i * num_features + 1] == tags[i] * 10.0 + 1);
+            if (tags[i] < seen.size()) seen[tags[i]]++;
+        }
+
+        total += count;
+        if (count == 0) std::this_thread::yield();
+    }
+
+    for (std::thread& producer : producers) producer.join();
+
+    for (int count : seen) CHECK(count == 1);
+}
+
+static void test_attach(const std::string& name) {
+    ScorerRing inspector, scorer;
+    std::string error;
+
+    CHECK(!scorer.attach(name, error) && !error.empty());
+
+    CHECK(inspector.create(name, 8, num_features, error));
+    CHECK(scorer.attach(name, error));
+
+    CHECK(!inspector.scorer_alive(1000000000LL));
+    scorer.beat();
+    CHECK(inspector.scorer_alive(1000000000LL));
+
+    scorer.close();
+    CHECK(!scorer.is_open());
+}
+
+int main() {
+    std::string name = "/ml_classifiers_test_" + std::to_string(getpid());
+
+    test_wraparound(name);
+    test_full(name);
+    test_producers(name);
+    shm_unlink(name.c_str());
+
+    test_attach(name);
+    shm_unlink(name.c_str());
+
+    return test_result("test_shm");
+}
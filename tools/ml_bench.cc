@@ -0,0 +1,378 @@
+//--------------------------------------------------------------------------
+// Copyright (C) 2014-2019 Cisco and/or its affiliates. All rights reserved.
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the GNU General Public License Version 2 as published
+// by the Free Software Foundation.  You may not use, modify or distribute
+// this program under any other version of the GNU General Public License.
+//
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along
+// with this program; if not, write to the Free Software Foundation, Inc.,
+// 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+//--------------------------------------------------------------------------
+// ml_bench.cc
+
+/*
+    Inference benchmark and parity check of the native models.
+
+    Loads each model (by default the six trained ones, clf_<key>.mlm in the model directory)
+    the way the inspector does and scores batches of 1 to 65536 flows, taken from the feature
+    vectors of tmp/timeouted_connections.txt and from synthetic ones (each feature drawn from
+    a random real vector, scaled by a lognormal factor, with a fixed seed). For every batch
+    size it reports the flows/s, the p50/p99 time of a batch and, where perf_event_open() is
+    allowed, the cache misses per flow; for every model, its memory footprint.
+
+    Each model is then checked against the sklearn outputs export_native_models.py stored next
+    to it (clf_<key>.reference.npy): every predicted class must match and every probability be
+    within the tolerance. The exit code is 2 when a model doesn't, so a performance change can
+    be validated for accuracy in the same run.
+*/
+
+#include <cmath>
+#include <memory>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <iostream>
+#include <algorithm>
+
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "../ml_npy.h"
+#include "../ml_models.h"
+
+struct BenchOptions {
+    std::string model_dir = "joblibs";
+    std::vector<std::string> models;    /* Keys (clf_<key>.mlm in model_dir) or .mlm paths. */
+    std::string rows = "tmp/timeouted_connections.txt";
+    uint64_t synthetic = 65536;         /* Synthetic feature vectors added to the real ones. */
+    uint64_t seed = 1;
+    std::vector<size_t> batches = { 1, 16, 256, 4096, 65536 };
+    uint64_t min_rows = 262144;         /* Rows scored per batch size, at least. */
+    size_t min_calls = 16;              /* Batches scored per batch size, at least (for the percentiles). */
+    double tolerance = 1e-6;            /* Largest probability difference with the reference. */
+};
+
+/* splitmix64: the synthetic rows only depend on the seed, whatever the standard library. */
+class BenchRandom {
+    public:
+        explicit BenchRandom(uint64_t seed) : state(seed) { }
+
+        uint64_t next() {
+            uint64_t value = (state += 0x9e3779b97f4a7c15ULL);
+            value = (value ^ (value >> 30)) * 0xbf58476d1ce4e5b9ULL;
+            value = (value ^ (value >> 27)) * 0x94d049bb133111ebULL;
+            return value ^ (value >> 31);
+        }
+
+        /* Uniform in (0, 1). */
+        double uniform() {
+            return ((next() >> 11) + 0.5) * (1.0 / 9007199254740992.0);
+        }
+
+        /* Standard normal (Box-Muller). */
+        double normal() {
+            return std::sqrt(-2.0 * std::log(uniform())) * std::cos(6.283185307179586 * uniform());
+        }
+
+    private:
+        uint64_t state;
+};
+
+/* Hardware event counter of the calling thread (user space only), if the kernel allows it. */
+class PerfCounter {
+    public:
+        PerfCounter(uint32_t type, uint64_t config) {
+            struct perf_event_attr attr;
+            memset(&attr, 0, sizeof(attr));
+
+            attr.size = sizeof(attr);
+            attr.type = type;
+            attr.config = config;
+            attr.disabled = 1;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+
+            fd = (int)syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+        }
+
+        ~PerfCounter() {
+            if (fd >= 0) close(fd);
+        }
+
+        bool available() const {
+            return fd >= 0;
+        }
+
+        void start() {
+            if (fd < 0) return;
+            ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+            ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+
+        uint64_t stop() {
+            uint64_t count = 0;
+
+            if (fd < 0) return 0;
+            ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+            if (read(fd, &count, sizeof(count)) != sizeof(count)) return 0;
+            return count;
+        }
+
+    private:
+        int fd = -1;
+};
+
+/* Reads the feature vectors of a timeouted_connections.txt (one per line, space-separated). */
+static bool read_rows(const std::string& path, uint32_t num_features, std::vector<double>& rows, std::string& error) {
+    std::ifstream input(path);
+
+    if (!input.is_open()) {
+        error = "couldn't open " + path;
+        return false;
+    }
+
+    std::string line;
+    while (std::getline(input, line)) {
+        std::istringstream values(line);
+        std::vector<double> row;
+        double value;
+
+        while (values >> value) row.push_back(value);
+
+        if (row.empty()) continue;
+        if (row.size() != num_features) {
+            error = path + " has a line with " + std::to_string(row.size()) + " features";
+            return false;
+        }
+        rows.insert(rows.end(), row.begin(), row.end());
+    }
+    return true;
+}
+
+/* Appends "count" synthetic rows, each feature taken from a random real row and scaled by a lognormal factor. */
+static void synthetic_rows(uint64_t count, uint32_t num_features, uint64_t seed, std::vector<double>& rows) {
+    size_t num_real = rows.size() / num_features;
+    BenchRandom random(seed);
+
+    for (uint64_t i = 0; i < count; i++) {
+        for (uint32_t f = 0; f < num_features; f++) {
+            /* Without real rows, a log-uniform value in [1, 1e6). */
+            double base = num_real ? rows[(random.next() % num_real) * num_features + f] : std::exp(random.uniform() * 13.8);
+            rows.push_back(base * std::exp(0.5 * random.normal()));
+        }
+    }
+}
+
+static double percentile(std::vector<double>& values, double q) {
+    std::sort(values.begin(), values.end());
+    return values[std::min(values.size() - 1, (size_t)(q * values.size()))];
+}
+
+/* Scores batches of every size over the rows and prints a line per size. */
+static void benchmark(const Model& model, const std::vector<double>& rows, const BenchOptions& options) {
+    size_t num_rows = rows.size() / model.num_features;
+    size_t max_batch = *std::max_element(options.batches.begin(), options.batches.end());
+
+    /* Batches wrap around the rows: the pointers repeat them up to the largest batch. */
+    std::vector<const double*> pointers(num_rows + max_batch);
+    for (size_t i = 0; i < pointers.size(); i++) pointers[i] = rows.data() + (i % num_rows) * model.num_features;
+
+    std::vector<double> proba(max_batch * model.num_classes);
+    PerfCounter cache_misses(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+
+    for (size_t batch : options.batches) {
+        size_t calls = std::max<size_t>(options.min_calls, (options.min_rows + batch - 1) / batch);
+        std::vector<double> latencies(calls);
+
+        cache_misses.start();
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+        for (size_t call = 0; call < calls; call++) {
+            std::chrono::steady_clock::time_point call_start = std::chrono::steady_clock::now();
+
+            if (batch == 1)
+                model.predict_proba(pointers[call % num_rows], proba.data());
+            else
+                model.predict_proba_batch(pointers.data() + (call * batch) % num_rows, batch, proba.data());
+
+            latencies[call] = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - call_start).count();
+        }
+
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        uint64_t misses = cache_misses.stop();
+        double flows = (double)calls * batch;
+
+        std::cout << "\t[*] Batch " << std::setw(5) << batch << ": " << std::fixed << std::setprecision(0)
+                  << flows / elapsed.count() << " flows/s, " << std::setprecision(2)
+                  << percentile(latencies, 0.5) << " us p50, " << percentile(latencies, 0.99) << " us p99, ";
+
+        if (cache_misses.available())
+            std::cout << std::setprecision(3) << misses / flows << " cache misses/flow." << std::endl;
+        else
+            std::cout << "cache misses n/a." << std::endl;
+
+        std::cout.unsetf(std::ios_base::floatfield);
+        std::cout << std::setprecision(6);
+    }
+}
+
+/*
+    Checks the model against its reference: (N, F + 1 + C) rows of features, sklearn's class
+    index and its probabilities (NaN without predict_proba). Returns false when they differ,
+    or when there's no reference to check the model against.
+*/
+static bool check_parity(const Model& model, const std::string& path, double tolerance) {
+    NpyArray reference;
+    std::string error;
+
+    if (!reference.open(path, error)) {
+        std::cout << "\t[*] Parity: FAILED, no reference (" << error << ")." << std::endl;
+        return false;
+    }
+
+    uint64_t columns = model.num_features + 1 + model.num_classes;
+
+    if (reference.descr != "<f8" || reference.shape.size() != 2 || reference.columns() != columns) {
+        std::cout << "\t[*] Parity: " << path << " isn't a (N, " << columns << ") float64 reference." << std::endl;
+        return false;
+    }
+
+    size_t num_rows = reference.rows();
+    const double* data = reference.data<double>();
+    std::vector<const double*> pointers(num_rows);
+    std::vector<double> proba(num_rows * model.num_classes);
+
+    for (size_t i = 0; i < num_rows; i++) pointers[i] = data + i * columns;
+
+    model.predict_proba_batch(pointers.data(), num_rows, proba.data());
+
+    size_t mismatches = 0;
+    double max_drift = 0;
+
+    for (size_t i = 0; i < num_rows; i++) {
+        const double* row_proba = proba.data() + i * model.num_classes;
+        const double* expected = data + i * columns + model.num_features;
+        uint32_t label = (uint32_t)(std::max_element(row_proba, row_proba + model.num_classes) - row_proba);
+
+        if (label != (uint32_t)expected[0]) mismatches++;
+
+        for (uint32_t c = 0; c < model.num_classes; c++) {
+            if (!std::isnan(expected[1 + c])) max_drift = std::max(max_drift, std::fabs(row_proba[c] - expected[1 + c]));
+        }
+    }
+
+    bool passed = (mismatches == 0 && max_drift <= tolerance);
+
+    std::cout << "\t[*] Parity: " << (passed ? "OK" : "FAILED") << " (" << num_rows << " rows, " << mismatches
+              << " classes differ, " << max_drift << " max probability difference)." << std::endl;
+    return passed;
+}
+
+static void usage() {
+    std::cerr << "Usage: ml_bench [-d <model_dir>] [-i <rows.txt>] [-s <rows>] [--seed <n>] [-b <sizes>] [-n <rows>] [-t <tolerance>] [<key>|<model.mlm>]..." << std::endl;
+    std::cerr << "\t<key>: scores <model_dir>/clf_<key>.mlm (default: ab dt rf svc bnb gnb)" << std::endl;
+    std::cerr << "\t-d <model_dir>: directory of the models and their references (default: joblibs)" << std::endl;
+    std::cerr << "\t-i <rows.txt>: feature vectors, one per line (default: tmp/timeouted_connections.txt)" << std::endl;
+    std::cerr << "\t-s <rows>: synthetic feature vectors added (default: 65536)" << std::endl;
+    std::cerr << "\t--seed <n>: seed of the synthetic feature vectors (default: 1)" << std::endl;
+    std::cerr << "\t-b <sizes>: comma-separated batch sizes (default: 1,16,256,4096,65536)" << std::endl;
+    std::cerr << "\t-n <rows>: rows scored per batch size, at least (default: 262144)" << std::endl;
+    std::cerr << "\t-t <tolerance>: largest probability difference with the reference (default: 1e-6)" << std::endl;
+}
+
+static bool parse_options(int argc, char** argv, BenchOptions& options) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        bool has_value = (i + 1 < argc);
+
+        if (arg == "-d" && has_value) options.model_dir = argv[++i];
+        else if (arg == "-i" && has_value) options.rows = argv[++i];
+        else if (arg == "-s" && has_value) options.synthetic = strtoull(argv[++i], nullptr, 10);
+        else if (arg == "--seed" && has_value) options.seed = strtoull(argv[++i], nullptr, 10);
+        else if (arg == "-n" && has_value) options.min_rows = strtoull(argv[++i], nullptr, 10);
+        else if (arg == "-t" && has_value) options.tolerance = strtod(argv[++i], nullptr);
+        else if (arg == "-b" && has_value) {
+            std::istringstream sizes(argv[++i]);
+            std::string size;
+
+            options.batches.clear();
+            while (std::getline(sizes, size, ',')) {
+                size_t batch = strtoull(size.c_str(), nullptr, 10);
+                if (batch == 0) return false;
+                options.batches.push_back(batch);
+            }
+            if (options.batches.empty()) return false;
+        }
+        else if (arg[0] == '-') return false;
+        else options.models.push_back(arg);
+    }
+
+    if (options.models.empty()) options.models = { "ab", "dt", "rf", "svc", "bnb", "gnb" };
+    return true;
+}
+
+int main(int argc, char** argv) {
+    BenchOptions options;
+
+    if (!parse_options(argc, argv, options)) {
+        usage();
+        return 1;
+    }
+
+    bool parity = true;
+
+    for (const std::string& name : options.models) {
+        bool is_path = (name.size() > 4 && name.compare(name.size() - 4, 4, ".mlm") == 0);
+        std::string path = is_path ? name : options.model_dir + "/clf_" + name + ".mlm";
+        std::string reference = path.substr(0, path.size() - 4) + ".reference.npy";
+        std::string error;
+
+        /* Folded, as the inspector loads them. */
+        std::unique_ptr<Model> model(load_model(path, error, true));
+
+        if (!model) {
+            std::cerr << "[*] Couldn't load " << path << " (" << error << ")." << std::endl;
+            parity = false;
+            continue;
+        }
+
+        /* The rows are read for each model, as they're checked against its number of features. */
+        std::vector<double> rows;
+
+        if (!options.rows.empty() && !read_rows(options.rows, model->num_features, rows, error)) {
+            std::cerr << "[*] Error! " << error << "." << std::endl;
+            return 1;
+        }
+
+        size_t num_real = rows.size() / model->num_features;
+        synthetic_rows(options.synthetic, model->num_features, options.seed, rows);
+
+        if (rows.empty()) {
+            std::cerr << "[*] Error! No rows to score (-i or -s)." << std::endl;
+            return 1;
+        }
+
+        std::cout << "[*] " << path << " (" << model->memory_bytes() << " bytes, " << num_real << " real and "
+                  << options.synthetic << " synthetic rows):" << std::endl;
+
+        benchmark(*model, rows, options);
+
+        if (!check_parity(*model, reference, options.tolerance)) parity = false;
+    }
+
+    return parity ? 0 : 2;
+}
@@ -0,0 +1,481 @@
+//--------------------------------------------------------------------------
+// Copyright (C) 2014-2019 Cisco and/or its affiliates. All rights reserved.
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the GNU General Public License Version 2 as published
+// by the Free Software Foundation.  You may not use, modify or distribute
+// this program under any other version of the GNU General Public License.
+//
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along
+// with this program; if not, write to the Free Software Foundation, Inc.,
+// 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+//--------------------------------------------------------------------------
+// ml_dataset.cc
+
+/*
+    Native replacement for the loading half of the dataset scripts:
+        - concatenates the CICIDS2017 day files (dataset-concatenate.py);
+        - maps the label column to 0 (BENIGN) / 1 (anything else);
+        - drops every row holding a NaN/Infinity feature (dataset-preprocessing.py);
+        - writes the result as two .npy files (<prefix>.X.npy and <prefix>.y.npy),
+          which numpy opens without copying through np.load(..., mmap_mode='r').
+
+    The CSVs are memory-mapped and split in newline-aligned chunks, which are
+    parsed in parallel and appended to the output in their original order.
+*/
+
+#include <cmath>
+#include <limits>
+#include <string>
+#include <thread>
+#include <vector>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <algorithm>
+
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "../ml_npy.h"
+
+/* Number of features in a CICIDS2017 (MachineLearningCVE) row. The 79th column is the label. */
+static const unsigned num_features = 78;
+
+/* Size of the slice of a CSV handed to a single worker. */
+static const size_t chunk_size = 32 << 20;
+
+/* Parsing statistics, kept per chunk and summed up at the end. */
+struct ParseStats {
+    uint64_t rows = 0;
+    uint64_t headers = 0;
+    uint64_t malformed = 0;
+    uint64_t non_finite = 0;
+    uint64_t benign = 0;
+    uint64_t attack = 0;
+
+    void add(const ParseStats& s) {
+        rows += s.rows;
+        headers += s.headers;
+        malformed += s.malformed;
+        non_finite += s.non_finite;
+        benign += s.benign;
+        attack += s.attack;
+    }
+};
+
+/* A parsed chunk: the features are kept row-major, exactly as they'll be written. */
+template <typename T>
+struct ParsedChunk {
+    std::vector<T> features;
+    std::vector<uint8_t> labels;
+    ParseStats stats;
+};
+
+/*
+    Powers of ten that are exactly representable as doubles.
+    Any value with a mantissa below 2^53 scaled by one of these is correctly rounded (Clinger's fast path).
+*/
+static const double exact_powers[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+/* Case insensitive comparison of [begin, end) against a lowercase literal. */
+static bool token_equals(const char* begin, const char* end, const char* literal) {
+    size_t length = strlen(literal);
+
+    if ((size_t)(end - begin) != length) return false;
+
+    for (size_t i = 0; i < length; i++) {
+        if (tolower((unsigned char)begin[i]) != literal[i]) return false;
+    }
+    return true;
+}
+
+/*
+    Parses a single CSV field as a double.
+    Returns false if the field isn't a number at all. "NaN"/"Infinity" are parsed
+    (so the row can be counted as non-finite instead of malformed).
+*/
+static bool parse_double(const char* begin, const char* end, double& value) {
+    while (begin < end && (*begin == ' ' || *begin == '\t')) begin++;
+    while (end > begin && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\r')) end--;
+
+    if (begin == end) return false;
+
+    const char* p = begin;
+    bool negative = false;
+
+    if (*p == '-' || *p == '+') {
+        negative = (*p == '-');
+        p++;
+    }
+
+    if (token_equals(p, end, "nan")) {
+        value = std::numeric_limits<double>::quiet_NaN();
+        return true;
+    }
+
+    if (token_equals(p, end, "inf") || token_equals(p, end, "infinity")) {
+        value = negative ? -std::numeric_limits<double>::infinity() : std::numeric_limits<double>::infinity();
+        return true;
+    }
+
+    uint64_t mantissa = 0;
+    int digits = 0;
+    int exponent = 0;
+    bool any_digit = false;
+
+    for (; p < end && *p >= '0' && *p <= '9'; p++) {
+        any_digit = true;
+        if (mantissa == 0 && *p == '0') continue;
+        if (digits < 19) {
+            mantissa = mantissa * 10 + (*p - '0');
+            digits++;
+        } else {
+            exponent++;
+        }
+    }
+
+    if (p < end && *p == '.') {
+        for (p++; p < end && *p >= '0' && *p <= '9'; p++) {
+            any_digit = true;
+            if (mantissa == 0 && *p == '0') {
+                exponent--;
+                continue;
+            }
+            if (digits < 19) {
+                mantissa = mantissa * 10 + (*p - '0');
+                digits++;
+                exponent--;
+            }
+        }
+    }
+
+    if (!any_digit) return false;
+
+    if (p < end && (*p == 'e' || *p == 'E')) {
+        p++;
+        bool negative_exponent = false;
+
+        if (p < end && (*p == '-' || *p == '+')) {
+            negative_exponent = (*p == '-');
+            p++;
+        }
+        if (p == end) return false;
+
+        int e = 0;
+        for (; p < end && *p >= '0' && *p <= '9'; p++) {
+            if (e < 10000) e = e * 10 + (*p - '0');
+        }
+        exponent += negative_exponent ? -e : e;
+    }
+
+    if (p != end) return false;
+
+    if (mantissa < (1ULL << 53) && exponent >= -22 && exponent <= 22) {
+        /* Fast path. */
+        value = (double)mantissa;
+        value = (exponent < 0) ? value / exact_powers[-exponent] : value * exact_powers[exponent];
+    } else {
+        /* Slow path: long mantissas or large exponents are left to strtod. */
+        std::string token(begin, end);
+        value = strtod(token.c_str(), nullptr);
+        return true;
+    }
+
+    if (negative) value = -value;
+    return true;
+}
+
+/*
+    Maps the label column the same way dataset-concatenate.py does.
+    Returns -1 for the header row and accepts already concatenated (numeric) labels.
+*/
+static int parse_label(const char* begin, const char* end) {
+    while (begin < end && (*begin == ' ' || *begin == '\t')) begin++;
+    while (end > begin && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\r')) end--;
+
+    if (token_equals(begin, end, "label")) return -1;
+    if (token_equals(begin, end, "benign")) return 0;
+
+    double numeric;
+    if (parse_double(begin, end, numeric)) return (numeric == 0.0) ? 0 : 1;
+
+    return 1;
+}
+
+/* Parses the complete lines inside [begin, end). */
+template <typename T>
+static void parse_chunk(const char* begin, const char* end, ParsedChunk<T>* chunk) {
+    const char* line = begin;
+    T row[num_features];
+
+    chunk->features.reserve((end - begin) / 200 * num_features);
+    chunk->labels.reserve((end - begin) / 200);
+
+    while (line < end) {
+        const char* line_end = (const char*)memchr(line, '\n', end - line);
+        if (!line_end) line_end = end;
+
+        const char* field = line;
+        unsigned column = 0;
+        bool finite = true;
+        bool valid = true;
+        int label = 0;
+
+        while (valid) {
+            const char* field_end = (const char*)memchr(field, ',', line_end - field);
+            if (!field_end) field_end = line_end;
+
+            if (column < num_features) {
+                double value;
+
+                if (!parse_double(field, field_end, value)) {
+                    /* The header has no numeric fields; it's recognized by its label column below. */
+                    finite = false;
+                    value = 0;
+                }
+
+                row[column] = (T)value;
+
+                if (!std::isfinite(row[column])) finite = false;
+            } else if (column == num_features) {
+                label = parse_label(field, field_end);
+            } else {
+                valid = false;
+            }
+
+            column++;
+            if (field_end == line_end) break;
+            field = field_end + 1;
+        }
+
+        if (line_end == line || (line_end - line == 1 && *line == '\r')) {
+            /* Blank line. */
+        } else if (!valid || column != num_features + 1) {
+            chunk->stats.malformed++;
+        } else if (label < 0) {
+            chunk->stats.headers++;
+        } else if (!finite) {
+            chunk->stats.non_finite++;
+        } else {
+            chunk->features.insert(chunk->features.end(), row, row + num_features);
+            chunk->labels.push_back((uint8_t)label);
+            chunk->stats.rows++;
+
+            if (label == 0)
+                chunk->stats.benign++;
+            else
+                chunk->stats.attack++;
+        }
+
+        line = line_end + 1;
+    }
+}
+
+/* Memory-maps a CSV file. */
+struct MappedFile {
+    const char* data = nullptr;
+    size_t size = 0;
+
+    bool open(const std::string& path) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+
+        struct stat st;
+        if (fstat(fd, &st) < 0) {
+            close(fd);
+            return false;
+        }
+
+        size = st.st_size;
+
+        if (size > 0) {
+            void* addr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+            if (addr == MAP_FAILED) {
+                close(fd);
+                return false;
+            }
+            madvise(addr, size, MADV_SEQUENTIAL);
+            data = (const char*)addr;
+        }
+
+        close(fd);
+        return true;
+    }
+
+    ~MappedFile() {
+        if (data) munmap((void*)data, size);
+    }
+};
+
+/* Splits a mapped file in newline-aligned chunks of roughly chunk_size bytes. */
+static std::vector<std::pair<const char*, const char*>> split_chunks(const MappedFile& file) {
+    std::vector<std::pair<const char*, const char*>> chunks;
+    const char* begin = file.data;
+    const char* end = file.data + file.size;
+
+    while (begin < end) {
+        const char* chunk_end = begin + std::min(chunk_size, (size_t)(end - begin));
+
+        if (chunk_end < end) {
+            const char* newline = (const char*)memchr(chunk_end, '\n', end - chunk_end);
+            chunk_end = newline ? newline + 1 : end;
+        }
+
+        chunks.push_back(std::make_pair(begin, chunk_end));
+        begin = chunk_end;
+    }
+
+    return chunks;
+}
+
+/* Expands directories into the (sorted) list of .csv files they contain, as glob does in dataset-concatenate.py. */
+static void collect_inputs(const std::string& path, const std::string& skip, std::vector<std::string>& inputs) {
+    DIR* dir = opendir(path.c_str());
+
+    if (!dir) {
+        inputs.push_back(path);
+        return;
+    }
+
+    std::vector<std::string> files;
+    struct dirent* entry;
+
+    while ((entry = readdir(dir)) != nullptr) {
+        std::string name = entry->d_name;
+
+        if (name.size() > 4 && name.compare(name.size() - 4, 4, ".csv") == 0 && name != skip) {
+            files.push_back(path + "/" + name);
+        }
+    }
+    closedir(dir);
+
+    std::sort(files.begin(), files.end());
+    inputs.insert(inputs.end(), files.begin(), files.end());
+}
+
+template <typename T>
+static int run(const std::vector<std::string>& inputs, const std::string& prefix, unsigned num_threads) {
+    NpyWriter features_out, labels_out;
+
+    if (!features_out.open(prefix + ".X.npy", npy_descr<T>(), num_features) ||
+        !labels_out.open(prefix + ".y.npy", npy_descr<uint8_t>(), 0)) {
+        std::cerr << "[*] Error! Couldn't create the output files." << std::endl;
+        return 1;
+    }
+
+    ParseStats total;
+
+    for (const std::string& input : inputs) {
+        MappedFile file;
+
+        std::cout << "[*] Reading '" << input << "'..." << std::endl;
+
+        if (!file.open(input)) {
+            std::cerr << "\t[*] Error! Couldn't open '" << input << "'." << std::endl;
+            return 1;
+        }
+
+        std::vector<std::pair<const char*, const char*>> chunks = split_chunks(file);
+        ParseStats file_stats;
+
+        /* Parses up to num_threads chunks at a time, so memory stays bounded by num_threads * chunk_size. */
+        for (size_t first = 0; first < chunks.size(); first += num_threads) {
+            size_t last = std::min(first + num_threads, chunks.size());
+            std::vector<ParsedChunk<T>> parsed(last - first);
+            std::vector<std::thread> workers;
+
+            for (size_t i = first; i < last; i++) {
+                workers.push_back(std::thread(parse_chunk<T>, chunks[i].first, chunks[i].second, &parsed[i - first]));
+            }
+
+            for (std::thread& worker : workers) {
+                worker.join();
+            }
+
+            for (ParsedChunk<T>& chunk : parsed) {
+                features_out.append(chunk.features.data(), chunk.stats.rows);
+                labels_out.append(chunk.labels.data(), chunk.stats.rows);
+                file_stats.add(chunk.stats);
+            }
+        }
+
+        std::cout << "\t[*] " << file_stats.rows << " rows kept, "
+                  << file_stats.non_finite << " non-finite and "
+                  << file_stats.malformed << " malformed rows dropped." << std::endl;
+
+        total.add(file_stats);
+    }
+
+    if (!features_out.close() || !labels_out.close()) {
+        std::cerr << "[*] Error! Couldn't write the output files." << std::endl;
+        return 1;
+    }
+
+    std::cout << "[*] " << prefix << ".X.npy: (" << total.rows << ", " << num_features << ") " << npy_descr<T>() << std::endl;
+    std::cout << "[*] " << prefix << ".y.npy: (" << total.rows << ",) |u1" << std::endl;
+    std::cout << "[*] Labels: {0: " << total.benign << ", 1: " << total.attack << "}" << std::endl;
+    std::cout << "[*] Dropped: " << total.non_finite << " non-finite, " << total.malformed << " malformed." << std::endl;
+
+    return 0;
+}
+
+static void usage() {
+    std::cerr << "Usage: ml_dataset [-o <prefix>] [-j <threads>] [-t f4|f8] <file.csv|directory> ..." << std::endl;
+    std::cerr << "\t-o: output prefix (default: CIC-IDS-2017), writes <prefix>.X.npy and <prefix>.y.npy" << std::endl;
+    std::cerr << "\t-j: number of parsing threads (default: all cores)" << std::endl;
+    std::cerr << "\t-t: feature dtype, f4 (float32, default) or f8 (float64)" << std::endl;
+}
+
+int main(int argc, char** argv) {
+    std::string prefix = "CIC-IDS-2017";
+    std::string dtype = "f4";
+    unsigned num_threads = std::max(1u, std::thread::hardware_concurrency());
+    std::vector<std::string> inputs;
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+
+        if (arg == "-o" && i + 1 < argc) {
+            prefix = argv[++i];
+        } else if (arg == "-j" && i + 1 < argc) {
+            num_threads = std::max(1, atoi(argv[++i]));
+        } else if (arg == "-t" && i + 1 < argc) {
+            dtype = argv[++i];
+        } else if (arg == "-h" || arg == "--help") {
+            usage();
+            return 0;
+        } else {
+            /* The concatenated output of dataset-concatenate.py is skipped when globbing a directory. */
+            collect_inputs(arg, "CIC-IDS-2017.csv", inputs);
+        }
+    }
+
+    if (inputs.empty() || (dtype != "f4" && dtype != "f8")) {
+        usage();
+        return 1;
+    }
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    int status = (dtype == "f4") ? run<float>(inputs, prefix, num_threads) : run<double>(inputs, prefix, num_threads);
+
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    std::cout << "[*] Done! (" << elapsed.count() << " s)" << std::endl;
+
+    return status;
+}
@@ -0,0 +1,602 @@
+//--------------------------------------------------------------------------
+// Copyright (C) 2014-2019 Cisco and/or its affiliates. All rights reserved.
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the GNU General Public License Version 2 as published
+// by the Free Software Foundation.  You may not use, modify or distribute
+// this program under any other version of the GNU General Public License.
+//
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along
+// with this program; if not, write to the Free Software Foundation, Inc.,
+// 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+//--------------------------------------------------------------------------
+// ml_import.cc
+
+/*
+    Importer of gradient-boosted tree models.
+
+    Reads an XGBoost JSON model (Booster.save_model("model.json")) or a LightGBM JSON dump
+    (json.dump(Booster.dump_model(), ...)) and writes it as a boosted tree ensemble in the
+    .mlm format (see ml_models.h), so the inspector scores it natively under any key (e.g.
+    clf_xgb.mlm or clf_lgbm.mlm). Neither library is needed, here or at runtime.
+
+    Splits become "x <= threshold" on double precision features: XGBoost's single precision
+    "x < condition" turns into the largest double still sent left, LightGBM's thresholds are
+    kept as is. Features are never missing in the inspector, so the default directions of
+    missing values are ignored; categorical splits and LightGBM's zero_as_missing aren't
+    supported. Supported objectives: binary:logistic, binary:logitraw, multi:softprob and
+    multi:softmax (XGBoost); binary and multiclass (LightGBM).
+
+    With -t, the imported model scores the rows written by ml_dataset and its accuracy and
+    throughput (batched and row by row) are reported.
+*/
+
+#include <cmath>
+#include <memory>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <algorithm>
+
+#include "../ml_npy.h"
+#include "../ml_models.h"
+
+struct ImportOptions {
+    std::string input;
+    std::string output;
+    std::string test_prefix;
+    uint32_t num_features = 0;          /* 0: the model's own. */
+};
+
+/* Minimal JSON document (the dumps are plain objects, arrays, numbers and strings). */
+struct Json {
+    enum Type { NUL, BOOLEAN, NUMBER, STRING, ARRAY, OBJECT };
+
+    Type type = NUL;
+    bool boolean = false;
+    double number = 0;
+    std::string string;
+    std::vector<Json> items;
+    std::vector<std::pair<std::string, Json>> members;
+
+    const Json* get(const std::string& key) const {
+        for (const std::pair<std::string, Json>& member : members) {
+            if (member.first == key) return &member.second;
+        }
+        return nullptr;
+    }
+
+    /* Numbers, and numbers written as strings (XGBoost's parameters, e.g. "5E-1" or "[5E-1]"). */
+    bool to_number(double& value) const {
+        if (type == NUMBER) {
+            value = number;
+            return true;
+        }
+
+        if (type != STRING) return false;
+
+        std::string text = string;
+        text.erase(std::remove_if(text.begin(), text.end(), [](char c) { return c == '[' || c == ']'; }), text.end());
+
+        char* end = nullptr;
+        value = strtod(text.c_str(), &end);
+        return end != text.c_str();
+    }
+};
+
+class JsonParser {
+    public:
+        explicit JsonParser(const std::string& text) : text(text) { }
+
+        bool parse(Json& value, std::string& error) {
+            if (!parse_value(value, 0) || (skip_spaces(), position != text.size())) {
+                error = "malformed JSON near byte " + std::to_string(position);
+                return false;
+            }
+            return true;
+        }
+
+    private:
+        void skip_spaces() {
+            while (position < text.size() && isspace((unsigned char)text[position])) position++;
+        }
+
+        bool consume(char c) {
+            skip_spaces();
+            if (position < text.size() && text[position] == c) {
+                position++;
+                return true;
+            }
+            return false;
+        }
+
+        bool parse_value(Json& value, int depth) {
+            if (depth > max_depth) return false;
+
+            skip_spaces();
+            if (position >= text.size()) return false;
+
+            char c = text[position];
+
+            if (c == '{') {
+                position++;
+                value.type = Json::OBJECT;
+                if (consume('}')) return true;
+
+                do {
+                    std::string key;
+                    skip_spaces();
+
+                    if (!parse_string(key) || !consume(':')) return false;
+
+                    value.members.emplace_back(key, Json());
+                    if (!parse_value(value.members.back().second, depth + 1)) return false;
+                } while (consume(','));
+
+                return consume('}');
+            }
+
+            if (c == '[') {
+                position++;
+                value.type = Json::ARRAY;
+                if (consume(']')) return true;
+
+                do {
+                    value.items.emplace_back();
+                    if (!parse_value(value.items.back(), depth + 1)) return false;
+                } while (consume(','));
+
+                return consume(']');
+            }
+
+            if (c == '"') {
+                value.type = Json::STRING;
+                return parse_string(value.string);
+            }
+
+            if (text.compare(position, 4, "true") == 0 || text.compare(position, 5, "false") == 0) {
+                value.type = Json::BOOLEAN;
+                value.boolean = (c == 't');
+                position += value.boolean ? 4 : 5;
+                return true;
+            }
+
+            if (text.compare(position, 4, "null") == 0) {
+                position += 4;
+                return true;
+            }
+
+            char* end = nullptr;
+            value.type = Json::NUMBER;
+            value.number = strtod(text.c_str() + position, &end);
+
+            if (end == text.c_str() + position) return false;
+            position = end - text.c_str();
+            return true;
+        }
+
+        /* Escapes other than \" and \\ only show up in feature names, which aren't used. */
+        bool parse_string(std::string& value) {
+            if (position >= text.size() || text[position] != '"') return false;
+
+            for (position++; position < text.size(); position++) {
+                char c = text[position];
+
+                if (c == '"') {
+                    position++;
+                    return true;
+                }
+
+                if (c == '\\' && position + 1 < text.size()) c = text[++position];
+                value.push_back(c);
+            }
+            return false;
+        }
+
+        static const int max_depth = 4096;
+
+        const std::string& text;
+        size_t position = 0;
+};
+
+/* A tree being converted: its nodes in preorder (children after their parent) and leaf margins. */
+struct ConvertedTree {
+    std::vector<TreeNode> nodes;
+    std::vector<double> values;
+};
+
+/* Appends a leaf holding "margin" for class "target" (every other class' margin is 0). */
+static int32_t add_leaf(ConvertedTree& tree, uint32_t num_classes, uint32_t target, double margin) {
+    TreeNode leaf = { 0.0, -1, -1, -1, (int32_t)tree.values.size() };
+
+    tree.values.resize(tree.values.size() + num_classes, 0.0);
+    tree.values[leaf.value + target] = margin;
+    tree.nodes.push_back(leaf);
+    return (int32_t)tree.nodes.size() - 1;
+}
+
+/* Base scores, as a tree made of a single leaf. */
+static void add_base_tree(TreeEnsemble& model, const std::vector<double>& margins) {
+    TreeNode leaf = { 0.0, -1, -1, -1, 0 };
+    model.add_tree({ leaf }, margins, 1.0);
+}
+
+static bool number_at(const Json* array, size_t index, double& value) {
+    return array && array->type == Json::ARRAY && index < array->items.size() && array->items[index].to_number(value);
+}
+
+/* Converts XGBoost's node "node" (and its subtree) of a tree given as parallel arrays. */
+static bool convert_xgboost_node(const Json& tree, size_t node, uint32_t num_classes, uint32_t target, int depth,
+                                 ConvertedTree& converted, std::string& error) {
+    double left = -1, right = -1, feature = 0, condition = 0;
+
+    if (depth > 4096 || !number_at(tree.get("left_children"), node, left) || !number_at(tree.get("right_children"), node, right) ||
+        !number_at(tree.get("split_conditions"), node, condition)) {
+        error = "malformed XGBoost tree";
+        return false;
+    }
+
+    /* Leaves keep their weight in split_conditions. */
+    if (left < 0) {
+        add_leaf(converted, num_classes, target, condition);
+        return true;
+    }
+
+    double split_type = 0;
+    if (number_at(tree.get("split_type"), node, split_type) && split_type != 0) {
+        error = "categorical splits aren't supported";
+        return false;
+    }
+
+    if (!number_at(tree.get("split_indices"), node, feature)) {
+        error = "malformed XGBoost tree";
+        return false;
+    }
+
+    /* (float)x < condition, over doubles: the largest x still going left. */
+    float split = (float)condition;
+    double threshold;
+
+    if (!last_passing([split](double x) { return (float)x < split; }, (double)split, threshold)) {
+        error = "split condition " + std::to_string(condition) + " can't be converted";
+        return false;
+    }
+
+    size_t index = converted.nodes.size();
+    converted.nodes.push_back({ threshold, (int32_t)feature, -1, -1, -1 });
+
+    converted.nodes[index].left = (int32_t)converted.nodes.size();
+    if (!convert_xgboost_node(tree, (size_t)left, num_classes, target, depth + 1, converted, error)) return false;
+
+    converted.nodes[index].right = (int32_t)converted.nodes.size();
+    return convert_xgboost_node(tree, (size_t)right, num_classes, target, depth + 1, converted, error);
+}
+
+static bool import_xgboost(const Json& root, TreeEnsemble& model, std::string& error) {
+    const Json* learner = root.get("learner");
+    const Json* parameters = learner ? learner->get("learner_model_param") : nullptr;
+    const Json* objective = learner && learner->get("objective") ? learner->get("objective")->get("name") : nullptr;
+    const Json* booster = learner ? learner->get("gradient_booster") : nullptr;
+
+    if (!parameters || !objective || !booster) {
+        error = "not an XGBoost JSON model";
+        return false;
+    }
+
+    double num_class = 0, num_feature = 0, base_score = 0.5;
+    if (parameters->get("num_class")) parameters->get("num_class")->to_number(num_class);
+    if (parameters->get("num_feature")) parameters->get("num_feature")->to_number(num_feature);
+    if (parameters->get("base_score")) parameters->get("base_score")->to_number(base_score);
+
+    std::string name = objective->string;
+    std::vector<double> base_margins;
+
+    /* Binary models boost class 1's margin; class 0 stays at 0, so the softmax is the sigmoid. */
+    if (name == "binary:logistic" || name == "binary:logitraw") {
+        model.num_classes = 2;
+        base_margins = { 0.0, (name == "binary:logistic") ? std::log(base_score / (1.0 - base_score)) : base_score };
+    } else if (name == "multi:softprob" || name == "multi:softmax") {
+        model.num_classes = (uint32_t)num_class;
+        base_margins.assign(model.num_classes, base_score);
+    } else {
+        error = "unsupported XGBoost objective " + name;
+        return false;
+    }
+
+    model.num_features = (uint32_t)num_feature;
+
+    /* DART keeps its trees under "gbtree" and a weight per tree. */
+    const Json* weight_drop = booster->get("weight_drop");
+    const Json* gbtree = booster->get("gbtree") ? booster->get("gbtree") : booster;
+    const Json* trees = gbtree->get("model") ? gbtree->get("model")->get("trees") : nullptr;
+    const Json* tree_info = gbtree->get("model") ? gbtree->get("model")->get("tree_info") : nullptr;
+
+    if (!trees || trees->type != Json::ARRAY || model.num_classes < 2 || model.num_features == 0) {
+        error = "malformed XGBoost model";
+        return false;
+    }
+
+    add_base_tree(model, base_margins);
+
+    for (size_t t = 0; t < trees->items.size(); t++) {
+        double group = 0, weight = 1.0;
+        number_at(tree_info, t, group);
+        number_at(weight_drop, t, weight);
+
+        uint32_t target = (model.num_classes == 2) ? 1 : (uint32_t)group;
+        ConvertedTree converted;
+
+        if (target >= model.num_classes) {
+            error = "tree " + std::to_string(t) + " boosts an unknown class";
+            return false;
+        }
+
+        if (!convert_xgboost_node(trees->items[t], 0, model.num_classes, target, 0, converted, error)) return false;
+        model.add_tree(converted.nodes, converted.values, weight);
+    }
+    return true;
+}
+
+/* Converts a LightGBM node (nested objects). */
+static bool convert_lightgbm_node(const Json& node, uint32_t num_classes, uint32_t target, double scale, int depth,
+                                  ConvertedTree& converted, std::string& error) {
+    double value = 0;
+
+    if (depth > 4096) {
+        error = "LightGBM tree too deep";
+        return false;
+    }
+
+    if (node.get("leaf_value")) {
+        node.get("leaf_value")->to_number(value);
+        add_leaf(converted, num_classes, target, value * scale);
+        return true;
+    }
+
+    const Json* decision = node.get("decision_type");
+    const Json* left = node.get("left_child");
+    const Json* right = node.get("right_child");
+    double feature = 0, threshold = 0;
+
+    if (!decision || !left || !right || !node.get("split_feature") || !node.get("threshold") ||
+        !node.get("split_feature")->to_number(feature) || !node.get("threshold")->to_number(threshold)) {
+        error = "malformed LightGBM tree";
+        return false;
+    }
+
+    if (decision->string != "<=") {
+        error = "categorical splits aren't supported";
+        return false;
+    }
+
+    /* Zeros treated as missing only matter when their default direction isn't where "0 <= threshold" sends them. */
+    const Json* missing = node.get("missing_type");
+    const Json* default_left = node.get("default_left");
+
+    if (missing && missing->string == "Zero" && (!default_left || default_left->boolean != (0.0 <= threshold))) {
+        error = "zero_as_missing isn't supported";
+        return false;
+    }
+
+    size_t index = converted.nodes.size();
+    converted.nodes.push_back({ threshold, (int32_t)feature, -1, -1, -1 });
+
+    converted.nodes[index].left = (int32_t)converted.nodes.size();
+    if (!convert_lightgbm_node(*left, num_classes, target, scale, depth + 1, converted, error)) return false;
+
+    converted.nodes[index].right = (int32_t)converted.nodes.size();
+    return convert_lightgbm_node(*right, num_classes, target, scale, depth + 1, converted, error);
+}
+
+static bool import_lightgbm(const Json& root, TreeEnsemble& model, std::string& error) {
+    const Json* objective = root.get("objective");
+    const Json* tree_info = root.get("tree_info");
+    double num_class = 1, per_iteration = 1, max_feature = -1;
+
+    if (!objective || !tree_info || tree_info->type != Json::ARRAY) {
+        error = "not a LightGBM JSON dump";
+        return false;
+    }
+
+    if (root.get("num_class")) root.get("num_class")->to_number(num_class);
+    if (root.get("num_tree_per_iteration")) root.get("num_tree_per_iteration")->to_number(per_iteration);
+    if (root.get("max_feature_idx")) root.get("max_feature_idx")->to_number(max_feature);
+
+    /* e.g. "binary sigmoid:1" or "multiclass num_class:3". */
+    std::istringstream words(objective->string);
+    std::string name, word;
+    double scale = 1.0;
+
+    words >> name;
+    while (words >> word) {
+        if (word.compare(0, 8, "sigmoid:") == 0) scale = strtod(word.c_str() + 8, nullptr);
+    }
+
+    if (name == "binary") {
+        model.num_classes = 2;
+    } else if (name == "multiclass" || name == "softmax") {
+        model.num_classes = (uint32_t)num_class;
+        scale = 1.0;
+    } else {
+        error = "unsupported LightGBM objective " + name;
+        return false;
+    }
+
+    model.num_features = (uint32_t)(max_feature + 1);
+
+    if (model.num_classes < 2 || model.num_features == 0 || per_iteration < 1) {
+        error = "malformed LightGBM dump";
+        return false;
+    }
+
+    /* Random forest mode averages the iterations instead of adding them up. */
+    size_t num_trees = tree_info->items.size();
+    size_t iterations = std::max<size_t>(1, num_trees / (size_t)per_iteration);
+    bool average = root.get("average_output") && root.get("average_output")->boolean;
+
+    /* LightGBM folds its initial score into the first trees. */
+    add_base_tree(model, std::vector<double>(model.num_classes, 0.0));
+
+    for (size_t t = 0; t < num_trees; t++) {
+        const Json* structure = tree_info->items[t].get("tree_structure");
+        uint32_t target = (model.num_classes == 2) ? 1 : (uint32_t)(t % (size_t)per_iteration);
+        ConvertedTree converted;
+
+        if (!structure || target >= model.num_classes) {
+            error = "malformed LightGBM tree " + std::to_string(t);
+            return false;
+        }
+
+        if (!convert_lightgbm_node(*structure, model.num_classes, target, scale, 0, converted, error)) return false;
+        model.add_tree(converted.nodes, converted.values, average ? 1.0 / iterations : 1.0);
+    }
+    return true;
+}
+
+/* Scores the ml_dataset rows with the imported model, batched and row by row. */
+static bool test_model(const Model& model, const std::string& prefix, std::string& error) {
+    NpyArray X, y;
+
+    if (!X.open(prefix + ".X.npy", error) || !y.open(prefix + ".y.npy", error)) return false;
+
+    if ((X.descr != "<f4" && X.descr != "<f8") || X.shape.size() != 2 || y.descr != "|u1" || y.rows() != X.rows() ||
+        X.columns() != model.num_features) {
+        error = "expected a float32/float64 (N, " + std::to_string(model.num_features) + ") X and an uint8 (N,) y";
+        return false;
+    }
+
+    uint64_t num_rows = X.rows();
+    uint32_t num_features = model.num_features;
+    std::vector<double> rows(num_rows * num_features);
+    std::vector<const double*> pointers(num_rows);
+
+    for (uint64_t i = 0; i < num_rows; i++) {
+        for (uint32_t f = 0; f < num_features; f++) {
+            uint64_t index = i * num_features + f;
+            rows[index] = (X.item_size() == 4) ? X.data<float>()[index] : X.data<double>()[index];
+        }
+        pointers[i] = rows.data() + i * num_features;
+    }
+
+    std::vector<uint32_t> batched(num_rows), single(num_rows);
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    model.predict_batch(pointers.data(), num_rows, batched.data());
+    std::chrono::duration<double> batched_seconds = std::chrono::steady_clock::now() - start;
+
+    start = std::chrono::steady_clock::now();
+    for (uint64_t i = 0; i < num_rows; i++) single[i] = model.predict(pointers[i]);
+    std::chrono::duration<double> single_seconds = std::chrono::steady_clock::now() - start;
+
+    uint64_t correct = 0;
+    for (uint64_t i = 0; i < num_rows; i++) {
+        if (batched[i] == y.data<uint8_t>()[i]) correct++;
+    }
+
+    std::cout << std::fixed << std::setprecision(4)
+              << "[*] " << prefix << ": accuracy " << (double)correct / num_rows
+              << (batched == single ? "" : " (batched and row by row predictions differ!)") << std::endl;
+    std::cout << std::setprecision(0)
+              << "[*] Batched: " << num_rows / batched_seconds.count() << " flows/s, row by row: "
+              << num_rows / single_seconds.count() << " flows/s." << std::endl;
+    return true;
+}
+
+static void usage() {
+    std::cerr << "Usage: ml_import [-f <features>] [-t <prefix>] -o <model.mlm> <model.json>" << std::endl;
+    std::cerr << "\t<model.json>: XGBoost JSON model or LightGBM JSON dump" << std::endl;
+    std::cerr << "\t-o <model.mlm>: output, e.g. joblibs/clf_xgb.mlm" << std::endl;
+    std::cerr << "\t-f <features>: number of features the model reads (default: the model's own)" << std::endl;
+    std::cerr << "\t-t <prefix>: scores <prefix>.X.npy and <prefix>.y.npy with the imported model" << std::endl;
+}
+
+static bool parse_options(int argc, char** argv, ImportOptions& options) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        bool has_value = (i + 1 < argc);
+
+        if (arg == "-o" && has_value) options.output = argv[++i];
+        else if (arg == "-f" && has_value) options.num_features = (uint32_t)strtoul(argv[++i], nullptr, 10);
+        else if (arg == "-t" && has_value) options.test_prefix = argv[++i];
+        else if (arg[0] == '-') return false;
+        else options.input = arg;
+    }
+    return !options.input.empty() && !options.output.empty();
+}
+
+int main(int argc, char** argv) {
+    ImportOptions options;
+
+    if (!parse_options(argc, argv, options)) {
+        usage();
+        return 1;
+    }
+
+    std::ifstream input(options.input, std::ios::binary);
+    std::stringstream text;
+
+    if (!input || !(text << input.rdbuf())) {
+        std::cerr << "[*] Error! Couldn't read " << options.input << "." << std::endl;
+        return 1;
+    }
+
+    Json root;
+    std::string error;
+    std::string document = text.str();
+
+    if (!JsonParser(document).parse(root, error)) {
+        std::cerr << "[*] Error! " << options.input << ": " << error << "." << std::endl;
+        return 1;
+    }
+
+    TreeEnsemble model(MODEL_BOOSTED_TREES);
+    bool xgboost = (root.get("learner") != nullptr);
+    bool imported = xgboost ? import_xgboost(root, model, error) : import_lightgbm(root, model, error);
+
+    if (imported && options.num_features > 0) {
+        if (options.num_features < model.num_features) {
+            error = "the model reads " + std::to_string(model.num_features) + " features";
+            imported = false;
+        } else {
+            model.num_features = options.num_features;
+        }
+    }
+
+    if (!imported) {
+        std::cerr << "[*] Error! " << options.input << ": " << error << "." << std::endl;
+        return 1;
+    }
+
+    if (!save_model(model, options.output)) {
+        std::cerr << "[*] Error! Couldn't write " << options.output << "." << std::endl;
+        return 1;
+    }
+
+    /* Reads it back, as the inspector would (which also validates the arena). */
+    std::unique_ptr<Model> loaded(load_model(options.output, error));
+
+    if (!loaded) {
+        std::cerr << "[*] Error! " << error << "." << std::endl;
+        return 1;
+    }
+
+    std::cout << "[*] Imported " << model.roots.size() - 1 << " " << (xgboost ? "XGBoost" : "LightGBM") << " trees ("
+              << model.nodes.size() << " nodes, " << model.num_classes << " classes, " << model.num_features
+              << " features) into " << options.output << " (" << loaded->memory_bytes() / 1024 << " KiB)." << std::endl;
+
+    if (!options.test_prefix.empty() && !test_model(*loaded, options.test_prefix, error)) {
+        std::cerr << "[*] Error! " << error << "." << std::endl;
+        return 1;
+    }
+    return 0;
+}
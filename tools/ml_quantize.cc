@@ -0,0 +1,221 @@
+//--------------------------------------------------------------------------
+// Copyright (C) 2014-2019 Cisco and/or its affiliates. All rights reserved.
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the GNU General Public License Version 2 as published
+// by the Free Software Foundation.  You may not use, modify or distribute
+// this program under any other version of the GNU General Public License.
+//
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along
+// with this program; if not, write to the Free Software Foundation, Inc.,
+// 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+//--------------------------------------------------------------------------
+// ml_quantize.cc
+
+/*
+    Drift report of the quantized engines (see ml_quantized.h).
+
+    Scores the rows written by ml_dataset (<prefix>.X.npy / <prefix>.y.npy) with every
+    given .mlm model, in double precision and quantized, and reports the accuracy of both,
+    how often they agree, how far the attack probabilities drift, the throughput and the
+    memory footprint of each. With -b, rows are scored in batches (see Model::predict_proba_batch()),
+    as the inspector does with the timeouted flows: that's where the MLP's GEMMs pay off, so
+    compare MLPs and trees with the same batch size.
+*/
+
+#include <cmath>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <algorithm>
+
+#include "../ml_npy.h"
+#include "../ml_quantized.h"
+
+struct QuantizeOptions {
+    std::string prefix = "CIC-IDS-2017";
+    std::vector<std::string> models;
+    uint64_t max_rows = 100000;         /* 0: every row. */
+    size_t batch = 1;                   /* Rows per predict_proba_batch() call (1: predict_proba()). */
+};
+
+/* Predictions of a model over the sampled rows. */
+struct Scores {
+    std::vector<uint32_t> labels;
+    std::vector<double> attack_proba;
+    double seconds = 0;
+};
+
+static double feature_value(const NpyArray& X, uint64_t row, uint32_t column) {
+    uint64_t index = row * X.columns() + column;
+
+    if (X.item_size() == 4)
+        return X.data<float>()[index];
+    return X.data<double>()[index];
+}
+
+static void score(const Model& model, const std::vector<double>& rows, uint32_t num_features, size_t batch, Scores& scores) {
+    size_t num_rows = rows.size() / num_features;
+    std::vector<double> proba(num_rows * model.num_classes);
+    std::vector<const double*> pointers(num_rows);
+
+    for (size_t i = 0; i < num_rows; i++) pointers[i] = rows.data() + i * num_features;
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    for (size_t first = 0; first < num_rows; first += batch) {
+        if (batch == 1) {
+            model.predict_proba(pointers[first], proba.data() + first * model.num_classes);
+        } else {
+            model.predict_proba_batch(pointers.data() + first, std::min(batch, num_rows - first), proba.data() + first * model.num_classes);
+        }
+    }
+
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    scores.seconds = elapsed.count();
+
+    scores.labels.resize(num_rows);
+    scores.attack_proba.resize(num_rows);
+
+    for (size_t i = 0; i < num_rows; i++) {
+        const double* row_proba = proba.data() + i * model.num_classes;
+
+        scores.labels[i] = (uint32_t)(std::max_element(row_proba, row_proba + model.num_classes) - row_proba);
+        scores.attack_proba[i] = 1.0 - row_proba[0];
+    }
+}
+
+static void usage() {
+    std::cerr << "Usage: ml_quantize [-n <rows>] [-b <rows>] [<prefix>] <model.mlm>..." << std::endl;
+    std::cerr << "\t<prefix>: reads <prefix>.X.npy and <prefix>.y.npy (default: CIC-IDS-2017)" << std::endl;
+    std::cerr << "\t-n <rows>: rows scored, evenly spread over the dataset, 0 for all (default: 100000)" << std::endl;
+    std::cerr << "\t-b <rows>: rows scored per call, in batches (default: 1, row by row)" << std::endl;
+}
+
+static bool parse_options(int argc, char** argv, QuantizeOptions& options) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        bool has_value = (i + 1 < argc);
+
+        if (arg == "-n" && has_value) options.max_rows = strtoull(argv[++i], nullptr, 10);
+        else if (arg == "-b" && has_value) options.batch = std::max<size_t>(1, strtoull(argv[++i], nullptr, 10));
+        else if (arg[0] == '-') return false;
+        else if (arg.size() > 4 && arg.compare(arg.size() - 4, 4, ".mlm") == 0) options.models.push_back(arg);
+        else options.prefix = arg;
+    }
+    return !options.models.empty();
+}
+
+int main(int argc, char** argv) {
+    QuantizeOptions options;
+
+    if (!parse_options(argc, argv, options)) {
+        usage();
+        return 1;
+    }
+
+    NpyArray X, y;
+    std::string error;
+
+    if (!X.open(options.prefix + ".X.npy", error) || !y.open(options.prefix + ".y.npy", error)) {
+        std::cerr << "[*] Error! " << error << "." << std::endl;
+        return 1;
+    }
+
+    if ((X.descr != "<f4" && X.descr != "<f8") || X.shape.size() != 2 || y.descr != "|u1" || y.rows() != X.rows()) {
+        std::cerr << "[*] Error! Expected a float32/float64 (N, F) X and an uint8 (N,) y." << std::endl;
+        return 1;
+    }
+
+    /* The sampled rows are copied once, so both engines read the same contiguous vectors. */
+    uint64_t num_rows = X.rows();
+    if (options.max_rows > 0) num_rows = std::min(num_rows, options.max_rows);
+
+    if (num_rows == 0) {
+        std::cerr << "[*] Error! " << options.prefix << " has no rows." << std::endl;
+        return 1;
+    }
+
+    uint64_t step = X.rows() / num_rows;
+    uint32_t num_features = (uint32_t)X.columns();
+    std::vector<double> rows(num_rows * num_features);
+    std::vector<uint8_t> truth(num_rows);
+
+    for (uint64_t i = 0; i < num_rows; i++) {
+        for (uint32_t f = 0; f < num_features; f++) rows[i * num_features + f] = feature_value(X, i * step, f);
+        truth[i] = y.data<uint8_t>()[i * step];
+    }
+
+    std::cout << "[*] Scoring " << num_rows << " rows (" << num_features << " features)." << std::endl;
+
+    for (const std::string& path : options.models) {
+        /* Unfolded, as quantization works on the scaled features. */
+        Model* model = load_model(path, error, false);
+
+        if (!model) {
+            std::cerr << "[*] Couldn't load " << path << " (" << error << ")." << std::endl;
+            continue;
+        }
+
+        if (model->num_features != num_features) {
+            std::cerr << "[*] " << path << " expects " << model->num_features << " features, skipping it." << std::endl;
+            delete model;
+            continue;
+        }
+
+        Scores reference;
+        score(*model, rows, num_features, options.batch, reference);
+        size_t reference_bytes = model->memory_bytes();
+
+        /* The MLP's reference engine already runs in single precision. */
+        std::string precision = (model->kind == MODEL_MLP) ? " (float32)" : " (double)";
+
+        /* quantize_model() takes the model over when it succeeds. */
+        Model* quantized = quantize_model(model, error);
+
+        if (!quantized) {
+            std::cerr << "[*] Couldn't quantize " << path << " (" << error << ")." << std::endl;
+            delete model;
+            continue;
+        }
+
+        Scores scores;
+        score(*quantized, rows, num_features, options.batch, scores);
+
+        uint64_t reference_correct = 0, correct = 0, agree = 0;
+        double max_drift = 0, total_drift = 0;
+
+        for (uint64_t i = 0; i < num_rows; i++) {
+            uint32_t label = (truth[i] != 0);
+
+            reference_correct += ((reference.labels[i] != 0) == label);
+            correct += ((scores.labels[i] != 0) == label);
+            agree += (reference.labels[i] == scores.labels[i]);
+
+            double drift = std::fabs(reference.attack_proba[i] - scores.attack_proba[i]);
+            max_drift = std::max(max_drift, drift);
+            total_drift += drift;
+        }
+
+        std::cout << "[*] " << path << ":" << std::endl;
+        std::cout << "\t[*] Accuracy: " << (double)reference_correct / num_rows << precision << ", "
+                  << (double)correct / num_rows << " (quantized)." << std::endl;
+        std::cout << "\t[*] Agreement: " << (double)agree / num_rows << " (" << num_rows - agree << " rows differ)." << std::endl;
+        std::cout << "\t[*] Attack probability drift: " << max_drift << " max, " << total_drift / num_rows << " mean." << std::endl;
+        std::cout << "\t[*] Throughput: " << num_rows / reference.seconds << " flows/s" << precision << ", "
+                  << num_rows / scores.seconds << " flows/s (quantized)." << std::endl;
+        std::cout << "\t[*] Memory: " << reference_bytes << " bytes" << precision << ", "
+                  << quantized->memory_bytes() << " bytes (quantized)." << std::endl;
+
+        delete quantized;
+    }
+
+    return 0;
+}
@@ -0,0 +1,966 @@
+//--------------------------------------------------------------------------
+// Copyright (C) 2014-2019 Cisco and/or its affiliates. All rights reserved.
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the GNU General Public License Version 2 as published
+// by the Free Software Foundation.  You may not use, modify or distribute
+// this program under any other version of the GNU General Public License.
+//
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along
+// with this program; if not, write to the Free Software Foundation, Inc.,
+// 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+//--------------------------------------------------------------------------
+// ml_sensor.cc
+
+/*
+    Standalone, classification-only sensor (Linux).
+
+    Captures from an interface through AF_PACKET TPACKET_V3 rings, one per worker thread,
+    joined in a fanout group: the kernel's flow hash is symmetric, so both directions of a
+    flow reach the same worker and every worker owns its flows (no locks on the packet
+    path). Packets are only decoded down to L4 (ml_decode.h) and fed to the inspector's
+    Connection engine (ml_connection.h); expired flows are classified with a native model.
+
+    With --dispatch, a single capture thread hashes the packets itself (symmetric Toeplitz,
+    see ml_dispatch.h) into per-core shards that each own their flows, and a per-shard load
+    report is printed at exit.
+
+    With -r, a pcap is replayed instead, as fast as it can be read: every timing (expiry,
+    active/idle, subflows) follows the packets' timestamps, so a replay always gives the same
+    flows. --record writes their feature vectors and verdicts (a golden output), --verify
+    checks a replay against one, so changes to the engine can be checked at full speed.
+*/
+
+#include <cmath>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <csignal>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <iostream>
+#include <algorithm>
+#include <unordered_map>
+
+#include <poll.h>
+#include <sched.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <net/if.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+
+#include "../ml_cache.h"
+#include "../ml_pcap.h"
+#include "../ml_decode.h"
+#include "../ml_dispatch.h"
+#include "../ml_models.h"
+#include "../ml_quantized.h"
+#include "../ml_connection.h"
+
+struct SensorOptions {
+    std::string interface;
+    std::string pcap;                   /* -r: replays a capture on packet time instead. */
+    std::string model;
+    unsigned num_workers = 0;           /* 0: every core live, one on replays. */
+    uint32_t block_size = 1 << 22;      /* Ring block size (bytes, a multiple of the page size). */
+    uint32_t num_blocks = 64;           /* Ring blocks per worker. */
+    uint32_t block_timeout = 100;       /* Milliseconds before the kernel retires a partially filled block. */
+    int64_t flow_timeout = 120000000;   /* Idle time (microseconds) before a flow is classified, as in the inspector. */
+    bool dispatch = false;              /* Hash the packets to the shards ourselves instead of the kernel's fanout. */
+    size_t queue_size = 65536;          /* Packets queued per shard (--dispatch). */
+    bool pin = false;                   /* Pin worker/shard n to CPU n. */
+    std::string record;                 /* Golden output written (-r). */
+    std::string verify;                 /* Golden output checked (-r). */
+    double tolerance = 1e-9;            /* Relative difference allowed between features by --verify. */
+    std::vector<double> alert_thresholds;   /* Per-class alert probabilities (see decide_class()). */
+    bool quantized = false;
+    bool verbose = false;
+};
+
+/* Per-worker counters. */
+struct SensorStats {
+    uint64_t packets = 0;
+    uint64_t bytes = 0;
+    uint64_t not_ip = 0;
+    uint64_t unsupported = 0;
+    uint64_t fragments = 0;
+    uint64_t truncated = 0;
+    uint64_t flows_created = 0;
+    uint64_t flows_expired = 0;
+    uint64_t normal_flows = 0;
+    uint64_t attack_flows = 0;
+
+    /* From PACKET_STATISTICS. */
+    uint64_t kernel_drops = 0;
+    uint64_t queue_freezes = 0;
+};
+
+static std::atomic<bool> stopping(false);
+
+/* Serializes the verdict lines of the workers. */
+static std::mutex output_mutex;
+
+/* Set once the capture thread is done, so the shards drain their queues and stop (--dispatch). */
+static std::atomic<bool> capture_done(false);
+
+static void handle_signal(int) {
+    stopping = true;
+}
+
+static void pin_thread(unsigned cpu) {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu % std::max(1u, std::thread::hardware_concurrency()), &cpus);
+
+    if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0) {
+        std::lock_guard<std::mutex> lock(output_mutex);
+        std::cerr << "[*] Couldn't pin a thread to CPU " << cpu << "." << std::endl;
+    }
+}
+
+/* A classified flow, as kept for --record and --verify. */
+struct FlowResult {
+    int64_t first_seen;
+    std::string id;
+    uint32_t label;
+    FeatureVector features;
+
+    bool operator<(const FlowResult& other) const {
+        return (first_seen != other.first_seen) ? first_seen < other.first_seen : id < other.id;
+    }
+};
+
+/* Direction-independent flow key: the endpoints are sorted, so both directions share it. */
+struct FlowKey {
+    uint8_t a[16];
+    uint8_t b[16];
+    uint16_t a_port;
+    uint16_t b_port;
+    uint16_t icmp_id;
+    uint8_t protocol;
+    uint8_t family;
+
+    bool operator==(const FlowKey& other) const {
+        return memcmp(this, &other, sizeof(FlowKey)) == 0;
+    }
+};
+
+struct FlowKeyHash {
+    size_t operator()(const FlowKey& key) const {
+        return (size_t)fnv1a(14695981039346656037ULL, &key, sizeof(key));
+    }
+};
+
+/* Builds the key of a packet; "source_is_a" tells on which side its source was sorted. */
+static FlowKey flow_key(const DecodedPacket& decoded, bool& source_is_a) {
+    FlowKey key;
+    memset(&key, 0, sizeof(key));
+
+    int order = memcmp(decoded.src, decoded.dst, sizeof(decoded.src));
+    source_is_a = (order < 0) || (order == 0 && decoded.src_port <= decoded.dst_port);
+
+    memcpy(key.a, source_is_a ? decoded.src : decoded.dst, sizeof(key.a));
+    memcpy(key.b, source_is_a ? decoded.dst : decoded.src, sizeof(key.b));
+    key.a_port = source_is_a ? decoded.src_port : decoded.dst_port;
+    key.b_port = source_is_a ? decoded.dst_port : decoded.src_port;
+    key.icmp_id = decoded.icmp_id;
+    key.protocol = decoded.protocol;
+    key.family = decoded.family;
+
+    return key;
+}
+
+/* A worker's flows: the client is the source of a flow's first packet. */
+class FlowTable {
+    public:
+        /* Classified flows are appended to "results" when given. */
+        FlowTable(const Model& model, const SensorOptions& options, SensorStats& stats, std::vector<FlowResult>* results = nullptr) :
+            model(model), options(options), stats(stats), results(results) { }
+
+        void add(const DecodedPacket& decoded) {
+            bool source_is_a;
+            FlowKey key = flow_key(decoded, source_is_a);
+
+            FlowPacket packet;
+            packet.timestamp = decoded.timestamp;
+            packet.pktlen = decoded.pktlen;
+            packet.dsize = decoded.dsize;
+            packet.protocol = decoded.protocol;
+            packet.tcp = decoded.is_tcp();
+            packet.tcp_flags = decoded.tcp_flags;
+            packet.window = decoded.window;
+
+            std::unordered_map<FlowKey, Flow, FlowKeyHash>::iterator it = flows.find(key);
+
+            if (it != flows.end()) {
+                /* Idle for longer than the timeout (before a sweep noticed): that flow is over and this packet starts a new one. */
+                if (decoded.timestamp - it->second.connection.get_flowlastseen() > options.flow_timeout) {
+                    classify(it->second.connection);
+                    flows.erase(it);
+                    stats.flows_expired++;
+                }
+                else {
+                    packet.from_client = (source_is_a == it->second.client_is_a);
+                    it->second.connection.add_packet(packet);
+                    return;
+                }
+            }
+
+            char client_ip[INET6_ADDRSTRLEN], server_ip[INET6_ADDRSTRLEN];
+            inet_ntop(decoded.family, decoded.src, client_ip, sizeof(client_ip));
+            inet_ntop(decoded.family, decoded.dst, server_ip, sizeof(server_ip));
+
+            packet.from_client = true;
+            packet.client_ip = client_ip;
+            packet.client_port = decoded.src_port;
+            packet.server_ip = server_ip;
+            packet.server_port = decoded.dst_port;
+
+            flows.emplace(key, Flow { Connection(packet, flow_id(decoded, client_ip, server_ip)), source_is_a });
+            stats.flows_created++;
+        }
+
+        /* Classifies and forgets the flows idle for longer than the flow timeout at "now" (everything if "all"). */
+        void expire(int64_t now, bool all = false) {
+            for (std::unordered_map<FlowKey, Flow, FlowKeyHash>::iterator it = flows.begin(); it != flows.end(); ) {
+                if (!all && now - it->second.connection.get_flowlastseen() <= options.flow_timeout) {
+                    ++it;
+                    continue;
+                }
+
+                classify(it->second.connection);
+                it = flows.erase(it);
+                stats.flows_expired++;
+            }
+        }
+
+        /* Expires the idle flows once per second of "now" (the wall clock live, packet time on replays). */
+        void tick(int64_t now) {
+            if (now < next_expiry) return;
+
+            if (next_expiry != 0) expire(now);
+            next_expiry = now + 1000000;
+        }
+
+        size_t size() const {
+            return flows.size();
+        }
+
+    private:
+        struct Flow {
+            Connection connection;
+            bool client_is_a;
+        };
+
+        /* Same format as the inspector's flow ids (see get_id_candidates()). */
+        static std::string flow_id(const DecodedPacket& decoded, const char* client_ip, const char* server_ip) {
+            std::string id = decoded.is_tcp() ? "TCP" : (decoded.is_icmp() ? "ICMP" : "UDP");
+
+            id += "-" + std::string(client_ip) + ":" + std::to_string(decoded.src_port) +
+                  "-" + std::string(server_ip) + ":" + std::to_string(decoded.dst_port);
+
+            if (decoded.is_icmp()) id += "-" + std::to_string(decoded.icmp_id);
+            return id;
+        }
+
+        void classify(Connection& connection) {
+            FeatureVector features;
+            connection.get_feature_vector(features.data());
+
+            double confidence;
+            uint32_t label = model.predict(features.data(), &confidence, &options.alert_thresholds);
+
+            if (label == 0) stats.normal_flows++;
+            else stats.attack_flows++;
+
+            if (results) {
+                results->push_back(FlowResult { connection.get_flowfirstseen(), connection.get_flowid(), label, features });
+            }
+
+            if (label != 0 || options.verbose) {
+                std::lock_guard<std::mutex> lock(output_mutex);
+
+                std::cout << "[-] " << connection.get_flowid() << std::endl;
+                std::cout << "\tResult: " << ((label == 0) ? "Normal" : "Attack") << " (" << label << ", "
+                          << confidence << ")" << std::endl;
+            }
+        }
+
+        const Model& model;
+        const SensorOptions& options;
+        SensorStats& stats;
+        std::vector<FlowResult>* results;
+
+        std::unordered_map<FlowKey, Flow, FlowKeyHash> flows;
+        int64_t next_expiry = 0;
+};
+
+/* A TPACKET_V3 receive ring bound to an interface and joined to a fanout group. */
+class PacketRing {
+    public:
+        bool open(const SensorOptions& options, uint16_t fanout_group, std::string& error) {
+            fd = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL));
+            if (fd < 0) {
+                error = "couldn't open an AF_PACKET socket (are you root?)";
+                return false;
+            }
+
+            int version = TPACKET_V3;
+            if (setsockopt(fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) < 0) {
+                error = "TPACKET_V3 isn't supported";
+                return false;
+            }
+
+            struct tpacket_req3 request;
+            memset(&request, 0, sizeof(request));
+            request.tp_block_size = options.block_size;
+            request.tp_block_nr = options.num_blocks;
+            request.tp_frame_size = 2048;
+            request.tp_frame_nr = (options.block_size / request.tp_frame_size) * options.num_blocks;
+            request.tp_retire_blk_tov = options.block_timeout;
+
+            if (setsockopt(fd, SOL_PACKET, PACKET_RX_RING, &request, sizeof(request)) < 0) {
+                error = "couldn't set up the receive ring";
+                return false;
+            }
+
+            ring_size = (size_t)options.block_size * options.num_blocks;
+            void* addr = mmap(nullptr, ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_LOCKED | MAP_POPULATE, fd, 0);
+
+            if (addr == MAP_FAILED) {
+                error = "couldn't map the receive ring";
+                return false;
+            }
+
+            ring = (uint8_t*)addr;
+            block_size = options.block_size;
+            num_blocks = options.num_blocks;
+
+            struct sockaddr_ll address;
+            memset(&address, 0, sizeof(address));
+            address.sll_family = AF_PACKET;
+            address.sll_protocol = htons(ETH_P_ALL);
+            address.sll_ifindex = if_nametoindex(options.interface.c_str());
+
+            if (address.sll_ifindex == 0 || bind(fd, (struct sockaddr*)&address, sizeof(address)) < 0) {
+                error = "couldn't bind to " + options.interface;
+                return false;
+            }
+
+            struct ifreq request_flags;
+            memset(&request_flags, 0, sizeof(request_flags));
+            strncpy(request_flags.ifr_name, options.interface.c_str(), IFNAMSIZ - 1);
+            loopback = (ioctl(fd, SIOCGIFFLAGS, &request_flags) == 0) && (request_flags.ifr_flags & IFF_LOOPBACK);
+
+            /* The kernel defragments first, so fragments are hashed (and decoded) as whole packets. */
+            int fanout = fanout_group | ((PACKET_FANOUT_HASH | PACKET_FANOUT_FLAG_DEFRAG) << 16);
+            if (setsockopt(fd, SOL_PACKET, PACKET_FANOUT, &fanout, sizeof(fanout)) < 0) {
+                error = "couldn't join the fanout group";
+                return false;
+            }
+            return true;
+        }
+
+        /*
+            Waits up to "timeout" milliseconds for a retired block and passes every packet
+            of the ready blocks to handler(header, data), then hands the blocks back.
+        */
+        template <typename Handler>
+        void poll_blocks(int timeout, Handler handler) {
+            struct tpacket_block_desc* block = (struct tpacket_block_desc*)(ring + (size_t)current * block_size);
+
+            if (!(block->hdr.bh1.block_status & TP_STATUS_USER)) {
+                struct pollfd descriptor = { fd, POLLIN | POLLERR, 0 };
+                ::poll(&descriptor, 1, timeout);
+            }
+
+            while (block->hdr.bh1.block_status & TP_STATUS_USER) {
+                const uint8_t* frame = (const uint8_t*)block + block->hdr.bh1.offset_to_first_pkt;
+
+                for (uint32_t i = 0; i < block->hdr.bh1.num_pkts; i++) {
+                    const struct tpacket3_hdr* header = (const struct tpacket3_hdr*)frame;
+                    const struct sockaddr_ll* link = (const struct sockaddr_ll*)(frame + TPACKET_ALIGN(sizeof(struct tpacket3_hdr)));
+
+                    /* The loopback interface shows every packet twice (sent and received), like libpcap only keep one. */
+                    if (!loopback || link->sll_pkttype != PACKET_OUTGOING) {
+                        handler(header, frame + header->tp_mac);
+                    }
+                    frame += header->tp_next_offset;
+                }
+
+                __atomic_store_n(&block->hdr.bh1.block_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+
+                current = (current + 1) % num_blocks;
+                block = (struct tpacket_block_desc*)(ring + (size_t)current * block_size);
+            }
+        }
+
+        /* Adds the kernel's drop counters (reset on every read) to "stats". */
+        void read_statistics(SensorStats& stats) {
+            struct tpacket_stats_v3 kernel_stats;
+            socklen_t size = sizeof(kernel_stats);
+
+            if (getsockopt(fd, SOL_PACKET, PACKET_STATISTICS, &kernel_stats, &size) == 0) {
+                stats.kernel_drops += kernel_stats.tp_drops;
+                stats.queue_freezes += kernel_stats.tp_freeze_q_cnt;
+            }
+        }
+
+        ~PacketRing() {
+            if (ring) munmap(ring, ring_size);
+            if (fd >= 0) ::close(fd);
+        }
+
+    private:
+        int fd = -1;
+        uint8_t* ring = nullptr;
+        size_t ring_size = 0;
+        uint32_t block_size = 0;
+        uint32_t num_blocks = 0;
+        uint32_t current = 0;
+        bool loopback = false;
+};
+
+/* Decodes a captured frame into "decoded", counting it in "stats". False if it isn't a flow's packet. */
+static bool decode_frame(uint32_t link_type, int64_t timestamp, uint32_t pktlen, const uint8_t* data, uint32_t caplen,
+        SensorStats& stats, DecodedPacket& decoded) {
+    decoded.timestamp = timestamp;
+    decoded.pktlen = pktlen;
+
+    stats.packets++;
+    stats.bytes += pktlen;
+
+    switch (decode_link(link_type, data, caplen, decoded)) {
+        case DECODE_OK: return true;
+        case DECODE_NOT_IP: stats.not_ip++; break;
+        case DECODE_UNSUPPORTED: stats.unsupported++; break;
+        case DECODE_FRAGMENT: stats.fragments++; break;
+        case DECODE_TRUNCATED: stats.truncated++; break;
+    }
+    return false;
+}
+
+static bool decode_frame(const struct tpacket3_hdr* header, const uint8_t* data, SensorStats& stats, DecodedPacket& decoded) {
+    return decode_frame(LINKTYPE_ETHERNET, (int64_t)header->tp_sec * 1000000 + header->tp_nsec / 1000, header->tp_len,
+                        data, header->tp_snaplen, stats, decoded);
+}
+
+static bool open_ring(PacketRing& ring, const char* name, unsigned index, const SensorOptions& options, uint16_t fanout_group) {
+    std::string error;
+
+    if (!ring.open(options, fanout_group, error)) {
+        std::lock_guard<std::mutex> lock(output_mutex);
+        std::cerr << "[*] Error! " << name << " " << index << ": " << error << "." << std::endl;
+
+        stopping = true;
+        return false;
+    }
+    return true;
+}
+
+static void run_worker(unsigned index, const Model& model, const SensorOptions& options, uint16_t fanout_group,
+        SensorStats& stats) {
+    if (options.pin) pin_thread(index);
+
+    PacketRing ring;
+    if (!open_ring(ring, "Worker", index, options, fanout_group)) return;
+
+    FlowTable flows(model, options, stats);
+    int64_t next_expiry = get_time_in_microseconds() + 1000000;
+
+    while (!stopping) {
+        ring.poll_blocks(100, [&](const struct tpacket3_hdr* header, const uint8_t* data) {
+            DecodedPacket decoded;
+            if (decode_frame(header, data, stats, decoded)) flows.add(decoded);
+        });
+
+        /* Live capture: flows expire on the wall clock, like the inspector's timeout thread. */
+        int64_t now = get_time_in_microseconds();
+        if (now >= next_expiry) {
+            flows.expire(now);
+            ring.read_statistics(stats);
+            next_expiry = now + 1000000;
+        }
+    }
+
+    /* Flows still open at shutdown are classified too. */
+    flows.expire(get_time_in_microseconds(), true);
+    ring.read_statistics(stats);
+}
+
+/* --dispatch: the only capture thread, feeding the shards' queues. */
+static void run_capture(const SensorOptions& options, uint16_t fanout_group, FlowDispatcher& dispatcher, SensorStats& stats) {
+    if (options.pin) pin_thread(options.num_workers);
+
+    PacketRing ring;
+
+    if (open_ring(ring, "Capture", 0, options, fanout_group)) {
+        int64_t next_statistics = get_time_in_microseconds() + 1000000;
+
+        while (!stopping) {
+            ring.poll_blocks(100, [&](const struct tpacket3_hdr* header, const uint8_t* data) {
+                DecodedPacket decoded;
+                if (decode_frame(header, data, stats, decoded)) dispatcher.dispatch(decoded, stopping);
+            });
+
+            int64_t now = get_time_in_microseconds();
+            if (now >= next_statistics) {
+                ring.read_statistics(stats);
+                next_statistics = now + 1000000;
+            }
+        }
+        ring.read_statistics(stats);
+    }
+
+    capture_done = true;
+}
+
+/*
+    --dispatch (or -r with several workers): a shard, owning the flows the dispatcher hashes to it.
+    Live, its flows expire on the wall clock; on replays, on the latest packet time it has seen.
+*/
+static void run_shard(unsigned index, const Model& model, const SensorOptions& options, FlowDispatcher& dispatcher,
+        SensorStats& stats, std::vector<FlowResult>* results) {
+    if (options.pin) pin_thread(index);
+
+    SpscRing<DecodedPacket>& queue = dispatcher.queue(index);
+    ShardLoad& load = dispatcher.load(index);
+
+    FlowTable flows(model, options, stats, results);
+    std::vector<DecodedPacket> batch(256);
+    bool replay = !options.pcap.empty();
+    int64_t packet_time = 0;
+
+    while (true) {
+        /* Read before popping: once the capture is done, an empty queue stays empty. */
+        bool done = capture_done;
+        size_t count = queue.pop(batch.data(), batch.size());
+
+        if (count > 0) {
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+            for (size_t i = 0; i < count; i++) {
+                flows.add(batch[i]);
+                packet_time = std::max(packet_time, batch[i].timestamp);
+            }
+
+            load.packets += count;
+            load.flows = stats.flows_created;
+            load.busy_nsecs += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+        }
+        else if (done) {
+            break;
+        }
+        else {
+            std::this_thread::sleep_for(std::chrono::microseconds(50));
+        }
+
+        flows.tick(replay ? packet_time : get_time_in_microseconds());
+    }
+
+    flows.expire(replay ? packet_time : get_time_in_microseconds(), true);
+}
+
+/*
+    -r: replays the capture as fast as it can be read, on this thread (one worker) or through
+    the dispatcher's shards. Flows expire on packet time, and the ones left are classified at
+    the end of the capture.
+*/
+static bool replay_pcap(const Model& model, const SensorOptions& options, FlowDispatcher* dispatcher, SensorStats& stats,
+        std::vector<FlowResult>* results) {
+    PcapReader reader;
+    std::string error;
+
+    if (!reader.open(options.pcap, error)) {
+        std::cerr << "[*] Error! " << error << "." << std::endl;
+        return false;
+    }
+
+    FlowTable flows(model, options, stats, results);
+    int64_t packet_time = 0;
+    PcapRecord record;
+
+    while (!stopping && reader.next(record)) {
+        DecodedPacket decoded;
+
+        if (!decode_frame(reader.linktype(), record.timestamp, record.pktlen, record.data, record.caplen, stats, decoded))
+            continue;
+
+        if (dispatcher) {
+            dispatcher->dispatch(decoded, stopping);
+            continue;
+        }
+
+        flows.add(decoded);
+        packet_time = std::max(packet_time, decoded.timestamp);
+        flows.tick(packet_time);
+    }
+
+    flows.expire(packet_time, true);
+    return true;
+}
+
+/* Golden output: "<first seen> <flow id> <label> <78 features>" per flow, ordered by first seen and id. */
+static bool write_golden(const std::string& path, const std::vector<FlowResult>& results) {
+    FILE* file = fopen(path.c_str(), "w");
+    if (!file) return false;
+
+    fprintf(file, "# ml_sensor golden output: first seen, flow id, label, %u features\n", (unsigned)NUM_FEATURES);
+
+    for (const FlowResult& result : results) {
+        fprintf(file, "%lld %s %u", (long long)result.first_seen, result.id.c_str(), result.label);
+
+        /* %.17g round-trips every double. */
+        for (size_t f = 0; f < NUM_FEATURES; f++) fprintf(file, " %.17g", result.features[f]);
+        fprintf(file, "\n");
+    }
+    return fclose(file) == 0;
+}
+
+static bool read_golden(const std::string& path, std::vector<FlowResult>& results, std::string& error) {
+    std::ifstream file(path);
+    if (!file.is_open()) {
+        error = "couldn't open " + path;
+        return false;
+    }
+
+    std::string line;
+    size_t line_number = 0;
+
+    while (std::getline(file, line)) {
+        line_number++;
+        if (line.empty() || line[0] == '#') continue;
+
+        std::istringstream fields(line);
+        FlowResult result;
+        long long first_seen;
+
+        fields >> first_seen >> result.id >> result.label;
+        result.first_seen = first_seen;
+
+        /* strtod() reads "nan" and "inf", which istream doesn't. */
+        std::string value;
+        size_t f = 0;
+        while (f < NUM_FEATURES && fields >> value) result.features[f++] = strtod(value.c_str(), nullptr);
+
+        if (!fields && f < NUM_FEATURES) {
+            error = path + ":" + std::to_string(line_number) + " isn't a golden output line";
+            return false;
+        }
+        results.push_back(result);
+    }
+
+    std::sort(results.begin(), results.end());
+    return true;
+}
+
+static bool same_feature(double expected, double actual, double tolerance) {
+    if (std::isnan(expected) || std::isnan(actual)) return std::isnan(expected) && std::isnan(actual);
+    if (expected == actual) return true;
+
+    return std::fabs(expected - actual) <= tolerance * std::max(std::fabs(expected), std::fabs(actual));
+}
+
+/* Compares a replay's flows ("results", sorted) against the golden output; prints the differences. */
+static bool verify_golden(const std::vector<FlowResult>& expected, const std::vector<FlowResult>& results, double tolerance) {
+    const size_t max_reported = 20;
+    uint64_t missing = 0, unexpected = 0, different_features = 0, different_labels = 0, reported = 0;
+
+    auto report = [&](const FlowResult& flow, const std::string& difference) {
+        if (reported++ < max_reported)
+            std::cout << "\t[*] " << flow.id << " (first seen " << flow.first_seen << "): " << difference << "." << std::endl;
+    };
+
+    std::cout << std::setprecision(17);
+
+    /* Both are sorted by first seen and id, so they're merged in one pass. */
+    size_t i = 0, j = 0;
+    while (i < expected.size() || j < results.size()) {
+        if (j == results.size() || (i < expected.size() && expected[i] < results[j])) {
+            report(expected[i++], "missing");
+            missing++;
+            continue;
+        }
+        if (i == expected.size() || results[j] < expected[i]) {
+            report(results[j++], "unexpected");
+            unexpected++;
+            continue;
+        }
+
+        const FlowResult& reference = expected[i++];
+        const FlowResult& flow = results[j++];
+
+        for (size_t f = 0; f < NUM_FEATURES; f++) {
+            if (!same_feature(reference.features[f], flow.features[f], tolerance)) {
+                std::ostringstream difference;
+                difference << "feature " << f + 1 << " is " << flow.features[f] << ", expected " << reference.features[f];
+
+                report(flow, difference.str());
+                different_features++;
+                break;
+            }
+        }
+
+        if (reference.label != flow.label) {
+            report(flow, "verdict " + std::to_string(flow.label) + ", expected " + std::to_string(reference.label));
+            different_labels++;
+        }
+    }
+
+    std::cout.unsetf(std::ios::floatfield);
+    std::cout << std::setprecision(6);
+
+    bool ok = (missing + unexpected + different_features + different_labels == 0);
+
+    std::cout << "[*] Verify: " << expected.size() << " expected flows, " << missing << " missing, " << unexpected
+              << " unexpected, " << different_features << " with different features, " << different_labels
+              << " with different verdicts: " << (ok ? "OK." : "FAILED.") << std::endl;
+    return ok;
+}
+
+static void usage() {
+    std::cerr << "Usage: ml_sensor -i <interface> -m <model.mlm> [options]" << std::endl;
+    std::cerr << "       ml_sensor -r <file.pcap> -m <model.mlm> [--record <golden>] [--verify <golden>] [options]" << std::endl;
+    std::cerr << "\t-j <workers>: capture/classification threads, or shards with --dispatch or -r (default: all cores, 1 with -r)" << std::endl;
+    std::cerr << "\t--dispatch: capture on one thread and hash the packets to the shards (with a load report)" << std::endl;
+    std::cerr << "\t--queue <packets>: packets queued per shard with --dispatch (default: 65536)" << std::endl;
+    std::cerr << "\t--pin: pin worker/shard n to CPU n (and the capture thread after them)" << std::endl;
+    std::cerr << "\t--block-size <bytes>, --blocks <n>: ring geometry per worker (default: 4194304, 64)" << std::endl;
+    std::cerr << "\t--block-timeout <ms>: retire partially filled blocks after this long (default: 100)" << std::endl;
+    std::cerr << "\t--flow-timeout <s>: idle time before a flow is classified (default: 120)" << std::endl;
+    std::cerr << "\t--record <file>: writes the replayed flows' feature vectors and verdicts (golden output)" << std::endl;
+    std::cerr << "\t--verify <file>: checks the replayed flows against a golden output (exits with 2 if they differ)" << std::endl;
+    std::cerr << "\t--tolerance <r>: relative difference allowed between features by --verify (default: 1e-9)" << std::endl;
+    std::cerr << "\t--quantized: quantized inference (see ml_quantized.h)" << std::endl;
+    std::cerr << "\t--alert-thresholds <list>: per-class alert probabilities, as \"class:probability ...\" or one probability for every attack class" << std::endl;
+    std::cerr << "\t-v: print the normal verdicts too" << std::endl;
+}
+
+static bool parse_options(int argc, char** argv, SensorOptions& options) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        bool has_value = (i + 1 < argc);
+
+        if (arg == "-i" && has_value) options.interface = argv[++i];
+        else if (arg == "-r" && has_value) options.pcap = argv[++i];
+        else if (arg == "-m" && has_value) options.model = argv[++i];
+        else if (arg == "-j" && has_value) options.num_workers = (unsigned)std::max(1, atoi(argv[++i]));
+        else if (arg == "--block-size" && has_value) options.block_size = (uint32_t)strtoul(argv[++i], nullptr, 10);
+        else if (arg == "--blocks" && has_value) options.num_blocks = (uint32_t)strtoul(argv[++i], nullptr, 10);
+        else if (arg == "--block-timeout" && has_value) options.block_timeout = (uint32_t)strtoul(argv[++i], nullptr, 10);
+        else if (arg == "--flow-timeout" && has_value) options.flow_timeout = (int64_t)(atof(argv[++i]) * 1000000);
+        else if (arg == "--dispatch") options.dispatch = true;
+        else if (arg == "--queue" && has_value) options.queue_size = (size_t)strtoull(argv[++i], nullptr, 10);
+        else if (arg == "--pin") options.pin = true;
+        else if (arg == "--record" && has_value) options.record = argv[++i];
+        else if (arg == "--verify" && has_value) options.verify = argv[++i];
+        else if (arg == "--tolerance" && has_value) options.tolerance = atof(argv[++i]);
+        else if (arg == "--quantized") options.quantized = true;
+        else if (arg == "--alert-thresholds" && has_value) {
+            std::string error;
+
+            if (!parse_alert_thresholds(argv[++i], options.alert_thresholds, error)) {
+                std::cerr << "[*] Error! " << error << "." << std::endl;
+                return false;
+            }
+        }
+        else if (arg == "-v") options.verbose = true;
+        else return false;
+    }
+
+    if (options.num_workers == 0) {
+        options.num_workers = options.pcap.empty() ? std::max(1u, std::thread::hardware_concurrency()) : 1;
+    }
+
+    /* A replayed pcap with several workers goes through the dispatcher. */
+    if (!options.pcap.empty() && options.num_workers > 1) options.dispatch = true;
+
+    long page_size = sysconf(_SC_PAGESIZE);
+
+    if (options.interface.empty() == options.pcap.empty()) return false;
+    if (options.pcap.empty() && (!options.record.empty() || !options.verify.empty())) return false;
+
+    return !options.model.empty() && options.num_blocks > 0 &&
+           options.block_size >= 2048 && options.block_size % page_size == 0 && options.flow_timeout > 0 && options.queue_size > 0;
+}
+
+int main(int argc, char** argv) {
+    SensorOptions options;
+
+    if (!parse_options(argc, argv, options)) {
+        usage();
+        return 1;
+    }
+
+    std::string error;
+    Model* model = load_model(options.model, error, !options.quantized);
+
+    if (!model) {
+        std::cerr << "[*] Error! Couldn't load " << options.model << " (" << error << ")." << std::endl;
+        return 1;
+    }
+
+    if (model->num_features != NUM_FEATURES) {
+        std::cerr << "[*] Error! " << options.model << " expects " << model->num_features << " features." << std::endl;
+        delete model;
+        return 1;
+    }
+
+    if (options.quantized) {
+        Model* quantized = quantize_model(model, error);
+
+        if (quantized)
+            model = quantized;
+        else
+            std::cout << "[*] Couldn't quantize " << options.model << " (" << error << "), using it as is." << std::endl;
+    }
+
+    /* Only the state the model reads is tracked (see update_feature_profile() in the inspector). */
+    std::vector<bool> used(NUM_FEATURES, false);
+    model->mark_used_features(used);
+    ml_tracked_state = tracked_state(used);
+
+    signal(SIGINT, handle_signal);
+    signal(SIGTERM, handle_signal);
+
+    /* Workers of one sensor share a fanout group, distinct from other processes' ones. */
+    uint16_t fanout_group = (uint16_t)getpid();
+    std::vector<SensorStats> stats(options.num_workers);
+    std::vector<std::thread> workers;
+
+    /* With --dispatch (or -r), the capture/replay thread has its own counters (packets, decoding, kernel drops). */
+    SensorStats capture_stats;
+    std::unique_ptr<FlowDispatcher> dispatcher;
+
+    /* Classified flows, kept per worker for --record and --verify. */
+    bool collect = !options.record.empty() || !options.verify.empty();
+    std::vector<std::vector<FlowResult>> results(options.num_workers);
+
+    std::string source = options.pcap.empty() ? "Capturing on " + options.interface : "Replaying " + options.pcap;
+    std::cout << "[*] " << source << " with " << options.num_workers << (options.dispatch ? " shard(s)." : " worker(s).") << std::endl;
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    bool ok = true;
+
+    if (options.dispatch) {
+        dispatcher.reset(new FlowDispatcher(options.num_workers, options.queue_size));
+
+        for (unsigned s = 0; s < options.num_workers; s++) {
+            workers.push_back(std::thread(run_shard, s, std::cref(*model), std::cref(options), std::ref(*dispatcher), std::ref(stats[s]),
+                                          collect ? &results[s] : nullptr));
+        }
+
+        if (options.pcap.empty()) {
+            workers.push_back(std::thread(run_capture, std::cref(options), fanout_group, std::ref(*dispatcher), std::ref(capture_stats)));
+        }
+        else {
+            ok = replay_pcap(*model, options, dispatcher.get(), capture_stats, nullptr);
+            capture_done = true;
+        }
+    }
+    else if (!options.pcap.empty()) {
+        ok = replay_pcap(*model, options, nullptr, stats[0], collect ? &results[0] : nullptr);
+    }
+    else {
+        for (unsigned w = 0; w < options.num_workers; w++) {
+            workers.push_back(std::thread(run_worker, w, std::cref(*model), std::cref(options), fanout_group, std::ref(stats[w])));
+        }
+    }
+
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    if (!ok) {
+        delete model;
+        return 1;
+    }
+
+    SensorStats total = capture_stats;
+    for (unsigned w = 0; w < options.num_workers; w++) {
+        const SensorStats& worker = stats[w];
+
+        if (!options.dispatch && options.pcap.empty())
+            std::cout << "[*] Worker " << w << ": " << worker.packets << " packets, " << worker.flows_created << " flows." << std::endl;
+
+        total.packets += worker.packets;
+        total.bytes += worker.bytes;
+        total.not_ip += worker.not_ip;
+        total.unsupported += worker.unsupported;
+        total.fragments += worker.fragments;
+        total.truncated += worker.truncated;
+        total.flows_created += worker.flows_created;
+        total.normal_flows += worker.normal_flows;
+        total.attack_flows += worker.attack_flows;
+        total.kernel_drops += worker.kernel_drops;
+        total.queue_freezes += worker.queue_freezes;
+    }
+
+    if (options.pcap.empty()) {
+        std::cout << "[*] " << total.packets << " packets (" << total.bytes << " bytes), " << total.kernel_drops
+                  << " dropped by the kernel (" << total.queue_freezes << " ring freezes)." << std::endl;
+    }
+    else {
+        std::cout << "[*] " << total.packets << " packets (" << total.bytes << " bytes) replayed in " << elapsed.count()
+                  << " s (" << total.packets / elapsed.count() << " packets/s, " << total.flows_created / elapsed.count()
+                  << " flows/s)." << std::endl;
+    }
+    std::cout << "[*] Skipped: " << total.not_ip << " non-IP, " << total.unsupported << " other protocols, "
+              << total.fragments << " fragments, " << total.truncated << " truncated." << std::endl;
+    std::cout << "[*] " << total.flows_created << " flows: " << total.normal_flows << " normal, "
+              << total.attack_flows << " attacks." << std::endl;
+
+    if (dispatcher) dispatcher->load_report(std::cout);
+
+    int status = 0;
+
+    if (collect) {
+        std::vector<FlowResult> flows;
+        for (std::vector<FlowResult>& worker : results) flows.insert(flows.end(), worker.begin(), worker.end());
+
+        /* Sorted, so the output doesn't depend on how the flows were spread over the workers. */
+        std::sort(flows.begin(), flows.end());
+
+        if (!options.record.empty()) {
+            if (write_golden(options.record, flows)) {
+                std::cout << "[*] Recorded " << flows.size() << " flows to " << options.record << "." << std::endl;
+            }
+            else {
+                std::cerr << "[*] Error! Couldn't write " << options.record << "." << std::endl;
+                status = 1;
+            }
+        }
+
+        if (!options.verify.empty()) {
+            std::vector<FlowResult> expected;
+
+            if (!read_golden(options.verify, expected, error)) {
+                std::cerr << "[*] Error! " << error << "." << std::endl;
+                status = 1;
+            }
+            else if (!verify_golden(expected, flows, options.tolerance)) {
+                status = 2;
+            }
+        }
+    }
+
+    delete model;
+    return status;
+}
@@ -0,0 +1,333 @@
+//--------------------------------------------------------------------------
+// Copyright (C) 2014-2019 Cisco and/or its affiliates. All rights reserved.
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the GNU General Public License Version 2 as published
+// by the Free Software Foundation.  You may not use, modify or distribute
+// this program under any other version of the GNU General Public License.
+//
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along
+// with this program; if not, write to the Free Software Foundation, Inc.,
+// 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+//--------------------------------------------------------------------------
+// ml_traffic.cc
+
+/*
+    Synthetic traffic driver (see ml_traffic.h).
+
+    Generates a mix of bulk TCP transfers, short UDP exchanges, ICMP echo floods and SYN scans
+    for a given duration of packet time and feeds it to the inspector's flow tracker: a map of
+    Connections keyed by flow id (as in ml_classifiers.h), checked for timeouts every 20 seconds
+    of packet time, with the inspector's 120 seconds timeout. Every report interval it prints the
+    throughput, the live flows, the process' RSS (and its growth) and the expiry lag (how long
+    past their timeout the expired flows were still tracked), so memory caps and scaling can be
+    checked at a million concurrent flows before a rollout.
+
+    With -w, the packets are written to a pcap instead, to replay through Snort itself (snort -r).
+*/
+
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <algorithm>
+
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#include "../ml_pcap.h"
+#include "../ml_traffic.h"
+#include "../ml_models.h"
+#include "../ml_connection.h"
+
+struct TrafficOptions {
+    TrafficMix mix;
+    double duration = 60;                   /* Seconds of packet time generated. */
+    double report_interval = 10;            /* Seconds of packet time between reports. */
+    int64_t flow_timeout = 120000000;       /* Same timeout and check interval as the inspector. */
+    int64_t expiry_interval = 20000000;
+    std::string pcap;                       /* -w: writes the packets instead of tracking them. */
+    std::string model;                      /* -m: classifies the expired flows. */
+};
+
+/* Counters of a report interval (and of the whole run). */
+struct TrafficStats {
+    uint64_t packets = 0;
+    uint64_t flows_created = 0;
+    uint64_t flows_expired = 0;
+    uint64_t attack_flows = 0;
+    int64_t max_lag = 0;
+    int64_t total_lag = 0;
+    double expiry_seconds = 0;
+};
+
+/* Resident set size of the process, in bytes. */
+static uint64_t resident_bytes() {
+    unsigned long size = 0, resident = 0;
+    FILE* statm = fopen("/proc/self/statm", "r");
+
+    if (!statm) return 0;
+    if (fscanf(statm, "%lu %lu", &size, &resident) != 2) resident = 0;
+    fclose(statm);
+
+    return (uint64_t)resident * (uint64_t)sysconf(_SC_PAGESIZE);
+}
+
+/* The inspector's flow tracker, fed with generated packets. */
+class FlowTracker {
+    public:
+        FlowTracker(const TrafficOptions& options, const Model* model) : options(options), model(model) { }
+
+        void add(const DecodedPacket& decoded, TrafficStats& stats) {
+            char source[INET_ADDRSTRLEN], destination[INET_ADDRSTRLEN];
+            inet_ntop(AF_INET, decoded.src, source, sizeof(source));
+            inet_ntop(AF_INET, decoded.dst, destination, sizeof(destination));
+
+            /* Same ids as get_id_candidates(): the packet's direction first, then the reverse. */
+            std::string protocol = decoded.is_tcp() ? "TCP" : (decoded.is_icmp() ? "ICMP" : "UDP");
+            std::string suffix = decoded.is_icmp() ? "-" + std::to_string(decoded.icmp_id) : "";
+            std::string forward = protocol + "-" + source + ":" + std::to_string(decoded.src_port) + "-" +
+                                  destination + ":" + std::to_string(decoded.dst_port) + suffix;
+            std::string reverse = protocol + "-" + destination + ":" + std::to_string(decoded.dst_port) + "-" +
+                                  source + ":" + std::to_string(decoded.src_port) + suffix;
+
+            FlowPacket packet;
+            packet.timestamp = decoded.timestamp;
+            packet.pktlen = decoded.pktlen;
+            packet.dsize = decoded.dsize;
+            packet.protocol = decoded.protocol;
+            packet.tcp = decoded.is_tcp();
+            packet.tcp_flags = decoded.tcp_flags;
+            packet.window = decoded.window;
+
+            std::map<std::string, Connection>::iterator it = connections.find(forward);
+            packet.from_client = true;
+
+            if (it == connections.end()) {
+                it = connections.find(reverse);
+                packet.from_client = false;
+            }
+
+            if (it != connections.end()) {
+                it->second.add_packet(packet);
+                return;
+            }
+
+            packet.from_client = true;
+            packet.client_ip = source;
+            packet.client_port = decoded.src_port;
+            packet.server_ip = destination;
+            packet.server_port = decoded.dst_port;
+
+            connections.emplace(forward, Connection(packet, forward));
+            stats.flows_created++;
+        }
+
+        /* Every expiry interval of packet time, expires the flows idle for longer than the timeout. */
+        void tick(int64_t now, TrafficStats& stats) {
+            if (next_expiry == 0) next_expiry = now + options.expiry_interval;
+            if (now < next_expiry) return;
+
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+            for (std::map<std::string, Connection>::iterator it = connections.begin(); it != connections.end(); ) {
+                int64_t deadline = it->second.get_flowlastseen() + options.flow_timeout;
+
+                if (now <= deadline) {
+                    ++it;
+                    continue;
+                }
+
+                FeatureVector features;
+                it->second.get_feature_vector(features.data());
+
+                if (model && model->predict(features.data()) != 0) stats.attack_flows++;
+
+                stats.max_lag = std::max(stats.max_lag, now - deadline);
+                stats.total_lag += now - deadline;
+                stats.flows_expired++;
+
+                it = connections.erase(it);
+            }
+
+            stats.expiry_seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            next_expiry = now + options.expiry_interval;
+        }
+
+        size_t size() const {
+            return connections.size();
+        }
+
+    private:
+        const TrafficOptions& options;
+        const Model* model;
+
+        std::map<std::string, Connection> connections;
+        int64_t next_expiry = 0;
+};
+
+static void report(double seconds, const TrafficStats& stats, double wall_seconds, size_t live_flows, uint64_t baseline) {
+    uint64_t rss = resident_bytes();
+
+    std::cout << "[*] " << std::fixed << std::setprecision(0) << seconds << " s: " << stats.packets << " packets ("
+              << (uint64_t)(stats.packets / std::max(wall_seconds, 1e-9)) << " packets/s), " << live_flows << " live flows (+"
+              << stats.flows_created << ", -" << stats.flows_expired << "), RSS " << std::setprecision(1) << rss / 1048576.0
+              << " MB (+" << ((int64_t)rss - (int64_t)baseline) / 1048576.0 << " MB), expiry lag "
+              << std::setprecision(2) << stats.max_lag / 1e6 << " s max, "
+              << (stats.flows_expired ? stats.total_lag / 1e6 / stats.flows_expired : 0.0) << " s mean, expiry "
+              << stats.expiry_seconds * 1000 << " ms." << std::endl;
+
+    std::cout.unsetf(std::ios_base::floatfield);
+    std::cout << std::setprecision(6);
+}
+
+static void usage() {
+    std::cerr << "Usage: ml_traffic [-d <seconds>] [--bulk <flows/s>] [--udp <flows/s>] [--echo <flows/s>] [--scan <probes/s>]" << std::endl;
+    std::cerr << "                  [--segments <n>] [--clients <n>] [--servers <n>] [--seed <n>] [-r <seconds>] [-m <model.mlm>] [-w <file.pcap>]" << std::endl;
+    std::cerr << "\t-d <seconds>: packet time generated (default: 60)" << std::endl;
+    std::cerr << "\t--bulk, --udp, --echo, --scan: new flows per second of each kind (default: 10, 1000, 0, 0)" << std::endl;
+    std::cerr << "\t--segments <n>: average data segments of a bulk transfer (default: 1000)" << std::endl;
+    std::cerr << "\t--clients, --servers <n>: client and server addresses in use (default: 65536, 1024)" << std::endl;
+    std::cerr << "\t--seed <n>: seed of the generator (default: 1)" << std::endl;
+    std::cerr << "\t-r <seconds>: packet time between reports (default: 10)" << std::endl;
+    std::cerr << "\t-m <model.mlm>: classifies the expired flows with a native model" << std::endl;
+    std::cerr << "\t-w <file.pcap>: writes the packets to a pcap instead of tracking them" << std::endl;
+}
+
+static bool parse_options(int argc, char** argv, TrafficOptions& options) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        bool has_value = (i + 1 < argc);
+
+        if (!has_value) return false;
+
+        if (arg == "-d") options.duration = strtod(argv[++i], nullptr);
+        else if (arg == "--bulk") options.mix.bulk_rate = strtod(argv[++i], nullptr);
+        else if (arg == "--udp") options.mix.udp_rate = strtod(argv[++i], nullptr);
+        else if (arg == "--echo") options.mix.echo_rate = strtod(argv[++i], nullptr);
+        else if (arg == "--scan") options.mix.scan_rate = strtod(argv[++i], nullptr);
+        else if (arg == "--segments") options.mix.bulk_segments = std::max(1u, (uint32_t)strtoul(argv[++i], nullptr, 10));
+        else if (arg == "--clients") options.mix.clients = std::max(1u, (uint32_t)strtoul(argv[++i], nullptr, 10));
+        else if (arg == "--servers") options.mix.servers = std::max(1u, (uint32_t)strtoul(argv[++i], nullptr, 10));
+        else if (arg == "--seed") options.mix.seed = strtoull(argv[++i], nullptr, 10);
+        else if (arg == "-r") options.report_interval = strtod(argv[++i], nullptr);
+        else if (arg == "-m") options.model = argv[++i];
+        else if (arg == "-w") options.pcap = argv[++i];
+        else return false;
+    }
+
+    return options.duration > 0 && options.report_interval > 0;
+}
+
+int main(int argc, char** argv) {
+    TrafficOptions options;
+
+    if (!parse_options(argc, argv, options)) {
+        usage();
+        return 1;
+    }
+
+    std::string error;
+    std::unique_ptr<Model> model;
+
+    if (!options.model.empty()) {
+        model.reset(load_model(options.model, error));
+
+        if (!model) {
+            std::cerr << "[*] Error! Couldn't load " << options.model << " (" << error << ")." << std::endl;
+            return 1;
+        }
+    }
+
+    PcapWriter writer;
+
+    if (!options.pcap.empty() && !writer.open(options.pcap, error)) {
+        std::cerr << "[*] Error! " << error << "." << std::endl;
+        return 1;
+    }
+
+    /* A fixed start, so the pcaps (and their timestamps) are the same on every run. */
+    const int64_t start = 1500000000LL * 1000000;
+    int64_t end = start + (int64_t)(options.duration * 1000000);
+    int64_t report_step = (int64_t)(options.report_interval * 1000000);
+    int64_t next_report = start + report_step;
+
+    TrafficGenerator generator(options.mix, start);
+    FlowTracker tracker(options, model.get());
+    TrafficStats interval;
+    TrafficPacket packet;
+    std::vector<uint8_t> frame;
+    size_t peak_flows = 0;
+    uint64_t packets = 0, attack_flows = 0;
+
+    uint64_t baseline = resident_bytes();
+    std::chrono::steady_clock::time_point run_start = std::chrono::steady_clock::now();
+    std::chrono::steady_clock::time_point interval_start = run_start;
+
+    while (generator.next(packet) && packet.decoded.timestamp < end) {
+        int64_t now = packet.decoded.timestamp;
+
+        while (now >= next_report) {
+            std::chrono::steady_clock::time_point wall = std::chrono::steady_clock::now();
+
+            report((next_report - start) / 1e6, interval, std::chrono::duration<double>(wall - interval_start).count(),
+                   options.pcap.empty() ? tracker.size() : generator.live_flows(), baseline);
+
+            attack_flows += interval.attack_flows;
+            interval = TrafficStats();
+            interval_start = wall;
+            next_report += report_step;
+        }
+
+        if (!options.pcap.empty()) {
+            encode_frame(packet, frame);
+
+            if (!writer.write(now, frame.data(), (uint32_t)frame.size(), error)) {
+                std::cerr << "[*] Error! " << error << "." << std::endl;
+                return 1;
+            }
+        } else {
+            tracker.add(packet.decoded, interval);
+            tracker.tick(now, interval);
+            peak_flows = std::max(peak_flows, tracker.size());
+        }
+
+        interval.packets++;
+        packets++;
+    }
+
+    /* The last interval, unless it's empty. */
+    if (interval.packets > 0) {
+        report(options.duration, interval, std::chrono::duration<double>(std::chrono::steady_clock::now() - interval_start).count(),
+               options.pcap.empty() ? tracker.size() : generator.live_flows(), baseline);
+        attack_flows += interval.attack_flows;
+    }
+
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - run_start;
+    uint64_t growth = resident_bytes() - std::min(baseline, resident_bytes());
+
+    std::cout << "[*] Generated " << packets << " packets in " << elapsed.count() << " s ("
+              << (uint64_t)(packets / elapsed.count()) << " packets/s): " << generator.flows_started(TRAFFIC_BULK) << " bulk, "
+              << generator.flows_started(TRAFFIC_UDP) << " udp, " << generator.flows_started(TRAFFIC_ECHO) << " echo and "
+              << generator.flows_started(TRAFFIC_SCAN) << " scan flows." << std::endl;
+
+    if (options.pcap.empty()) {
+        std::cout << "[*] Peak of " << peak_flows << " live flows, RSS grew by " << growth / 1048576.0 << " MB";
+        if (peak_flows > 0) std::cout << " (" << growth / peak_flows << " bytes per peak flow)";
+        std::cout << "." << std::endl;
+    }
+
+    if (model) std::cout << "[*] " << attack_flows << " of the expired flows classified as attacks." << std::endl;
+
+    return 0;
+}
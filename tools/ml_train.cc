@@ -0,0 +1,540 @@
+//--------------------------------------------------------------------------
+// Copyright (C) 2014-2019 Cisco and/or its affiliates. All rights reserved.
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the GNU General Public License Version 2 as published
+// by the Free Software Foundation.  You may not use, modify or distribute
+// this program under any other version of the GNU General Public License.
+//
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along
+// with this program; if not, write to the Free Software Foundation, Inc.,
+// 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+//--------------------------------------------------------------------------
+// ml_train.cc
+
+/*
+    Native trainer for CART Decision Trees and Random Forests.
+
+    Reads the matrices written by ml_dataset (<prefix>.X.npy / <prefix>.y.npy) and
+    writes a .mlm file the inspector loads directly (see ml_models.h).
+
+    Training is histogram based: every feature is quantized once into at most 256 bins,
+    stored column by column (one contiguous uint8 column per feature), and the best
+    split of a node is found by scanning per-bin class histograms. Forest trees are
+    trained in parallel; a single tree parallelizes the histogram construction of its
+    large nodes across features instead.
+*/
+
+#include <mutex>
+#include <atomic>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <algorithm>
+
+#include "../ml_npy.h"
+#include "../ml_models.h"
+
+struct TrainOptions {
+    std::string prefix = "CIC-IDS-2017";
+    std::string output;
+    std::string model = "rf";
+    uint32_t num_trees = 100;
+    uint32_t max_depth = 0;             /* 0: unlimited. */
+    uint32_t min_samples_split = 2;
+    uint32_t min_samples_leaf = 1;
+    double max_features = 0;            /* Fraction of the features tried per node; 0: sqrt (rf) or all (dt). */
+    uint32_t max_bins = 255;
+    double holdout = 0;
+    bool balanced = false;
+    uint64_t seed = 12;
+    unsigned num_threads = std::max(1u, std::thread::hardware_concurrency());
+};
+
+/* Nodes with at least this many rows split their histogram work across threads (single tree only). */
+static const size_t parallel_node_rows = 65536;
+
+/* The training set after quantization. */
+struct BinnedDataset {
+    uint64_t num_rows = 0;
+    uint32_t num_features = 0;
+    uint32_t num_classes = 0;
+
+    /* bins[f * num_rows + i]: bin of the feature f of the i-th training row. */
+    std::vector<uint8_t> bins;
+    std::vector<uint8_t> labels;
+
+    /* edges[f][b]: threshold between bins b and b + 1 (x <= edges[f][b] goes to bin <= b). */
+    std::vector<std::vector<double>> edges;
+};
+
+/* Best split found for a node. */
+struct Split {
+    double impurity = 0;
+    int32_t feature = -1;
+    int32_t bin = -1;
+};
+
+/* Runs body(i) for i in [0, count) over num_threads threads. */
+template <typename Body>
+static void parallel_for(size_t count, unsigned num_threads, Body body) {
+    std::atomic<size_t> next(0);
+    std::vector<std::thread> workers;
+
+    for (unsigned t = 0; t < std::min((size_t)num_threads, count); t++) {
+        workers.push_back(std::thread([&]() {
+            for (size_t i = next++; i < count; i = next++) body(i);
+        }));
+    }
+
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+}
+
+/* Reads X[row][column] as the single precision value the trees compare against. */
+static float feature_value(const NpyArray& X, uint64_t row, uint32_t column) {
+    uint64_t index = row * X.columns() + column;
+
+    if (X.item_size() == 4)
+        return X.data<float>()[index];
+    return (float)X.data<double>()[index];
+}
+
+/*
+    Computes the bin edges of every feature from a sample of the training rows and
+    quantizes the training rows, feature by feature.
+*/
+static void bin_dataset(const NpyArray& X, const NpyArray& y, const std::vector<uint64_t>& rows,
+        const TrainOptions& options, BinnedDataset& dataset) {
+    dataset.num_rows = rows.size();
+    dataset.num_features = (uint32_t)X.columns();
+    dataset.bins.resize(dataset.num_rows * dataset.num_features);
+    dataset.edges.resize(dataset.num_features);
+    dataset.labels.resize(dataset.num_rows);
+
+    uint8_t max_label = 0;
+    for (uint64_t i = 0; i < dataset.num_rows; i++) {
+        dataset.labels[i] = y.data<uint8_t>()[rows[i]];
+        max_label = std::max(max_label, dataset.labels[i]);
+    }
+    dataset.num_classes = std::max(2, max_label + 1);
+
+    const uint64_t sample_size = std::min<uint64_t>(dataset.num_rows, 200000);
+    const uint64_t sample_step = std::max<uint64_t>(1, dataset.num_rows / sample_size);
+
+    parallel_for(dataset.num_features, options.num_threads, [&](size_t f) {
+        std::vector<float> sample;
+        for (uint64_t i = 0; i < dataset.num_rows; i += sample_step) {
+            sample.push_back(feature_value(X, rows[i], (uint32_t)f));
+        }
+
+        std::sort(sample.begin(), sample.end());
+        std::vector<float> distinct(sample.begin(), std::unique(sample.begin(), sample.end()));
+
+        /* Cut points: every distinct value when they fit, quantiles of the sample otherwise. */
+        std::vector<float> cuts;
+        if (distinct.size() <= options.max_bins) {
+            cuts.assign(distinct.begin(), distinct.end() - 1);
+        } else {
+            for (uint32_t b = 1; b < options.max_bins; b++) {
+                float cut = sample[b * sample.size() / options.max_bins];
+                if (cut < distinct.back() && (cuts.empty() || cut > cuts.back())) cuts.push_back(cut);
+            }
+        }
+
+        /* Thresholds sit halfway between a cut point and the next distinct value, as sklearn's do. */
+        std::vector<double>& edges = dataset.edges[f];
+        for (float cut : cuts) {
+            float next = *std::upper_bound(distinct.begin(), distinct.end(), cut);
+            double edge = ((double)cut + (double)next) / 2.0;
+
+            /* Keeps "cut <= edge < next" true after the float comparison done at inference. */
+            if ((float)edge >= next) edge = cut;
+            edges.push_back(edge);
+        }
+
+        uint8_t* column = dataset.bins.data() + f * dataset.num_rows;
+        for (uint64_t i = 0; i < dataset.num_rows; i++) {
+            float value = feature_value(X, rows[i], (uint32_t)f);
+            column[i] = (uint8_t)(std::lower_bound(edges.begin(), edges.end(), (double)value) - edges.begin());
+        }
+    });
+}
+
+/* Grows the trees of the forest. */
+class TreeBuilder {
+    public:
+        TreeBuilder(const BinnedDataset& dataset, const TrainOptions& options, const std::vector<double>& class_weights)
+            : dataset(dataset), options(options), class_weights(class_weights) { }
+
+        /* Trains the tree number "index" into nodes/values (indices relative to the tree). */
+        void build(uint32_t index, bool bootstrap, uint32_t features_per_node, unsigned node_threads,
+                std::vector<TreeNode>& nodes, std::vector<double>& values) const {
+            std::mt19937_64 rng(options.seed + index);
+            const uint32_t C = dataset.num_classes;
+
+            /* Per-row weights: bootstrap multiplicity times the class weight. */
+            std::vector<double> weights(dataset.num_rows, 1.0);
+            if (bootstrap) {
+                std::fill(weights.begin(), weights.end(), 0.0);
+                std::uniform_int_distribution<uint64_t> pick(0, dataset.num_rows - 1);
+                for (uint64_t i = 0; i < dataset.num_rows; i++) weights[pick(rng)] += 1.0;
+            }
+
+            std::vector<uint32_t> rows;
+            rows.reserve(dataset.num_rows);
+            for (uint64_t i = 0; i < dataset.num_rows; i++) {
+                if (weights[i] > 0) {
+                    weights[i] *= class_weights[dataset.labels[i]];
+                    rows.push_back((uint32_t)i);
+                }
+            }
+
+            std::vector<uint32_t> feature_order(dataset.num_features);
+            for (uint32_t f = 0; f < dataset.num_features; f++) feature_order[f] = f;
+
+            struct Task { int32_t node; size_t begin; size_t end; uint32_t depth; };
+            std::vector<Task> stack;
+
+            nodes.assign(1, TreeNode());
+            stack.push_back(Task{ 0, 0, rows.size(), 0 });
+
+            std::vector<double> totals(C);
+
+            while (!stack.empty()) {
+                Task task = stack.back();
+                stack.pop_back();
+
+                std::fill(totals.begin(), totals.end(), 0.0);
+                for (size_t i = task.begin; i < task.end; i++) {
+                    totals[dataset.labels[rows[i]]] += weights[rows[i]];
+                }
+
+                Split split;
+                size_t num_rows = task.end - task.begin;
+                uint32_t non_zero = (uint32_t)std::count_if(totals.begin(), totals.end(), [](double t) { return t > 0; });
+
+                bool can_split = non_zero > 1 && num_rows >= options.min_samples_split &&
+                                 num_rows >= 2 * options.min_samples_leaf &&
+                                 (options.max_depth == 0 || task.depth < options.max_depth);
+
+                if (can_split) {
+                    /* Partial Fisher-Yates: the first features_per_node entries are this node's candidates. */
+                    for (uint32_t k = 0; k < features_per_node; k++) {
+                        std::uniform_int_distribution<uint32_t> pick(k, dataset.num_features - 1);
+                        std::swap(feature_order[k], feature_order[pick(rng)]);
+                    }
+
+                    split = find_split(rows.data() + task.begin, num_rows, weights, totals,
+                                       feature_order.data(), features_per_node,
+                                       (num_rows >= parallel_node_rows) ? node_threads : 1);
+                }
+
+                if (split.feature < 0) {
+                    /* Leaf: class fractions of the node. */
+                    double total = 0;
+                    for (double t : totals) total += t;
+
+                    nodes[task.node].feature = -1;
+                    nodes[task.node].left = nodes[task.node].right = -1;
+                    nodes[task.node].threshold = 0;
+                    nodes[task.node].value = (int32_t)values.size();
+
+                    for (uint32_t c = 0; c < C; c++) {
+                        values.push_back((total > 0) ? totals[c] / total : 1.0 / C);
+                    }
+                    continue;
+                }
+
+                const uint8_t* column = dataset.bins.data() + (size_t)split.feature * dataset.num_rows;
+                uint32_t* middle = std::partition(rows.data() + task.begin, rows.data() + task.end,
+                                                  [&](uint32_t row) { return column[row] <= split.bin; });
+                size_t middle_index = middle - rows.data();
+
+                int32_t left = (int32_t)nodes.size();
+                nodes.resize(nodes.size() + 2);
+
+                TreeNode& node = nodes[task.node];
+                node.feature = split.feature;
+                node.threshold = dataset.edges[split.feature][split.bin];
+                node.left = left;
+                node.right = left + 1;
+                node.value = -1;
+
+                stack.push_back(Task{ left + 1, middle_index, task.end, task.depth + 1 });
+                stack.push_back(Task{ left, task.begin, middle_index, task.depth + 1 });
+            }
+        }
+
+    private:
+        /* Gini impurity of a class histogram, weighted by its total. */
+        static double weighted_gini(const double* counts, uint32_t C) {
+            double total = 0, squares = 0;
+
+            for (uint32_t c = 0; c < C; c++) {
+                total += counts[c];
+                squares += counts[c] * counts[c];
+            }
+            return (total > 0) ? total - squares / total : 0;
+        }
+
+        /* Best split of a single feature, scanning its per-bin class histogram. */
+        void evaluate_feature(const uint32_t* rows, size_t num_rows, const std::vector<double>& weights,
+                const std::vector<double>& totals, uint32_t f, Split& best) const {
+            const uint32_t C = dataset.num_classes;
+            const uint32_t num_bins = (uint32_t)dataset.edges[f].size() + 1;
+
+            if (num_bins < 2) return;
+
+            std::vector<double> histogram(num_bins * C, 0.0);
+            std::vector<uint32_t> counts(num_bins, 0);
+            const uint8_t* column = dataset.bins.data() + (size_t)f * dataset.num_rows;
+
+            for (size_t i = 0; i < num_rows; i++) {
+                uint32_t row = rows[i];
+                uint8_t bin = column[row];
+
+                histogram[bin * C + dataset.labels[row]] += weights[row];
+                counts[bin]++;
+            }
+
+            std::vector<double> left(C, 0.0), right(C);
+            size_t left_rows = 0;
+
+            for (uint32_t b = 0; b + 1 < num_bins; b++) {
+                left_rows += counts[b];
+                for (uint32_t c = 0; c < C; c++) left[c] += histogram[b * C + c];
+
+                if (counts[b] == 0) continue;
+                if (left_rows < options.min_samples_leaf) continue;
+                if (num_rows - left_rows < options.min_samples_leaf) break;
+
+                for (uint32_t c = 0; c < C; c++) right[c] = totals[c] - left[c];
+
+                double impurity = weighted_gini(left.data(), C) + weighted_gini(right.data(), C);
+
+                if (best.feature < 0 || impurity < best.impurity) {
+                    best.impurity = impurity;
+                    best.feature = (int32_t)f;
+                    best.bin = (int32_t)b;
+                }
+            }
+        }
+
+        Split find_split(const uint32_t* rows, size_t num_rows, const std::vector<double>& weights,
+                const std::vector<double>& totals, const uint32_t* features, uint32_t num_candidates,
+                unsigned num_threads) const {
+            std::vector<Split> best(num_candidates);
+
+            if (num_threads > 1) {
+                parallel_for(num_candidates, num_threads, [&](size_t k) {
+                    evaluate_feature(rows, num_rows, weights, totals, features[k], best[k]);
+                });
+            } else {
+                for (uint32_t k = 0; k < num_candidates; k++) {
+                    evaluate_feature(rows, num_rows, weights, totals, features[k], best[k]);
+                }
+            }
+
+            Split split;
+            double parent = weighted_gini(totals.data(), dataset.num_classes);
+
+            for (const Split& candidate : best) {
+                if (candidate.feature < 0) continue;
+                if (split.feature < 0 || candidate.impurity < split.impurity ||
+                    (candidate.impurity == split.impurity && candidate.feature < split.feature)) {
+                    split = candidate;
+                }
+            }
+
+            /* Only splits that actually reduce the impurity are kept. */
+            if (split.feature >= 0 && parent - split.impurity <= 1e-9 * parent) split = Split();
+            return split;
+        }
+
+        const BinnedDataset& dataset;
+        const TrainOptions& options;
+        const std::vector<double>& class_weights;
+};
+
+static void usage() {
+    std::cerr << "Usage: ml_train -o <model.mlm> [options] [<prefix>]" << std::endl;
+    std::cerr << "\t<prefix>: reads <prefix>.X.npy and <prefix>.y.npy (default: CIC-IDS-2017)" << std::endl;
+    std::cerr << "\t-m dt|rf: Decision Tree or Random Forest (default: rf)" << std::endl;
+    std::cerr << "\t-n <trees>: number of trees of the forest (default: 100)" << std::endl;
+    std::cerr << "\t-d <depth>: maximum depth, 0 for unlimited (default: 0)" << std::endl;
+    std::cerr << "\t--min-samples-split <n>, --min-samples-leaf <n> (default: 2, 1)" << std::endl;
+    std::cerr << "\t--max-features <fraction>: features tried per node (default: sqrt for rf, all for dt)" << std::endl;
+    std::cerr << "\t--bins <n>: histogram bins per feature, at most 256 (default: 255)" << std::endl;
+    std::cerr << "\t--holdout <fraction>: rows kept out of training to report the accuracy (default: 0)" << std::endl;
+    std::cerr << "\t--balanced: weights the classes inversely to their frequency" << std::endl;
+    std::cerr << "\t-s <seed> (default: 12), -j <threads> (default: all cores)" << std::endl;
+}
+
+static bool parse_options(int argc, char** argv, TrainOptions& options) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        bool has_value = (i + 1 < argc);
+
+        if (arg == "-o" && has_value) options.output = argv[++i];
+        else if (arg == "-m" && has_value) options.model = argv[++i];
+        else if (arg == "-n" && has_value) options.num_trees = (uint32_t)atoi(argv[++i]);
+        else if (arg == "-d" && has_value) options.max_depth = (uint32_t)atoi(argv[++i]);
+        else if (arg == "--min-samples-split" && has_value) options.min_samples_split = (uint32_t)atoi(argv[++i]);
+        else if (arg == "--min-samples-leaf" && has_value) options.min_samples_leaf = (uint32_t)atoi(argv[++i]);
+        else if (arg == "--max-features" && has_value) options.max_features = atof(argv[++i]);
+        else if (arg == "--bins" && has_value) options.max_bins = (uint32_t)atoi(argv[++i]);
+        else if (arg == "--holdout" && has_value) options.holdout = atof(argv[++i]);
+        else if (arg == "--balanced") options.balanced = true;
+        else if (arg == "-s" && has_value) options.seed = strtoull(argv[++i], nullptr, 10);
+        else if (arg == "-j" && has_value) options.num_threads = std::max(1, atoi(argv[++i]));
+        else if (arg[0] != '-') options.prefix = arg;
+        else return false;
+    }
+
+    if (options.model == "dt") options.num_trees = 1;
+
+    return !options.output.empty() && (options.model == "dt" || options.model == "rf") &&
+           options.num_trees > 0 && options.max_bins >= 2 && options.max_bins <= 256 &&
+           options.min_samples_leaf > 0 && options.holdout >= 0 && options.holdout < 1 &&
+           options.max_features >= 0 && options.max_features <= 1;
+}
+
+int main(int argc, char** argv) {
+    TrainOptions options;
+
+    if (!parse_options(argc, argv, options)) {
+        usage();
+        return 1;
+    }
+
+    NpyArray X, y;
+    std::string error;
+
+    if (!X.open(options.prefix + ".X.npy", error) || !y.open(options.prefix + ".y.npy", error)) {
+        std::cerr << "[*] Error! " << error << "." << std::endl;
+        return 1;
+    }
+
+    if ((X.descr != "<f4" && X.descr != "<f8") || X.shape.size() != 2 || y.descr != "|u1" || y.rows() != X.rows()) {
+        std::cerr << "[*] Error! Expected a float32/float64 (N, F) X and an uint8 (N,) y." << std::endl;
+        return 1;
+    }
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    /* Holdout split (shuffled with the seed, like train_test_split). */
+    std::vector<uint64_t> order(X.rows());
+    for (uint64_t i = 0; i < order.size(); i++) order[i] = i;
+
+    uint64_t num_test = (uint64_t)(options.holdout * order.size());
+    if (num_test > 0) {
+        std::mt19937_64 rng(options.seed);
+        std::shuffle(order.begin(), order.end(), rng);
+    }
+
+    std::vector<uint64_t> train_rows(order.begin(), order.end() - num_test);
+    std::vector<uint64_t> test_rows(order.end() - num_test, order.end());
+
+    std::cout << "[*] Binning " << train_rows.size() << " training rows (" << X.columns() << " features)..." << std::endl;
+
+    BinnedDataset dataset;
+    bin_dataset(X, y, train_rows, options, dataset);
+
+    std::vector<double> class_weights(dataset.num_classes, 1.0);
+    if (options.balanced) {
+        std::vector<uint64_t> class_counts(dataset.num_classes, 0);
+        for (uint8_t label : dataset.labels) class_counts[label]++;
+
+        for (uint32_t c = 0; c < dataset.num_classes; c++) {
+            if (class_counts[c] > 0)
+                class_weights[c] = (double)dataset.num_rows / (dataset.num_classes * class_counts[c]);
+        }
+    }
+
+    bool forest = (options.model == "rf");
+    uint32_t features_per_node = dataset.num_features;
+
+    if (options.max_features > 0)
+        features_per_node = (uint32_t)std::ceil(options.max_features * dataset.num_features);
+    else if (forest)
+        features_per_node = (uint32_t)std::sqrt((double)dataset.num_features);
+    features_per_node = std::max(1u, std::min(features_per_node, dataset.num_features));
+
+    std::cout << "[*] Training " << options.num_trees << " tree(s) on " << options.num_threads << " thread(s)..." << std::endl;
+
+    std::vector<std::vector<TreeNode>> tree_nodes(options.num_trees);
+    std::vector<std::vector<double>> tree_values(options.num_trees);
+    TreeBuilder builder(dataset, options, class_weights);
+
+    /* Trees are built in parallel; threads left over are used inside the nodes of each tree. */
+    unsigned tree_threads = std::min(options.num_threads, options.num_trees);
+    unsigned node_threads = std::max(1u, options.num_threads / tree_threads);
+    std::mutex progress_mutex;
+    uint32_t done = 0;
+
+    parallel_for(options.num_trees, tree_threads, [&](size_t t) {
+        builder.build((uint32_t)t, forest, features_per_node, node_threads, tree_nodes[t], tree_values[t]);
+
+        std::lock_guard<std::mutex> lock(progress_mutex);
+        if (++done % 10 == 0 || done == options.num_trees)
+            std::cout << "\t[*] " << done << "/" << options.num_trees << " trees." << std::endl;
+    });
+
+    TreeEnsemble model;
+    model.num_features = dataset.num_features;
+    model.num_classes = dataset.num_classes;
+
+    size_t total_nodes = 0;
+    for (uint32_t t = 0; t < options.num_trees; t++) {
+        model.add_tree(tree_nodes[t], tree_values[t], 1.0);
+        total_nodes += tree_nodes[t].size();
+    }
+
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    std::cout << "[*] Trained " << total_nodes << " nodes in " << elapsed.count() << " s." << std::endl;
+
+    if (!test_rows.empty()) {
+        std::vector<uint64_t> confusion(dataset.num_classes * dataset.num_classes, 0);
+        std::vector<double> features(X.columns());
+        uint64_t correct = 0;
+
+        for (uint64_t row : test_rows) {
+            for (uint32_t f = 0; f < X.columns(); f++) features[f] = feature_value(X, row, f);
+
+            uint32_t predicted = model.predict(features.data());
+            uint8_t label = y.data<uint8_t>()[row];
+
+            if (label < dataset.num_classes) confusion[label * dataset.num_classes + predicted]++;
+            if (predicted == label) correct++;
+        }
+
+        std::cout << "[*] Holdout accuracy: " << (double)correct / test_rows.size()
+                  << " (" << test_rows.size() << " rows)" << std::endl;
+        std::cout << "[*] Confusion matrix (rows: true class):" << std::endl;
+
+        for (uint32_t t = 0; t < dataset.num_classes; t++) {
+            std::cout << "\t";
+            for (uint32_t p = 0; p < dataset.num_classes; p++) std::cout << confusion[t * dataset.num_classes + p] << " ";
+            std::cout << std::endl;
+        }
+    }
+
+    if (!save_model(model, options.output)) {
+        std::cerr << "[*] Error! Couldn't write " << options.output << "." << std::endl;
+        return 1;
+    }
+
+    std::cout << "[*] Saved " << options.output << "." << std::endl;
+    return 0;
+}